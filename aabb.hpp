@@ -24,23 +24,33 @@ class aabb
 			return m_tmax;
 		}
 
+		// Slab 0 is the min corner, slab 1 the max corner. Indexed with ray::sign to pick the near/far planes.
+		const vec3 &bound(int i) const
+		{
+			return i ? m_tmax : m_tmin;
+		}
+
+		/*
+		 * Branchless slab test using the reciprocal direction and sign bits precomputed in the ray. Each axis costs
+		 * two subtract-multiplies and two selects.
+		 *
+		 * For a ray parallel to a slab the reciprocal is infinite, and the distances come out as -inf/+inf when the
+		 * origin lies between the planes, and both +inf or both -inf when it lies outside, which culls the box. Only an
+		 * origin exactly on a plane gives 0 * inf = NaN; NaN fails both comparisons and leaves the interval untouched,
+		 * so such rays are kept.
+		 */
 		bool hit(const ray &r, float tmin, float tmax) const
 		{
 			for (int a = 0; a < 3; a++)
 			{
-				float invD = 1.0f / r.direction()[a]; // avoid a division. Multiplication is faster.
-				float t0 = (min()[a] - r.origin()[a]) * invD;
-				float t1 = (max()[a] - r.origin()[a]) * invD;
-
-				// If the ray is travelling in the negative direction.
-				if (invD < 0.0f)
-				{
-					std::swap(t0, t1);
-				}
+				float t0 = (bound(r.sign[a])[a] - r.A[a]) * r.inv_B[a];
+				float t1 = (bound(1 - r.sign[a])[a] - r.A[a]) * r.inv_B[a];
 
 				tmin = t0 > tmin ? t0 : tmin;
-				tmax = t0 < tmax ? t0 : tmax;
+				tmax = t1 < tmax ? t1 : tmax;
 			}
+
+			return tmin <= tmax;
 		}
 
 		vec3 m_tmin;
@@ -53,9 +63,9 @@ aabb sorrounding_box(aabb box0, aabb box1)
 	           fmin(box0.min().y(), box1.min().y()),
 			   fmin(box0.min().z(), box1.min().z()));
 
-	vec3 big(fmax(box0.min().x(), box1.min().x()),
-	         fmax(box0.min().y(), box1.min().y()),
-			 fmax(box0.min().z(), box1.min().z()));;
+	vec3 big(fmax(box0.max().x(), box1.max().x()),
+	         fmax(box0.max().y(), box1.max().y()),
+			 fmax(box0.max().z(), box1.max().z()));
 
 	return aabb(small, big);
 }
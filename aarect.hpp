@@ -59,6 +59,7 @@ bool xy_rect::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (y - y0) / (y1 - y0);
+	rec.uv_extent = sqrtf((x1 - x0) * (y1 - y0));
 	rec.t = t;
 	rec.mat_ptr = mat;
 	rec.p = r.point_at_parameter(t);
@@ -148,6 +149,7 @@ bool xz_rect::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_extent = sqrtf((x1 - x0) * (z1 - z0));
 	rec.t = t;
 	rec.mat_ptr = mat;
 	rec.p = r.point_at_parameter(t);
@@ -212,6 +214,7 @@ bool yz_rect::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
 
 	rec.u = (y - y0) / (y1 - y0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_extent = sqrtf((y1 - y0) * (z1 - z0));
 	rec.t = t;
 	rec.mat_ptr = mat;
 	rec.p = r.point_at_parameter(t);
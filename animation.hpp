@@ -0,0 +1,74 @@
+#ifndef ANIMATIONHPP
+#define ANIMATIONHPP
+
+#include "render.hpp"
+#include "camera.hpp"
+#include "thread_pool.hpp"
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Frame range of an animation. Frame f covers scene time f / fps, and the shutter stays open for "shutter" of a frame
+ * (0.5 is the classic 180 degree shutter). Every frame is written to "output", a printf pattern taking the frame number.
+ */
+struct animation_settings
+{
+	int first_frame = 0;
+	int last_frame = 0;
+	float fps = 24;
+	float shutter = 0.5f;
+	std::string output = "frame_%04d.ppm";
+};
+
+/*
+ * Render frames first_frame..last_frame of "world". The scene is built once; before each frame its hitables refit their
+ * bounds to that frame's shutter interval (BVHs rebuild themselves when refitting degrades them too much, see
+ * flat_bvh::refit), and the camera shutter is set to the same interval. Returns non-zero if a frame could not be
+ * written.
+ */
+int render_animation(thread_pool &pool, hitable *world, const camera_settings &cam_settings,
+                     const render_settings &settings, const animation_settings &anim)
+{
+	std::vector<unsigned char> rgb(settings.nx * settings.ny * 3);
+
+	for (int frame = anim.first_frame; frame <= anim.last_frame; frame++)
+	{
+		camera_settings frame_cam = cam_settings;
+		frame_cam.time0 = frame / anim.fps;
+		frame_cam.time1 = frame_cam.time0 + anim.shutter / anim.fps;
+
+		auto start = std::chrono::steady_clock::now();
+		world->refit(frame_cam.time0, frame_cam.time1);
+		auto refitted = std::chrono::steady_clock::now();
+
+		camera cam(frame_cam, settings.nx, settings.ny);
+		render_image(pool, world, cam, settings, rgb.data());
+		auto rendered = std::chrono::steady_clock::now();
+
+		char path[1024];
+		snprintf(path, sizeof(path), anim.output.c_str(), frame);
+
+		std::ofstream out(path);
+
+		if (!out)
+		{
+			std::cerr << "Cannot write " << path << "\n";
+			return 1;
+		}
+
+		write_ppm(out, rgb.data(), settings.nx, settings.ny);
+
+		std::cerr << "frame " << frame << " [" << frame_cam.time0 << ", " << frame_cam.time1 << "]: refit "
+		          << std::chrono::duration<double, std::milli>(refitted - start).count() << " ms, render "
+		          << std::chrono::duration<double, std::milli>(rendered - refitted).count() << " ms -> " << path
+		          << "\n";
+	}
+
+	return 0;
+}
+
+#endif // ANIMATIONHPP
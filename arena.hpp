@@ -0,0 +1,183 @@
+#ifndef ARENAHPP
+#define ARENAHPP
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Monotonic (bump) allocator that owns every object of a scene: materials, textures, hitables and the pointer arrays
+ * that hold them. Objects are carved out of large blocks in creation order, so things built together (the six rects of
+ * a box, the nodes of a BVH) end up next to each other in memory. Nothing is freed individually; destroying or
+ * releasing the arena drops the whole scene at once.
+ *
+ * Most scene classes only hold plain values and pointers into the same arena and have trivial destructors, which are
+ * skipped. Types with a non-trivial destructor (e.g. a flat BVH holding vectors) get it run on release, in reverse
+ * creation order. Raw outside memory (e.g. pixels from stbi_load) must be registered with on_release().
+ */
+class scene_arena
+{
+	public:
+		scene_arena(size_t block_size = 1 << 20) : block_bytes(block_size) {}
+
+		~scene_arena()
+		{
+			release();
+		}
+
+		scene_arena(const scene_arena &) = delete;
+		scene_arena &operator=(const scene_arena &) = delete;
+
+		void *allocate(size_t bytes, size_t alignment);
+
+		template<typename T, typename... Args>
+		T *make(Args&&... args)
+		{
+			T *p = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+			if (!std::is_trivially_destructible<T>::value)
+			{
+				on_release([](void *q) { static_cast<T *>(q)->~T(); }, p);
+			}
+
+			return p;
+		}
+
+		// Default-constructed array, e.g. the "hitable **list" handed to hitable_list and bvh_node.
+		template<typename T>
+		T *make_array(int n)
+		{
+			T *p = static_cast<T *>(allocate(sizeof(T) * n, alignof(T)));
+
+			for (int i = 0; i < n; i++)
+			{
+				new (p + i) T();
+			}
+
+			return p;
+		}
+
+		// Run "fn(p)" when the arena is released. Used for memory the arena did not allocate itself.
+		void on_release(void (*fn)(void *), void *p);
+
+		// Free every block at once. The arena can be reused afterwards.
+		void release();
+
+		size_t bytes_used() const
+		{
+			return used_bytes;
+		}
+
+	private:
+		struct block
+		{
+			block *next;
+			size_t size;
+		};
+
+		struct finalizer
+		{
+			finalizer *next;
+			void (*fn)(void *);
+			void *p;
+		};
+
+		size_t block_bytes;
+		block *blocks = nullptr;
+		char *cursor = nullptr;
+		char *end = nullptr;
+		finalizer *finalizers = nullptr;
+		size_t used_bytes = 0;
+};
+
+void *scene_arena::allocate(size_t bytes, size_t alignment)
+{
+	size_t pad = cursor ? (alignment - (size_t(cursor) % alignment)) % alignment : 0;
+
+	if (cursor && cursor + pad + bytes <= end)
+	{
+		char *p = cursor + pad;
+
+		cursor = p + bytes;
+		used_bytes += bytes;
+
+		return p;
+	}
+
+	// Oversized requests get a block of their own, and later small ones keep filling the current block.
+	bool oversized = bytes + alignment > block_bytes;
+	size_t size = oversized ? bytes + alignment : block_bytes;
+	block *b = static_cast<block *>(malloc(sizeof(block) + size));
+
+	if (!b)
+	{
+		throw std::bad_alloc();
+	}
+
+	b->next = blocks;
+	b->size = size;
+	blocks = b;
+
+	char *start = reinterpret_cast<char *>(b + 1);
+	char *p = start + (alignment - (size_t(start) % alignment)) % alignment;
+
+	if (!oversized)
+	{
+		cursor = p + bytes;
+		end = start + size;
+	}
+
+	used_bytes += bytes;
+
+	return p;
+}
+
+void scene_arena::on_release(void (*fn)(void *), void *p)
+{
+	finalizer *f = make<finalizer>();
+
+	f->next = finalizers;
+	f->fn = fn;
+	f->p = p;
+	finalizers = f;
+}
+
+void scene_arena::release()
+{
+	for (finalizer *f = finalizers; f; f = f->next)
+	{
+		f->fn(f->p);
+	}
+
+	while (blocks)
+	{
+		block *next = blocks->next;
+
+		free(blocks);
+		blocks = next;
+	}
+
+	finalizers = nullptr;
+	cursor = end = nullptr;
+	used_bytes = 0;
+}
+
+/*
+ * Allocate from "arena" when there is one and fall back to the heap otherwise. Lets classes that build their own
+ * children (box, bvh_node, constant_medium) keep working outside an arena.
+ */
+template<typename T, typename... Args>
+T *arena_new(scene_arena *arena, Args&&... args)
+{
+	return arena ? arena->make<T>(std::forward<Args>(args)...) : new T(std::forward<Args>(args)...);
+}
+
+template<typename T>
+T *arena_new_array(scene_arena *arena, int n)
+{
+	return arena ? arena->make_array<T>(n) : new T[n];
+}
+
+#endif // ARENAHPP
@@ -0,0 +1,281 @@
+#ifndef BAKEDNOISEHPP
+#define BAKEDNOISEHPP
+
+#include "perlin.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+/*
+ * Samples per unit of distance at which noise_texture's turbulence is baked. 0 (the default) evaluates it exactly at
+ * every lookup.
+ */
+float noise_bake_resolution = 0;
+
+// Memory the baked bricks may take. Lookups in new bricks past it are evaluated exactly.
+size_t noise_bake_budget = size_t(256) << 20;
+
+/*
+ * perlin::turbulence() sampled on a grid of "resolution" points per unit and read back by trilinear interpolation.
+ * The grid is sparse: it is cut into bricks of 8x8x8 cells, and a brick is baked the first time a lookup lands in
+ * it, so only the space around textured surfaces is ever sampled. Bricks carry their neighbours' first plane of
+ * samples (9x9x9 points), so a lookup reads a single brick. The grid reaches 2^23 samples from the origin on each
+ * axis, as far as a brick key holds; lookups past that are evaluated exactly.
+ *
+ * Bricks live in a fixed open-addressing table of atomic pointers: lookups take no lock, and two threads baking the
+ * same brick race to publish it, the loser dropping its copy.
+ *
+ * The grid can't follow detail finer than two samples, so octaves of turbulence above resolution / 2 are smoothed
+ * away. To report how far that moves the result, each baked brick is also compared to the exact turbulence at a few
+ * points inside it.
+ */
+class baked_turbulence
+{
+	public:
+		static const int brick_cells = 8;
+		static const int brick_points = brick_cells + 1;
+		static const int check_points = 4;  // Per brick, for the error report.
+		static const int key_bits = 21;  // Per brick coordinate, so keys hold bricks -2^20 to 2^20 - 1 on each axis.
+
+		baked_turbulence(float samples_per_unit, size_t budget_bytes, int octaves = 7);
+
+		~baked_turbulence()
+		{
+			for (size_t i = 0; i < table_size; i++)
+			{
+				delete table[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		float value(const vec3 &p) const;
+
+		// Bricks, memory and the error of the baked values against the exact ones, as one line.
+		void report(std::ostream &out) const;
+
+	private:
+		struct brick
+		{
+			uint64_t key;
+			float samples[brick_points][brick_points][brick_points];  // [x][y][z]
+		};
+
+		static uint64_t brick_key(int bx, int by, int bz)
+		{
+			const uint64_t mask = (uint64_t(1) << key_bits) - 1;
+
+			return ((uint64_t(bx) & mask) << (2 * key_bits) | (uint64_t(by) & mask) << key_bits | (uint64_t(bz) & mask)) + 1;
+		}
+
+		const brick *find(int bx, int by, int bz) const;
+
+		// New brick, with the summed and the largest error of its baked values at a few points between samples.
+		brick *bake(int bx, int by, int bz, double &sum, double &max) const;
+
+		void count_lookup() const
+		{
+			static const uint32_t batch = 4096;
+			static thread_local uint32_t local_lookups = 0;
+
+			if (++local_lookups == batch)
+			{
+				lookups.fetch_add(batch, std::memory_order_relaxed);
+				local_lookups = 0;
+			}
+		}
+
+		static float interpolate(const brick &b, int x, int y, int z, float fx, float fy, float fz)
+		{
+			float c00 = b.samples[x][y][z] * (1 - fz) + b.samples[x][y][z + 1] * fz;
+			float c01 = b.samples[x][y + 1][z] * (1 - fz) + b.samples[x][y + 1][z + 1] * fz;
+			float c10 = b.samples[x + 1][y][z] * (1 - fz) + b.samples[x + 1][y][z + 1] * fz;
+			float c11 = b.samples[x + 1][y + 1][z] * (1 - fz) + b.samples[x + 1][y + 1][z + 1] * fz;
+			float c0 = c00 * (1 - fy) + c01 * fy;
+			float c1 = c10 * (1 - fy) + c11 * fy;
+
+			return c0 * (1 - fx) + c1 * fx;
+		}
+
+		perlin noise;
+		float resolution;
+		int depth;
+		size_t max_bricks;
+		size_t table_size;  // Power of two, at least twice max_bricks.
+		std::unique_ptr<std::atomic<brick *>[]> table;
+
+		mutable std::atomic<size_t> bricks{0};
+		mutable std::atomic<uint64_t> lookups{0};  // Counted per thread in batches, so may lag a little.
+		mutable std::atomic<uint64_t> exact_lookups{0};  // Bricks that didn't fit in the budget.
+		mutable std::atomic<uint64_t> far_lookups{0};  // Past the bricks a key holds.
+		mutable std::mutex error_lock;
+		mutable double error_sum = 0;
+		mutable double error_max = 0;
+		mutable uint64_t error_points = 0;
+};
+
+baked_turbulence::baked_turbulence(float samples_per_unit, size_t budget_bytes, int octaves) :
+    resolution(samples_per_unit), depth(octaves)
+{
+	max_bricks = std::max<size_t>(budget_bytes / sizeof(brick), 1);
+	table_size = 1;
+
+	while (table_size < 2 * max_bricks)
+	{
+		table_size *= 2;
+	}
+
+	table.reset(new std::atomic<brick *>[table_size]);
+
+	for (size_t i = 0; i < table_size; i++)
+	{
+		table[i].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+const baked_turbulence::brick *baked_turbulence::find(int bx, int by, int bz) const
+{
+	uint64_t key = brick_key(bx, by, bz);
+	size_t mask = table_size - 1;
+
+	for (size_t i = (key * 0x9e3779b97f4a7c15ull) >> 20 & mask; ; i = (i + 1) & mask)
+	{
+		brick *b = table[i].load(std::memory_order_acquire);
+
+		if (!b)
+		{
+			if (bricks.load(std::memory_order_relaxed) >= max_bricks)
+			{
+				return nullptr;
+			}
+
+			double sum, max;
+			brick *baked = bake(bx, by, bz, sum, max);
+			brick *expected = nullptr;
+
+			if (table[i].compare_exchange_strong(expected, baked, std::memory_order_acq_rel))
+			{
+				std::lock_guard<std::mutex> guard(error_lock);
+
+				bricks.fetch_add(1, std::memory_order_relaxed);
+				error_sum += sum;
+				error_max = std::max(error_max, max);
+				error_points += check_points;
+
+				return baked;
+			}
+
+			// Another thread filled the slot first: maybe with this brick, otherwise keep probing.
+			delete baked;
+			b = expected;
+		}
+
+		if (b->key == key)
+		{
+			return b;
+		}
+	}
+}
+
+baked_turbulence::brick *baked_turbulence::bake(int bx, int by, int bz, double &sum, double &max) const
+{
+	brick *b = new brick;
+	vec3 origin(bx * brick_cells, by * brick_cells, bz * brick_cells);
+
+	b->key = brick_key(bx, by, bz);
+
+	for (int x = 0; x < brick_points; x++)
+	{
+		for (int y = 0; y < brick_points; y++)
+		{
+			for (int z = 0; z < brick_points; z++)
+			{
+				b->samples[x][y][z] = noise.turbulence((origin + vec3(x, y, z)) / resolution, depth);
+			}
+		}
+	}
+
+	// Error at a few points between the samples, at fixed offsets so runs are repeatable.
+	static const float offsets[check_points][3] =
+	    {{0.5f, 0.5f, 0.5f}, {0.25f, 0.75f, 0.4f}, {0.8f, 0.2f, 0.6f}, {0.1f, 0.4f, 0.9f}};
+
+	sum = 0;
+	max = 0;
+
+	for (int i = 0; i < check_points; i++)
+	{
+		int cell = (i * 5) % brick_cells;
+		vec3 g = origin + vec3(cell + offsets[i][0], cell + offsets[i][1], cell + offsets[i][2]);
+		float baked = interpolate(*b, cell, cell, cell, offsets[i][0], offsets[i][1], offsets[i][2]);
+		double error = fabs(baked - noise.turbulence(g / resolution, depth));
+
+		sum += error;
+		max = std::max(max, error);
+	}
+
+	return b;
+}
+
+float baked_turbulence::value(const vec3 &p) const
+{
+	float gx = p.x() * resolution;
+	float gy = p.y() * resolution;
+	float gz = p.z() * resolution;
+	float cx = floorf(gx);
+	float cy = floorf(gy);
+	float cz = floorf(gz);
+
+	count_lookup();
+
+	// Past the bricks a key holds, two bricks would share a key and so their samples; NaNs land here too.
+	const float cell_limit = float(brick_cells) * float(1 << (key_bits - 1));
+
+	if (!(cx >= -cell_limit && cx < cell_limit && cy >= -cell_limit && cy < cell_limit && cz >= -cell_limit &&
+	      cz < cell_limit))
+	{
+		far_lookups.fetch_add(1, std::memory_order_relaxed);
+		return noise.turbulence(p, depth);
+	}
+
+	int ix = int(cx);
+	int iy = int(cy);
+	int iz = int(cz);
+
+	// Brick and cell within it; the shift floors negative cells too.
+	int bx = ix >> 3;
+	int by = iy >> 3;
+	int bz = iz >> 3;
+	const brick *b = find(bx, by, bz);
+
+	if (!b)
+	{
+		exact_lookups.fetch_add(1, std::memory_order_relaxed);
+		return noise.turbulence(p, depth);
+	}
+
+	return interpolate(*b, ix & 7, iy & 7, iz & 7, gx - cx, gy - cy, gz - cz);
+}
+
+void baked_turbulence::report(std::ostream &out) const
+{
+	std::lock_guard<std::mutex> guard(error_lock);
+	size_t n = bricks.load();
+
+	out << "Baked noise: " << n << " bricks (" << n * sizeof(brick) / (1024 * 1024) << " MB) at " << resolution
+	    << " samples per unit, error against exact turbulence max " << error_max << ", mean "
+	    << (error_points ? error_sum / error_points : 0.0) << " over " << error_points << " points; "
+	    << exact_lookups.load() << " of " << lookups.load() << " lookups exact (budget full), " << far_lookups.load()
+	    << " past the range of the grid\n";
+}
+
+// The baked turbulence noise_textures share, created on first use with noise_bake_resolution and noise_bake_budget.
+const baked_turbulence &shared_baked_turbulence()
+{
+	static baked_turbulence baked(noise_bake_resolution, noise_bake_budget);
+
+	return baked;
+}
+
+#endif // BAKEDNOISEHPP
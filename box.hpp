@@ -3,6 +3,7 @@
 
 #include "aarect.hpp"
 #include "hitable_list.hpp"
+#include "arena.hpp"
 
 /*
  * Class to generate boxes inside the Cornell Box
@@ -11,7 +12,7 @@ class box : public hitable
 {
 	public:
 		box() {}
-		box(const vec3 &p0, const vec3 &p1, material *ptr);
+		box(const vec3 &p0, const vec3 &p1, material *ptr, scene_arena *arena = nullptr);
 
 		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
 
@@ -22,27 +23,32 @@ class box : public hitable
 			return true;
 		}
 
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			fn(list_ptr);
+		}
+
 		hitable *list_ptr;
 		// 2 3D points that define a box
 		vec3 pmin;
 		vec3 pmax;
 };
 
-box::box(const vec3 &p0, const vec3 &p1, material *ptr)
+// The six sides are allocated from "arena" (when given) right after the box itself, so they share cache lines.
+box::box(const vec3 &p0, const vec3 &p1, material *ptr, scene_arena *arena)
 {
 	pmin = p0;
 	pmax = p1;
-	hitable **list = new hitable*[6];
-
-	list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-	list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-	list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-	list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-	list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-	list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+	hitable **list = arena_new_array<hitable *>(arena, 6);
 
-	list_ptr = new hitable_list(list, 6);
+	list[0] = arena_new<xy_rect>(arena, p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
+	list[1] = arena_new<flip_normals>(arena, arena_new<xy_rect>(arena, p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+	list[2] = arena_new<xz_rect>(arena, p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
+	list[3] = arena_new<flip_normals>(arena, arena_new<xz_rect>(arena, p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+	list[4] = arena_new<yz_rect>(arena, p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
+	list[5] = arena_new<flip_normals>(arena, arena_new<yz_rect>(arena, p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 
+	list_ptr = arena_new<hitable_list>(arena, list, 6);
 }
 
 bool box::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
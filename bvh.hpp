@@ -2,19 +2,39 @@
 #define BVHHPP
 
 #include "hitable.hpp"
+#include "arena.hpp"
 
 class bvh_node : public hitable
 {
 	public:
 		bvh_node() {}
-		bvh_node(hitable **list, int n, float time0, float time1);
+		bvh_node(hitable **list, int n, float time0, float time1, scene_arena *arena = nullptr);
 
 		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
 		virtual bool bounding_box(float t0, float t1, aabb &box) const;
+		virtual void refit(float t0, float t1);
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			// Single-hitable nodes hold it as both children.
+			bool shared = right == left;
+
+			fn(left);
+
+			if (shared)
+			{
+				right = left;
+			}
+			else
+			{
+				fn(right);
+			}
+		}
 
 		hitable *left;
 		hitable *right;
 		aabb box;
+		int axis; // Axis the children were sorted on. "left" holds the lower coordinates.
 };
 
 bool bvh_node::bounding_box(float t0, float t1, aabb &b) const
@@ -24,48 +44,43 @@ bool bvh_node::bounding_box(float t0, float t1, aabb &b) const
 	return true;
 }
 
-bool bvh_node::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+// Bottom-up: the children refit themselves first, then this node takes the union of their new boxes.
+void bvh_node::refit(float t0, float t1)
 {
-	if (box.hit(r, t_min, t_max))
-	{
-		hit_record left_rec;
-		hit_record right_rec;
+	aabb box_left;
+	aabb box_right;
 
-		bool hit_left = left->hit(r, t_min, t_max, left_rec);
-		bool hit_right = right->hit(r, t_min, t_max, right_rec);
+	left->refit(t0, t1);
 
-		if (hit_left && hit_right)
-		{
-			if (left_rec.t < right_rec.t)
-			{
-				rec = left_rec;
-			}
-			else
-			{
-				rec = right_rec;
-			}
+	if (right != left)
+	{
+		right->refit(t0, t1);
+	}
 
-			return true;
-		}
-		else if (hit_left)
-		{
-			rec = left_rec;
-			return true;
-		}
-		else if (hit_right)
-		{
-			rec = right_rec;
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+	if (left->bounding_box(t0, t1, box_left) && right->bounding_box(t0, t1, box_right))
+	{
+		box = sorrounding_box(box_left, box_right);
 	}
-	else
+}
+
+/*
+ * Children are sorted along "axis" at construction, so the ray sign on that axis tells which one is nearer. Visiting it
+ * first lets the far child be tested against the closer hit distance, which culls most of its subtree.
+ */
+bool bvh_node::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	if (!box.hit(r, t_min, t_max))
 	{
 		return false;
 	}
+
+	hitable *near = r.sign[axis] ? right : left;
+	hitable *far = r.sign[axis] ? left : right;
+
+	bool hit_near = near->hit(r, t_min, t_max, rec);
+	bool hit_far = far->hit(r, t_min, hit_near ? rec.t : t_max, rec);
+
+	return hit_near || hit_far;
 }
 
 static int box_x_compare(const void *a, const void *b)
@@ -128,10 +143,10 @@ static int box_z_compare(const void *a, const void *b)
 		return 1;
 }
 
-bvh_node::bvh_node(hitable **list, int n, float time0, float time1)
+bvh_node::bvh_node(hitable **list, int n, float time0, float time1, scene_arena *arena)
 {
 	// Choose a random axis on each recursive call to use to split the list.
-	int axis = int(3 * drand48());
+	axis = int(3 * drand48());
 
 	if (axis == 0)
 	{
@@ -157,8 +172,8 @@ bvh_node::bvh_node(hitable **list, int n, float time0, float time1)
 	}
 	else
 	{
-		left = new bvh_node(list, n/2, time0, time1);
-		right = new bvh_node(list + n/2, n - n/2, time0, time1);
+		left = arena_new<bvh_node>(arena, list, n/2, time0, time1, arena);
+		right = arena_new<bvh_node>(arena, list + n/2, n - n/2, time0, time1, arena);
 	}
 
 	aabb box_left;
@@ -0,0 +1,204 @@
+#ifndef BVHLAYOUTHPP
+#define BVHLAYOUTHPP
+
+#include "bvh_tree.hpp"
+#include <stdlib.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+/*
+ * Post-build node layout. Depth-first order keeps one child next to its parent, but the other child of an upper-level
+ * node lands thousands of nodes away, and a ray that descends both pays a cache miss (and often a TLB miss) for each.
+ *
+ * The treelet layout stores both children of a node as a sibling pair on one 64-byte cache line, so deciding between
+ * them touches a single line. Pairs are then grouped into page-sized treelets: starting from a treelet root, the pair
+ * a ray is most likely to visit next (by surface area, i.e. the chance a ray through the root also passes the parent)
+ * is added until the page is full. What is left on the treelet's frontier seeds the next treelets, hottest first. The
+ * top of the tree, which nearly every ray walks, ends up packed into the first pages.
+ *
+ * Node 0 is the root; node 1 is a copy of it, so that the pairs after it start on a cache line. Children still come
+ * after their parent, so bottom-up passes can keep walking the array backwards.
+ */
+const int bvh_layout_page_bytes = 4096;
+
+void layout_treelets(bvh_tree &tree)
+{
+	if (tree.node_count < 3 || tree.layout == BVH_LAYOUT_TREELET)
+	{
+		return;
+	}
+
+	struct pending_pair
+	{
+		int parent;      // Inner node in the source tree.
+		int out_parent;  // Where that node went in the new array.
+		float probability;
+
+		bool operator<(const pending_pair &other) const
+		{
+			return probability < other.probability;
+		}
+	};
+
+	tree.make_owned();
+
+	const int page_nodes = bvh_layout_page_bytes / sizeof(flat_bvh_node);
+	float root_area = surface_area(tree.nodes[0].box);
+	bvh_node_vector out(tree.node_count + 1);
+	std::priority_queue<pending_pair> treelet_roots;
+	int next = 2;
+
+	out[0] = tree.nodes[0];
+	treelet_roots.push({0, 0, 1.0f});
+
+	while (!treelet_roots.empty())
+	{
+		std::priority_queue<pending_pair> frontier;
+
+		// The hottest pending pair starts the next treelet.
+		frontier.push(treelet_roots.top());
+		treelet_roots.pop();
+
+		// A treelet fills up the rest of the current page.
+		int page_end = (next / page_nodes + 1) * page_nodes;
+
+		while (!frontier.empty() && next + 2 <= page_end)
+		{
+			pending_pair p = frontier.top();
+			frontier.pop();
+
+			int children[2] = {tree.first_child(p.parent), tree.second_child(p.parent)};
+
+			out[p.out_parent].offset = next;
+
+			for (int c = 0; c < 2; c++)
+			{
+				const flat_bvh_node &child = tree.nodes[children[c]];
+
+				out[next + c] = child;
+
+				if (child.count == 0)
+				{
+					float area = surface_area(child.box);
+					frontier.push({children[c], next + c, root_area > 0 ? area / root_area : 0});
+				}
+			}
+
+			next += 2;
+		}
+
+		while (!frontier.empty())
+		{
+			treelet_roots.push(frontier.top());
+			frontier.pop();
+		}
+	}
+
+	out[1] = out[0];
+	tree.owned_nodes.swap(out);
+	tree.use_owned();
+	tree.layout = BVH_LAYOUT_TREELET;
+}
+
+/*
+ * Memory traffic of a set of rays: the average number of distinct 64-byte cache lines and 4 KB pages of the node array
+ * each ray touches. leaf(r, first, count, t_max) works like the one of bvh_tree::traverse() and also gets the ray, so
+ * the rays do real closest-hit traversals.
+ */
+struct bvh_memory_stats
+{
+	float lines_per_ray;
+	float pages_per_ray;
+};
+
+template<typename F>
+bvh_memory_stats measure_bvh_memory(const bvh_tree &tree, const std::vector<ray> &rays, F &&leaf)
+{
+	std::vector<uintptr_t> lines;
+	std::vector<uintptr_t> pages;
+	size_t total_lines = 0;
+	size_t total_pages = 0;
+
+	for (const ray &r : rays)
+	{
+		int stack[bvh_max_depth];
+		int sp = 0;
+		int node = 0;
+		float t_max = FLT_MAX;
+
+		lines.clear();
+		pages.clear();
+
+		for (;;)
+		{
+			const flat_bvh_node &n = tree.nodes[node];
+			uintptr_t address = uintptr_t(&n);
+
+			lines.push_back(address / 64);
+			pages.push_back(address / bvh_layout_page_bytes);
+
+			if (n.box.hit(r, 0.001f, t_max))
+			{
+				if (n.count == 0)
+				{
+					int near = r.sign[n.axis] ? tree.second_child(node) : tree.first_child(node);
+					int far = r.sign[n.axis] ? tree.first_child(node) : tree.second_child(node);
+
+					stack[sp++] = far;
+					node = near;
+
+					continue;
+				}
+
+				leaf(r, n.offset, n.count, t_max);
+			}
+
+			if (sp == 0)
+			{
+				break;
+			}
+
+			node = stack[--sp];
+		}
+
+		std::sort(lines.begin(), lines.end());
+		std::sort(pages.begin(), pages.end());
+		total_lines += std::unique(lines.begin(), lines.end()) - lines.begin();
+		total_pages += std::unique(pages.begin(), pages.end()) - pages.begin();
+	}
+
+	bvh_memory_stats stats;
+	stats.lines_per_ray = rays.empty() ? 0 : float(total_lines) / rays.size();
+	stats.pages_per_ray = rays.empty() ? 0 : float(total_pages) / rays.size();
+
+	return stats;
+}
+
+// Rays from random points inside "box" in random directions. Uses its own random state, so scenes built later don't
+// change.
+std::vector<ray> random_rays_in_box(const aabb &box, int n)
+{
+	unsigned short state[3] = {0x1234, 0x5678, 0x9abc};
+	std::vector<ray> rays;
+
+	rays.reserve(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		vec3 o;
+		vec3 d;
+
+		for (int a = 0; a < 3; a++)
+		{
+			o[a] = box.min()[a] + (box.max()[a] - box.min()[a]) * erand48(state);
+			d[a] = erand48(state) - 0.5;
+		}
+
+		rays.push_back(ray(o, d, erand48(state)));
+	}
+
+	return rays;
+}
+
+#endif // BVHLAYOUTHPP
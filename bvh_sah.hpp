@@ -0,0 +1,443 @@
+#ifndef BVHSAHHPP
+#define BVHSAHHPP
+
+#include "bvh_tree.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <vector>
+
+const int bvh_bins = 16;
+
+struct bvh_bin
+{
+	aabb box;
+	int count;
+};
+
+// Bins of all three axes for one range of primitives.
+struct bvh_bins_3
+{
+	bvh_bin bins[3][bvh_bins];
+
+	void clear()
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			for (int b = 0; b < bvh_bins; b++)
+			{
+				bins[a][b].box = empty_box();
+				bins[a][b].count = 0;
+			}
+		}
+	}
+
+	void merge(const bvh_bins_3 &other)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			for (int b = 0; b < bvh_bins; b++)
+			{
+				grow(bins[a][b].box, other.bins[a][b].box);
+				bins[a][b].count += other.bins[a][b].count;
+			}
+		}
+	}
+};
+
+inline int bin_index(float c, float lo, float scale)
+{
+	int b = int((c - lo) * scale);
+
+	return b < 0 ? 0 : (b >= bvh_bins ? bvh_bins - 1 : b);
+}
+
+/*
+ * Binned SAH builder. Primitive bounds and centroids come precomputed in flat arrays (bvh_build_input). With a pool the
+ * upper levels bin and reduce their bounds in parallel chunks, and every range below "task_size" primitives becomes a
+ * task that builds its subtree into a private node vector. The pieces are stitched into one depth-first array at the
+ * end, which only has to shift inner node offsets; leaf offsets already index the shared index array, whose ranges are
+ * disjoint between tasks.
+ */
+class bvh_builder
+{
+	public:
+		/*
+		 * "leaf_block" is how many primitives a leaf tests for the price of one, e.g. the SIMD width of a sphere_batch.
+		 * Costs count primitives in blocks of that size, so leaves fill up to whole blocks.
+		 */
+		bvh_builder(const bvh_build_input &input, int32_t *idx, int leaf_size, thread_pool *p, int leaf_block = 1) :
+		    in(input), indices(idx), max_leaf(leaf_size), block(leaf_block), pool(p) {}
+
+		void build(int n, bvh_node_vector &out);
+
+	private:
+		struct range_info
+		{
+			aabb box;
+			aabb centroid_box;
+		};
+
+		// Upper part of the tree, built before the tasks run.
+		struct top_node
+		{
+			aabb box;
+			int axis;
+			int left;
+			int right;
+			int task;  // >= 0: the subtree is the output of tasks[task].
+		};
+
+		struct subtree_task
+		{
+			int begin;
+			int end;
+			int depth;
+			std::vector<flat_bvh_node> nodes;
+		};
+
+		range_info measure(int begin, int end, bool parallel) const;
+		void bin(int begin, int end, const aabb &centroid_box, bvh_bins_3 &out, bool parallel) const;
+		int split(int begin, int end, int depth, const range_info &info, int &axis, bool parallel) const;
+		int build_top(int begin, int end, int depth);
+		void build_serial(std::vector<flat_bvh_node> &nodes, int node, int begin, int end, int depth) const;
+		void emit(int top, bvh_node_vector &out);
+
+		float blocks(int count) const
+		{
+			return float((count + block - 1) / block);
+		}
+
+		const bvh_build_input &in;
+		int32_t *indices;
+		int max_leaf;
+		int block;
+		thread_pool *pool;
+		int task_size = 0;
+		std::vector<top_node> top;
+		std::vector<subtree_task> tasks;
+};
+
+bvh_builder::range_info bvh_builder::measure(int begin, int end, bool parallel) const
+{
+	range_info info;
+	info.box = empty_box();
+	info.centroid_box = empty_box();
+
+	if (!parallel || end - begin <= bvh_parallel_grain)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			grow(info.box, in.bounds[indices[i]]);
+			grow(info.centroid_box, in.centroids[indices[i]]);
+		}
+
+		return info;
+	}
+
+	int chunks = (end - begin + bvh_parallel_grain - 1) / bvh_parallel_grain;
+	std::vector<range_info> partial(chunks);
+
+	parallel_for(*pool, 0, chunks, 1, [&](int first, int last)
+	{
+		for (int c = first; c < last; c++)
+		{
+			int b = begin + c * bvh_parallel_grain;
+			partial[c] = measure(b, std::min(end, b + bvh_parallel_grain), false);
+		}
+	});
+
+	for (const range_info &p : partial)
+	{
+		grow(info.box, p.box);
+		grow(info.centroid_box, p.centroid_box);
+	}
+
+	return info;
+}
+
+void bvh_builder::bin(int begin, int end, const aabb &centroid_box, bvh_bins_3 &out, bool parallel) const
+{
+	out.clear();
+
+	if (!parallel || end - begin <= bvh_parallel_grain)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			float lo = centroid_box.min()[a];
+			float extent = centroid_box.max()[a] - lo;
+			float scale = extent > 0 ? bvh_bins / extent : 0;
+
+			for (int i = begin; i < end; i++)
+			{
+				bvh_bin &b = out.bins[a][bin_index(in.centroids[indices[i]][a], lo, scale)];
+
+				grow(b.box, in.bounds[indices[i]]);
+				b.count++;
+			}
+		}
+
+		return;
+	}
+
+	int chunks = (end - begin + bvh_parallel_grain - 1) / bvh_parallel_grain;
+	std::vector<bvh_bins_3> partial(chunks);
+
+	parallel_for(*pool, 0, chunks, 1, [&](int first, int last)
+	{
+		for (int c = first; c < last; c++)
+		{
+			int b = begin + c * bvh_parallel_grain;
+			bin(b, std::min(end, b + bvh_parallel_grain), centroid_box, partial[c], false);
+		}
+	});
+
+	for (const bvh_bins_3 &p : partial)
+	{
+		out.merge(p);
+	}
+}
+
+/*
+ * Partition [begin, end) and return the first index of the right half, or -1 to make a leaf. Falls back to a median
+ * split when SAH can't separate the centroids or the tree is getting too deep for the traversal stack.
+ */
+int bvh_builder::split(int begin, int end, int depth, const range_info &info, int &axis, bool parallel) const
+{
+	int count = end - begin;
+
+	if (count <= 1)
+	{
+		return -1;
+	}
+
+	axis = longest_axis(info.centroid_box);
+
+	bool degenerate = info.centroid_box.max()[axis] - info.centroid_box.min()[axis] <= 0;
+
+	if (!degenerate && depth < bvh_max_depth / 2)
+	{
+		bvh_bins_3 bins;
+		bin(begin, end, info.centroid_box, bins, parallel);
+
+		float best_cost = FLT_MAX;
+		int best_axis = -1;
+		int best_bin = 0;
+
+		for (int a = 0; a < 3; a++)
+		{
+			// Sweep from the right to get the area and count of every right-hand side, then from the left.
+			float right_area[bvh_bins];
+			int right_count[bvh_bins];
+			aabb acc = empty_box();
+			int n = 0;
+
+			for (int b = bvh_bins - 1; b > 0; b--)
+			{
+				grow(acc, bins.bins[a][b].box);
+				n += bins.bins[a][b].count;
+				right_area[b] = n ? surface_area(acc) : 0;
+				right_count[b] = n;
+			}
+
+			acc = empty_box();
+			n = 0;
+
+			for (int b = 0; b < bvh_bins - 1; b++)
+			{
+				grow(acc, bins.bins[a][b].box);
+				n += bins.bins[a][b].count;
+
+				if (n == 0 || right_count[b + 1] == 0)
+				{
+					continue;
+				}
+
+				float cost = blocks(n) * surface_area(acc) + blocks(right_count[b + 1]) * right_area[b + 1];
+
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = a;
+					best_bin = b;
+				}
+			}
+		}
+
+		// Unit costs for a traversal step and a primitive test, both scaled by the area of the node.
+		float leaf_cost = blocks(count) * surface_area(info.box);
+
+		if (count <= max_leaf && (best_axis < 0 || surface_area(info.box) + best_cost >= leaf_cost))
+		{
+			return -1;
+		}
+
+		if (best_axis >= 0)
+		{
+			axis = best_axis;
+
+			float lo = info.centroid_box.min()[axis];
+			float scale = bvh_bins / (info.centroid_box.max()[axis] - lo);
+			int32_t *mid = std::partition(indices + begin, indices + end, [&](int32_t i)
+			{
+				return bin_index(in.centroids[i][axis], lo, scale) <= best_bin;
+			});
+
+			return int(mid - indices);
+		}
+	}
+
+	if (count <= max_leaf)
+	{
+		return -1;
+	}
+
+	int mid = (begin + end) / 2;
+
+	std::nth_element(indices + begin, indices + mid, indices + end,
+	                 [this, axis](int32_t a, int32_t b) { return in.centroids[a][axis] < in.centroids[b][axis]; });
+
+	return mid;
+}
+
+void bvh_builder::build_serial(std::vector<flat_bvh_node> &nodes, int node, int begin, int end, int depth) const
+{
+	range_info info = measure(begin, end, false);
+	int axis = 0;
+	int mid = split(begin, end, depth, info, axis, false);
+
+	nodes[node].box = info.box;
+
+	if (mid < 0)
+	{
+		nodes[node].offset = begin;
+		nodes[node].count = end - begin;
+		nodes[node].axis = 0;
+
+		return;
+	}
+
+	nodes[node].count = 0;
+	nodes[node].axis = axis;
+
+	int left = nodes.size();
+	nodes.emplace_back();
+	build_serial(nodes, left, begin, mid, depth + 1);
+
+	int right = nodes.size();
+	nodes.emplace_back();
+	nodes[node].offset = right;
+	build_serial(nodes, right, mid, end, depth + 1);
+}
+
+int bvh_builder::build_top(int begin, int end, int depth)
+{
+	int index = top.size();
+	top.push_back(top_node());
+
+	if (end - begin <= task_size)
+	{
+		top[index].task = tasks.size();
+		tasks.push_back({begin, end, depth, std::vector<flat_bvh_node>()});
+
+		return index;
+	}
+
+	range_info info = measure(begin, end, true);
+	int axis = 0;
+	int mid = split(begin, end, depth, info, axis, true);
+
+	if (mid < 0)
+	{
+		top[index].task = tasks.size();
+		tasks.push_back({begin, end, depth, std::vector<flat_bvh_node>()});
+
+		return index;
+	}
+
+	int left = build_top(begin, mid, depth + 1);
+	int right = build_top(mid, end, depth + 1);
+
+	top[index].box = info.box;
+	top[index].axis = axis;
+	top[index].left = left;
+	top[index].right = right;
+	top[index].task = -1;
+
+	return index;
+}
+
+void bvh_builder::emit(int t, bvh_node_vector &out)
+{
+	const top_node &n = top[t];
+
+	if (n.task >= 0)
+	{
+		int base = out.size();
+
+		for (flat_bvh_node node : tasks[n.task].nodes)
+		{
+			if (node.count == 0)
+			{
+				node.offset += base;
+			}
+
+			out.push_back(node);
+		}
+
+		return;
+	}
+
+	int index = out.size();
+	out.emplace_back();
+	out[index].box = n.box;
+	out[index].axis = n.axis;
+	out[index].count = 0;
+
+	emit(n.left, out);
+	out[index].offset = out.size();
+	emit(n.right, out);
+}
+
+void bvh_builder::build(int n, bvh_node_vector &out)
+{
+	int threads = pool ? pool->size() : 1;
+
+	// Enough tasks to keep every thread busy even when subtrees are uneven. Without a pool everything is one task.
+	task_size = threads > 1 ? std::max(4096, n / (threads * 8)) : n;
+
+	top.clear();
+	tasks.clear();
+	build_top(0, n, 0);
+
+	auto run = [this](subtree_task &task)
+	{
+		task.nodes.reserve(2 * (task.end - task.begin));
+		task.nodes.emplace_back();
+		build_serial(task.nodes, 0, task.begin, task.end, task.depth);
+	};
+
+	if (threads > 1 && tasks.size() > 1)
+	{
+		task_group group(*pool);
+
+		for (subtree_task &task : tasks)
+		{
+			group.run([&run, &task]() { run(task); });
+		}
+
+		group.wait();
+	}
+	else
+	{
+		for (subtree_task &task : tasks)
+		{
+			run(task);
+		}
+	}
+
+	out.clear();
+	out.reserve(2 * n);
+	emit(0, out);
+}
+
+#endif // BVHSAHHPP
@@ -0,0 +1,273 @@
+#ifndef BVHTREEHPP
+#define BVHTREEHPP
+
+#include "hitable.hpp"
+#include "mapped_file.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+/*
+ * BVH stored as one array of nodes plus the order of the primitives in the leaves. Unlike bvh_node there are no
+ * pointers, so the whole structure can be written to disk and mapped back in place.
+ *
+ * Builders write the nodes in depth-first order: an inner node's first child is the node right after it and "offset"
+ * is the index of its second child. After the layout pass (bvh_layout.hpp) the two children of a node are siblings
+ * at "offset" and "offset + 1" instead. A leaf covers primitives [offset, offset + count) of the index array.
+ */
+struct flat_bvh_node
+{
+	aabb box;
+	int32_t offset;
+	uint16_t count;  // Primitives in the leaf, 0 for inner nodes.
+	uint8_t axis;    // Axis the children were split on. The first child holds the lower coordinates.
+	uint8_t pad;
+};
+
+enum bvh_node_layout
+{
+	BVH_LAYOUT_DEPTH_FIRST,
+	BVH_LAYOUT_TREELET
+};
+
+/*
+ * Node arrays are aligned to cache lines, so that a sibling pair of the treelet layout (two 32-byte nodes) shares one.
+ */
+template<typename T>
+struct cache_aligned_allocator
+{
+	typedef T value_type;
+
+	cache_aligned_allocator() {}
+
+	template<typename U>
+	cache_aligned_allocator(const cache_aligned_allocator<U> &) {}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(64)));
+	}
+
+	void deallocate(T *p, size_t)
+	{
+		::operator delete(p, std::align_val_t(64));
+	}
+
+	bool operator==(const cache_aligned_allocator &) const { return true; }
+	bool operator!=(const cache_aligned_allocator &) const { return false; }
+};
+
+typedef std::vector<flat_bvh_node, cache_aligned_allocator<flat_bvh_node>> bvh_node_vector;
+
+// Deep enough for any tree built here. The SAH builder falls back to median splits long before that; LBVH rejects
+// deeper trees.
+const int bvh_max_depth = 64;
+
+/*
+ * Node and index arrays of a flattened BVH. They either live in the owned vectors (freshly built) or point into a
+ * mapped cache file.
+ */
+class bvh_tree
+{
+	public:
+		bvh_tree() {}
+
+		bvh_tree(const bvh_tree &) = delete;
+		bvh_tree &operator=(const bvh_tree &) = delete;
+
+		// Make "nodes" and "indices" point at the owned vectors after they were filled.
+		void use_owned()
+		{
+			nodes = owned_nodes.data();
+			node_count = owned_nodes.size();
+			indices = owned_indices.data();
+			index_count = owned_indices.size();
+			mapping.close();
+		}
+
+		// Copy a tree that lives in a mapped cache file into the owned vectors, so its nodes can be changed.
+		void make_owned()
+		{
+			if (nodes != owned_nodes.data())
+			{
+				owned_nodes.assign(nodes, nodes + node_count);
+				owned_indices.assign(indices, indices + index_count);
+				use_owned();
+			}
+		}
+
+		// Children of inner node i. The first one holds the lower coordinates on the split axis.
+		int first_child(int i) const
+		{
+			return layout == BVH_LAYOUT_TREELET ? nodes[i].offset : i + 1;
+		}
+
+		int second_child(int i) const
+		{
+			return layout == BVH_LAYOUT_TREELET ? nodes[i].offset + 1 : nodes[i].offset;
+		}
+
+		/*
+		 * Closest-hit traversal. Children are visited near first, using the ray sign on the split axis, and "t_max"
+		 * shrinks as hits are found. leaf(first, count, t_max) tests primitives [first, first + count) of the index
+		 * array, lowers t_max on a hit and returns whether anything was hit.
+		 */
+		template<typename F>
+		bool traverse(const ray &r, float t_min, float t_max, F &&leaf) const
+		{
+			int stack[bvh_max_depth];
+			int sp = 0;
+			int node = 0;
+			bool hit_anything = false;
+
+			if (node_count == 0)
+			{
+				return false;
+			}
+
+			for (;;)
+			{
+				const flat_bvh_node &n = nodes[node];
+
+				if (n.box.hit(r, t_min, t_max))
+				{
+					if (n.count == 0)
+					{
+						int first = layout == BVH_LAYOUT_TREELET ? n.offset : node + 1;
+						int second = layout == BVH_LAYOUT_TREELET ? n.offset + 1 : n.offset;
+						int near = r.sign[n.axis] ? second : first;
+						int far = r.sign[n.axis] ? first : second;
+
+						stack[sp++] = far;
+						node = near;
+
+						continue;
+					}
+
+					if (leaf(n.offset, n.count, t_max))
+					{
+						hit_anything = true;
+					}
+				}
+
+				if (sp == 0)
+				{
+					break;
+				}
+
+				node = stack[--sp];
+			}
+
+			return hit_anything;
+		}
+
+		const flat_bvh_node *nodes = nullptr;
+		int node_count = 0;
+		const int32_t *indices = nullptr;
+		int index_count = 0;
+		bvh_node_layout layout = BVH_LAYOUT_DEPTH_FIRST;
+
+		bvh_node_vector owned_nodes;
+		std::vector<int32_t> owned_indices;
+		mapped_file mapping;
+};
+
+/*
+ * Primitive bounds and centroids computed once up front, so building never calls bounding_box() again.
+ */
+struct bvh_build_input
+{
+	std::vector<aabb> bounds;
+	std::vector<vec3> centroids;
+
+	void add(const aabb &box)
+	{
+		bounds.push_back(box);
+		centroids.push_back(0.5 * (box.min() + box.max()));
+	}
+
+	void resize(int n)
+	{
+		bounds.resize(n);
+		centroids.resize(n);
+	}
+
+	void set(int i, const aabb &box)
+	{
+		bounds[i] = box;
+		centroids[i] = 0.5 * (box.min() + box.max());
+	}
+
+	int size() const
+	{
+		return int(bounds.size());
+	}
+};
+
+inline aabb empty_box()
+{
+	return aabb(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+}
+
+inline void grow(aabb &box, const aabb &other)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		box.m_tmin[a] = fmin(box.m_tmin[a], other.m_tmin[a]);
+		box.m_tmax[a] = fmax(box.m_tmax[a], other.m_tmax[a]);
+	}
+}
+
+inline void grow(aabb &box, const vec3 &p)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		box.m_tmin[a] = fmin(box.m_tmin[a], p[a]);
+		box.m_tmax[a] = fmax(box.m_tmax[a], p[a]);
+	}
+}
+
+inline int longest_axis(const aabb &box)
+{
+	vec3 d = box.max() - box.min();
+
+	return d.x() > d.y() && d.x() > d.z() ? 0 : (d.y() > d.z() ? 1 : 2);
+}
+
+inline float surface_area(const aabb &box)
+{
+	vec3 d = box.max() - box.min();
+
+	return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+/*
+ * SAH cost of a tree relative to its root: a traversal step and a primitive test both cost one, weighted by the
+ * chance (area ratio) that a ray through the root also passes the node. Lower is better; only meaningful for comparing
+ * trees over the same primitives.
+ */
+inline float bvh_sah_cost(const bvh_tree &tree)
+{
+	if (tree.node_count == 0)
+	{
+		return 0;
+	}
+
+	float root_area = surface_area(tree.nodes[0].box);
+	double cost = 0;
+
+	for (int i = 0; i < tree.node_count; i++)
+	{
+		const flat_bvh_node &n = tree.nodes[i];
+
+		cost += surface_area(n.box) * (n.count ? n.count : 1);
+	}
+
+	return root_area > 0 ? float(cost / root_area) : 0;
+}
+
+// Chunk size for parallel loops over primitives in the builders.
+const int bvh_parallel_grain = 16384;
+
+#endif // BVHTREEHPP
@@ -15,6 +15,22 @@ vec3 random_in_unit_disk()
 	return p;
 }
 
+/*
+ * Plain description of a camera, as it comes from a scene default, a render job or a scene file. Turned into a camera
+ * once the image aspect ratio is known.
+ */
+struct camera_settings
+{
+	vec3 lookfrom;
+	vec3 lookat;
+	vec3 vup;
+	float vfov;  // Top to bottom in degrees.
+	float aperture;
+	float focus_dist;
+	float time0;  // Shutter open time.
+	float time1;  // Shutter close time.
+};
+
 class camera
 {
 	public:
@@ -47,13 +63,40 @@ class camera
 			vertical = 2.0 * half_height * focus_dist * v;
 		}
 
-		ray get_ray(float s, float t)
+		camera(const camera_settings &c, float aspect) :
+		    camera(c.lookfrom, c.lookat, c.vup, c.vfov, aspect, c.aperture, c.focus_dist, c.time0, c.time1) {}
+
+		// Camera for an nx by ny image, whose rays carry the footprint of one pixel (see ray::spread).
+		camera(const camera_settings &c, int nx, int ny) : camera(c, float(nx) / float(ny))
+		{
+			pixel_spread = vertical.length() / (ny * (lower_left_corner + 0.5 * (horizontal + vertical) - origin).length());
+		}
+
+		/*
+		 * Render kernels for scenes that need no lens or no shutter (see scene_features.hpp) turn those off, which
+		 * skips their random samples: rays then start at "origin" and all leave at time0.
+		 */
+		template<bool lens = true, bool shutter = true>
+		ray get_ray(float s, float t) const
 		{
-			vec3 rd = lens_radius * random_in_unit_disk();
-			vec3 offset = u * rd.x() + v * rd.y();
-			float time = time0 + drand48() * (time1 - time0);
+			vec3 offset(0, 0, 0);
+			float time = time0;
+
+			if (lens)
+			{
+				vec3 rd = lens_radius * random_in_unit_disk();
+				offset = u * rd.x() + v * rd.y();
+			}
+
+			if (shutter)
+			{
+				time += drand48() * (time1 - time0);
+			}
+
+			ray r(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, time);
+			r.spread = pixel_spread;
 
-			return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, time);
+			return r;
 		}
 
 		vec3 origin;
@@ -64,6 +107,7 @@ class camera
 		float time0; // Shutter open time.
 		float time1; // Shutter close time.
 		float lens_radius;
+		float pixel_spread = 0;  // Angle one pixel covers, 0 if the image size is unknown.
 };
 
 #endif // CAMERAHPP
@@ -3,6 +3,7 @@
 
 #include "hitable.hpp"
 #include "float.h"
+#include "arena.hpp"
 
 /*
  * Class to implement volumes. Look at chapter 8 for more information about the maths behind this class.
@@ -10,9 +11,9 @@
 class constant_medium : public hitable
 {
 	public:
-		constant_medium(hitable *b, float d, texture *a) : boundary(b), density(d)
+		constant_medium(hitable *b, float d, texture *a, scene_arena *arena = nullptr) : boundary(b), density(d)
 		{
-			phase_function = new isotropic(a);
+			phase_function = arena_new<isotropic>(arena, a);
 		}
 
 		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
@@ -22,6 +23,16 @@ class constant_medium : public hitable
 			return boundary->bounding_box(t0, t1, box);
 		}
 
+		virtual void refit(float t0, float t1)
+		{
+			boundary->refit(t0, t1);
+		}
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			fn(boundary);
+		}
+
 		hitable *boundary;
 		float density;
 		material *phase_function;
@@ -97,6 +108,7 @@ bool constant_medium::hit(const ray &r, float t_min, float t_max, hit_record &re
 
 				rec.normal = vec3(1, 0, 0); // Arbitrary
 				rec.mat_ptr = phase_function;
+				rec.uv_extent = 0;
 
 				return true;
 			}
@@ -0,0 +1,102 @@
+#ifndef CPUDISPATCHHPP
+#define CPUDISPATCHHPP
+
+#include <iostream>
+#include <string>
+
+/*
+ * Instruction sets the hot kernels are built for. The binary itself targets the baseline x86-64 CPU; kernels with wider
+ * versions compile those with a target attribute and pick one at run time through kernel_isa, so one build runs on
+ * every machine and still uses AVX2 or AVX-512 where they exist.
+ *
+ * Kernels with per-ISA versions: the sphere_batch test (sphere_batch.hpp), tonemapping (tonemap_row() in render.hpp)
+ * and Perlin noise (perlin::noise8() in perlin.hpp, whose AVX2 version also serves AVX-512).
+ */
+enum cpu_isa
+{
+	ISA_BASELINE,  // x86-64: SSE2.
+	ISA_SSE42,
+	ISA_AVX2,      // With FMA.
+	ISA_AVX512,    // F and VL.
+};
+
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+
+const char *isa_name(cpu_isa isa)
+{
+	switch (isa)
+	{
+		case ISA_SSE42:
+			return "sse4.2";
+		case ISA_AVX2:
+			return "avx2";
+		case ISA_AVX512:
+			return "avx512";
+		default:
+			return "baseline";
+	}
+}
+
+bool parse_isa(const std::string &name, cpu_isa &isa)
+{
+	for (cpu_isa i : {ISA_BASELINE, ISA_SSE42, ISA_AVX2, ISA_AVX512})
+	{
+		if (name == isa_name(i))
+		{
+			isa = i;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Widest instruction set this CPU runs, from cpuid.
+cpu_isa detect_cpu_isa()
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+	{
+		return ISA_AVX512;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return ISA_AVX2;
+	}
+
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		return ISA_SSE42;
+	}
+
+	return ISA_BASELINE;
+}
+
+// Versions the kernels run, detected once at startup. Only select_kernel_isa() changes it, before rendering starts.
+cpu_isa kernel_isa = detect_cpu_isa();
+
+/*
+ * Use "requested" if the CPU runs it, otherwise the widest it does. Logs the choice to std::cerr and returns it.
+ */
+cpu_isa select_kernel_isa(cpu_isa requested)
+{
+	cpu_isa supported = detect_cpu_isa();
+
+	if (requested > supported)
+	{
+		std::cerr << "This CPU has no " << isa_name(requested) << ", using " << isa_name(supported) << "\n";
+		requested = supported;
+	}
+
+	kernel_isa = requested;
+	std::cerr << "CPU kernels: " << isa_name(kernel_isa) << " (CPU supports " << isa_name(supported) << ")\n";
+
+	return kernel_isa;
+}
+
+#endif // CPUDISPATCHHPP
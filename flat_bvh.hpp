@@ -0,0 +1,622 @@
+#ifndef FLATBVHHPP
+#define FLATBVHHPP
+
+#include "hitable.hpp"
+#include "bvh_tree.hpp"
+#include "bvh_sah.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "quantized_bvh.hpp"
+#include "bvh_layout.hpp"
+#include "sphere_batch.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/*
+ * Build speed against trace speed. SAH builds the best trees and is the default for still images. LBVH builds several
+ * times faster, for scenes rebuilt every frame; LBVH_TREELET sits in between. SBVH adds spatial splits to SAH for
+ * scenes mixing huge and small primitives, at the price of a serial build and duplicated references.
+ */
+enum bvh_build_method
+{
+	BVH_BUILD_SAH,
+	BVH_BUILD_LBVH,
+	BVH_BUILD_LBVH_TREELET,
+	BVH_BUILD_SBVH
+};
+
+bvh_build_method bvh_method = BVH_BUILD_SAH;
+
+// Extra references SBVH may create by spatial splits, as a fraction of the primitive count.
+float bvh_split_budget = 0.5f;
+
+bool parse_bvh_build_method(const std::string &name, bvh_build_method &method)
+{
+	if (name == "sah") method = BVH_BUILD_SAH;
+	else if (name == "lbvh") method = BVH_BUILD_LBVH;
+	else if (name == "lbvh-treelet") method = BVH_BUILD_LBVH_TREELET;
+	else if (name == "sbvh") method = BVH_BUILD_SBVH;
+	else return false;
+
+	return true;
+}
+
+// Pool used for BVH builds. Null builds on the calling thread.
+thread_pool *bvh_build_pool = nullptr;
+
+/*
+ * Build "tree" over "in" with leaves of up to "max_leaf" primitives. "leaf_block" tells the SAH builder how many
+ * primitives a leaf tests at once (see bvh_builder).
+ */
+void build_bvh(const bvh_build_input &in, bvh_tree &tree, int max_leaf = 4, int leaf_block = 1)
+{
+	int n = in.size();
+
+	tree.owned_nodes.clear();
+	tree.owned_indices.clear();
+	tree.layout = BVH_LAYOUT_DEPTH_FIRST;
+
+	if (n > 0 && bvh_method == BVH_BUILD_SBVH)
+	{
+		sbvh_builder builder(in, max_leaf, bvh_split_budget);
+
+		builder.build(tree.owned_nodes, tree.owned_indices);
+		tree.use_owned();
+		return;
+	}
+
+	if (n > 0 && (bvh_method == BVH_BUILD_LBVH || bvh_method == BVH_BUILD_LBVH_TREELET))
+	{
+		lbvh_builder builder(in, max_leaf, bvh_method == BVH_BUILD_LBVH_TREELET, bvh_build_pool);
+
+		if (builder.build(tree.owned_nodes, tree.owned_indices))
+		{
+			tree.use_owned();
+			return;
+		}
+
+		// Too deep to traverse, e.g. many primitives crowded into a tiny part of the scene. SAH copes with that.
+		tree.owned_nodes.clear();
+	}
+
+	tree.owned_indices.resize(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		tree.owned_indices[i] = i;
+	}
+
+	if (n > 0)
+	{
+		bvh_builder builder(in, tree.owned_indices.data(), max_leaf, bvh_build_pool, leaf_block);
+		builder.build(n, tree.owned_nodes);
+	}
+
+	tree.use_owned();
+}
+
+/*
+ * On-disk BVH cache. Files are named after a hash of the primitive bounds, which is everything the builder looks at,
+ * so the same geometry always finds its tree and changed geometry never does. Layout: header, nodes, indices.
+ */
+const char bvh_cache_magic[8] = {'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0'};
+const uint32_t bvh_cache_version = 1;
+
+struct bvh_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t node_count;
+	uint32_t index_count;
+	uint32_t node_bytes;  // sizeof(flat_bvh_node) of the writer, to reject files from a different layout.
+	uint64_t geometry_hash;
+	uint64_t checksum;    // FNV-1a of the node and index arrays.
+};
+
+// Directory for cached BVHs. Empty disables the cache, except for scene files (see scene_bvh_cache_dir).
+std::string bvh_cache_dir;
+
+/*
+ * Directory for the BVHs of the scene file being built on this thread, used when bvh_cache_dir is empty. Set by
+ * open_scene() to "<file>.bvh" next to the scene cache, so reloading a scene file skips BVH builds by default.
+ */
+thread_local std::string scene_bvh_cache_dir;
+
+uint64_t bvh_geometry_hash(const bvh_build_input &in)
+{
+	uint64_t n = in.size();
+	uint64_t hash = fnv1a(&n, sizeof(n));
+
+	return fnv1a(in.bounds.data(), in.bounds.size() * sizeof(aabb), hash);
+}
+
+std::string bvh_cache_path(const std::string &dir, uint64_t geometry_hash)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)geometry_hash);
+
+	return dir + "/" + name;
+}
+
+bool save_bvh(const std::string &path, const bvh_tree &tree, uint64_t geometry_hash)
+{
+	size_t node_bytes = tree.node_count * sizeof(flat_bvh_node);
+	size_t index_bytes = tree.index_count * sizeof(int32_t);
+	std::vector<char> bytes(sizeof(bvh_cache_header) + node_bytes + index_bytes);
+	bvh_cache_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+	header.version = bvh_cache_version;
+	header.node_count = tree.node_count;
+	header.index_count = tree.index_count;
+	header.node_bytes = sizeof(flat_bvh_node);
+	header.geometry_hash = geometry_hash;
+	header.checksum = fnv1a(tree.indices, index_bytes, fnv1a(tree.nodes, node_bytes));
+
+	memcpy(&bytes[0], &header, sizeof(header));
+	memcpy(&bytes[sizeof(header)], tree.nodes, node_bytes);
+	memcpy(&bytes[sizeof(header) + node_bytes], tree.indices, index_bytes);
+
+	return write_file_atomically(path, bytes.data(), bytes.size());
+}
+
+/*
+ * Whether a depth-first tree only refers inside itself: inner nodes have a valid split axis and both children after
+ * them, no deeper than a traversal stack holds; leaves hold at most "max_leaf" references inside the index array; and
+ * every index names one of "prim_count" primitives. The checksum of a cached tree only shows it is the tree that was
+ * written, so load_bvh() checks this too before anything reads through it.
+ */
+bool check_bvh_tree(const flat_bvh_node *nodes, uint32_t node_count, const int32_t *indices, uint32_t index_count,
+                    int prim_count, int max_leaf)
+{
+	// Children come after their parent, so depths are known by the time a node is reached.
+	std::vector<uint8_t> depth(node_count, 0);
+
+	for (uint32_t i = 0; i < node_count; i++)
+	{
+		const flat_bvh_node &n = nodes[i];
+
+		if (n.count == 0)
+		{
+			if (n.axis > 2 || i + 1 >= node_count || n.offset <= int32_t(i) || uint32_t(n.offset) >= node_count ||
+			    depth[i] + 1 >= bvh_max_depth)
+			{
+				return false;
+			}
+
+			depth[i + 1] = depth[i] + 1;
+			depth[n.offset] = depth[i] + 1;
+		}
+		else if (n.count > max_leaf || n.count > index_count || n.offset < 0 || uint32_t(n.offset) > index_count - n.count)
+		{
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < index_count; i++)
+	{
+		if (indices[i] < 0 || indices[i] >= prim_count)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Map a cached tree. Rejects it (and the caller rebuilds) on any mismatch: magic, version, node layout, geometry, size
+ * or checksum, or a tree that fails check_bvh_tree().
+ */
+bool load_bvh(const std::string &path, bvh_tree &tree, uint64_t geometry_hash, int prim_count, int max_leaf)
+{
+	mapped_file &m = tree.mapping;
+
+	if (!m.open(path) || m.size() < sizeof(bvh_cache_header))
+	{
+		return false;
+	}
+
+	bvh_cache_header header;
+	memcpy(&header, m.data(), sizeof(header));
+
+	size_t node_bytes = size_t(header.node_count) * sizeof(flat_bvh_node);
+	size_t index_bytes = size_t(header.index_count) * sizeof(int32_t);
+	const char *nodes = m.data() + sizeof(header);
+	const char *indices = nodes + node_bytes;
+
+	if (memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0 || header.version != bvh_cache_version ||
+	    header.node_bytes != sizeof(flat_bvh_node) || header.geometry_hash != geometry_hash ||
+	    int(header.index_count) < prim_count || header.node_count == 0 ||
+	    m.size() != sizeof(header) + node_bytes + index_bytes ||
+	    fnv1a(indices, index_bytes, fnv1a(nodes, node_bytes)) != header.checksum ||
+	    !check_bvh_tree(reinterpret_cast<const flat_bvh_node *>(nodes), header.node_count,
+	                    reinterpret_cast<const int32_t *>(indices), header.index_count, prim_count, max_leaf))
+	{
+		m.close();
+		return false;
+	}
+
+	tree.layout = BVH_LAYOUT_DEPTH_FIRST;
+	tree.nodes = reinterpret_cast<const flat_bvh_node *>(nodes);
+	tree.node_count = header.node_count;
+	tree.indices = reinterpret_cast<const int32_t *>(indices);
+	tree.index_count = header.index_count;
+
+	return true;
+}
+
+/*
+ * Build "tree" for "in", or map it from the cache directory when an up to date copy is there. A freshly built tree is
+ * written back for the next run.
+ */
+void build_or_load_bvh(const bvh_build_input &in, bvh_tree &tree, int max_leaf = 4, int leaf_block = 1)
+{
+	const std::string &dir = bvh_cache_dir.empty() ? scene_bvh_cache_dir : bvh_cache_dir;
+
+	if (dir.empty() || in.size() == 0)
+	{
+		build_bvh(in, tree, max_leaf, leaf_block);
+		return;
+	}
+
+	// Trees from different builders or leaf sizes must not be mixed up, so those are part of the key.
+	int32_t leaf_shape[2] = {max_leaf, leaf_block};
+	uint64_t hash = fnv1a(&bvh_method, sizeof(bvh_method), bvh_geometry_hash(in));
+	hash = fnv1a(leaf_shape, sizeof(leaf_shape), hash);
+	std::string path = bvh_cache_path(dir, hash);
+
+	if (load_bvh(path, tree, hash, in.size(), max_leaf))
+	{
+		return;
+	}
+
+	build_bvh(in, tree, max_leaf, leaf_block);
+
+	if (!save_bvh(path, tree, hash))
+	{
+		std::cerr << "Could not write BVH cache " << path << "\n";
+	}
+}
+
+/*
+ * Recompute every box of "tree" for moved primitives, keeping the topology. leaf_box(i, box) returns the new bounds of
+ * the primitive at position i of the index array. Leaves, which do the expensive part, are refit in parallel chunks
+ * when there is a pool. Children always come after their parent in the node array, in both layouts, so a backwards
+ * walk then finishes the inner nodes bottom-up.
+ */
+template<typename F>
+void refit_bvh(bvh_tree &tree, F leaf_box)
+{
+	tree.make_owned();
+
+	bvh_node_vector &nodes = tree.owned_nodes;
+
+	auto refit_leaves = [&](int first, int last)
+	{
+		aabb box;
+
+		for (int i = first; i < last; i++)
+		{
+			flat_bvh_node &n = nodes[i];
+
+			if (n.count > 0)
+			{
+				n.box = empty_box();
+
+				for (int k = n.offset; k < n.offset + n.count; k++)
+				{
+					leaf_box(k, box);
+					grow(n.box, box);
+				}
+			}
+		}
+	};
+
+	if (bvh_build_pool && bvh_build_pool->size() > 1)
+	{
+		parallel_for(*bvh_build_pool, 0, tree.node_count, 4096, refit_leaves);
+	}
+	else
+	{
+		refit_leaves(0, tree.node_count);
+	}
+
+	for (int i = tree.node_count - 1; i >= 0; i--)
+	{
+		flat_bvh_node &n = nodes[i];
+
+		if (n.count == 0)
+		{
+			n.box = nodes[tree.first_child(i)].box;
+			grow(n.box, nodes[tree.second_child(i)].box);
+		}
+	}
+}
+
+/*
+ * How far refitting may let a BVH degrade before it is rebuilt: the ratio of its SAH cost to the cost right after the
+ * last build. Refitting keeps the topology, so primitives that move apart leave large, overlapping nodes behind.
+ */
+float bvh_rebuild_threshold = 1.5f;
+
+// Node order flat_bvh trees are put in after building (see bvh_layout.hpp).
+bvh_node_layout bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+
+// Memory-saving mode: flat_bvh keeps its tree as quantized nodes only (see quantized_bvh.hpp for the trade-off).
+bool bvh_compact = false;
+
+/*
+ * Hitable over a flattened BVH. The primitives are copied into leaf order, so a leaf reads a contiguous run of
+ * pointers. With SBVH a primitive can be referenced from several leaves, so the list as given is kept apart from the
+ * leaf references: refits move each primitive once and rebuilds start from it, not from the duplicates.
+ */
+class flat_bvh : public hitable
+{
+	public:
+		flat_bvh(hitable **list, int n, float time0, float time1) : members(list, list + n)
+		{
+			build(time0, time1, true);
+		}
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
+		virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+		/*
+		 * Refit the tree to where the primitives are over [t0, t1], and rebuild it instead once its SAH cost has
+		 * grown past bvh_rebuild_threshold times the cost after the last build.
+		 */
+		virtual void refit(float t0, float t1);
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			for (hitable *&h : members)
+			{
+				fn(h);
+			}
+
+			for (size_t i = 0; i < prims.size(); i++)
+			{
+				prims[i] = members[prim_members[i]];
+			}
+		}
+
+		std::vector<hitable *> members;      // Each primitive once, as given.
+		std::vector<hitable *> prims;        // In leaf order, split references repeated.
+		std::vector<int32_t> prim_members;   // Index in "members" of each of "prims".
+		bvh_tree tree;                 // Empty in compact mode.
+		quantized_bvh_tree compact;    // Only in compact mode.
+		sphere_batch spheres;          // Copy of "prims" for leaf tests, when they are all spheres.
+		float built_cost = 0;  // SAH cost right after the last build.
+
+	private:
+		void build(float time0, float time1, bool use_cache);
+		void optimize_layout();
+};
+
+void flat_bvh::build(float time0, float time1, bool use_cache)
+{
+	hitable **list = members.data();
+	int n = members.size();
+	bvh_build_input in;
+	in.resize(n);
+
+	auto compute_bounds = [&](int first, int last)
+	{
+		aabb box;
+
+		for (int i = first; i < last; i++)
+		{
+			if (!list[i]->bounding_box(time0, time1, box))
+			{
+				std::cerr << "No bounding box in flat_bvh constructor \n";
+			}
+
+			in.set(i, box);
+		}
+	};
+
+	if (bvh_build_pool && n > bvh_parallel_grain)
+	{
+		parallel_for(*bvh_build_pool, 0, n, bvh_parallel_grain, compute_bounds);
+	}
+	else
+	{
+		compute_bounds(0, n);
+	}
+
+	// Sphere-only lists get leaves that fill whole batches.
+	bool batched = sphere_batch::accepts(list, n);
+	int max_leaf = batched ? sphere_batch::width : 4;
+	int leaf_block = batched ? sphere_batch::width : 1;
+
+	if (use_cache)
+	{
+		build_or_load_bvh(in, tree, max_leaf, leaf_block);
+	}
+	else
+	{
+		build_bvh(in, tree, max_leaf, leaf_block);
+	}
+
+	prims.resize(tree.index_count);
+	prim_members.assign(tree.indices, tree.indices + tree.index_count);
+
+	for (int i = 0; i < tree.index_count; i++)
+	{
+		prims[i] = list[tree.indices[i]];
+	}
+
+	spheres.clear();
+
+	if (batched)
+	{
+		spheres.build(prims);
+	}
+
+	built_cost = bvh_sah_cost(tree);
+
+	if (bvh_layout == BVH_LAYOUT_TREELET)
+	{
+		optimize_layout();
+	}
+
+	compact.clear();
+
+	if (bvh_compact && compact.build(tree))
+	{
+		// "prims" is in leaf order already, so the full tree and its index array can go.
+		tree.owned_nodes.clear();
+		tree.owned_nodes.shrink_to_fit();
+		tree.owned_indices.clear();
+		tree.owned_indices.shrink_to_fit();
+		tree.use_owned();
+	}
+}
+
+/*
+ * Switch the tree to the treelet layout. For trees big enough to matter it reports how many cache lines and pages a
+ * ray touches before and after, measured with random rays through the scene.
+ */
+void flat_bvh::optimize_layout()
+{
+	if (tree.node_count < 1024)
+	{
+		layout_treelets(tree);
+		return;
+	}
+
+	std::vector<ray> rays = random_rays_in_box(tree.nodes[0].box, 4096);
+	auto leaf = [&](const ray &r, int first, int count, float &closest)
+	{
+		hit_record rec;
+		bool hit_leaf = false;
+
+		for (int i = first; i < first + count; i++)
+		{
+			if (prims[i]->hit(r, 0.001f, closest, rec))
+			{
+				hit_leaf = true;
+				closest = rec.t;
+			}
+		}
+
+		return hit_leaf;
+	};
+
+	bvh_memory_stats before = measure_bvh_memory(tree, rays, leaf);
+	layout_treelets(tree);
+	bvh_memory_stats after = measure_bvh_memory(tree, rays, leaf);
+
+	std::cerr << "BVH layout (" << tree.node_count << " nodes): cache lines per ray " << before.lines_per_ray << " -> "
+	          << after.lines_per_ray << ", pages per ray " << before.pages_per_ray << " -> " << after.pages_per_ray
+	          << "\n";
+}
+
+void flat_bvh::refit(float t0, float t1)
+{
+	// Each primitive once, however many leaves reference it. Leaves take the whole box of a split primitive, which
+	// still bounds the part they held.
+	std::vector<aabb> boxes(members.size());
+
+	auto refit_members = [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			members[i]->refit(t0, t1);
+
+			if (!members[i]->bounding_box(t0, t1, boxes[i]))
+			{
+				boxes[i] = empty_box();
+			}
+		}
+	};
+
+	if (bvh_build_pool && int(members.size()) > bvh_parallel_grain)
+	{
+		parallel_for(*bvh_build_pool, 0, members.size(), bvh_parallel_grain, refit_members);
+	}
+	else
+	{
+		refit_members(0, members.size());
+	}
+
+	// Quantized boxes cannot be refit exactly, so compact trees are rebuilt. Rebuilt trees are only good for this
+	// interval, so they don't go to the cache.
+	if (!compact.empty())
+	{
+		build(t0, t1, false);
+		return;
+	}
+
+	if (!spheres.empty())
+	{
+		spheres.build(prims);
+	}
+
+	refit_bvh(tree, [&](int i, aabb &box)
+	{
+		box = boxes[prim_members[i]];
+	});
+
+	float cost = bvh_sah_cost(tree);
+
+	if (cost > built_cost * bvh_rebuild_threshold)
+	{
+		build(t0, t1, false);
+		std::cerr << "BVH over " << members.size() << " primitives rebuilt: SAH cost " << cost << " after refit, "
+		          << built_cost << " rebuilt\n";
+	}
+}
+
+bool flat_bvh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	auto leaf = [&](int first, int count, float &closest)
+	{
+		if (!spheres.empty())
+		{
+			return spheres.hit(r, first, count, t_min, closest, rec);
+		}
+
+		bool hit_leaf = false;
+
+		for (int i = first; i < first + count; i++)
+		{
+			if (prims[i]->hit(r, t_min, closest, rec))
+			{
+				hit_leaf = true;
+				closest = rec.t;
+			}
+		}
+
+		return hit_leaf;
+	};
+
+	return compact.empty() ? tree.traverse(r, t_min, t_max, leaf) : compact.traverse(r, t_min, t_max, leaf);
+}
+
+bool flat_bvh::bounding_box(float t0, float t1, aabb &box) const
+{
+	if (!compact.empty())
+	{
+		box = compact.root_box;
+
+		return true;
+	}
+
+	if (tree.node_count == 0)
+	{
+		return false;
+	}
+
+	box = tree.nodes[0].box;
+
+	return true;
+}
+
+#endif // FLATBVHHPP
@@ -4,6 +4,7 @@
 #include "ray.hpp"
 #include "aabb.hpp"
 #include "float.h"
+#include <functional>
 
 class material;
 
@@ -20,11 +21,21 @@ void get_sphere_uv(const vec3 &p, float &u, float &v)
     v = (theta + M_PI / 2) / M_PI;
 }
 
+/*
+ * uv_extent of a sphere (see hit_record): u goes 2*pi*r around the equator and v pi*r from pole to pole, so this is
+ * their geometric mean. Towards the poles u gets narrower, which this ignores.
+ */
+inline float sphere_uv_extent(float radius)
+{
+    return float(M_PI * M_SQRT2) * radius;
+}
+
 struct hit_record
 {
     float t; // "t" in p(t) = A + t*B, for the ray. The hit will only count if "t" is between a given t_min and t_max.
     float u; // For texture mapping.
     float v; // For texture mapping.
+    float uv_extent = 0; // World-space size of a unit of u and v around the hit, for texture filtering. 0 if unknown.
     vec3 p; // Position of the hit
     vec3 normal;  // Normal of the hit. For a spher eit would be p - center of the sphere.
     material *mat_ptr;  // Material properties of the "hitable"
@@ -38,6 +49,17 @@ class hitable
          */
         virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const = 0;
         virtual bool bounding_box(float t0, float t1, aabb &box) const = 0;
+        /*
+         * Update bounds cached at construction for a new shutter interval [t0, t1], e.g. for the next frame of an
+         * animation. Only hitables that cache bounds or hold other hitables need to do anything.
+         */
+        virtual void refit(float t0, float t1) {}
+        /*
+         * Call fn on every hitable this one holds. fn may replace the pointer; scene passes (scene_finalize.hpp) use
+         * that to rewrite the graph, and refit the holder afterwards. A hitable kept in more than one place (e.g. in
+         * a list and in that list's BVH) is passed once per place.
+         */
+        virtual void visit_children(const std::function<void(hitable *&)> &fn) {}
         virtual float pdf_value(const vec3 &origin, const vec3 &v) const
         {
             return 0.0;
@@ -76,6 +98,16 @@ class flip_normals : public hitable
             return ptr->bounding_box(t0, t1, box);
         }
 
+        virtual void refit(float t0, float t1)
+        {
+            ptr->refit(t0, t1);
+        }
+
+        virtual void visit_children(const std::function<void(hitable *&)> &fn)
+        {
+            fn(ptr);
+        }
+
         hitable *ptr;
 };
 
@@ -91,6 +123,16 @@ class translate : public hitable
         virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
         virtual bool bounding_box(float t0, float t1, aabb &box) const;
 
+        virtual void refit(float t0, float t1)
+        {
+            ptr->refit(t0, t1);
+        }
+
+        virtual void visit_children(const std::function<void(hitable *&)> &fn)
+        {
+            fn(ptr);
+        }
+
         hitable *ptr;
         // How much to offset the ray so simulate that is the box that moves. We don't "move" the box coordinates.
         vec3 offset;
@@ -143,6 +185,20 @@ class rotate_y : public hitable
             return hasbox;
         }
 
+        virtual void refit(float t0, float t1)
+        {
+            ptr->refit(t0, t1);
+            compute_box(t0, t1);
+        }
+
+        virtual void visit_children(const std::function<void(hitable *&)> &fn)
+        {
+            fn(ptr);
+        }
+
+        // Bounds of the rotated child over [t0, t1].
+        void compute_box(float t0, float t1);
+
         hitable *ptr;
         bool hasbox;
         aabb bbox;
@@ -159,7 +215,12 @@ rotate_y::rotate_y(hitable *p, float angle) : ptr(p)
     sin_theta = sin(radians);
     cos_theta = cos(radians);
 
-    hasbox = ptr->bounding_box(0, 1, bbox);
+    compute_box(0, 1);
+}
+
+void rotate_y::compute_box(float t0, float t1)
+{
+    hasbox = ptr->bounding_box(t0, t1, bbox);
 
     vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
     vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
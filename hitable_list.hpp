@@ -2,30 +2,132 @@
 #define HITABLELISTHPP
 
 #include "hitable.hpp"
+#include "flat_bvh.hpp"
+#include <memory>
+#include <vector>
+
+/*
+ * Lists with at least this many members build a flat_bvh over them on construction, so scenes written as one flat
+ * list still get logarithmic hit cost. Members without a bounding box stay outside the BVH and are tested one by one.
+ * 0 disables it.
+ */
+int list_bvh_threshold = 8;
 
 class hitable_list: public hitable
 {
     public:
         hitable_list() {}
-        hitable_list(hitable **l, int n)
+        hitable_list(hitable **l, int n, float time0 = 0, float time1 = 1)
 		{
 			list = l;
 			list_size = n;
+			build_accelerator(time0, time1);
 		}
 
         virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
 		virtual bool bounding_box(float t0, float t1, aabb &box) const;
 
+		virtual void refit(float t0, float t1)
+		{
+			if (accelerator)
+			{
+				// The BVH refits its own members.
+				accelerator->refit(t0, t1);
+
+				for (hitable *h : unbounded)
+				{
+					h->refit(t0, t1);
+				}
+
+				return;
+			}
+
+			for (int i = 0; i < list_size; i++)
+			{
+				list[i]->refit(t0, t1);
+			}
+		}
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			for (int i = 0; i < list_size; i++)
+			{
+				fn(list[i]);
+			}
+
+			if (accelerator)
+			{
+				accelerator->visit_children(fn);
+
+				for (hitable *&h : unbounded)
+				{
+					fn(h);
+				}
+			}
+		}
+
         hitable **list;
         int list_size;
+
+		std::unique_ptr<flat_bvh> accelerator;  // Over the bounded members, null for short lists.
+		std::vector<hitable *> unbounded;        // Members left out of "accelerator".
+
+	private:
+		void build_accelerator(float time0, float time1);
 };
 
+/*
+ * The BVH bounds its members over [time0, time1]. Most scenes don't pass an interval and get [0, 1], like the BVHs
+ * built in scenes.hpp; animations refit them to each frame anyway.
+ */
+void hitable_list::build_accelerator(float time0, float time1)
+{
+	if (list_bvh_threshold <= 0 || list_size < list_bvh_threshold)
+	{
+		return;
+	}
+
+	std::vector<hitable *> bounded;
+	aabb box;
+
+	for (int i = 0; i < list_size; i++)
+	{
+		(list[i]->bounding_box(time0, time1, box) ? bounded : unbounded).push_back(list[i]);
+	}
+
+	if (int(bounded.size()) < list_bvh_threshold)
+	{
+		unbounded.clear();
+		return;
+	}
+
+	accelerator.reset(new flat_bvh(bounded.data(), bounded.size(), time0, time1));
+}
+
 bool hitable_list::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
 {
 	hit_record temp_rec;
 	bool hit_anything = false;
 	double closest_so_far = t_max;
 
+	if (accelerator)
+	{
+		hit_anything = accelerator->hit(r, t_min, t_max, rec);
+		closest_so_far = hit_anything ? rec.t : t_max;
+
+		for (hitable *h : unbounded)
+		{
+			if (h->hit(r, t_min, closest_so_far, temp_rec))
+			{
+				hit_anything = true;
+				closest_so_far = temp_rec.t;
+				rec = temp_rec;
+			}
+		}
+
+		return hit_anything;
+	}
+
 	for(int i = 0; i < list_size; i++)
 	{
 		if(list[i]->hit(r, t_min, closest_so_far, temp_rec))
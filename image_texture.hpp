@@ -2,22 +2,527 @@
 #define IMAGETEXTUREHPP
 
 #include "texture.hpp"
+#include "tile_cache.hpp"
+#include "arena.hpp"
+#include "mapped_file.hpp"
+#include "stb_image.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
 
+enum texture_texel_layout
+{
+	TEXTURE_LAYOUT_LINEAR,  // Rows of RGB bytes, as loaded.
+	TEXTURE_LAYOUT_TILED    // 32x32 tiles of RGBA words, Morton (Z) order inside a tile.
+};
+
+/*
+ * Texel layout image_textures convert their levels to when they are created. Tiled keeps texels that are close in
+ * the image close in memory in both directions: a tile is one 4 KB page, and any 2x2 block of a bilinear lookup
+ * shares at most a couple of cache lines, where a linear row may be thousands of bytes from the next. It costs a
+ * third more memory for the alpha padding.
+ */
+texture_texel_layout texture_layout = TEXTURE_LAYOUT_TILED;
+
+bool parse_texture_layout(const std::string &name, texture_texel_layout &layout)
+{
+	if (name == "linear")
+	{
+		layout = TEXTURE_LAYOUT_LINEAR;
+	}
+	else if (name == "tiled")
+	{
+		layout = TEXTURE_LAYOUT_TILED;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * RGB image, 8 bits per channel, from the top row down. value() is a nearest-texel lookup into the full image.
+ * filtered_value() reads a mip pyramid of 2x2 box-filtered halvings built at construction, blending the two levels
+ * whose texels are closest to the footprint size (trilinear), so distant or minified surfaces read a few small
+ * levels instead of aliasing over the whole image. Levels are stored in texture_layout.
+ *
+ * Textures opened by path with a tile_cache only read the image size up front. The first lookup decodes the image
+ * into tiled levels in an unlinked temporary file, and from then on tiles are read from there into the cache as they
+ * are touched, so memory stays within the cache budget however large the textures are.
+ *
+ * .rtex files (see write_rtex()) hold the tiled levels ready to use. They are mapped and read in place, with no
+ * decoding and no copy; the page cache then plays the part of the tile cache, shared by every process that maps them.
+ */
 class image_texture : public texture
 {
 	public:
 		image_texture() {}
-		image_texture(unsigned char *pixels, int A, int B) : data(pixels), nx(A), ny(B) {}
+		image_texture(unsigned char *pixels, int A, int B) : data(pixels), nx(A), ny(B)
+		{
+			build_mipmaps();
+		}
+
+		image_texture(const std::string &path, tile_cache &tiles);
+
+		~image_texture()
+		{
+			if (source)
+			{
+				cache->forget(*source, source->tiles);
+			}
+		}
 
 		virtual vec3 value(float u, float v, const vec3 &p) const;
+		virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const;
+
+		// Map an .rtex file and use its levels. Returns false, leaving the texture empty, if it isn't a valid one.
+		bool open_rtex(const std::string &path);
+
+		// Save the levels as an .rtex file. The texture must hold its levels in memory (not in a tile_cache).
+		bool write_rtex(const std::string &path);
+
+		// Decode the image at "path" into this empty texture, which then owns the pixels. False if it can't be read.
+		bool decode(const std::string &path);
+
+		// Texture memory: pixels it owns, mip levels and tiles. Not counting a mapped .rtex file or a tile_cache.
+		size_t memory_bytes() const
+		{
+			return (owned_pixels ? size_t(nx) * ny * 3 : 0) + pyramid.size() + tiled.size() * 4;
+		}
+
+		// False if the image could not be read; lookups then return cyan.
+		bool loaded() const
+		{
+			return !levels.empty() || decode_queued;
+		}
+
+		unsigned char *data = nullptr;  // Full-size image, unless the texture lives in a tile_cache.
+		bool decode_queued = false;  // Known to be readable, decode() pending (see texture_registry.hpp).
+		int nx = 0;
+		int ny = 0;
+
+	private:
+		struct mip_level
+		{
+			int nx;
+			int ny;
+			int tiles_x;  // Tiles per row, for the tiled layout.
+			uint32_t first_tile;  // Tiles of the levels before this one, for the tiled layout.
+			const unsigned char *texels;  // Null for textures in a tile_cache.
+		};
+
+		// Tiled levels of an image file, decoded on the first tile load.
+		class file_tiles : public tile_source
+		{
+			public:
+				file_tiles(const std::string &p, uint32_t n) : path(p), tiles(n)
+				{
+					set_tile_count(tiles);
+				}
+
+				~file_tiles()
+				{
+					if (spill)
+					{
+						fclose(spill);
+					}
+				}
+
+				virtual void load_tile(uint32_t tile, uint32_t *words);
+
+				std::string path;
+				uint32_t tiles;
+				bool decoded = false;
+				FILE *spill = nullptr;  // Tiles of every level, in order. Null if decoding failed.
+		};
+
+		void build_mipmaps();
+		void tile_levels();
+		vec3 bilinear(const mip_level &level, float u, float v) const;
+
+		// Texel (i, j) of "level", channels 0 to 255.
+		vec3 texel(const mip_level &level, int i, int j) const
+		{
+			if (layout == TEXTURE_LAYOUT_LINEAR)
+			{
+				const unsigned char *t = &level.texels[3 * (i + size_t(level.nx) * j)];
+
+				return vec3(t[0], t[1], t[2]);
+			}
+
+			uint32_t tile = uint32_t(j >> 5) * level.tiles_x + (i >> 5);
+			uint32_t word = morton_bits(i & 31) | (morton_bits(j & 31) << 1);
+			uint32_t rgba;
+
+			if (source)
+			{
+				rgba = cache->read(*source, level.first_tile + tile, word);
+			}
+			else
+			{
+				memcpy(&rgba, &level.texels[4 * ((size_t(tile) << 10) | word)], 4);
+			}
+
+			return vec3(rgba & 255, (rgba >> 8) & 255, (rgba >> 16) & 255);
+		}
+
+		// Bits of a 5-bit coordinate spread to the even bits, for Morton order inside a tile.
+		static unsigned morton_bits(unsigned x)
+		{
+			static const uint16_t spread[32] = {
+				0x000, 0x001, 0x004, 0x005, 0x010, 0x011, 0x014, 0x015,
+				0x040, 0x041, 0x044, 0x045, 0x050, 0x051, 0x054, 0x055,
+				0x100, 0x101, 0x104, 0x105, 0x110, 0x111, 0x114, 0x115,
+				0x140, 0x141, 0x144, 0x145, 0x150, 0x151, 0x154, 0x155,
+			};
+
+			return spread[x];
+		}
+
+		texture_texel_layout layout = TEXTURE_LAYOUT_LINEAR;
+		std::vector<mip_level> levels;  // levels[0] is "data" (linear) or the start of "tiled", down to 1x1.
+		std::vector<unsigned char> pyramid;  // Linear texels of levels 1 and up.
+		std::vector<uint32_t> tiled;  // Every level in the tiled layout.
+		tile_cache *cache = nullptr;
+		std::unique_ptr<file_tiles> source;  // Set if the tiles live in "cache".
+		mapped_file mapping;  // Tiled levels of an .rtex file.
+		std::unique_ptr<unsigned char, void (*)(void *)> owned_pixels{nullptr, stbi_image_free};
+};
+
+bool image_texture::decode(const std::string &path)
+{
+	int n;
+	unsigned char *pixels = stbi_load(path.c_str(), &nx, &ny, &n, 3);
+
+	if (!pixels)
+	{
+		nx = 0;
+		ny = 0;
+		return false;
+	}
+
+	owned_pixels.reset(pixels);
+	data = pixels;
+	build_mipmaps();
+
+	// The tiles have their own copy of level 0.
+	if (layout == TEXTURE_LAYOUT_TILED)
+	{
+		owned_pixels.reset();
+		data = nullptr;
+	}
+
+	return true;
+}
+
+/*
+ * .rtex texture file: header, level table, then from offset rtex_tile_offset the tiles of every level in the tiled
+ * layout, so they are page aligned in the mapping. Only the header and level table are checked on load; reading the
+ * tiles to checksum them would cost what the format is meant to save.
+ */
+const char rtex_magic[8] = {'R', 'T', 'T', 'E', 'X', '\0', '\0', '\0'};
+const uint32_t rtex_version = 1;
+const size_t rtex_tile_offset = 4096;
 
-		unsigned char *data;
-		int nx;
-		int ny;
+struct rtex_level
+{
+	int32_t nx;
+	int32_t ny;
+	int32_t tiles_x;
+	uint32_t first_tile;
+};
+
+struct rtex_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t level_count;
+	uint32_t tile_count;
+	uint32_t tile_bytes;  // 4096: 32x32 RGBA texels.
+	uint64_t checksum;    // FNV-1a of the level table.
+	rtex_level levels[32];
 };
 
+bool is_rtex_path(const std::string &path)
+{
+	return path.size() > 5 && path.compare(path.size() - 5, 5, ".rtex") == 0;
+}
+
+bool image_texture::write_rtex(const std::string &path)
+{
+	if (levels.empty() || source || levels.size() > 32)
+	{
+		return false;
+	}
+
+	if (layout != TEXTURE_LAYOUT_TILED)
+	{
+		tile_levels();
+	}
+
+	size_t tile_bytes = tile_cache::tile_words * 4;
+	size_t tiles = tiled.size() / tile_cache::tile_words;
+	std::vector<char> bytes(rtex_tile_offset + tiles * tile_bytes);
+	rtex_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, rtex_magic, sizeof(header.magic));
+	header.version = rtex_version;
+	header.level_count = levels.size();
+	header.tile_count = tiles;
+	header.tile_bytes = tile_bytes;
+
+	for (size_t l = 0; l < levels.size(); l++)
+	{
+		header.levels[l] = {levels[l].nx, levels[l].ny, levels[l].tiles_x, levels[l].first_tile};
+	}
+
+	header.checksum = fnv1a(header.levels, sizeof(header.levels));
+
+	memcpy(&bytes[0], &header, sizeof(header));
+	memcpy(&bytes[rtex_tile_offset], tiled.data(), tiles * tile_bytes);
+
+	return write_file_atomically(path, bytes.data(), bytes.size());
+}
+
+bool image_texture::open_rtex(const std::string &path)
+{
+	if (!mapping.open(path) || mapping.size() < rtex_tile_offset)
+	{
+		mapping.close();
+		return false;
+	}
+
+	rtex_header header;
+	memcpy(&header, mapping.data(), sizeof(header));
+
+	bool valid = memcmp(header.magic, rtex_magic, sizeof(header.magic)) == 0 && header.version == rtex_version &&
+	             header.tile_bytes == tile_cache::tile_words * 4 && header.level_count > 0 &&
+	             header.level_count <= 32 && header.checksum == fnv1a(header.levels, sizeof(header.levels)) &&
+	             mapping.size() == rtex_tile_offset + size_t(header.tile_count) * header.tile_bytes;
+
+	// Every level inside the file and half the size of the one before, as build_mipmaps() makes them.
+	for (uint32_t l = 0; valid && l < header.level_count; l++)
+	{
+		const rtex_level &level = header.levels[l];
+		const rtex_level &prev = header.levels[l > 0 ? l - 1 : 0];
+
+		valid = level.nx > 0 && level.ny > 0 && level.tiles_x == (level.nx + 31) / 32 &&
+		        uint64_t(level.first_tile) + uint64_t(level.tiles_x) * ((level.ny + 31) / 32) <= header.tile_count &&
+		        (l == 0 || (level.nx == std::max(prev.nx / 2, 1) && level.ny == std::max(prev.ny / 2, 1)));
+	}
+
+	if (!valid)
+	{
+		mapping.close();
+		return false;
+	}
+
+	const unsigned char *tiles = reinterpret_cast<const unsigned char *>(mapping.data() + rtex_tile_offset);
+
+	levels.clear();
+
+	for (uint32_t l = 0; l < header.level_count; l++)
+	{
+		const rtex_level &level = header.levels[l];
+
+		levels.push_back({level.nx, level.ny, level.tiles_x, level.first_tile,
+		                  tiles + size_t(level.first_tile) * header.tile_bytes});
+	}
+
+	layout = TEXTURE_LAYOUT_TILED;
+	nx = levels[0].nx;
+	ny = levels[0].ny;
+
+	return true;
+}
+
+image_texture::image_texture(const std::string &path, tile_cache &tiles) : cache(&tiles)
+{
+	int channels;
+
+	if (!stbi_info(path.c_str(), &nx, &ny, &channels))
+	{
+		nx = 0;
+		ny = 0;
+		return;
+	}
+
+	// Same level sizes and tile order as build_mipmaps() and tile_levels().
+	uint32_t first_tile = 0;
+
+	for (int w = nx, h = ny; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1))
+	{
+		int tiles_x = (w + 31) / 32;
+
+		levels.push_back({w, h, tiles_x, first_tile, nullptr});
+		first_tile += tiles_x * ((h + 31) / 32);
+
+		if (w == 1 && h == 1)
+		{
+			break;
+		}
+	}
+
+	layout = TEXTURE_LAYOUT_TILED;
+	source.reset(new file_tiles(path, first_tile));
+}
+
+void image_texture::file_tiles::load_tile(uint32_t tile, uint32_t *words)
+{
+	if (!decoded)
+	{
+		decoded = true;
+
+		int w, h, n;
+		unsigned char *pixels = stbi_load(path.c_str(), &w, &h, &n, 3);
+
+		if (pixels)
+		{
+			image_texture image(pixels, w, h);
+
+			if (image.layout != TEXTURE_LAYOUT_TILED)
+			{
+				image.tile_levels();
+			}
+
+			spill = image.tiled.size() == size_t(tiles) * tile_cache::tile_words ? tmpfile() : nullptr;
+
+			if (spill && fwrite(image.tiled.data(), 4, image.tiled.size(), spill) != image.tiled.size())
+			{
+				fclose(spill);
+				spill = nullptr;
+			}
+
+			stbi_image_free(pixels);
+		}
+
+		if (!spill)
+		{
+			std::cerr << "Cannot load image " << path << "\n";
+		}
+	}
+
+	size_t bytes = tile_cache::tile_words * 4;
+
+	// Cyan, as for images that fail to open.
+	if (!spill || fflush(spill) != 0 || pread(fileno(spill), words, bytes, off_t(tile) * bytes) != ssize_t(bytes))
+	{
+		std::fill(words, words + tile_cache::tile_words, 0x00ffff00u);
+	}
+}
+
+void image_texture::build_mipmaps()
+{
+	if (!data)
+	{
+		return;
+	}
+
+	size_t bytes = 0;
+
+	for (int w = nx, h = ny; w > 1 || h > 1; )
+	{
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+		bytes += size_t(w) * h * 3;
+	}
+
+	pyramid.resize(bytes);
+	levels.push_back({nx, ny, 0, 0, data});
+
+	unsigned char *next = pyramid.data();
+
+	while (levels.back().nx > 1 || levels.back().ny > 1)
+	{
+		mip_level src = levels.back();
+		mip_level dst = {std::max(src.nx / 2, 1), std::max(src.ny / 2, 1), 0, 0, next};
+
+		// Average of each 2x2 block; odd last rows and columns of the source are dropped.
+		for (int j = 0; j < dst.ny; j++)
+		{
+			int j0 = std::min(2 * j, src.ny - 1);
+			int j1 = std::min(2 * j + 1, src.ny - 1);
+
+			for (int i = 0; i < dst.nx; i++)
+			{
+				int i0 = std::min(2 * i, src.nx - 1);
+				int i1 = std::min(2 * i + 1, src.nx - 1);
+
+				for (int c = 0; c < 3; c++)
+				{
+					int sum = src.texels[3 * (i0 + src.nx * j0) + c] + src.texels[3 * (i1 + src.nx * j0) + c] +
+					          src.texels[3 * (i0 + src.nx * j1) + c] + src.texels[3 * (i1 + src.nx * j1) + c];
+
+					next[3 * (i + dst.nx * j) + c] = (sum + 2) / 4;
+				}
+			}
+		}
+
+		next += size_t(dst.nx) * dst.ny * 3;
+		levels.push_back(dst);
+	}
+
+	if (texture_layout == TEXTURE_LAYOUT_TILED)
+	{
+		tile_levels();
+	}
+}
+
+// Copy every level into "tiled" as RGBA words and switch lookups to it. The linear pyramid is dropped.
+void image_texture::tile_levels()
+{
+	size_t words = 0;
+
+	for (mip_level &level : levels)
+	{
+		level.tiles_x = (level.nx + 31) / 32;
+		level.first_tile = words / 1024;
+		words += size_t(level.tiles_x) * ((level.ny + 31) / 32) * 1024;
+	}
+
+	tiled.assign(words, 0);
+	layout = TEXTURE_LAYOUT_TILED;
+
+	unsigned char *next = reinterpret_cast<unsigned char *>(tiled.data());
+
+	for (mip_level &level : levels)
+	{
+		for (int j = 0; j < level.ny; j++)
+		{
+			for (int i = 0; i < level.nx; i++)
+			{
+				size_t tile = size_t(j >> 5) * level.tiles_x + (i >> 5);
+				size_t word = (tile << 10) | morton_bits(i & 31) | (morton_bits(j & 31) << 1);
+
+				memcpy(&next[4 * word], &level.texels[3 * (i + size_t(level.nx) * j)], 3);
+			}
+		}
+
+		level.texels = next;
+		next += size_t(level.tiles_x) * ((level.ny + 31) / 32) * 1024 * 4;
+	}
+
+	pyramid.clear();
+	pyramid.shrink_to_fit();
+}
+
 vec3 image_texture::value(float u, float v, const vec3 &p) const
 {
+	// Image that failed to load: solid cyan, so it shows up instead of crashing the render.
+	if (levels.empty())
+	{
+		return vec3(0, 1, 1);
+	}
+
 	int i = (  u) * nx;
 	int j = (1-v) * ny - 0.001;
 
@@ -41,11 +546,94 @@ vec3 image_texture::value(float u, float v, const vec3 &p) const
 		j = ny -1;
 	}
 
-	float r = int(data[3*i + 3*nx*j  ]) / 255.0;
-	float g = int(data[3*i + 3*nx*j+1]) / 255.0;
-	float b = int(data[3*i + 3*nx*j+2]) / 255.0;
+	vec3 t = texel(levels[0], i, j);
+	float r = t[0] / 255.0;
+	float g = t[1] / 255.0;
+	float b = t[2] / 255.0;
 
 	return vec3(r, g, b);
 }
 
-#endif // IMAGETEXTUREHPP
\ No newline at end of file
+// Bilinear blend of the 4 texels of "level" around (u, v), clamped at the edges like value().
+vec3 image_texture::bilinear(const mip_level &level, float u, float v) const
+{
+	float x = u * level.nx - 0.5f;
+	float y = (1 - v) * level.ny - 0.5f;
+	float x_floor = floorf(x);
+	float y_floor = floorf(y);
+	float fx = x - x_floor;
+	float fy = y - y_floor;
+	int i0 = std::min(std::max(int(x_floor), 0), level.nx - 1);
+	int i1 = std::min(std::max(int(x_floor) + 1, 0), level.nx - 1);
+	int j0 = std::min(std::max(int(y_floor), 0), level.ny - 1);
+	int j1 = std::min(std::max(int(y_floor) + 1, 0), level.ny - 1);
+
+	vec3 top = (1 - fx) * texel(level, i0, j0) + fx * texel(level, i1, j0);
+	vec3 bottom = (1 - fx) * texel(level, i0, j1) + fx * texel(level, i1, j1);
+
+	return ((1 - fy) * top + fy * bottom) / 255.0f;
+}
+
+vec3 image_texture::filtered_value(float u, float v, const vec3 &p, float width) const
+{
+	if (levels.empty() || width <= 0)
+	{
+		return value(u, v, p);
+	}
+
+	// Level whose texels are about "width" wide: level 0 has max(nx, ny) texels per unit of u or v.
+	float lod = log2f(width * std::max(nx, ny));
+	int top = int(levels.size()) - 1;
+
+	if (lod <= 0)
+	{
+		return bilinear(levels[0], u, v);
+	}
+
+	if (lod >= top)
+	{
+		return bilinear(levels[top], u, v);
+	}
+
+	int level = int(lod);
+	float f = lod - level;
+
+	return (1 - f) * bilinear(levels[level], u, v) + f * bilinear(levels[level + 1], u, v);
+}
+
+/*
+ * Convert an image stb_image reads (JPEG, PNG, ...) to an .rtex file. Prints what it wrote, or why it failed, to
+ * std::cerr. Returns non-zero on failure.
+ */
+int convert_texture(const std::string &in, const std::string &out)
+{
+	int nx;
+	int ny;
+	int nn;
+	unsigned char *pixels = stbi_load(in.c_str(), &nx, &ny, &nn, 3);
+
+	if (!pixels)
+	{
+		std::cerr << "Cannot load image " << in << "\n";
+		return 1;
+	}
+
+	image_texture image(pixels, nx, ny);
+	bool written = image.write_rtex(out);
+
+	stbi_image_free(pixels);
+
+	file_stamp stamp;
+
+	if (!written || !get_file_stamp(out, stamp))
+	{
+		std::cerr << "Cannot write " << out << "\n";
+		return 1;
+	}
+
+	std::cerr << "Wrote " << out << ": " << nx << "x" << ny << ", " << stamp.size / 1024 << " KB\n";
+
+	return 0;
+}
+
+#endif // IMAGETEXTUREHPP
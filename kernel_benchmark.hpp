@@ -0,0 +1,76 @@
+#ifndef KERNELBENCHMARKHPP
+#define KERNELBENCHMARKHPP
+
+#include "render.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
+#include "thread_pool.hpp"
+#include <float.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Renders every built-in scene at "settings" size (the scene's own settings are ignored) with the render kernel that
+ * has every feature compiled in and with the one specialized on the features of the scene and its camera (see
+ * render_image()), best of "repeats" runs each. Prints the SIMD kernels in use and one line per scene to "out".
+ * Returns non-zero if a scene can't be opened.
+ */
+int run_kernel_benchmark(thread_pool &pool, const render_settings &settings, std::ostream &out, int repeats = 3)
+{
+	std::vector<unsigned char> rgb(settings.nx * settings.ny * 3);
+	char line[256];
+
+	out << "# CPU kernels: " << isa_name(kernel_isa) << "\n";
+	snprintf(line, sizeof(line), "%-26s %-28s %10s %12s %8s\n", "scene", "features", "all (ms)", "special (ms)",
+	         "speedup");
+	out << line;
+
+	for (const scene_entry &entry : scene_table)
+	{
+		scene_arena arena;
+		camera_settings cam_settings;
+		render_settings scene_settings;
+		std::string error;
+		hitable *world = open_scene(entry.name, arena, cam_settings, scene_settings, error);
+
+		if (!world)
+		{
+			std::cerr << "Cannot open scene " << entry.name << ": " << error << "\n";
+			return 1;
+		}
+
+		camera cam(cam_settings, settings.nx, settings.ny);
+		unsigned features = render_features(scene_settings, cam);
+
+		double all = FLT_MAX;
+		double special = FLT_MAX;
+
+		auto time_kernel = [&](tile_kernel kernel, double &best)
+		{
+			auto start = std::chrono::steady_clock::now();
+			render_image_with(kernel, pool, world, cam, settings, rgb.data());
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			best = std::min(best, ms);
+		};
+
+		// Interleaved, so both kernels see the same machine load.
+		for (int run = 0; run < repeats; run++)
+		{
+			time_kernel(select_tile_kernel(world, FEATURE_ALL), all);
+			time_kernel(select_tile_kernel(world, features), special);
+		}
+
+		snprintf(line, sizeof(line), "%-26s %-28s %10.1f %12.1f %7.2fx\n", entry.name, feature_names(features).c_str(),
+		         all, special, all / special);
+		out << line;
+	}
+
+	return 0;
+}
+
+#endif // KERNELBENCHMARKHPP
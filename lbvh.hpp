@@ -0,0 +1,738 @@
+#ifndef LBVHHPP
+#define LBVHHPP
+
+#include "bvh_tree.hpp"
+#include "thread_pool.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/*
+ * Linear BVH (Karras 2012). Centroids are quantized to Morton codes, 30 bits for small inputs and 63 bits otherwise,
+ * and radix sorted. Every inner node of the resulting radix tree can then be found on its own from the sorted codes,
+ * so the hierarchy comes out of one parallel loop in linear time. Bounds and SAH costs are filled in bottom-up by the
+ * second thread to reach each node.
+ *
+ * The tree starts with one primitive per leaf. Subtrees whose SAH cost says so are collapsed into leaves of up to
+ * "max_leaf" primitives when the tree is flattened.
+ *
+ * Morton order ignores primitive sizes, so the trees trace slower than SAH ones. The optional treelet pass (Karras and
+ * Aila 2013) wins most of that back: during the bottom-up pass every node grows a treelet of up to seven subtrees and
+ * rearranges them into the topology with the lowest SAH cost.
+ */
+class lbvh_builder
+{
+	public:
+		lbvh_builder(const bvh_build_input &input, int leaf_size, bool restructure, thread_pool *p) :
+		    in(input), max_leaf(leaf_size), optimize(restructure), pool(p) {}
+
+		// Returns false if the tree came out too deep for bvh_tree::traverse(), which only degenerate inputs do.
+		bool build(bvh_node_vector &out_nodes, std::vector<int32_t> &out_indices);
+
+	private:
+		// Children >= 0 are inner nodes, < 0 are leaves ~child, i.e. the primitive at sorted position ~child.
+		struct radix_node
+		{
+			aabb box;
+			int32_t child[2];
+			int32_t parent;
+			int32_t count;  // Primitives below.
+			int32_t size;   // Flattened nodes below, after collapsing.
+			int32_t height; // Levels below, after collapsing.
+			float cost;     // SAH cost, relative to the area of the node.
+			bool leaf;      // Collapsed into one leaf.
+		};
+
+		void compute_codes();
+		void sort_codes();
+		int delta(int i, int j) const;
+		void build_node(int i);
+		void finish_leaf(int leaf);
+		void finish_node(int i);
+		void restructure(int i);
+		void set_child(int node, int side, int child);
+		void gather(int child, std::vector<int32_t> &prims) const;
+		void emit(int node, int pos, int prim_pos, flat_bvh_node *out, int32_t *out_indices) const;
+
+		template<typename F>
+		void for_range(int n, int grain, F fn)
+		{
+			if (pool && pool->size() > 1)
+			{
+				parallel_for(*pool, 0, n, grain, fn);
+			}
+			else
+			{
+				fn(0, n);
+			}
+		}
+
+		const aabb &child_box(int child) const
+		{
+			return child >= 0 ? nodes[child].box : in.bounds[order[~child]];
+		}
+
+		float child_cost(int child) const
+		{
+			return child >= 0 ? nodes[child].cost : surface_area(in.bounds[order[~child]]);
+		}
+
+		int child_count(int child) const
+		{
+			return child >= 0 ? nodes[child].count : 1;
+		}
+
+		int child_size(int child) const
+		{
+			return child >= 0 ? nodes[child].size : 1;
+		}
+
+		int child_height(int child) const
+		{
+			return child >= 0 ? nodes[child].height : 1;
+		}
+
+		const bvh_build_input &in;
+		int max_leaf;
+		bool optimize;
+		thread_pool *pool;
+		int n = 0;
+		int code_bits = 0;
+		std::vector<uint64_t> codes;
+		std::vector<int32_t> order;  // Primitive index for each sorted position.
+		std::vector<int32_t> leaf_parent;
+		std::vector<radix_node> nodes;
+		std::unique_ptr<std::atomic<int>[]> visits;
+};
+
+// Spread the low 21 bits of "v" so there are two zero bits between each.
+inline uint64_t morton_spread(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+
+	return v;
+}
+
+void lbvh_builder::compute_codes()
+{
+	// Small inputs get 10 bits per axis, so the sort needs half the passes.
+	int bits = n < (1 << 18) ? 10 : 21;
+	float cells = float(1 << bits) - 1;
+	aabb centroid_box = empty_box();
+
+	for (int i = 0; i < n; i++)
+	{
+		grow(centroid_box, in.centroids[i]);
+	}
+
+	vec3 lo = centroid_box.min();
+	vec3 extent = centroid_box.max() - lo;
+	vec3 scale(extent.x() > 0 ? cells / extent.x() : 0, extent.y() > 0 ? cells / extent.y() : 0,
+	           extent.z() > 0 ? cells / extent.z() : 0);
+
+	code_bits = 3 * bits;
+	codes.resize(n);
+	order.resize(n);
+
+	for_range(n, bvh_parallel_grain, [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			vec3 c = in.centroids[i] - lo;
+
+			codes[i] = morton_spread(uint64_t(c.x() * scale.x())) << 2 | morton_spread(uint64_t(c.y() * scale.y())) << 1 |
+			           morton_spread(uint64_t(c.z() * scale.z()));
+			order[i] = i;
+		}
+	});
+}
+
+/*
+ * LSD radix sort on 8-bit digits. Each pass counts digits per chunk in parallel, turns the counts into per-chunk
+ * output offsets and scatters every chunk in parallel, which keeps the sort stable. Digits that are the same for
+ * every key are skipped.
+ */
+void lbvh_builder::sort_codes()
+{
+	const int radix = 256;
+	int threads = pool ? pool->size() : 1;
+	int chunks = std::max(1, std::min(threads * 4, n / 4096));
+	int chunk_size = (n + chunks - 1) / chunks;
+	std::vector<uint64_t> codes_tmp(n);
+	std::vector<int32_t> order_tmp(n);
+	std::vector<int> counts(chunks * radix);
+
+	for (int shift = 0; shift < code_bits; shift += 8)
+	{
+		std::fill(counts.begin(), counts.end(), 0);
+
+		for_range(chunks, 1, [&](int first, int last)
+		{
+			for (int c = first; c < last; c++)
+			{
+				int *count = &counts[c * radix];
+
+				for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+				{
+					count[(codes[i] >> shift) & (radix - 1)]++;
+				}
+			}
+		});
+
+		int sum = 0;
+		bool single_digit = false;
+
+		for (int d = 0; d < radix; d++)
+		{
+			int digit_total = 0;
+
+			for (int c = 0; c < chunks; c++)
+			{
+				int k = counts[c * radix + d];
+
+				counts[c * radix + d] = sum;
+				sum += k;
+				digit_total += k;
+			}
+
+			single_digit = single_digit || digit_total == n;
+		}
+
+		if (single_digit)
+		{
+			continue;
+		}
+
+		for_range(chunks, 1, [&](int first, int last)
+		{
+			for (int c = first; c < last; c++)
+			{
+				int *offset = &counts[c * radix];
+
+				for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+				{
+					int to = offset[(codes[i] >> shift) & (radix - 1)]++;
+
+					codes_tmp[to] = codes[i];
+					order_tmp[to] = order[i];
+				}
+			}
+		});
+
+		codes.swap(codes_tmp);
+		order.swap(order_tmp);
+	}
+}
+
+// Length of the common prefix of sorted keys i and j, -1 outside the array. Equal codes are told apart by position.
+int lbvh_builder::delta(int i, int j) const
+{
+	if (j < 0 || j >= n)
+	{
+		return -1;
+	}
+
+	uint64_t x = codes[i] ^ codes[j];
+
+	return x ? __builtin_clzll(x) : 64 + __builtin_clz(uint32_t(i ^ j));
+}
+
+// Find the key range of inner node i and where it splits (Karras 2012, figure 4).
+void lbvh_builder::build_node(int i)
+{
+	int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+	int delta_min = delta(i, i - d);
+	int length_max = 2;
+
+	while (delta(i, i + length_max * d) > delta_min)
+	{
+		length_max *= 2;
+	}
+
+	int length = 0;
+
+	for (int t = length_max / 2; t > 0; t /= 2)
+	{
+		if (delta(i, i + (length + t) * d) > delta_min)
+		{
+			length += t;
+		}
+	}
+
+	int j = i + length * d;
+	int delta_node = delta(i, j);
+	int split = 0;
+
+	for (int t = (length + 1) / 2; ; t = (t + 1) / 2)
+	{
+		if (split + t < length + 1 && delta(i, i + (split + t) * d) > delta_node)
+		{
+			split += t;
+		}
+
+		if (t == 1)
+		{
+			break;
+		}
+	}
+
+	int gamma = i + split * d + std::min(d, 0);
+	int first = std::min(i, j);
+	int last = std::max(i, j);
+
+	nodes[i].child[0] = first == gamma ? ~gamma : gamma;
+	nodes[i].child[1] = last == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+	nodes[i].count = last - first + 1;
+
+	for (int side = 0; side < 2; side++)
+	{
+		int child = nodes[i].child[side];
+
+		if (child >= 0)
+		{
+			nodes[child].parent = i;
+		}
+		else
+		{
+			leaf_parent[~child] = i;
+		}
+	}
+}
+
+void lbvh_builder::set_child(int node, int side, int child)
+{
+	nodes[node].child[side] = child;
+
+	if (child >= 0)
+	{
+		nodes[child].parent = node;
+	}
+}
+
+/*
+ * Bounds, cost and flattened size of inner node i from its children. Costs use a traversal step and a primitive test
+ * of unit cost, both scaled by the node's surface area. A node that can be a leaf becomes one when that is cheaper.
+ */
+void lbvh_builder::finish_node(int i)
+{
+	radix_node &node = nodes[i];
+	int a = node.child[0];
+	int b = node.child[1];
+
+	node.box = child_box(a);
+	grow(node.box, child_box(b));
+
+	float area = surface_area(node.box);
+	float inner_cost = area + child_cost(a) + child_cost(b);
+	float leaf_cost = area * node.count;
+
+	node.leaf = node.count <= max_leaf && leaf_cost <= inner_cost;
+	node.cost = node.leaf ? leaf_cost : inner_cost;
+	node.size = node.leaf ? 1 : 1 + child_size(a) + child_size(b);
+	node.height = node.leaf ? 1 : 1 + std::max(child_height(a), child_height(b));
+}
+
+// Walk up from a leaf. The first thread to reach an inner node stops there; the second one finishes it and goes on.
+void lbvh_builder::finish_leaf(int leaf)
+{
+	int node = leaf_parent[leaf];
+
+	while (node >= 0)
+	{
+		if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+		{
+			return;
+		}
+
+		if (optimize)
+		{
+			restructure(node);
+		}
+
+		finish_node(node);
+		node = nodes[node].parent;
+	}
+}
+
+/*
+ * Treelet restructuring. The treelet grows from node i by repeatedly opening the leaf with the largest area, up to
+ * seven leaves. Dynamic programming over all subsets of those leaves finds the binary tree over them with the lowest
+ * SAH cost, which is then written back into the treelet's own inner nodes. The subtrees below the treelet leaves are
+ * finished already and stay as they are.
+ */
+void lbvh_builder::restructure(int i)
+{
+	const int max_leaves = 7;
+	int leaves[max_leaves];
+	int inner[max_leaves - 1];
+	int leaf_count = 2;
+	int inner_count = 1;
+
+	leaves[0] = nodes[i].child[0];
+	leaves[1] = nodes[i].child[1];
+	inner[0] = i;
+
+	while (leaf_count < max_leaves)
+	{
+		int best = -1;
+		float best_area = -1;
+
+		for (int k = 0; k < leaf_count; k++)
+		{
+			if (leaves[k] >= 0 && surface_area(nodes[leaves[k]].box) > best_area)
+			{
+				best = k;
+				best_area = surface_area(nodes[leaves[k]].box);
+			}
+		}
+
+		if (best < 0)
+		{
+			break;
+		}
+
+		int opened = leaves[best];
+
+		inner[inner_count++] = opened;
+		leaves[best] = nodes[opened].child[0];
+		leaves[leaf_count++] = nodes[opened].child[1];
+	}
+
+	if (leaf_count < 3)
+	{
+		return;
+	}
+
+	const int subsets = 1 << max_leaves;
+	aabb boxes[subsets];
+	float area[subsets];
+	float cost[subsets];
+	int best_split[subsets];
+	int full = (1 << leaf_count) - 1;
+
+	boxes[0] = empty_box();
+
+	for (int s = 1; s <= full; s++)
+	{
+		boxes[s] = boxes[s & (s - 1)];
+		grow(boxes[s], child_box(leaves[__builtin_ctz(s)]));
+		area[s] = surface_area(boxes[s]);
+	}
+
+	for (int k = 0; k < leaf_count; k++)
+	{
+		cost[1 << k] = child_cost(leaves[k]);
+	}
+
+	// Subsets in increasing order, so every proper subset is done before its superset.
+	for (int s = 1; s <= full; s++)
+	{
+		if ((s & (s - 1)) == 0)
+		{
+			continue;
+		}
+
+		float best = FLT_MAX;
+		int low = s & -s;
+
+		// Only partitions whose first half holds the lowest leaf, so every split is seen once.
+		for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+		{
+			if ((p & low) && cost[p] + cost[s ^ p] < best)
+			{
+				best = cost[p] + cost[s ^ p];
+				best_split[s] = p;
+			}
+		}
+
+		cost[s] = area[s] + best;
+	}
+
+	// Node i itself has no box yet, but its area is the same either way.
+	float old_cost = area[full];
+
+	for (int k = 1; k < inner_count; k++)
+	{
+		old_cost += surface_area(nodes[inner[k]].box);
+	}
+
+	for (int k = 0; k < leaf_count; k++)
+	{
+		old_cost += child_cost(leaves[k]);
+	}
+
+	if (cost[full] >= old_cost * 0.999f)
+	{
+		return;
+	}
+
+	// Rebuild top-down. Inner nodes of the treelet are reused in any order; i stays the root.
+	int root_parent = nodes[i].parent;
+	int next_inner = 1;
+	int stack_node[max_leaves];
+	int stack_set[max_leaves];
+	int sp = 0;
+	int post_order[max_leaves];
+	int post_count = 0;
+
+	stack_node[sp] = i;
+	stack_set[sp++] = full;
+
+	while (sp > 0)
+	{
+		int node = stack_node[--sp];
+		int s = stack_set[sp];
+		int halves[2] = {best_split[s], s ^ best_split[s]};
+
+		post_order[post_count++] = node;
+		nodes[node].count = 0;
+
+		for (int side = 0; side < 2; side++)
+		{
+			int h = halves[side];
+
+			if ((h & (h - 1)) == 0)
+			{
+				set_child(node, side, leaves[__builtin_ctz(h)]);
+			}
+			else
+			{
+				int child = inner[next_inner++];
+
+				set_child(node, side, child);
+				stack_node[sp] = child;
+				stack_set[sp++] = h;
+			}
+		}
+	}
+
+	nodes[i].parent = root_parent;
+
+	// Children were pushed after their parents, so finishing in reverse order goes bottom-up.
+	for (int k = post_count - 1; k >= 0; k--)
+	{
+		int node = post_order[k];
+
+		nodes[node].count = child_count(nodes[node].child[0]) + child_count(nodes[node].child[1]);
+
+		if (node != i)
+		{
+			finish_node(node);
+		}
+	}
+}
+
+void lbvh_builder::gather(int child, std::vector<int32_t> &prims) const
+{
+	if (child < 0)
+	{
+		prims.push_back(order[~child]);
+		return;
+	}
+
+	gather(nodes[child].child[0], prims);
+	gather(nodes[child].child[1], prims);
+}
+
+// Write inner node "node" and everything below it at "pos", with its primitives starting at "prim_pos".
+void lbvh_builder::emit(int node, int pos, int prim_pos, flat_bvh_node *out, int32_t *out_indices) const
+{
+	const radix_node &r = nodes[node];
+	flat_bvh_node &f = out[pos];
+
+	f.box = r.box;
+	f.pad = 0;
+
+	if (r.leaf)
+	{
+		std::vector<int32_t> prims;
+		gather(node, prims);
+		std::copy(prims.begin(), prims.end(), out_indices + prim_pos);
+
+		f.offset = prim_pos;
+		f.count = r.count;
+		f.axis = 0;
+
+		return;
+	}
+
+	int a = r.child[0];
+	int b = r.child[1];
+	vec3 ca = child_box(a).min() + child_box(a).max();
+	vec3 cb = child_box(b).min() + child_box(b).max();
+
+	// Karras' left child is not necessarily the lower one; traversal wants the lower side first on the split axis.
+	f.axis = longest_axis(r.box);
+	f.count = 0;
+
+	if (ca[f.axis] > cb[f.axis])
+	{
+		std::swap(a, b);
+	}
+
+	int positions[2] = {pos + 1, pos + 1 + child_size(a)};
+	int prim_positions[2] = {prim_pos, prim_pos + child_count(a)};
+	int children[2] = {a, b};
+
+	f.offset = positions[1];
+
+	for (int side = 0; side < 2; side++)
+	{
+		int c = children[side];
+
+		if (c >= 0)
+		{
+			emit(c, positions[side], prim_positions[side], out, out_indices);
+		}
+		else
+		{
+			flat_bvh_node &leaf = out[positions[side]];
+
+			leaf.box = child_box(c);
+			leaf.offset = prim_positions[side];
+			leaf.count = 1;
+			leaf.axis = 0;
+			leaf.pad = 0;
+			out_indices[prim_positions[side]] = order[~c];
+		}
+	}
+}
+
+bool lbvh_builder::build(bvh_node_vector &out_nodes, std::vector<int32_t> &out_indices)
+{
+	n = in.size();
+	out_indices.resize(n);
+
+	if (n == 1)
+	{
+		flat_bvh_node leaf;
+
+		leaf.box = in.bounds[0];
+		leaf.offset = 0;
+		leaf.count = 1;
+		leaf.axis = 0;
+		leaf.pad = 0;
+		out_nodes.assign(1, leaf);
+		out_indices[0] = 0;
+
+		return true;
+	}
+
+	compute_codes();
+	sort_codes();
+
+	nodes.resize(n - 1);
+	nodes[0].parent = -1;
+	leaf_parent.resize(n);
+	visits.reset(new std::atomic<int>[n - 1]);
+
+	for_range(n - 1, bvh_parallel_grain, [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			visits[i].store(0, std::memory_order_relaxed);
+			build_node(i);
+		}
+	});
+
+	for_range(n, bvh_parallel_grain, [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			finish_leaf(i);
+		}
+	});
+
+	if (nodes[0].height >= bvh_max_depth)
+	{
+		return false;
+	}
+
+	// Flatten. The top is walked serially down to subtrees small enough to hand out as tasks.
+	out_nodes.resize(nodes[0].size);
+
+	struct subtree
+	{
+		int node;
+		int pos;
+		int prim_pos;
+	};
+
+	int threads = pool ? pool->size() : 1;
+	int task_size = threads > 1 ? std::max(4096, nodes[0].size / (threads * 8)) : nodes[0].size;
+	std::vector<subtree> todo(1, {0, 0, 0});
+	std::vector<subtree> tasks;
+
+	while (!todo.empty())
+	{
+		subtree t = todo.back();
+		todo.pop_back();
+
+		const radix_node &r = nodes[t.node];
+
+		if (r.size <= task_size || r.leaf)
+		{
+			tasks.push_back(t);
+			continue;
+		}
+
+		// Same child order and positions as emit().
+		int a = r.child[0];
+		int b = r.child[1];
+		vec3 ca = child_box(a).min() + child_box(a).max();
+		vec3 cb = child_box(b).min() + child_box(b).max();
+		flat_bvh_node &f = out_nodes[t.pos];
+
+		f.box = r.box;
+		f.axis = longest_axis(r.box);
+		f.count = 0;
+		f.pad = 0;
+
+		if (ca[f.axis] > cb[f.axis])
+		{
+			std::swap(a, b);
+		}
+
+		f.offset = t.pos + 1 + child_size(a);
+
+		subtree halves[2] = {{a, t.pos + 1, t.prim_pos}, {b, f.offset, t.prim_pos + child_count(a)}};
+
+		for (const subtree &h : halves)
+		{
+			if (h.node >= 0)
+			{
+				todo.push_back(h);
+			}
+			else
+			{
+				flat_bvh_node &leaf = out_nodes[h.pos];
+
+				leaf.box = child_box(h.node);
+				leaf.offset = h.prim_pos;
+				leaf.count = 1;
+				leaf.axis = 0;
+				leaf.pad = 0;
+				out_indices[h.prim_pos] = order[~h.node];
+			}
+		}
+	}
+
+	for_range(tasks.size(), 1, [&](int first, int last)
+	{
+		for (int k = first; k < last; k++)
+		{
+			emit(tasks[k].node, tasks[k].pos, tasks[k].prim_pos, out_nodes.data(), out_indices.data());
+		}
+	});
+
+	return true;
+}
+
+#endif // LBVHHPP
@@ -1,462 +1,269 @@
 #include <iostream>
-#include "sphere.hpp"
-#include "moving_sphere.hpp"
-#include "hitable_list.hpp"
-#include "camera.hpp"
-#include "material.hpp"
-#include "texture.hpp"
-#include "image_texture.hpp"
-#include "aarect.hpp"
-#include "box.hpp"
-#include "constant_medium.hpp"
-#include "bvh.hpp"
+#include "render.hpp"
+#include "scene_file.hpp"
+#include "render_server.hpp"
+#include "animation.hpp"
+#include "kernel_benchmark.hpp"
+#include "texture_benchmark.hpp"
+#include "thread_pool.hpp"
+#include "arena.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#include <thread>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <vector>
-#include <sstream>
 
-// Global variables, to be used on main() and render_scene()
-const int nx = 800;
-const int ny = 800;
-const int ns = 100; // Number of samples
-
-inline vec3 de_nan(const vec3& c) {
-    vec3 temp = c;
-    if (!(temp[0] == temp[0])) temp[0] = 0;
-    if (!(temp[1] == temp[1])) temp[1] = 0;
-    if (!(temp[2] == temp[2])) temp[2] = 0;
-    return temp;
-}
-
-vec3 color(const ray &r, hitable *world, int depth)
+/*
+ * Usage:
+ *     raytracer [--threads N] [--scene S]          Render a scene as PPM to stdout. S is a built-in scene name (see
+ *                                                  scenes.hpp) or a scene file (see scene_file.hpp).
+ *     raytracer [--threads N] --server <socket>    Run as a render daemon, see render_server.hpp.
+ *     raytracer [--threads N] [--scene S] --animate <first> <last> [--fps F] [--shutter S] [--output pattern]
+ *                                                  Render frames of an animation, see animation.hpp.
+ *                                                  --rebuild-threshold R sets when refitted BVHs are rebuilt.
+ *     raytracer [--threads N] --benchmark-kernels  Time every built-in scene with the generic and the specialized
+ *                                                  render kernel at 200x200, 16 samples (see kernel_benchmark.hpp).
+ *     raytracer --benchmark-textures               Time texture lookups in the linear and the tiled texel layout
+ *                                                  (see texture_benchmark.hpp).
+ *     raytracer --convert-texture <in> <out.rtex>  Convert an image to a texture file that loads without decoding
+ *                                                  (see image_texture.hpp). Scenes take .rtex files wherever they
+ *                                                  take images.
+ *
+ * --bvh-cache <dir> keeps built BVHs in <dir> and maps them back on later runs (see flat_bvh.hpp). Without it, the BVHs
+ * of a scene file are kept next to it in "<file>.bvh".
+ * --bvh sah|lbvh|lbvh-treelet|sbvh picks the BVH builder: best trees, fastest build, or in between. sbvh adds
+ * spatial splits for scenes with a few huge primitives among small ones; --bvh-split-budget <f> caps the duplicated
+ * references it may add, as a fraction of the primitive count (default 0.5).
+ * --bvh-layout dfs|treelet picks the node order of BVHs; treelet packs nodes visited together into the same cache
+ * lines and pages, and reports the difference (see bvh_layout.hpp).
+ * --list-bvh-threshold <n> sets the size from which hitable_lists build a BVH over their members (default 8, 0
+ * disables it, see hitable_list.hpp).
+ * --bvh-compact stores BVHs with quantized nodes, trading some speed for less memory (see quantized_bvh.hpp).
+ * --compile-scene flattens the scene into typed primitive arrays under one BVH before rendering, and checks it against
+ * the original scene (see scene_compiler.hpp).
+ * --isa baseline|sse4.2|avx2|avx512 caps the instruction set of the SIMD kernels, which otherwise use the widest one
+ * the CPU has (see cpu_dispatch.hpp).
+ * --motion-segments <n> gives motion BVHs <n> time segments for primitives that move further than their size over the
+ * shutter (default 1, no temporal splits, see motion_bvh.hpp).
+ * --texture-layout linear|tiled picks how image textures store their texels (default tiled, see image_texture.hpp).
+ * --texture-cache-mb <n> loads image textures lazily, tile by tile, into a cache of at most <n> MB instead of keeping
+ * them decoded in memory, and prints its statistics after rendering (see tile_cache.hpp).
+ * --bake-noise <n> samples the turbulence of noise textures on a grid of <n> points per unit, baked lazily in bricks of
+ * at most --bake-noise-mb <m> MB (default 256), and prints its error against the exact noise after rendering (see
+ * baked_noise.hpp).
+ */
+int main(int argc, char **argv)
 {
-    hit_record rec;
+    const char *server_socket = nullptr;
+    //const char *scene_name = "cornell_box_final_book2";
+    //const char *scene_name = "cornell_smoke";
+    const char *scene_name = "cornell_box";
+    //const char *scene_name = "simple_light";
+    //const char *scene_name = "earth";
+    //const char *scene_name = "two_perlin_spheres";
+    int num_threads = 4;
+    bool animate = false;
+    bool benchmark = false;
+    bool benchmark_textures = false;
+    cpu_isa isa = detect_cpu_isa();
+    animation_settings anim;
 
-    if(world->hit(r, 0.001, FLT_MAX, rec))
+    for (int a = 1; a < argc; a++)
     {
-        ray scattered;
-        vec3 attenuation;
-
-        // If the material in the hitpoint is an emitting material, the color emitted affects on the returned value.
-        vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-
-        // Probability Density Function (PDF).
-        float pdf_val;
-        vec3 albedo;
-
-        if(depth < 50 && rec.mat_ptr->scatter(r, rec, albedo, scattered, pdf_val))
+        if (strcmp(argv[a], "--server") == 0 && a + 1 < argc)
         {
-            hitable *light_shape = new xz_rect(213, 343, 227, 332, 554, 0);
-            hitable_pdf pdf_0(light_shape, rec.p);
-            cosine_pdf pdf_1(rec.normal);
-            mixture_pdf mix_p(&pdf_0, &pdf_1);
-
-            // We override whatever value was written in the material call to "scatter()"
-            scattered = ray(rec.p, mix_p.generate(), r.time());
-
-            pdf_val = mix_p.value(scattered.direction());
-
-            // Color = (Albdo * scattering_pdf(direction) * color(direction)) / pdf(direction)
-            return emitted + albedo * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-                   * color(scattered, world, depth + 1) / pdf_val;
-            // If we want to just map a texture image, return just "attenuation".
-            // return attenuation;
+            server_socket = argv[++a];
         }
-        else
+        else if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
         {
-            return emitted;
+            scene_name = argv[++a];
         }
-    }
-    else
-    {
-        // Blackground is black (it was different in earlier stages of the raytracer).
-        return vec3(0, 0, 0);
-    }
-}
-
-hitable *cornell_box_final_book2() {
-    int nb = 20;
-
-    hitable **list = new hitable*[30];
-    hitable **boxlist = new hitable*[10000];
-    hitable **boxlist2 = new hitable*[10000];
-    material *white = new lambertian( new constant_texture(vec3(0.73, 0.73, 0.73)) );
-    material *ground = new lambertian( new constant_texture(vec3(0.48, 0.83, 0.53)) );
-    int b = 0;
-
-    for (int i = 0; i < nb; i++)
-    {
-        for (int j = 0; j < nb; j++)
+        else if (strcmp(argv[a], "--bvh-cache") == 0 && a + 1 < argc)
         {
-            float w = 100;
-            float x0 = -1000 + i*w;
-            float z0 = -1000 + j*w;
-            float y0 = 0;
-            float x1 = x0 + w;
-            float y1 = 100*(drand48()+0.01);
-            float z1 = z0 + w;
-            boxlist[b++] = new box(vec3(x0,y0,z0), vec3(x1,y1,z1), ground);
+            bvh_cache_dir = argv[++a];
+            mkdir(bvh_cache_dir.c_str(), 0755);
         }
-    }
-
-    int l = 0;
-
-    list[l++] = new bvh_node(boxlist, b, 0, 1);
-    material *light = new diffuse_light( new constant_texture(vec3(7, 7, 7)) );
-    list[l++] = new xz_rect(123, 423, 147, 412, 554, light);
-    vec3 center(400, 400, 200);
-    list[l++] = new moving_sphere(center, center+vec3(30, 0, 0), 0, 1, 50, new lambertian(new constant_texture(vec3(0.7, 0.3, 0.1))));
-    list[l++] = new sphere(vec3(260, 150, 45), 50, new dielectric(1.5));
-    list[l++] = new sphere(vec3(0, 150, 145), 50, new metal(vec3(0.8, 0.8, 0.9), 10.0));
-    hitable *boundary = new sphere(vec3(360, 150, 145), 70, new dielectric(1.5));
-    list[l++] = boundary;
-    list[l++] = new constant_medium(boundary, 0.2, new constant_texture(vec3(0.2, 0.4, 0.9)));
-    boundary = new sphere(vec3(0, 0, 0), 5000, new dielectric(1.5));
-    list[l++] = new constant_medium(boundary, 0.0001, new constant_texture(vec3(1.0, 1.0, 1.0)));
-    int nx, ny, nn;
-    unsigned char *tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-    material *emat =  new lambertian(new image_texture(tex_data, nx, ny));
-    list[l++] = new sphere(vec3(400,200, 400), 100, emat);
-    texture *pertext = new noise_texture(0.1);
-    list[l++] =  new sphere(vec3(220,280, 300), 80, new lambertian( pertext ));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++)
-    {
-        boxlist2[j] = new sphere(vec3(165*drand48(), 165*drand48(), 165*drand48()), 10, white);
-    }
-    list[l++] =   new translate(new rotate_y(new bvh_node(boxlist2,ns, 0.0, 1.0), 15), vec3(-100,270,395));
-    return new hitable_list(list,l);
-}
-
-hitable *cornell_smoke()
-{
-    hitable **list = new hitable *[8];
-
-    int i = 0;
-
-    material *red = new lambertian(new constant_texture(vec3(0.65, 0.05, 0.05)));
-    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
-    material *green = new lambertian(new constant_texture(vec3(0.12, 0.45, 0.15)));
-    material *light = new diffuse_light(new constant_texture(vec3(7, 7, 7)));
-
-    // Cornell Box
-    list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green));
-    list[i++] = new yz_rect(0, 555, 0, 555, 0, red);
-    list[i++] = new xz_rect(113, 443, 127, 432, 554, light);
-    list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white));
-    list[i++] = new xz_rect(0, 555, 0, 555, 0, white);
-    list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white));
-
-    hitable *b1 = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 165, 165), white), -18), vec3(130, 0, 65));
-    hitable *b2 = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 330, 165), white), 15), vec3(265, 0, 295));
-
-    // Light particles smoke
-    list[i++] = new constant_medium(b1, 0.01, new constant_texture(vec3(1.0, 1.0, 1.0)));
-    // Dark particles smoke
-    list[i++] = new constant_medium(b2, 0.01, new constant_texture(vec3(0.0, 0.0, 0.0)));
-
-    return new hitable_list(list, i);
-}
-
-hitable *cornell_box()
-{
-    hitable **list = new hitable *[8];
-
-    int i = 0;
-
-    material *red = new lambertian(new constant_texture(vec3(0.65, 0.05, 0.05)));
-    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
-    material *green = new lambertian(new constant_texture(vec3(0.12, 0.45, 0.15)));
-    material *light = new diffuse_light(new constant_texture(vec3(15, 15, 15)));
-
-    // Cornell Box
-    list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green));
-    list[i++] = new yz_rect(0, 555, 0, 555, 0, red);
-    list[i++] = new flip_normals(new xz_rect(213, 343, 227, 332, 554, light));
-    list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white));
-    list[i++] = new xz_rect(0, 555, 0, 555, 0, white);
-    list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white));
-
-    // 2 Boxes inside the room (withut rotation or translation)
-    // list[i++] = new box(vec3(130, 0, 65), vec3(295, 165, 230), white);
-    // list[i++] = new box(vec3(265, 0, 295), vec3(430, 330, 460), white);
-
-    list[i++] = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 165, 165), white), -18), vec3(130, 0, 65));
-    list[i++] = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 330, 165), white), 15), vec3(265, 0, 295));
-
-    return new hitable_list(list, i);
-}
-
-hitable *simple_light()
-{
-    texture *pertext = new noise_texture(4);
-
-    hitable **list = new hitable *[4];
-
-    list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(pertext));
-    list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(pertext));
-    // Lights are brighter than (1, 1, 1) to allow it to be bright enough to light things.
-    list[2] = new sphere(vec3(0, 7, 0), 2, new diffuse_light(new constant_texture(vec3(4, 4, 4))));
-    list[3] = new xy_rect(3, 5, 1, 3, -2, new diffuse_light(new constant_texture(vec3(4, 4, 4))));
-
-    return new hitable_list(list, 4);
-}
-
-hitable *earth() {
-    int nx, ny, nn;
-    unsigned char *tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-    material *mat =  new lambertian(new image_texture(tex_data, nx, ny));
-    return new sphere(vec3(0,0, 0), 2, mat);
-}
-
-hitable *two_perlin_spheres()
-{
-    texture *perlin_texture = new noise_texture(4);
-
-    hitable **list = new hitable *[2];
-
-    list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(perlin_texture));
-    list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(perlin_texture));
-
-    return new hitable_list(list, 2);
-}
-
-hitable *two_spheres()
-{
-    texture *checker = new checker_texture(new constant_texture(vec3(0.2, 0.3, 0.1)),
-                       new constant_texture(vec3(0.9, 0.9, 0.9)));
-
-    int n = 50;
-
-    hitable **list = new hitable *[n + 1];
-
-    list[0] = new sphere(vec3(0, -10, 0), 10, new lambertian(checker));
-    list[1] = new sphere(vec3(0, 10, 0), 10, new lambertian(checker));
-
-    return new hitable_list(list, 2);
-}
-
-hitable *random_scene()
-{
-    int n = 50000;
-    hitable **list = new hitable *[n+1];
-
-    texture *checker = new checker_texture(new constant_texture(vec3(0.2, 0.3, 0.1)),
-                                           new constant_texture(vec3(0.9, 0.9, 0.9)));
-    list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(checker));
-
-    int i = 1;
-
-    for(int a = -10; a < 10; a++)
-    {
-        for(int b = -10; b < 10; b++)
+        else if (strcmp(argv[a], "--bvh-layout") == 0 && a + 1 < argc)
         {
-            float choose_mat = drand48();
-            vec3 center(a + 0.9 * drand48(), 0.2, b + 0.9 * drand48());
+            a++;
 
-            if ((center - vec3(4, 0.2, 0)).length() > 0.9)
+            if (strcmp(argv[a], "dfs") == 0)
+            {
+                bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+            }
+            else if (strcmp(argv[a], "treelet") == 0)
+            {
+                bvh_layout = BVH_LAYOUT_TREELET;
+            }
+            else
             {
-                if (choose_mat < 0.8) // Diffuse
-                {
-                    vec3 albedo = vec3(drand48() * drand48(), drand48() * drand48(), drand48() * drand48());
-                    list[i++] = new moving_sphere(center, center + vec3(0, 0.5 * drand48(), 0), 0.0, 1.0, 0.2,
-                                                  new lambertian(new constant_texture(albedo)));
-                }
-                else if (choose_mat < 0.95) // Metal
-                {
-                    vec3 albedo = vec3(0.5 * (1 + drand48()), 0.5 * (1 + drand48()), 0.5 * (1 + drand48()));
-                    float fuzz = 0.5 * drand48();
-                    list[i++] = new sphere(center, 0.2, new metal(albedo, fuzz));
-                }
-                else // Glass
-                {
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
-                }
+                std::cerr << "Unknown BVH layout " << argv[a] << "\n";
+                return 1;
             }
         }
-    }
-
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(new constant_texture(vec3(0.4, 0.2, 0.1))));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
-
-    return new hitable_list(list, i);
-}
-
-void render_scene(int start_row, int end_row, int *pixels)
-{
-    //hitable *world = cornell_box_final_book2();
-    //hitable *world = cornell_smoke();
-    hitable *world = cornell_box();
-    //hitable *world = simple_light();
-    //hitable *world = earth();
-    //hitable *world = two_perlin_spheres();
-
-    // Final scene book 2 camera settings
-    //vec3 lookfrom(478, 278, -600);
-    //vec3 lookat(278, 278, 0);
-
-    // Cornell Box camera settings
-    vec3 lookfrom(278, 278, -800);
-    vec3 lookat(278, 278, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    float vfov = 40.0;
-    // Setup until chapter 6 (included) of the second book.
-    //vec3 lookfrom(20, 4, 5);
-    //vec3 lookat(0, 2, 0);
-    //float dist_to_focus = 10.0;
-    //float aperture = 0.0;
-
-    camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-    // Setup until chapter 6 (included) of the second book.
-    //camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-
-    for (int j = end_row; j >= start_row; j--)
-    {
-        int *row = &pixels[nx * j * 3];
-        for (int i = 0; i < nx; i++)
+        else if (strcmp(argv[a], "--bvh-compact") == 0)
         {
-            vec3 col{0, 0, 0};
-
-            for(int s = 0; s < ns; s++)
+            bvh_compact = true;
+        }
+        else if (strcmp(argv[a], "--bvh") == 0 && a + 1 < argc)
+        {
+            if (!parse_bvh_build_method(argv[++a], bvh_method))
             {
-                float u = float(i + drand48()) / float(nx);
-                float v = float(j + drand48()) / float(ny);
-
-                ray r = cam.get_ray(u, v);
-                col += de_nan(color(r, world, 0));
+                std::cerr << "Unknown BVH builder " << argv[a] << "\n";
+                return 1;
             }
-
-            col /= float(ns);
-            col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-
-            int ir = int(255.99 * col[0]);
-            int ig = int(255.99 * col[1]);
-            int ib = int(255.99 * col[2]);
-
-            // Access the current pixel to store. There are 3 components per pixel.
-            row[(i*3) + 0] = ir;
-            row[(i*3) + 1] = ig;
-            row[(i*3) + 2] = ib;
         }
-    }
-}
-
-int main()
-{
-    std::cout << "P3\n" << nx << " " << ny << "\n255\n";
-
-    /* Multithread code starts here */
-    int pixels[nx * ny * 3]; // temporary buffer to store 3 components per pixel.
-    int num_threads = 4;
-    int rows_per_thread = ny / num_threads;
-
-    if ((rows_per_thread % num_threads) != 0)
-    {
-        std::cerr << "\nThe image height must be divisible by the number of threads used\n";
-    }
-
-    std::vector<std::thread> threads;
-
-    for (int i = 0; i < num_threads; ++i)
-    {
-        int start_row = rows_per_thread * i;
-        int end_row;
-
-        if (i + 1 == num_threads)
+        else if (strcmp(argv[a], "--bvh-split-budget") == 0 && a + 1 < argc)
+        {
+            bvh_split_budget = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--list-bvh-threshold") == 0 && a + 1 < argc)
+        {
+            list_bvh_threshold = atoi(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--compile-scene") == 0)
+        {
+            scene_compile = true;
+        }
+        else if (strcmp(argv[a], "--isa") == 0 && a + 1 < argc)
+        {
+            if (!parse_isa(argv[++a], isa))
+            {
+                std::cerr << "Unknown instruction set " << argv[a] << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "--benchmark-kernels") == 0)
+        {
+            benchmark = true;
+        }
+        else if (strcmp(argv[a], "--convert-texture") == 0 && a + 2 < argc)
         {
-            end_row = ny - 1;
+            return convert_texture(argv[a + 1], argv[a + 2]);
+        }
+        else if (strcmp(argv[a], "--benchmark-textures") == 0)
+        {
+            benchmark_textures = true;
+        }
+        else if (strcmp(argv[a], "--texture-cache-mb") == 0 && a + 1 < argc)
+        {
+            texture_cache_budget = size_t(atof(argv[++a]) * 1024 * 1024);
+        }
+        else if (strcmp(argv[a], "--bake-noise") == 0 && a + 1 < argc)
+        {
+            noise_bake_resolution = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--bake-noise-mb") == 0 && a + 1 < argc)
+        {
+            noise_bake_budget = size_t(atof(argv[++a]) * 1024 * 1024);
+        }
+        else if (strcmp(argv[a], "--texture-layout") == 0 && a + 1 < argc)
+        {
+            if (!parse_texture_layout(argv[++a], texture_layout))
+            {
+                std::cerr << "Unknown texture layout " << argv[a] << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "--animate") == 0 && a + 2 < argc)
+        {
+            animate = true;
+            anim.first_frame = atoi(argv[++a]);
+            anim.last_frame = atoi(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--fps") == 0 && a + 1 < argc)
+        {
+            anim.fps = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--shutter") == 0 && a + 1 < argc)
+        {
+            anim.shutter = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+        {
+            anim.output = argv[++a];
+        }
+        else if (strcmp(argv[a], "--rebuild-threshold") == 0 && a + 1 < argc)
+        {
+            bvh_rebuild_threshold = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--motion-segments") == 0 && a + 1 < argc)
+        {
+            motion_time_segments = std::max(atoi(argv[++a]), 1);
+        }
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+        {
+            num_threads = atoi(argv[++a]);
         }
         else
         {
-            end_row = start_row + rows_per_thread - 1;
+            std::cerr << "Unknown argument " << argv[a] << "\n";
+            return 1;
         }
-
-        threads.push_back(std::thread(render_scene, start_row, end_row, pixels));
     }
 
-        for (std::thread &t : threads)
+    select_kernel_isa(isa);
+
+    thread_pool pool(num_threads);
+    bvh_build_pool = &pool;
+
+    if (server_socket)
     {
-        t.join();
+        render_server server(server_socket, pool);
+
+        return server.run();
     }
 
-    // Write pixels to the ppm file
-    for (int j = ny-1; j >= 0; j--)
+    if (benchmark_textures)
     {
-        int *row = &pixels[nx * j * 3];
+        run_texture_benchmark(std::cout);
 
-        for (int i = 0; i < nx; i++)
-        {
-            std::cout << row[i*3 + 0] << " " << row[i*3 + 1] << " " << row[i*3 + 2] << "\n";
-        }
+        return 0;
     }
-    // Multithread code ends here.
-#if 0
-    // SINGLE THREAD CODE
-    /*
-    hitable *list[5];
-    list[0] = new sphere(vec3(0, 0, -1), 0.5, new lambertian(vec3(0.1, 0.2, 0.5)));
-    list[1] = new sphere(vec3(0, -100.5, -1), 100,  new lambertian(vec3(0.8, 0.8, 0.0)));
-    list[2] = new sphere(vec3(1, 0, -1), 0.5, new metal(vec3(0.8, 0.6, 0.2), 0.0));
-    list[3] = new sphere(vec3(-1, 0, -1), 0.5, new dielectric(1.5));
-    list[4] = new sphere(vec3(-1, 0, -1), -0.45, new dielectric(1.5));
-    hitable *world = new hitable_list(list, 5);
-    */
-
-    //hitable *world = cornell_box();
-    //hitable *world = cornell_box_final_book2();
-    hitable *world = cornell_smoke();
-    //hitable *world = simple_light();
-    //hitable *world = earth();
-    //hitable *world = two_perlin_spheres();
 
-    // Final scene book 2 camera settings
-    //vec3 lookfrom(478, 278, -600);
-    //vec3 lookat(278, 278, 0);
+    if (benchmark)
+    {
+        render_settings bench_settings;
+        bench_settings.nx = 200;
+        bench_settings.ny = 200;
+        bench_settings.ns = 16;
 
-    // Cornell Box camera settings
-    vec3 lookfrom(278, 278, -800);
-    vec3 lookat(278, 278, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    float vfov = 40.0;
+        return run_kernel_benchmark(pool, bench_settings, std::cout);
+    }
 
-    // Setup until chapter 6 (included) of the second book.
-    //vec3 lookfrom(20, 4, 5);
-    //vec3 lookat(0, 2, 0);
-    //float dist_to_focus = 10.0;
-    //float aperture = 0.0;
+    render_settings settings;
+    camera_settings cam_settings;
+    std::string error;
 
-    camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-    // Setup until chapter 6 (included) of the second book.
-    //camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
+    // The scene is built once and shared by all threads. Everything it allocates lives in "arena" and is freed with it.
+    scene_arena arena;
+    hitable *world = open_scene(scene_name, arena, cam_settings, settings, error);
 
-    for (int j = ny - 1; j >= 0; j--)
+    if (!world)
     {
-        for (int i = 0; i < nx; i++)
-        {
-            vec3 col{0, 0, 0};
+        std::cerr << "Cannot open scene " << scene_name << ": " << error << "\n";
+        return 1;
+    }
 
-            for(int s = 0; s < ns; s++)
-            {
-                float u = float(i + drand48()) / float(nx);
-                float v = float(j + drand48()) / float(ny);
+    if (animate)
+    {
+        return render_animation(pool, world, cam_settings, settings, anim);
+    }
 
-                ray r = cam.get_ray(u, v);
-                col += color(r, world, 0);
-            }
+    camera cam(cam_settings, settings.nx, settings.ny);
+    std::vector<unsigned char> pixels(settings.nx * settings.ny * 3); // 3 components per pixel.
 
-            col /= float(ns);
-            col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+    render_image(pool, world, cam, settings, pixels.data());
+    write_ppm(std::cout, pixels.data(), settings.nx, settings.ny);
 
-            int ir = int(255.99 * col[0]);
-            int ig = int(255.99 * col[1]);
-            int ib = int(255.99 * col[2]);
+    if (texture_cache_budget > 0)
+    {
+        report_texture_cache(std::cerr);
+    }
 
-            std::cout << ir << " " << ig << " " << ib << "\n";
-        }
+    if (noise_bake_resolution > 0)
+    {
+        shared_baked_turbulence().report(std::cerr);
     }
-#endif
 }
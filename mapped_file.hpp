@@ -0,0 +1,166 @@
+#ifndef MAPPEDFILEHPP
+#define MAPPEDFILEHPP
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+
+/*
+ * Read-only memory mapping of a whole file. Pages are loaded on first touch and shared between processes mapping the
+ * same file, so cached scenes, BVHs and textures can be used in place without copying or decoding.
+ */
+class mapped_file
+{
+	public:
+		mapped_file() {}
+
+		~mapped_file()
+		{
+			close();
+		}
+
+		mapped_file(const mapped_file &) = delete;
+		mapped_file &operator=(const mapped_file &) = delete;
+
+		bool open(const std::string &path)
+		{
+			close();
+
+			int fd = ::open(path.c_str(), O_RDONLY);
+
+			if (fd < 0)
+			{
+				return false;
+			}
+
+			struct stat st;
+
+			if (fstat(fd, &st) != 0 || st.st_size == 0)
+			{
+				::close(fd);
+				return false;
+			}
+
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+
+			if (p == MAP_FAILED)
+			{
+				return false;
+			}
+
+			bytes = static_cast<const char *>(p);
+			length = st.st_size;
+
+			return true;
+		}
+
+		void close()
+		{
+			if (bytes)
+			{
+				munmap(const_cast<char *>(bytes), length);
+			}
+
+			bytes = nullptr;
+			length = 0;
+		}
+
+		const char *data() const
+		{
+			return bytes;
+		}
+
+		size_t size() const
+		{
+			return length;
+		}
+
+	private:
+		const char *bytes = nullptr;
+		size_t length = 0;
+};
+
+// Size and modification time of a file, used to tell whether a cache built from it is stale.
+struct file_stamp
+{
+	uint64_t size;
+	int64_t mtime_ns;
+};
+
+bool get_file_stamp(const std::string &path, file_stamp &stamp)
+{
+	struct stat st;
+
+	if (stat(path.c_str(), &st) != 0)
+	{
+		return false;
+	}
+
+	stamp.size = st.st_size;
+	stamp.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+/*
+ * Write "size" bytes to "path" through a temporary file and rename, so a reader never maps a half written cache. The
+ * temporary file has a unique name, so writers racing for the same path (say the render server and a command line
+ * run) each rename a whole file of their own, and it is removed if anything fails.
+ */
+bool write_file_atomically(const std::string &path, const void *data, size_t size)
+{
+	std::string tmp = path + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	const char *p = static_cast<const char *>(data);
+	size_t left = size;
+	bool ok = fchmod(fd, 0644) == 0;
+
+	while (ok && left > 0)
+	{
+		ssize_t written = ::write(fd, p, left);
+
+		ok = written > 0;
+		p += ok ? written : 0;
+		left -= ok ? written : 0;
+	}
+
+	ok = ::close(fd) == 0 && ok;
+
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// 64-bit FNV-1a. Used for cache keys and checksums, not for anything security related.
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+#endif // MAPPEDFILEHPP
@@ -17,6 +17,12 @@ float schlick(float cosine, float ref_idx)
 	return r0 + (1 - r0) * pow(1 - cosine, 5.0);
 }
 
+// Width of the footprint of "r" at its hit, in units of the surface's u and v. 0 (point sampling) if either is unknown.
+float uv_footprint(const ray &r, const hit_record &rec)
+{
+	return rec.uv_extent > 0 ? r.footprint(rec.t) / rec.uv_extent : 0;
+}
+
 bool refract(const vec3 &v, const vec3 &n, float ni_over_nt, vec3 &refracted)
 {
 	// Snell's law vector form. Can be found on the wikipedia or the GLSL spec in Khronos.
@@ -111,7 +117,7 @@ class diffuse_light : public material
 		{
 			if (dot(rec.normal, ray_in.direction()) < 0.0)
 			{
-				return emit->value(u, v, p);
+				return emit->filtered_value(u, v, p, uv_footprint(ray_in, rec));
 			}
 			else
 			{
@@ -153,7 +159,8 @@ class lambertian : public material
 			vec3 direction = uvw.local(random_cosine_direction());
 
 			scattered = ray(rec.p, unit_vector(direction), ray_in.time());
-			alb = albedo->value(rec.u, rec.v, rec.p);
+			scattered.inherit_footprint(ray_in, rec.t);
+			alb = albedo->filtered_value(rec.u, rec.v, rec.p, uv_footprint(ray_in, rec));
 
 			// PDF to weight against.
 			//pdf = dot(rec.normal, scattered.direction()) / M_PI;
@@ -185,6 +192,7 @@ class metal : public material
 		{
 			vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
 			scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+			scattered.inherit_footprint(r_in, rec.t);
 			attenuation = albedo;
 
 			return (dot(scattered.direction(), rec.normal) > 0);
@@ -240,6 +248,8 @@ class dielectric : public material
 				scattered = ray(rec.p, refracted);
 			}
 
+			scattered.inherit_footprint(r_in, rec.t);
+
 			return true;
 		}
 
@@ -0,0 +1,448 @@
+#ifndef MOTIONBVHHPP
+#define MOTIONBVHHPP
+
+#include "hitable.hpp"
+#include "flat_bvh.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Node of a BVH over moving primitives. Instead of one box covering the whole shutter interval it keeps the bounds at
+ * shutter open and close; a ray at time t tests the box linearly interpolated between them. Same layout rules as
+ * flat_bvh_node otherwise.
+ */
+struct motion_bvh_node
+{
+	aabb box0;  // Bounds at time0.
+	aabb box1;  // Bounds at time1.
+	int32_t offset;
+	uint16_t count;
+	uint8_t axis;
+	uint8_t pad;
+};
+
+/*
+ * One BVH with interpolated bounds over [time0, time1]. Interpolating the boxes of the two end points is exact for
+ * primitives moving linearly (moving_sphere) and conservative for unions of them, so inner nodes stay valid.
+ */
+class motion_tree
+{
+	public:
+		void build(const std::vector<hitable *> &list, float t0, float t1);
+
+		// New interval, same topology. Refits every member once, then the node bounds, then rebuild_if_degraded().
+		void refit(float t0, float t1);
+
+		// Node bounds for a new interval from the members as they are, without refitting them.
+		void fit_bounds(float t0, float t1);
+
+		// Rebuild from "members" once the SAH cost has grown past bvh_rebuild_threshold times built_cost.
+		void rebuild_if_degraded();
+
+		// SAH cost (see bvh_sah_cost()) with each node's area averaged over its two end boxes.
+		float sah_cost() const;
+
+		bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
+
+		bool empty() const
+		{
+			return nodes.empty();
+		}
+
+		float time0 = 0;
+		float time1 = 0;
+		std::vector<motion_bvh_node> nodes;
+		std::vector<hitable *> members;  // Each primitive once, as given.
+		std::vector<hitable *> prims;    // In leaf order, split references repeated.
+		std::vector<int32_t> prim_members;  // Index in "members" of each of "prims".
+		sphere_batch spheres;            // Copy of "prims" for leaf tests, when they are all spheres.
+		float built_cost = 0;            // SAH cost right after the last build.
+};
+
+void motion_tree::build(const std::vector<hitable *> &list, float t0, float t1)
+{
+	bvh_build_input in;
+	bvh_tree tree;
+	aabb box0;
+	aabb box1;
+
+	// "list" may be "members" itself, when rebuilding.
+	members = list;
+
+	// Topology from the boxes at mid-shutter, which is what a ray sees on average.
+	for (hitable *h : list)
+	{
+		h->bounding_box(t0, t0, box0);
+		h->bounding_box(t1, t1, box1);
+		in.add(aabb(0.5 * (box0.min() + box1.min()), 0.5 * (box0.max() + box1.max())));
+	}
+
+	bool batched = sphere_batch::accepts(list.data(), list.size());
+
+	if (batched)
+	{
+		build_bvh(in, tree, sphere_batch::width, sphere_batch::width);
+	}
+	else
+	{
+		build_bvh(in, tree);
+	}
+
+	nodes.resize(tree.node_count);
+	prims.resize(tree.index_count);
+
+	for (int i = 0; i < tree.node_count; i++)
+	{
+		nodes[i].offset = tree.nodes[i].offset;
+		nodes[i].count = tree.nodes[i].count;
+		nodes[i].axis = tree.nodes[i].axis;
+		nodes[i].pad = 0;
+	}
+
+	prim_members.assign(tree.indices, tree.indices + tree.index_count);
+
+	for (int i = 0; i < tree.index_count; i++)
+	{
+		prims[i] = members[tree.indices[i]];
+	}
+
+	spheres.clear();
+
+	if (batched)
+	{
+		spheres.build(prims);
+	}
+
+	fit_bounds(t0, t1);
+	built_cost = sah_cost();
+}
+
+void motion_tree::refit(float t0, float t1)
+{
+	for (hitable *h : members)
+	{
+		h->refit(t0, t1);
+	}
+
+	fit_bounds(t0, t1);
+	rebuild_if_degraded();
+}
+
+void motion_tree::rebuild_if_degraded()
+{
+	float cost = sah_cost();
+
+	if (cost > built_cost * bvh_rebuild_threshold)
+	{
+		build(members, time0, time1);
+		std::cerr << "Motion BVH over " << members.size() << " primitives rebuilt: SAH cost " << cost
+		          << " after refit, " << built_cost << " rebuilt\n";
+	}
+}
+
+float motion_tree::sah_cost() const
+{
+	if (nodes.empty())
+	{
+		return 0;
+	}
+
+	auto area = [](const motion_bvh_node &n)
+	{
+		return 0.5f * (surface_area(n.box0) + surface_area(n.box1));
+	};
+
+	float root_area = area(nodes[0]);
+	double cost = 0;
+
+	for (const motion_bvh_node &n : nodes)
+	{
+		cost += area(n) * (n.count ? n.count : 1);
+	}
+
+	return root_area > 0 ? float(cost / root_area) : 0;
+}
+
+void motion_tree::fit_bounds(float t0, float t1)
+{
+	time0 = t0;
+	time1 = t1;
+
+	// Children follow their parent, so walking backwards is bottom-up.
+	for (int i = int(nodes.size()) - 1; i >= 0; i--)
+	{
+		motion_bvh_node &n = nodes[i];
+
+		if (n.count > 0)
+		{
+			aabb box;
+
+			n.box0 = empty_box();
+			n.box1 = empty_box();
+
+			for (int k = n.offset; k < n.offset + n.count; k++)
+			{
+				if (prims[k]->bounding_box(t0, t0, box))
+				{
+					grow(n.box0, box);
+				}
+
+				if (prims[k]->bounding_box(t1, t1, box))
+				{
+					grow(n.box1, box);
+				}
+			}
+		}
+		else
+		{
+			n.box0 = nodes[i + 1].box0;
+			n.box1 = nodes[i + 1].box1;
+			grow(n.box0, nodes[n.offset].box0);
+			grow(n.box1, nodes[n.offset].box1);
+		}
+	}
+}
+
+bool motion_tree::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	// Rays outside the interval get the bounds of the nearest end, like every other BVH built for one interval.
+	float s = time1 > time0 ? (r.time() - time0) / (time1 - time0) : 0;
+	s = s < 0 ? 0 : (s > 1 ? 1 : s);
+
+	int stack[bvh_max_depth];
+	int sp = 0;
+	int node = 0;
+	bool hit_anything = false;
+
+	for (;;)
+	{
+		const motion_bvh_node &n = nodes[node];
+		aabb box((1 - s) * n.box0.min() + s * n.box1.min(), (1 - s) * n.box0.max() + s * n.box1.max());
+
+		if (box.hit(r, t_min, t_max))
+		{
+			if (n.count == 0)
+			{
+				int near = r.sign[n.axis] ? n.offset : node + 1;
+				int far = r.sign[n.axis] ? node + 1 : n.offset;
+
+				stack[sp++] = far;
+				node = near;
+
+				continue;
+			}
+
+			if (!spheres.empty())
+			{
+				hit_anything |= spheres.hit(r, n.offset, n.count, t_min, t_max, rec);
+			}
+			else
+			{
+				for (int i = n.offset; i < n.offset + n.count; i++)
+				{
+					if (prims[i]->hit(r, t_min, t_max, rec))
+					{
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+			}
+		}
+
+		if (sp == 0)
+		{
+			break;
+		}
+
+		node = stack[--sp];
+	}
+
+	return hit_anything;
+}
+
+// Primitives that move further than this many times their own size during the shutter count as fast movers.
+const float motion_fast_ratio = 1.0f;
+
+// Time segments the motion_bvh of built-in scenes and scene files cut the shutter into for fast movers (see below).
+int motion_time_segments = 1;
+
+/*
+ * BVH for motion-blurred scenes. With the default single time segment everything goes into one tree with interpolated
+ * bounds.
+ *
+ * More segments enable temporal splits for fast movers: the shutter is cut into "time_segments" pieces, each with its
+ * own tree over the fast movers, and a ray only visits the piece holding its time. Interpolation is already exact for
+ * a single linearly moving primitive, but fast movers heading in different directions inflate the interpolated inner
+ * boxes mid-shutter, and shorter intervals keep those tight. It costs one copy of the fast movers' nodes per segment
+ * and a second traversal per ray, so it only pays off when fast movers dominate.
+ *
+ * Refits keep each tree's topology until its SAH cost passes bvh_rebuild_threshold times the cost after its last
+ * build, then rebuild that tree, like flat_bvh. Which primitives are fast movers is decided once, at construction.
+ */
+class motion_bvh : public hitable
+{
+	public:
+		motion_bvh(hitable **list, int n, float time0, float time1, int time_segments = 1);
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
+		virtual bool bounding_box(float t0, float t1, aabb &box) const;
+		virtual void refit(float t0, float t1);
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn);
+
+		float time0;
+		float time1;
+		motion_tree slow;
+		std::vector<motion_tree> fast;  // One per time segment, empty without fast movers.
+};
+
+motion_bvh::motion_bvh(hitable **list, int n, float t0, float t1, int time_segments) : time0(t0), time1(t1)
+{
+	std::vector<hitable *> slow_list;
+	std::vector<hitable *> fast_list;
+	aabb box0;
+	aabb box1;
+
+	for (int i = 0; i < n; i++)
+	{
+		bool fast_mover = false;
+
+		if (time_segments > 1 && list[i]->bounding_box(t0, t0, box0) && list[i]->bounding_box(t1, t1, box1))
+		{
+			vec3 size = box0.max() - box0.min();
+			vec3 moved = (box1.min() + box1.max()) - (box0.min() + box0.max());
+
+			fast_mover = 0.5f * moved.length() > motion_fast_ratio * std::max(size.x(), std::max(size.y(), size.z()));
+		}
+
+		(fast_mover ? fast_list : slow_list).push_back(list[i]);
+	}
+
+	slow.build(slow_list, t0, t1);
+
+	if (!fast_list.empty())
+	{
+		fast.resize(time_segments);
+
+		for (int k = 0; k < time_segments; k++)
+		{
+			fast[k].build(fast_list, t0 + (t1 - t0) * k / time_segments, t0 + (t1 - t0) * (k + 1) / time_segments);
+		}
+	}
+}
+
+void motion_bvh::visit_children(const std::function<void(hitable *&)> &fn)
+{
+	// Each member once, then the leaf references and sphere copies from the members as they are now.
+	auto relink = [](motion_tree &tree)
+	{
+		for (size_t i = 0; i < tree.prims.size(); i++)
+		{
+			tree.prims[i] = tree.members[tree.prim_members[i]];
+		}
+
+		if (!tree.spheres.empty())
+		{
+			tree.spheres.build(tree.prims);
+		}
+	};
+
+	for (hitable *&h : slow.members)
+	{
+		fn(h);
+	}
+
+	relink(slow);
+
+	if (fast.empty())
+	{
+		return;
+	}
+
+	// Every segment's tree holds the same fast movers.
+	for (hitable *&h : fast[0].members)
+	{
+		fn(h);
+	}
+
+	for (motion_tree &tree : fast)
+	{
+		tree.members = fast[0].members;
+		relink(tree);
+	}
+}
+
+bool motion_bvh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	bool hit_slow = slow.hit(r, t_min, t_max, rec);
+
+	if (fast.empty())
+	{
+		return hit_slow;
+	}
+
+	int k = time1 > time0 ? int((r.time() - time0) / (time1 - time0) * fast.size()) : 0;
+	k = k < 0 ? 0 : (k >= int(fast.size()) ? int(fast.size()) - 1 : k);
+
+	bool hit_fast = fast[k].hit(r, t_min, hit_slow ? rec.t : t_max, rec);
+
+	return hit_slow || hit_fast;
+}
+
+bool motion_bvh::bounding_box(float t0, float t1, aabb &box) const
+{
+	bool has_box = false;
+
+	box = empty_box();
+
+	auto add = [&](const motion_tree &tree)
+	{
+		if (!tree.empty())
+		{
+			grow(box, tree.nodes[0].box0);
+			grow(box, tree.nodes[0].box1);
+			has_box = true;
+		}
+	};
+
+	add(slow);
+
+	for (const motion_tree &tree : fast)
+	{
+		add(tree);
+	}
+
+	return has_box;
+}
+
+void motion_bvh::refit(float t0, float t1)
+{
+	time0 = t0;
+	time1 = t1;
+	slow.refit(t0, t1);
+
+	if (fast.empty())
+	{
+		return;
+	}
+
+	// Every segment's tree holds all the fast movers: refit them once over the whole interval, then each tree's bounds.
+	for (hitable *h : fast[0].members)
+	{
+		h->refit(t0, t1);
+	}
+
+	for (int k = 0; k < int(fast.size()); k++)
+	{
+		fast[k].fit_bounds(t0 + (t1 - t0) * k / fast.size(), t0 + (t1 - t0) * (k + 1) / fast.size());
+		fast[k].rebuild_if_degraded();
+	}
+}
+
+#endif // MOTIONBVHHPP
@@ -48,6 +48,7 @@ bool moving_sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec)
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center(r.time())) / radius;
             rec.mat_ptr = mat_ptr;
+            rec.uv_extent = 0;  // u and v aren't computed, so textures are point sampled.
 
             return true;
         }
@@ -59,6 +60,7 @@ bool moving_sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec)
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center(r.time())) / radius;
             rec.mat_ptr = mat_ptr;
+            rec.uv_extent = 0;  // u and v aren't computed, so textures are point sampled.
 
             return true;
         }
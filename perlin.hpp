@@ -2,136 +2,303 @@
 #define PERLINHPP
 
 #include "vec3.hpp"
+#include "cpu_dispatch.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <immintrin.h>
 
-/* Function to smooth out the Perlin generated noise using linear interpolation. In order to avoid "blockiness" on the
- * generated noise due to the min and max of the patttern landing exactly on the integer x/y/z, we use a trick from Ken
- * Perlin, to punt unit vectors (instead of floats) on the lattice points and use a dot product to move the min and max
- * off the lattice.
+// Seed of the Perlin tables. Changing it changes every noise texture.
+constexpr uint64_t perlin_seed = 0x2545f4914f6cdd1dull;
+
+/*
+ * Gradients and permutations of Perlin noise, in separate arrays of 32-bit values so the SIMD kernel can gather from
+ * them. Built at compile time from perlin_seed, so the noise doesn't depend on drand48() or on static initialization
+ * order.
  */
-inline float trilinear_interpolation(vec3 c[2][2][2], float u, float v, float w)
+struct perlin_tables
+{
+	float gradient_x[256];
+	float gradient_y[256];
+	float gradient_z[256];
+	int32_t perm_x[256];
+	int32_t perm_y[256];
+	int32_t perm_z[256];
+};
+
+// splitmix64, uniform in [0, 1).
+constexpr double perlin_random(uint64_t &state)
 {
-	float accumulation = 0;
+	uint64_t z = (state += 0x9e3779b97f4a7c15ull);
 
-	// Hermite Cubic interpolation to remove Mach Bands artifacts in the gnerated noise
-	float uu = u * u * (3 - 2 * u);
-	float vv = v * v * (3 - 2 * v);
-	float ww = w * w * (3 - 2 * w);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	z = z ^ (z >> 31);
 
-	for(int i = 0; i < 2; i++)
+	return double(z >> 11) / double(1ull << 53);
+}
+
+// sqrt() for constant expressions, by Newton's method.
+constexpr double perlin_sqrt(double x)
+{
+	double r = x > 1 ? x : 1;
+
+	for (int i = 0; i < 64; i++)
 	{
-		for(int j = 0; j < 2; j++)
-		{
-			for(int k = 0; k < 2; k++)
-			{
-				vec3 weight_v(u - i, v - j, w - k);
+		r = 0.5 * (r + x / r);
+	}
 
-				accumulation += (i*uu + (1-i) * (1-uu)) *
-				                (j*vv + (1-j) * (1-vv)) *
-								(k*ww + (1-k) * (1-ww)) * dot(c[i][j][k], weight_v);
-			}
-		}
+	return r;
+}
+
+constexpr void perlin_permute(int32_t *p, uint64_t &state)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		p[i] = i;
 	}
 
-	return accumulation;
+	for (int i = 255; i > 0; i--)
+	{
+		int target = int(perlin_random(state) * (i + 1));
+		int32_t tmp = p[i];
+
+		p[i] = p[target];
+		p[target] = tmp;
+	}
+}
+
+constexpr perlin_tables make_perlin_tables(uint64_t seed)
+{
+	perlin_tables t{};
+	uint64_t state = seed;
+
+	// Random unit vectors on the lattice points.
+	for (int i = 0; i < 256; i++)
+	{
+		double x = -1 + 2 * perlin_random(state);
+		double y = -1 + 2 * perlin_random(state);
+		double z = -1 + 2 * perlin_random(state);
+		double length = perlin_sqrt(x * x + y * y + z * z);
+
+		t.gradient_x[i] = float(x / length);
+		t.gradient_y[i] = float(y / length);
+		t.gradient_z[i] = float(z / length);
+	}
+
+	perlin_permute(t.perm_x, state);
+	perlin_permute(t.perm_y, state);
+	perlin_permute(t.perm_z, state);
+
+	return t;
 }
 
 /*
  * Class to generate Perlin noise, which is an algorithm to generate "natural looking" textures. It takes a 3D point as
  * input and always return the same randomish number.
+ *
+ * To avoid "blockiness" on the generated noise due to the min and max of the pattern landing exactly on the integer
+ * x/y/z, we use a trick from Ken Perlin, to put unit vectors (instead of floats) on the lattice points and use a dot
+ * product to move the min and max off the lattice. The dot products at the 8 corners of the lattice cell are then
+ * interpolated with Hermite cubic weights, which removes Mach band artifacts.
+ *
+ * noise8() evaluates 8 points per call; with AVX2 all 8 at once, gathering the permutations and gradients of each
+ * corner (see cpu_dispatch.hpp). turbulence() evaluates its octaves that way.
  */
 class perlin
 {
 	public:
 		float noise(const vec3 &p) const
 		{
-			float u = p.x() - floor(p.x());
-			float v = p.y() - floor(p.y());
-			float w = p.z() - floor(p.z());
+			float fx = floorf(p.x());
+			float fy = floorf(p.y());
+			float fz = floorf(p.z());
+			float u = p.x() - fx;
+			float v = p.y() - fy;
+			float w = p.z() - fz;
+			int i = int(fx);
+			int j = int(fy);
+			int k = int(fz);
+			int x0 = tables.perm_x[i & 255];
+			int x1 = tables.perm_x[(i + 1) & 255];
+			int y0 = tables.perm_y[j & 255];
+			int y1 = tables.perm_y[(j + 1) & 255];
+			int z0 = tables.perm_z[k & 255];
+			int z1 = tables.perm_z[(k + 1) & 255];
 
-			int i = floor(p.x());
-			int j = floor(p.y());
-			int k = floor(p.z());
+			float c000 = corner(x0 ^ y0 ^ z0, u, v, w);
+			float c001 = corner(x0 ^ y0 ^ z1, u, v, w - 1);
+			float c010 = corner(x0 ^ y1 ^ z0, u, v - 1, w);
+			float c011 = corner(x0 ^ y1 ^ z1, u, v - 1, w - 1);
+			float c100 = corner(x1 ^ y0 ^ z0, u - 1, v, w);
+			float c101 = corner(x1 ^ y0 ^ z1, u - 1, v, w - 1);
+			float c110 = corner(x1 ^ y1 ^ z0, u - 1, v - 1, w);
+			float c111 = corner(x1 ^ y1 ^ z1, u - 1, v - 1, w - 1);
 
-			vec3 c[2][2][2];
+			float uu = u * u * (3 - 2 * u);
+			float vv = v * v * (3 - 2 * v);
+			float ww = w * w * (3 - 2 * w);
 
-			for(int di = 0; di < 2; di++)
-			{
-				for(int dj = 0; dj < 2; dj++)
-				{
-					for(int dk = 0; dk < 2; dk++)
-					{
-						c[di][dj][dk] = rand_vector[perm_x[(i + di) & 255] ^ perm_y[(j + dj) & 255] ^ perm_z[(k + dk) & 255]];
-					}
-				}
-			}
-
-			return trilinear_interpolation(c, u, v, w);
+			return lerp(lerp(lerp(c000, c001, ww), lerp(c010, c011, ww), vv),
+			            lerp(lerp(c100, c101, ww), lerp(c110, c111, ww), vv), uu);
 		}
 
-		float turbulence(const vec3 &p,  int depth = 7) const
+		// Noise at the 8 points (x[i], y[i], z[i]), into out[i].
+		static void noise8(const float *x, const float *y, const float *z, float *out);
+
+		float turbulence(const vec3 &p, int depth = 7) const
 		{
 			float accumulation = 0;
 			float weight = 1.0;
 			vec3 temp_p = p;
 
-			for(int i = 0; i < depth; i++)
+			if (kernel_isa < ISA_AVX2)
 			{
-				accumulation += weight * noise(temp_p);
-				weight *= 0.5;
-				temp_p *= 2.0;
+				for (int i = 0; i < depth; i++)
+				{
+					accumulation += weight * noise(temp_p);
+					weight *= 0.5;
+					temp_p *= 2.0;
+				}
+
+				return fabs(accumulation);
+			}
+
+			// Up to 8 octaves per noise8() call, spare lanes at the origin.
+			for (int first = 0; first < depth; first += 8)
+			{
+				int octaves = depth - first < 8 ? depth - first : 8;
+				float x[8] = {}, y[8] = {}, z[8] = {}, n[8];
+
+				for (int i = 0; i < octaves; i++)
+				{
+					x[i] = temp_p.x();
+					y[i] = temp_p.y();
+					z[i] = temp_p.z();
+					temp_p *= 2.0;
+				}
+
+				noise8(x, y, z, n);
+
+				for (int i = 0; i < octaves; i++)
+				{
+					accumulation += weight * n[i];
+					weight *= 0.5;
+				}
 			}
 
 			return fabs(accumulation);
 		}
 
-		static vec3 *rand_vector;
-		static int *perm_x;
-		static int *perm_y;
-		static int *perm_z;
+		static constexpr perlin_tables tables = make_perlin_tables(perlin_seed);
+
+	private:
+		static float lerp(float a, float b, float t)
+		{
+			return a + t * (b - a);
+		}
+
+		static float corner(int h, float du, float dv, float dw)
+		{
+			return tables.gradient_x[h] * du + tables.gradient_y[h] * dv + tables.gradient_z[h] * dw;
+		}
+
+		static void noise8_scalar(const float *x, const float *y, const float *z, float *out);
+		static void noise8_avx2(const float *x, const float *y, const float *z, float *out);
 };
 
-static vec3 * perlin_generate()
+void perlin::noise8_scalar(const float *x, const float *y, const float *z, float *out)
 {
-	vec3 *p = new vec3[256];
-	for (int i = 0; i < 256; ++i)
+	perlin noise;
+
+	for (int i = 0; i < 8; i++)
 	{
-		p[i] = unit_vector(vec3( -1 + 2 * drand48(),  -1 + 2 * drand48(),  -1 + 2 * drand48()));
+		out[i] = noise.noise(vec3(x[i], y[i], z[i]));
 	}
+}
+
+// Dot product of the gradient at lattice hash "h" with the offset (du, dv, dw), in 8 lanes.
+TARGET_AVX2 inline __attribute__((always_inline)) __m256 perlin_corner8(__m256i h, __m256 du, __m256 dv, __m256 dw)
+{
+	__m256 gx = _mm256_i32gather_ps(perlin::tables.gradient_x, h, 4);
+	__m256 gy = _mm256_i32gather_ps(perlin::tables.gradient_y, h, 4);
+	__m256 gz = _mm256_i32gather_ps(perlin::tables.gradient_z, h, 4);
 
-	return p;
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gx, du), _mm256_mul_ps(gy, dv)), _mm256_mul_ps(gz, dw));
 }
 
-void permute(int *p, int n)
+TARGET_AVX2 inline __attribute__((always_inline)) __m256 perlin_lerp8(__m256 a, __m256 b, __m256 t)
 {
-	for(int i = n-1; i > 0; i--)
-	{
-		int target = int(drand48() * (i + 1));
-		int tmp = p[i];
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
 
-		p[i] = p[target];
-		p[target] = tmp;
-	}
+// Hermite cubic t * t * (3 - 2 * t), in 8 lanes.
+TARGET_AVX2 inline __attribute__((always_inline)) __m256 perlin_smooth8(__m256 t)
+{
+	__m256 cubic = _mm256_sub_ps(_mm256_set1_ps(3), _mm256_mul_ps(_mm256_set1_ps(2), t));
 
-	return;
+	return _mm256_mul_ps(_mm256_mul_ps(t, t), cubic);
 }
 
-static int * perlin_generate_permute()
+TARGET_AVX2 void perlin::noise8_avx2(const float *x, const float *y, const float *z, float *out)
 {
-	int *p = new int[256];
+	__m256 px = _mm256_loadu_ps(x);
+	__m256 py = _mm256_loadu_ps(y);
+	__m256 pz = _mm256_loadu_ps(z);
+	__m256 fx = _mm256_floor_ps(px);
+	__m256 fy = _mm256_floor_ps(py);
+	__m256 fz = _mm256_floor_ps(pz);
+	__m256 u = _mm256_sub_ps(px, fx);
+	__m256 v = _mm256_sub_ps(py, fy);
+	__m256 w = _mm256_sub_ps(pz, fz);
+	__m256 one = _mm256_set1_ps(1);
+	__m256 u1 = _mm256_sub_ps(u, one);
+	__m256 v1 = _mm256_sub_ps(v, one);
+	__m256 w1 = _mm256_sub_ps(w, one);
 
-	for(int i = 0; i < 256; i++)
-	{
-		p[i] = i;
-	}
+	__m256i mask = _mm256_set1_epi32(255);
+	__m256i next = _mm256_set1_epi32(1);
+	__m256i i = _mm256_cvttps_epi32(fx);
+	__m256i j = _mm256_cvttps_epi32(fy);
+	__m256i k = _mm256_cvttps_epi32(fz);
+	__m256i x0 = _mm256_i32gather_epi32(tables.perm_x, _mm256_and_si256(i, mask), 4);
+	__m256i x1 = _mm256_i32gather_epi32(tables.perm_x, _mm256_and_si256(_mm256_add_epi32(i, next), mask), 4);
+	__m256i y0 = _mm256_i32gather_epi32(tables.perm_y, _mm256_and_si256(j, mask), 4);
+	__m256i y1 = _mm256_i32gather_epi32(tables.perm_y, _mm256_and_si256(_mm256_add_epi32(j, next), mask), 4);
+	__m256i z0 = _mm256_i32gather_epi32(tables.perm_z, _mm256_and_si256(k, mask), 4);
+	__m256i z1 = _mm256_i32gather_epi32(tables.perm_z, _mm256_and_si256(_mm256_add_epi32(k, next), mask), 4);
+	__m256i x0y0 = _mm256_xor_si256(x0, y0);
+	__m256i x0y1 = _mm256_xor_si256(x0, y1);
+	__m256i x1y0 = _mm256_xor_si256(x1, y0);
+	__m256i x1y1 = _mm256_xor_si256(x1, y1);
+
+	__m256 c000 = perlin_corner8(_mm256_xor_si256(x0y0, z0), u, v, w);
+	__m256 c001 = perlin_corner8(_mm256_xor_si256(x0y0, z1), u, v, w1);
+	__m256 c010 = perlin_corner8(_mm256_xor_si256(x0y1, z0), u, v1, w);
+	__m256 c011 = perlin_corner8(_mm256_xor_si256(x0y1, z1), u, v1, w1);
+	__m256 c100 = perlin_corner8(_mm256_xor_si256(x1y0, z0), u1, v, w);
+	__m256 c101 = perlin_corner8(_mm256_xor_si256(x1y0, z1), u1, v, w1);
+	__m256 c110 = perlin_corner8(_mm256_xor_si256(x1y1, z0), u1, v1, w);
+	__m256 c111 = perlin_corner8(_mm256_xor_si256(x1y1, z1), u1, v1, w1);
 
-	permute(p, 256);
+	__m256 uu = perlin_smooth8(u);
+	__m256 vv = perlin_smooth8(v);
+	__m256 ww = perlin_smooth8(w);
+	__m256 c0 = perlin_lerp8(perlin_lerp8(c000, c001, ww), perlin_lerp8(c010, c011, ww), vv);
+	__m256 c1 = perlin_lerp8(perlin_lerp8(c100, c101, ww), perlin_lerp8(c110, c111, ww), vv);
 
-	return p;
+	_mm256_storeu_ps(out, perlin_lerp8(c0, c1, uu));
 }
 
-vec3 *perlin::rand_vector = perlin_generate();
-int *perlin::perm_x = perlin_generate_permute();
-int *perlin::perm_y = perlin_generate_permute();
-int *perlin::perm_z = perlin_generate_permute();
+void perlin::noise8(const float *x, const float *y, const float *z, float *out)
+{
+	switch (kernel_isa)
+	{
+		case ISA_AVX512:
+		case ISA_AVX2:
+			return noise8_avx2(x, y, z, out);
+		default:
+			return noise8_scalar(x, y, z, out);
+	}
+}
 
-#endif // PERLINHPP
\ No newline at end of file
+#endif // PERLINHPP
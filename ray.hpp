@@ -11,6 +11,8 @@ class ray
             A = a;
             B = b;
             exist_time = ti;
+
+            precompute();
         }
 
         vec3 origin() const
@@ -33,9 +35,50 @@ class ray
             return A + t * B;
         }
 
+        // Width of the ray's footprint at "t", 0 for rays without one.
+        float footprint(float t) const
+        {
+            return spread > 0 ? width + spread * t * B.length() : width;
+        }
+
+        /*
+         * Continue the footprint of "parent" from its point at "t", for a ray leaving a surface there. Mirror
+         * reflection and refraction off a flat surface keep the spread; curvature and diffuse bounces would widen it,
+         * which is ignored, so those rays pick sharper texture levels than they could.
+         */
+        void inherit_footprint(const ray &parent, float t)
+        {
+            width = parent.footprint(t);
+            spread = parent.spread;
+        }
+
+        /*
+         * Per-ray constants used by the slab test in aabb::hit, computed once here instead of at every BVH node the
+         * ray visits. A zero direction component gives an infinite reciprocal, with which the slab test culls boxes
+         * the ray passes beside on that axis (see aabb::hit).
+         */
+        void precompute()
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                inv_B[a] = 1.0f / B[a];
+                sign[a] = inv_B[a] < 0.0f;
+            }
+        }
+
         vec3 A;  // Ray origin.
         vec3 B;  // Ray direction.
         float exist_time;  // Time
+        vec3 inv_B;  // 1 / direction, per axis.
+        int sign[3];  // 1 if the direction is negative on that axis. Selects the near/far slab without branching.
+
+        /*
+         * Ray differentials in their isotropic form (a ray cone): the distance to the rays through the neighbouring
+         * pixels is "width" at the origin and grows by "spread" per unit of distance. Textures use it to pick a mip
+         * level. Zero for rays that don't track it.
+         */
+        float width = 0;
+        float spread = 0;
 };
 
 #endif /* RAYHPP */
@@ -0,0 +1,357 @@
+#ifndef RENDERHPP
+#define RENDERHPP
+
+#include "hitable.hpp"
+#include "camera.hpp"
+#include "material.hpp"
+#include "aarect.hpp"
+#include "thread_pool.hpp"
+#include "scene_features.hpp"
+#include "scene_compiler.hpp"
+#include "cpu_dispatch.hpp"
+#include <immintrin.h>
+#include <string.h>
+#include <functional>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// Image size and sample count of a render. The defaults are the ones main() has always used.
+struct render_settings
+{
+	int nx = 800;
+	int ny = 800;
+	int ns = 100; // Number of samples
+	unsigned features = FEATURE_ALL;  // scene_feature bits the scene uses, set by open_scene().
+};
+
+inline vec3 de_nan(const vec3& c) {
+    vec3 temp = c;
+    if (!(temp[0] == temp[0])) temp[0] = 0;
+    if (!(temp[1] == temp[1])) temp[1] = 0;
+    if (!(temp[2] == temp[2])) temp[2] = 0;
+    return temp;
+}
+
+// Closest hit of a camera or bounce ray. A compiled_scene gets the traversal specialized on the same features.
+template<unsigned features>
+inline bool world_hit(const hitable *world, const ray &r, hit_record &rec)
+{
+    return world->hit(r, 0.001, FLT_MAX, rec);
+}
+
+template<unsigned features>
+inline bool world_hit(const compiled_scene *world, const ray &r, hit_record &rec)
+{
+    return world->hit_with<features>(r, 0.001, FLT_MAX, rec);
+}
+
+/*
+ * Radiance along "r", for a scene using only "features" (scene_feature bits). "world_type" is hitable, or
+ * compiled_scene for the specialized traversal.
+ */
+template<unsigned features, typename world_type>
+vec3 trace(const ray &r, const world_type *world, int depth)
+{
+    // Nothing emits and the background is black, so every path carries zero.
+    if (!(features & FEATURE_AREA_LIGHTS))
+    {
+        return vec3(0, 0, 0);
+    }
+
+    hit_record rec;
+
+    if(world_hit<features>(world, r, rec))
+    {
+        ray scattered;
+        vec3 attenuation;
+
+        // If the material in the hitpoint is an emitting material, the color emitted affects on the returned value.
+        vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+
+        // Probability Density Function (PDF).
+        float pdf_val;
+        vec3 albedo;
+
+        if(depth < 50 && rec.mat_ptr->scatter(r, rec, albedo, scattered, pdf_val))
+        {
+            xz_rect light_shape(213, 343, 227, 332, 554, 0);
+            hitable_pdf pdf_0(&light_shape, rec.p);
+            cosine_pdf pdf_1(rec.normal);
+            mixture_pdf mix_p(&pdf_0, &pdf_1);
+
+            // We override whatever value was written in the material call to "scatter()"
+            scattered = ray(rec.p, mix_p.generate(), r.time());
+            scattered.inherit_footprint(r, rec.t);
+
+            pdf_val = mix_p.value(scattered.direction());
+
+            // Color = (Albdo * scattering_pdf(direction) * color(direction)) / pdf(direction)
+            return emitted + albedo * rec.mat_ptr->scattering_pdf(r, rec, scattered)
+                   * trace<features>(scattered, world, depth + 1) / pdf_val;
+            // If we want to just map a texture image, return just "attenuation".
+            // return attenuation;
+        }
+        else
+        {
+            return emitted;
+        }
+    }
+    else
+    {
+        // Blackground is black (it was different in earlier stages of the raytracer).
+        return vec3(0, 0, 0);
+    }
+}
+
+vec3 color(const ray &r, hitable *world, int depth)
+{
+    return trace<FEATURE_ALL>(r, world, depth);
+}
+
+// Rectangle of pixels [x0, x1) x [y0, y1), with y counted from the top row of the image.
+struct tile
+{
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+};
+
+std::vector<tile> make_tiles(int nx, int ny, int size)
+{
+	std::vector<tile> tiles;
+
+	for (int y = 0; y < ny; y += size)
+	{
+		for (int x = 0; x < nx; x += size)
+		{
+			tiles.push_back({x, y, x + size < nx ? x + size : nx, y + size < ny ? y + size : ny});
+		}
+	}
+
+	return tiles;
+}
+
+/*
+ * Tonemapping of "n" channel sums of "samples" samples each into 8-bit values: average, gamma 2 (sqrt), scale by
+ * 255.99 and clamp, with the same rounding as the scalar version so every ISA writes the same bytes.
+ */
+inline __attribute__((always_inline)) void tonemap_row_scalar(const float *in, unsigned char *out, int n, int samples)
+{
+	float k = 1.0 / float(samples);
+
+	for (int i = 0; i < n; i++)
+	{
+		float v = sqrtf(in[i] * k);
+		int value = int(255.99 * v);
+
+		out[i] = value > 255 ? 255 : value;
+	}
+}
+
+TARGET_SSE42 void tonemap_row_sse42(const float *in, unsigned char *out, int n, int samples)
+{
+	float k = 1.0 / float(samples);
+	__m128 scale = _mm_set1_ps(k);
+	__m128d gain = _mm_set1_pd(255.99);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_sqrt_ps(_mm_mul_ps(_mm_loadu_ps(&in[i]), scale));
+		__m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(v), gain));
+		__m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), gain));
+		__m128i values = _mm_min_epi32(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi32(255));
+		__m128i bytes = _mm_packus_epi16(_mm_packus_epi32(values, values), _mm_setzero_si128());
+
+		int word = _mm_cvtsi128_si32(bytes);
+		memcpy(&out[i], &word, 4);
+	}
+
+	tonemap_row_scalar(&in[i], &out[i], n - i, samples);
+}
+
+TARGET_AVX2 void tonemap_row_avx2(const float *in, unsigned char *out, int n, int samples)
+{
+	float k = 1.0 / float(samples);
+	__m256 scale = _mm256_set1_ps(k);
+	__m256d gain = _mm256_set1_pd(255.99);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v = _mm256_sqrt_ps(_mm256_mul_ps(_mm256_loadu_ps(&in[i]), scale));
+		__m128i lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), gain));
+		__m128i hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), gain));
+		__m128i cap = _mm_set1_epi32(255);
+		__m128i words = _mm_packus_epi32(_mm_min_epi32(lo, cap), _mm_min_epi32(hi, cap));
+
+		_mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(words, words));
+	}
+
+	tonemap_row_scalar(&in[i], &out[i], n - i, samples);
+}
+
+/*
+ * 8 channels a step, widened to doubles in one 512-bit register; masked loads and stores cover the tail. Negative and
+ * NaN sums truncate to INT_MIN, so values are clamped to [0, 255] before the truncating byte store, as the scalar
+ * version does.
+ */
+TARGET_AVX512 void tonemap_row_avx512(const float *in, unsigned char *out, int n, int samples)
+{
+	float k = 1.0 / float(samples);
+	__m256 scale = _mm256_set1_ps(k);
+	__m512d gain = _mm512_set1_pd(255.99);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i cap = _mm256_set1_epi32(255);
+
+	for (int i = 0; i < n; i += 8)
+	{
+		__mmask8 lanes = n - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (n - i)) - 1);
+		__m256 v = _mm256_sqrt_ps(_mm256_mul_ps(_mm256_maskz_loadu_ps(lanes, &in[i]), scale));
+		__m256i values = _mm512_maskz_cvttpd_epi32(0xff, _mm512_mul_pd(_mm512_maskz_cvtps_pd(0xff, v), gain));
+
+		_mm256_mask_cvtepi32_storeu_epi8(&out[i], lanes, _mm256_min_epi32(_mm256_max_epi32(values, zero), cap));
+	}
+}
+
+// The version of the tonemapper for kernel_isa.
+void tonemap_row(const float *in, unsigned char *out, int n, int samples)
+{
+	switch (kernel_isa)
+	{
+		case ISA_AVX512:
+			return tonemap_row_avx512(in, out, n, samples);
+		case ISA_AVX2:
+			return tonemap_row_avx2(in, out, n, samples);
+		case ISA_SSE42:
+			return tonemap_row_sse42(in, out, n, samples);
+		default:
+			return tonemap_row_scalar(in, out, n, samples);
+	}
+}
+
+/*
+ * Trace one tile into "rgb", a top-down image of nx * ny pixels with 3 bytes each. Gamma 2 is applied and values are
+ * clamped to 255. Instantiated per feature mask and world type, see select_tile_kernel().
+ */
+template<unsigned features, typename world_type>
+void render_tile(hitable *scene, const camera &cam, const render_settings &settings, const tile &t, unsigned char *rgb)
+{
+    const world_type *world = static_cast<const world_type *>(scene);
+    const bool lens = features & FEATURE_DEPTH_OF_FIELD;
+    const bool shutter = features & FEATURE_MOTION_BLUR;
+
+    std::vector<float> sums((t.x1 - t.x0) * 3);
+
+    for (int y = t.y0; y < t.y1; y++)
+    {
+        // The camera counts rows from the bottom of the image.
+        int j = settings.ny - 1 - y;
+        unsigned char *row = &rgb[settings.nx * y * 3];
+
+        for (int i = t.x0; i < t.x1; i++)
+        {
+            vec3 col{0, 0, 0};
+
+            for(int s = 0; s < settings.ns; s++)
+            {
+                float u = float(i + drand48()) / float(settings.nx);
+                float v = float(j + drand48()) / float(settings.ny);
+
+                ray r = cam.get_ray<lens, shutter>(u, v);
+                col += de_nan(trace<features>(r, world, 0));
+            }
+
+            // Access the current pixel to store. There are 3 components per pixel.
+            for (int c = 0; c < 3; c++)
+            {
+                sums[(i - t.x0) * 3 + c] = col[c];
+            }
+        }
+
+        tonemap_row(sums.data(), &row[t.x0 * 3], int(sums.size()), settings.ns);
+    }
+}
+
+typedef void (*tile_kernel)(hitable *world, const camera &cam, const render_settings &settings, const tile &t,
+                            unsigned char *rgb);
+
+// One render_tile() per feature mask, indexed by the mask. Bits outside kernel_feature_mask share instantiations.
+template<typename world_type, size_t... masks>
+const tile_kernel *tile_kernels(std::index_sequence<masks...>)
+{
+	static const tile_kernel kernels[] = {render_tile<masks & kernel_feature_mask, world_type>...};
+
+	return kernels;
+}
+
+// render_tile() for "world" compiled with only the given features.
+tile_kernel select_tile_kernel(hitable *world, unsigned features)
+{
+	std::make_index_sequence<FEATURE_ALL + 1> masks;
+
+	if (dynamic_cast<compiled_scene *>(world))
+	{
+		return tile_kernels<compiled_scene>(masks)[features & FEATURE_ALL];
+	}
+
+	return tile_kernels<hitable>(masks)[features & FEATURE_ALL];
+}
+
+// Features a render with "cam" needs: the scene's, plus depth of field if the camera has an aperture.
+unsigned render_features(const render_settings &settings, const camera &cam)
+{
+	unsigned features = settings.features & ~FEATURE_DEPTH_OF_FIELD;
+
+	return cam.lens_radius > 0 ? features | FEATURE_DEPTH_OF_FIELD : features;
+}
+
+/*
+ * Render the whole image on the pool with "kernel", one task per tile. "on_tile" (optional) is called from the worker
+ * thread that finished each tile, so it must be thread-safe.
+ */
+void render_image_with(tile_kernel kernel, thread_pool &pool, hitable *world, const camera &cam,
+                       const render_settings &settings, unsigned char *rgb,
+                       std::function<void(const tile &)> on_tile = nullptr)
+{
+	std::vector<tile> tiles = make_tiles(settings.nx, settings.ny, 32);
+	task_group group(pool);
+
+	for (const tile &t : tiles)
+	{
+		group.run([&, t]()
+		{
+			kernel(world, cam, settings, t, rgb);
+
+			if (on_tile)
+			{
+				on_tile(t);
+			}
+		});
+	}
+
+	group.wait();
+}
+
+// render_image_with() the kernel specialized for the features of the scene and camera.
+void render_image(thread_pool &pool, hitable *world, const camera &cam, const render_settings &settings,
+                  unsigned char *rgb, std::function<void(const tile &)> on_tile = nullptr)
+{
+	tile_kernel kernel = select_tile_kernel(world, render_features(settings, cam));
+
+	render_image_with(kernel, pool, world, cam, settings, rgb, on_tile);
+}
+
+void write_ppm(std::ostream &out, const unsigned char *rgb, int nx, int ny)
+{
+	out << "P3\n" << nx << " " << ny << "\n255\n";
+
+	for (int p = 0; p < nx * ny; p++)
+	{
+		out << int(rgb[p*3 + 0]) << " " << int(rgb[p*3 + 1]) << " " << int(rgb[p*3 + 2]) << "\n";
+	}
+}
+
+#endif // RENDERHPP
@@ -0,0 +1,559 @@
+#ifndef RENDERSERVERHPP
+#define RENDERSERVERHPP
+
+#include "render.hpp"
+#include "scene_file.hpp"
+#include "thread_pool.hpp"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Long-running render daemon. Keeps the thread pool and every scene it has built alive between jobs, so a camera tweak
+ * on an already loaded scene only pays for the rays.
+ *
+ * Protocol, over a UNIX domain stream socket. Every message is a frame:
+ *
+ *     uint32 length   (payload bytes, host byte order)
+ *     uint8  type
+ *     length bytes of payload
+ *
+ * Client -> server
+ *     JOB       Text payload, one "key value..." pair per line. Keys: scene, lookfrom x y z, lookat x y z, vup x y z,
+ *               vfov, aperture, focus_dist, time0, time1, width, height, spp, output. Only "scene" and "output" are
+ *               required; "scene" is a built-in name or a scene file path. The camera and image settings default to
+ *               the scene's own.
+ *
+ * Server -> client, for each job
+ *     PROGRESS  uint32 tiles_done, uint32 tiles_total. Sent after every tile.
+ *     TILE      uint32 x, y, width, height, then width * height RGB bytes, rows top to bottom. "y" counts from the top.
+ *     DONE      Path the finished image was written to (PPM).
+ *     ERROR     Text message. The connection stays open for further jobs.
+ *
+ * A connection may send any number of jobs, one after the other. Each connection is served by its own thread and
+ * tiles of concurrent jobs share the pool.
+ *
+ * Frames go out through a queue per connection, written by a thread of its own, so render workers never wait on a
+ * client's socket. While a client is more than max_send_backlog bytes behind, its TILE and PROGRESS frames are
+ * dropped; DONE and ERROR always follow, and the image is in the output file either way. A client that reads nothing
+ * for send_timeout_seconds is disconnected.
+ */
+enum message_type : uint8_t
+{
+	MSG_JOB = 1,
+	MSG_PROGRESS = 16,
+	MSG_TILE = 17,
+	MSG_DONE = 18,
+	MSG_ERROR = 19
+};
+
+// Larger job frames are rejected. A job is a handful of text lines.
+const uint32_t max_job_frame = 1 << 16;
+
+// Bytes of frames a connection may have queued before its progress updates are dropped.
+const size_t max_send_backlog = size_t(16) << 20;
+
+// A send() that makes no progress for this long drops the connection.
+const int send_timeout_seconds = 30;
+
+class render_server
+{
+	public:
+		render_server(const std::string &path, thread_pool &p) : socket_path(path), pool(p) {}
+
+		// Accept connections until the process is killed. Returns non-zero if the socket could not be set up.
+		int run();
+
+	private:
+		struct loaded_scene
+		{
+			scene_arena arena;
+			hitable *world;
+			camera_settings cam;
+			render_settings settings;
+			bool from_file;   // A scene file, not a built-in scene.
+			file_stamp stamp;  // Of the scene file when it was read.
+			std::string error;  // Why "world" is null.
+		};
+
+		// Outgoing side of a client connection: frames are queued and sent by the connection's writer thread.
+		struct connection
+		{
+			explicit connection(int f);
+			~connection();
+
+			/*
+			 * Queue a frame. Updates (TILE, PROGRESS) are dropped while more than max_send_backlog bytes wait, and
+			 * every frame is dropped once the socket has failed.
+			 */
+			void post(uint8_t type, const void *payload, uint32_t len, bool update = false);
+
+			void write_frames();
+
+			int fd;
+			std::mutex lock;
+			std::condition_variable ready;
+			std::deque<std::string> frames;
+			size_t backlog = 0;
+			uint64_t dropped = 0;
+			bool closing = false;
+			bool broken = false;
+			std::thread writer;
+		};
+
+		void serve(int fd);
+		void run_job(connection &conn, const std::string &request);
+		std::shared_ptr<loaded_scene> warm_scene(const std::string &name, std::string &error);
+
+		std::string socket_path;
+		thread_pool &pool;
+		std::mutex scenes_mutex;
+		// Built or being built. Jobs hold the scene they render, so a rebuild can replace it under them.
+		std::map<std::string, std::shared_future<std::shared_ptr<loaded_scene>>> scenes;
+};
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+	const char *p = static_cast<const char *>(data);
+
+	while (len > 0)
+	{
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n <= 0)
+		{
+			return false;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+	char *p = static_cast<char *>(data);
+
+	while (len > 0)
+	{
+		ssize_t n = recv(fd, p, len, 0);
+
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n <= 0)
+		{
+			return false;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+render_server::connection::connection(int f) : fd(f)
+{
+	timeval timeout = {send_timeout_seconds, 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	writer = std::thread(&connection::write_frames, this);
+}
+
+// Sends what is still queued, then stops the writer. The socket stays open for the caller to close.
+render_server::connection::~connection()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closing = true;
+	}
+
+	ready.notify_one();
+	writer.join();
+
+	if (dropped)
+	{
+		std::cerr << "render server: dropped " << dropped << " progress frames for a client that fell behind\n";
+	}
+}
+
+void render_server::connection::post(uint8_t type, const void *payload, uint32_t len, bool update)
+{
+	std::string frame(sizeof(len) + sizeof(type) + len, '\0');
+
+	memcpy(&frame[0], &len, sizeof(len));
+	memcpy(&frame[sizeof(len)], &type, sizeof(type));
+	memcpy(&frame[sizeof(len) + sizeof(type)], payload, len);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (broken || (update && backlog > max_send_backlog))
+		{
+			dropped += update;
+			return;
+		}
+
+		backlog += frame.size();
+		frames.push_back(std::move(frame));
+	}
+
+	ready.notify_one();
+}
+
+void render_server::connection::write_frames()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	for (;;)
+	{
+		ready.wait(guard, [this] { return closing || !frames.empty(); });
+
+		if (frames.empty())
+		{
+			return;
+		}
+
+		std::string frame = std::move(frames.front());
+
+		frames.pop_front();
+		guard.unlock();
+
+		bool sent = write_all(fd, frame.data(), frame.size());
+
+		guard.lock();
+		backlog -= frame.size();
+
+		if (!sent)
+		{
+			// The client went away or stopped reading: drop what is queued and end the connection's reads too.
+			broken = true;
+			backlog = 0;
+			frames.clear();
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+}
+
+int render_server::run()
+{
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listener < 0)
+	{
+		std::cerr << "render server: socket(): " << strerror(errno) << "\n";
+		return 1;
+	}
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socket_path.size() >= sizeof(addr.sun_path))
+	{
+		std::cerr << "render server: socket path too long\n";
+		close(listener);
+		return 1;
+	}
+
+	strcpy(addr.sun_path, socket_path.c_str());
+	unlink(socket_path.c_str());
+
+	if (bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 8) < 0)
+	{
+		std::cerr << "render server: cannot listen on " << socket_path << ": " << strerror(errno) << "\n";
+		close(listener);
+		return 1;
+	}
+
+	std::cerr << "render server: listening on " << socket_path << " with " << pool.size() << " threads\n";
+
+	for (;;)
+	{
+		int fd = accept(listener, nullptr, nullptr);
+
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			std::cerr << "render server: accept(): " << strerror(errno) << "\n";
+			break;
+		}
+
+		std::thread(&render_server::serve, this, fd).detach();
+	}
+
+	close(listener);
+
+	return 1;
+}
+
+void render_server::serve(int fd)
+{
+	{
+		connection conn(fd);
+
+		for (;;)
+		{
+			uint32_t len;
+			uint8_t type;
+
+			if (!read_all(fd, &len, sizeof(len)) || !read_all(fd, &type, sizeof(type)))
+			{
+				break;
+			}
+
+			if (type != MSG_JOB || len > max_job_frame)
+			{
+				const char *msg = "expected a JOB frame";
+				conn.post(MSG_ERROR, msg, strlen(msg));
+				break;
+			}
+
+			std::string request(len, '\0');
+
+			if (!read_all(fd, &request[0], len))
+			{
+				break;
+			}
+
+			run_job(conn, request);
+		}
+	}
+
+	close(fd);
+}
+
+/*
+ * Build a scene the first time it is asked for and keep it. Later jobs on the same scene start tracing right away, and
+ * jobs asking for it while it builds wait for that build. The build runs outside scenes_mutex, so jobs on other scenes
+ * go on meanwhile. A scene file that changed since it was built is built again.
+ */
+std::shared_ptr<render_server::loaded_scene> render_server::warm_scene(const std::string &name, std::string &error)
+{
+	file_stamp stamp;
+	bool from_file = !find_scene(name.c_str()) && get_file_stamp(name, stamp);
+	std::promise<std::shared_ptr<loaded_scene>> building;
+	std::shared_future<std::shared_ptr<loaded_scene>> scene;
+	bool build = false;
+
+	{
+		std::lock_guard<std::mutex> lock(scenes_mutex);
+		auto found = scenes.find(name);
+
+		if (found != scenes.end())
+		{
+			scene = found->second;
+
+			// A build still running is waited for, even if the file changed again since it started.
+			if (scene.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			{
+				const loaded_scene &built = *scene.get();
+
+				if (from_file != built.from_file || (from_file && (stamp.size != built.stamp.size ||
+				                                                   stamp.mtime_ns != built.stamp.mtime_ns)))
+				{
+					scene = std::shared_future<std::shared_ptr<loaded_scene>>();
+				}
+			}
+		}
+
+		if (!scene.valid())
+		{
+			scene = building.get_future().share();
+			scenes[name] = scene;
+			build = true;
+		}
+	}
+
+	if (build)
+	{
+		std::shared_ptr<loaded_scene> built = std::make_shared<loaded_scene>();
+
+		built->from_file = from_file;
+		built->stamp = stamp;
+		built->world = open_scene(name, built->arena, built->cam, built->settings, built->error);
+
+		if (!built->world)
+		{
+			// Not kept, so the next job tries again. Only a finished build is replaced, so the entry is still this one.
+			std::lock_guard<std::mutex> lock(scenes_mutex);
+			scenes.erase(name);
+		}
+
+		building.set_value(built);
+	}
+
+	if (!scene.get()->world)
+	{
+		error = scene.get()->error;
+		return nullptr;
+	}
+
+	return scene.get();
+}
+
+void render_server::run_job(connection &conn, const std::string &request)
+{
+	std::istringstream lines(request);
+	std::string line;
+	std::string scene_name;
+	std::string output;
+	std::string error;
+	std::shared_ptr<loaded_scene> scene;
+	camera_settings cam_settings;
+	render_settings settings;
+	bool has_camera = false;
+
+	auto fail = [&conn](const std::string &msg)
+	{
+		conn.post(MSG_ERROR, msg.data(), msg.size());
+	};
+
+	// The scene line must be known before camera overrides can be applied on top of its defaults.
+	while (std::getline(lines, line))
+	{
+		std::istringstream fields(line);
+		std::string key;
+
+		if ((fields >> key) && key == "scene")
+		{
+			fields >> scene_name;
+		}
+	}
+
+	scene = warm_scene(scene_name, error);
+
+	if (!scene)
+	{
+		fail("cannot open scene '" + scene_name + "': " + error);
+		return;
+	}
+
+	cam_settings = scene->cam;
+	settings = scene->settings;
+	lines.clear();
+	lines.str(request);
+
+	while (std::getline(lines, line))
+	{
+		std::istringstream fields(line);
+		std::string key;
+
+		if (!(fields >> key) || key == "scene")
+		{
+			continue;
+		}
+
+		if (key == "lookfrom") { fields >> cam_settings.lookfrom; has_camera = true; }
+		else if (key == "lookat") { fields >> cam_settings.lookat; has_camera = true; }
+		else if (key == "vup") { fields >> cam_settings.vup; has_camera = true; }
+		else if (key == "vfov") { fields >> cam_settings.vfov; has_camera = true; }
+		else if (key == "aperture") { fields >> cam_settings.aperture; has_camera = true; }
+		else if (key == "focus_dist") { fields >> cam_settings.focus_dist; has_camera = true; }
+		else if (key == "time0") { fields >> cam_settings.time0; has_camera = true; }
+		else if (key == "time1") { fields >> cam_settings.time1; has_camera = true; }
+		else if (key == "width") fields >> settings.nx;
+		else if (key == "height") fields >> settings.ny;
+		else if (key == "spp") fields >> settings.ns;
+		else if (key == "output") fields >> output;
+		else
+		{
+			fail("unknown job key '" + key + "'");
+			return;
+		}
+
+		if (fields.fail())
+		{
+			fail("bad value for '" + key + "'");
+			return;
+		}
+	}
+
+	if (output.empty())
+	{
+		fail("missing output path");
+		return;
+	}
+
+	if (settings.nx <= 0 || settings.ny <= 0 || settings.nx > 16384 || settings.ny > 16384 || settings.ns <= 0)
+	{
+		fail("bad image size or sample count");
+		return;
+	}
+
+	hitable *world = scene->world;
+	camera cam(cam_settings, settings.nx, settings.ny);
+	std::vector<unsigned char> rgb(settings.nx * settings.ny * 3);
+	uint32_t total = make_tiles(settings.nx, settings.ny, 32).size();
+	std::atomic<uint32_t> done(0);
+
+	std::cerr << "render server: " << scene_name << (has_camera ? " (camera override) " : " ") << settings.nx
+	          << "x" << settings.ny << " " << settings.ns << "spp -> " << output << "\n";
+
+	render_image(pool, world, cam, settings, rgb.data(), [&](const tile &t)
+	{
+		uint32_t w = t.x1 - t.x0;
+		uint32_t h = t.y1 - t.y0;
+		std::vector<unsigned char> payload(4 * sizeof(uint32_t) + w * h * 3);
+		uint32_t header[4] = {uint32_t(t.x0), uint32_t(t.y0), w, h};
+
+		memcpy(payload.data(), header, sizeof(header));
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			memcpy(&payload[sizeof(header) + y * w * 3], &rgb[((t.y0 + y) * settings.nx + t.x0) * 3], w * 3);
+		}
+
+		uint32_t progress[2] = {++done, total};
+
+		// Only queued here: a slow or vanished client loses updates, never holds up the workers.
+		conn.post(MSG_TILE, payload.data(), payload.size(), true);
+		conn.post(MSG_PROGRESS, progress, sizeof(progress), true);
+	});
+
+	std::ofstream out(output.c_str());
+
+	if (!out)
+	{
+		fail("cannot write '" + output + "'");
+		return;
+	}
+
+	write_ppm(out, rgb.data(), settings.nx, settings.ny);
+	out.close();
+
+	conn.post(MSG_DONE, output.data(), output.size());
+}
+
+#endif // RENDERSERVERHPP
@@ -0,0 +1,520 @@
+#ifndef SBVHHPP
+#define SBVHHPP
+
+#include "bvh_tree.hpp"
+#include "bvh_sah.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Spatial split BVH (Stich, Friedrich and Dietrich 2009). Object splits put every primitive wholly on one side, so a
+ * primitive much larger than its neighbours (a huge boundary sphere, a long thin wall) widens every node it lands in
+ * and rays that miss it still pay for it. A spatial split cuts the node box at a plane instead; primitives crossing
+ * the plane are referenced from both children, each reference clipped to its side.
+ *
+ * Each node tries a binned object split first. A spatial split is only tried when the two halves of the best object
+ * split overlap by more than "min_overlap" of the root area, and only while the references made so far stay within
+ * the budget, (1 + budget) times the primitive count. References are clipped as boxes: builders only see primitive
+ * bounds, so the clipped reference is the part of the primitive's box on that side of the plane, which is exact for
+ * boxes and rects and conservative for spheres.
+ *
+ * The index array holds a duplicated primitive once per reference, so it is longer than the primitive count. Leaves
+ * don't clip the primitive, so a ray may hit a primitive outside the leaf's box; closest-hit traversal still finds the
+ * nearest hit, just possibly earlier.
+ */
+class sbvh_builder
+{
+	public:
+		sbvh_builder(const bvh_build_input &input, int leaf_size, float split_budget) :
+		    in(input), max_leaf(leaf_size), budget(split_budget) {}
+
+		void build(bvh_node_vector &out_nodes, std::vector<int32_t> &out_indices);
+
+		// Overlap, relative to the root area, below which spatial splits are not tried.
+		float min_overlap = 1e-5f;
+
+	private:
+		struct reference
+		{
+			aabb box;
+			int32_t prim;
+		};
+
+		struct spatial_bin
+		{
+			aabb box;
+			int entries;  // References starting in this bin.
+			int exits;    // References ending in this bin.
+		};
+
+		struct split_candidate
+		{
+			float cost = FLT_MAX;
+			int axis = -1;
+			int bin = 0;
+			aabb left;
+			aabb right;
+			int left_count = 0;
+			int right_count = 0;
+		};
+
+		split_candidate find_object_split(const std::vector<reference> &refs, const aabb &centroid_box) const;
+		split_candidate find_spatial_split(const std::vector<reference> &refs, const aabb &box) const;
+		void object_partition(std::vector<reference> &refs, const aabb &centroid_box, const split_candidate &split,
+		                      std::vector<reference> &left, std::vector<reference> &right) const;
+		void spatial_partition(std::vector<reference> &refs, const aabb &box, split_candidate &split,
+		                       std::vector<reference> &left, std::vector<reference> &right);
+		void build_node(std::vector<reference> &refs, int node, int depth);
+
+		const bvh_build_input &in;
+		int max_leaf;
+		float budget;
+		size_t max_refs = 0;
+		size_t ref_count = 0;
+		float root_area = 0;
+		bvh_node_vector *nodes = nullptr;
+		std::vector<int32_t> *indices = nullptr;
+};
+
+inline aabb clip_box(const aabb &box, int axis, float lo, float hi)
+{
+	aabb clipped = box;
+
+	clipped.m_tmin[axis] = fmax(clipped.m_tmin[axis], lo);
+	clipped.m_tmax[axis] = fmin(clipped.m_tmax[axis], hi);
+
+	return clipped;
+}
+
+inline aabb intersect_boxes(const aabb &a, const aabb &b)
+{
+	aabb box;
+
+	for (int k = 0; k < 3; k++)
+	{
+		box.m_tmin[k] = fmax(a.m_tmin[k], b.m_tmin[k]);
+		box.m_tmax[k] = fmin(a.m_tmax[k], b.m_tmax[k]);
+	}
+
+	return box;
+}
+
+inline float overlap_area(const aabb &a, const aabb &b)
+{
+	aabb box = intersect_boxes(a, b);
+
+	for (int k = 0; k < 3; k++)
+	{
+		if (box.m_tmin[k] > box.m_tmax[k])
+		{
+			return 0;
+		}
+	}
+
+	return surface_area(box);
+}
+
+sbvh_builder::split_candidate sbvh_builder::find_object_split(const std::vector<reference> &refs,
+                                                              const aabb &centroid_box) const
+{
+	split_candidate best;
+	bvh_bin bins[3][bvh_bins];
+
+	for (int a = 0; a < 3; a++)
+	{
+		float lo = centroid_box.min()[a];
+		float extent = centroid_box.max()[a] - lo;
+
+		if (extent <= 0)
+		{
+			continue;
+		}
+
+		float scale = bvh_bins / extent;
+
+		for (int b = 0; b < bvh_bins; b++)
+		{
+			bins[a][b].box = empty_box();
+			bins[a][b].count = 0;
+		}
+
+		for (const reference &ref : refs)
+		{
+			bvh_bin &b = bins[a][bin_index(0.5f * (ref.box.min()[a] + ref.box.max()[a]), lo, scale)];
+
+			grow(b.box, ref.box);
+			b.count++;
+		}
+
+		aabb right_box[bvh_bins];
+		int right_count[bvh_bins];
+		aabb acc = empty_box();
+		int n = 0;
+
+		for (int b = bvh_bins - 1; b > 0; b--)
+		{
+			grow(acc, bins[a][b].box);
+			n += bins[a][b].count;
+			right_box[b] = acc;
+			right_count[b] = n;
+		}
+
+		acc = empty_box();
+		n = 0;
+
+		for (int b = 0; b < bvh_bins - 1; b++)
+		{
+			grow(acc, bins[a][b].box);
+			n += bins[a][b].count;
+
+			if (n == 0 || right_count[b + 1] == 0)
+			{
+				continue;
+			}
+
+			float cost = n * surface_area(acc) + right_count[b + 1] * surface_area(right_box[b + 1]);
+
+			if (cost < best.cost)
+			{
+				best.cost = cost;
+				best.axis = a;
+				best.bin = b;
+				best.left = acc;
+				best.right = right_box[b + 1];
+				best.left_count = n;
+				best.right_count = right_count[b + 1];
+			}
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Bins along each axis of the node box. A reference adds its clipped box to every bin it spans, an entry to its first
+ * bin and an exit to its last, so sweeping gives the bounds and counts of both sides for every plane between bins.
+ */
+sbvh_builder::split_candidate sbvh_builder::find_spatial_split(const std::vector<reference> &refs,
+                                                               const aabb &box) const
+{
+	split_candidate best;
+	spatial_bin bins[bvh_bins];
+
+	for (int a = 0; a < 3; a++)
+	{
+		float lo = box.min()[a];
+		float extent = box.max()[a] - lo;
+
+		if (extent <= 0)
+		{
+			continue;
+		}
+
+		float scale = bvh_bins / extent;
+		float width = extent / bvh_bins;
+
+		for (int b = 0; b < bvh_bins; b++)
+		{
+			bins[b].box = empty_box();
+			bins[b].entries = 0;
+			bins[b].exits = 0;
+		}
+
+		for (const reference &ref : refs)
+		{
+			int first = bin_index(ref.box.min()[a], lo, scale);
+			int last = bin_index(ref.box.max()[a], lo, scale);
+
+			for (int b = first; b <= last; b++)
+			{
+				float bin_hi = b == bvh_bins - 1 ? box.max()[a] : lo + (b + 1) * width;
+
+				grow(bins[b].box, clip_box(ref.box, a, lo + b * width, bin_hi));
+			}
+
+			bins[first].entries++;
+			bins[last].exits++;
+		}
+
+		aabb right_box[bvh_bins];
+		int right_count[bvh_bins];
+		aabb acc = empty_box();
+		int n = 0;
+
+		for (int b = bvh_bins - 1; b > 0; b--)
+		{
+			grow(acc, bins[b].box);
+			n += bins[b].exits;
+			right_box[b] = acc;
+			right_count[b] = n;
+		}
+
+		acc = empty_box();
+		n = 0;
+
+		for (int b = 0; b < bvh_bins - 1; b++)
+		{
+			grow(acc, bins[b].box);
+			n += bins[b].entries;
+
+			if (n == 0 || right_count[b + 1] == 0)
+			{
+				continue;
+			}
+
+			float cost = n * surface_area(acc) + right_count[b + 1] * surface_area(right_box[b + 1]);
+
+			if (cost < best.cost)
+			{
+				best.cost = cost;
+				best.axis = a;
+				best.bin = b;
+				best.left = acc;
+				best.right = right_box[b + 1];
+				best.left_count = n;
+				best.right_count = right_count[b + 1];
+			}
+		}
+	}
+
+	return best;
+}
+
+void sbvh_builder::object_partition(std::vector<reference> &refs, const aabb &centroid_box,
+                                    const split_candidate &split, std::vector<reference> &left,
+                                    std::vector<reference> &right) const
+{
+	int a = split.axis;
+	float lo = centroid_box.min()[a];
+	float scale = bvh_bins / (centroid_box.max()[a] - lo);
+
+	for (const reference &ref : refs)
+	{
+		bool goes_left = bin_index(0.5f * (ref.box.min()[a] + ref.box.max()[a]), lo, scale) <= split.bin;
+
+		(goes_left ? left : right).push_back(ref);
+	}
+}
+
+/*
+ * Split at the plane after split.bin. A reference crossing the plane is duplicated unless moving it wholly to one side
+ * is cheaper ("reference unsplitting"), or the budget has run out.
+ */
+void sbvh_builder::spatial_partition(std::vector<reference> &refs, const aabb &box, split_candidate &split,
+                                     std::vector<reference> &left, std::vector<reference> &right)
+{
+	int a = split.axis;
+	float plane = box.min()[a] + (split.bin + 1) * (box.max()[a] - box.min()[a]) / bvh_bins;
+	aabb left_box = empty_box();
+	aabb right_box = empty_box();
+	std::vector<reference> straddling;
+
+	for (const reference &ref : refs)
+	{
+		if (ref.box.max()[a] <= plane)
+		{
+			left.push_back(ref);
+			grow(left_box, ref.box);
+		}
+		else if (ref.box.min()[a] >= plane)
+		{
+			right.push_back(ref);
+			grow(right_box, ref.box);
+		}
+		else
+		{
+			straddling.push_back(ref);
+		}
+	}
+
+	int left_count = left.size() + straddling.size();
+	int right_count = right.size() + straddling.size();
+
+	for (const reference &ref : straddling)
+	{
+		reference l = {clip_box(ref.box, a, -FLT_MAX, plane), ref.prim};
+		reference r = {clip_box(ref.box, a, plane, FLT_MAX), ref.prim};
+		aabb split_left = left_box;
+		aabb split_right = right_box;
+		aabb all_left = left_box;
+		aabb all_right = right_box;
+
+		grow(split_left, l.box);
+		grow(split_right, r.box);
+		grow(all_left, ref.box);
+		grow(all_right, ref.box);
+
+		float split_cost = surface_area(split_left) * left_count + surface_area(split_right) * right_count;
+		float left_cost = surface_area(all_left) * left_count + surface_area(right_box) * (right_count - 1);
+		float right_cost = surface_area(left_box) * (left_count - 1) + surface_area(all_right) * right_count;
+		bool can_duplicate = ref_count < max_refs;
+
+		if (can_duplicate && split_cost < left_cost && split_cost < right_cost)
+		{
+			left.push_back(l);
+			right.push_back(r);
+			left_box = split_left;
+			right_box = split_right;
+			ref_count++;
+		}
+		else if (left_cost <= right_cost)
+		{
+			left.push_back(ref);
+			left_box = all_left;
+			right_count--;
+		}
+		else
+		{
+			right.push_back(ref);
+			right_box = all_right;
+			left_count--;
+		}
+	}
+}
+
+void sbvh_builder::build_node(std::vector<reference> &refs, int node, int depth)
+{
+	bvh_node_vector &out = *nodes;
+	int count = refs.size();
+	aabb box = empty_box();
+	aabb centroid_box = empty_box();
+
+	for (const reference &ref : refs)
+	{
+		grow(box, ref.box);
+		grow(centroid_box, 0.5 * (ref.box.min() + ref.box.max()));
+	}
+
+	out[node].box = box;
+
+	auto make_leaf = [&]()
+	{
+		out[node].offset = indices->size();
+		out[node].count = count;
+		out[node].axis = 0;
+
+		for (const reference &ref : refs)
+		{
+			indices->push_back(ref.prim);
+		}
+	};
+
+	if (count <= 1)
+	{
+		make_leaf();
+		return;
+	}
+
+	std::vector<reference> left;
+	std::vector<reference> right;
+	float leaf_cost = count * surface_area(box);
+	split_candidate split;
+
+	// Same limit as bvh_builder: past half the stack depth only median splits, which always halve the node.
+	if (depth < bvh_max_depth / 2)
+	{
+		split = find_object_split(refs, centroid_box);
+
+		bool use_spatial = false;
+
+		if (ref_count < max_refs && (split.axis < 0 || overlap_area(split.left, split.right) > min_overlap * root_area))
+		{
+			split_candidate spatial = find_spatial_split(refs, box);
+
+			if (spatial.axis >= 0 && spatial.cost < split.cost)
+			{
+				split = spatial;
+				use_spatial = true;
+			}
+		}
+
+		if (count <= max_leaf && (split.axis < 0 || surface_area(box) + split.cost >= leaf_cost))
+		{
+			make_leaf();
+			return;
+		}
+
+		if (use_spatial)
+		{
+			spatial_partition(refs, box, split, left, right);
+		}
+		else if (split.axis >= 0)
+		{
+			object_partition(refs, centroid_box, split, left, right);
+		}
+
+		// Unsplitting can leave one side empty.
+		if (left.empty() || right.empty())
+		{
+			left.clear();
+			right.clear();
+			split.axis = -1;
+		}
+	}
+
+	if (left.empty())
+	{
+		if (count <= max_leaf)
+		{
+			make_leaf();
+			return;
+		}
+
+		int axis = longest_axis(centroid_box);
+		int mid = count / 2;
+
+		std::nth_element(refs.begin(), refs.begin() + mid, refs.end(), [axis](const reference &a, const reference &b)
+		{
+			return a.box.min()[axis] + a.box.max()[axis] < b.box.min()[axis] + b.box.max()[axis];
+		});
+
+		split.axis = axis;
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+	}
+
+	// The parent's references are not needed any more; free them before going deeper.
+	std::vector<reference>().swap(refs);
+
+	out[node].count = 0;
+	out[node].axis = split.axis;
+
+	int first = out.size();
+	out.emplace_back();
+	build_node(left, first, depth + 1);
+
+	int second = out.size();
+	out.emplace_back();
+	out[node].offset = second;
+	build_node(right, second, depth + 1);
+}
+
+void sbvh_builder::build(bvh_node_vector &out_nodes, std::vector<int32_t> &out_indices)
+{
+	int n = in.size();
+	std::vector<reference> refs(n);
+	aabb root = empty_box();
+
+	for (int i = 0; i < n; i++)
+	{
+		refs[i].box = in.bounds[i];
+		refs[i].prim = i;
+		grow(root, in.bounds[i]);
+	}
+
+	ref_count = n;
+	max_refs = size_t(n * (1 + std::max(budget, 0.0f)));
+	root_area = surface_area(root);
+	nodes = &out_nodes;
+	indices = &out_indices;
+
+	out_nodes.clear();
+	out_indices.clear();
+	out_nodes.reserve(2 * n);
+	out_indices.reserve(n);
+	out_nodes.emplace_back();
+	build_node(refs, 0, 0);
+}
+
+#endif // SBVHHPP
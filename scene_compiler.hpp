@@ -0,0 +1,741 @@
+#ifndef SCENECOMPILERHPP
+#define SCENECOMPILERHPP
+
+#include "hitable.hpp"
+#include "hitable_list.hpp"
+#include "flat_bvh.hpp"
+#include "motion_bvh.hpp"
+#include "bvh.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "constant_medium.hpp"
+#include "transform.hpp"
+#include "sphere_batch.hpp"
+#include "scene_features.hpp"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+// Set by --compile-scene: finalize_scene() replaces the world with a compiled_scene.
+bool scene_compile = false;
+
+enum compiled_prim_type : int32_t
+{
+	COMPILED_SPHERE,    // sphere or moving_sphere, in compiled_scene::spheres.
+	COMPILED_RECT,      // Axis-aligned rectangle.
+	COMPILED_BOX,
+	COMPILED_INSTANCE,  // Anything else, hit through its own virtual hit().
+};
+
+struct compiled_prim
+{
+	compiled_prim_type type;
+	int32_t index;  // Into the array of its type.
+};
+
+/*
+ * xy_rect, xz_rect and yz_rect in one form: "axis" is the axis of the plane's normal, "a" and "b" the two axes in the
+ * plane, in the order the rect classes use for u and v.
+ */
+struct compiled_rect
+{
+	int axis;
+	int a;
+	int b;
+	float a0;
+	float a1;
+	float b0;
+	float b1;
+	float k;
+	float normal;  // +1 or -1 along "axis".
+	material *mat;
+};
+
+/*
+ * Box tested as one slab intersection instead of six rects. Its corners are in object space; "moved" boxes take the
+ * ray into object space first, like transform does.
+ */
+struct compiled_box
+{
+	vec3 pmin;
+	vec3 pmax;
+	material *mat;
+	bool moved;
+	bool rigid;
+	bool flipped;
+	affine_matrix to_object;
+	affine_matrix normal_matrix;
+};
+
+/*
+ * Flattened copy of a scene graph, for rendering only. Lists, BVHs and placement wrappers are walked once and every
+ * primitive is baked into a flat array for its type:
+ *
+ *  - spheres and moving spheres under translations only go into a sphere_batch, centers moved to the world,
+ *  - rects under translations only get the offset folded into their bounds, and flips into their normal,
+ *  - boxes keep one object-to-world matrix, with no matrix at all when they are not moved,
+ *  - everything else (media, shapes under rotations or scales, unknown hitables) is hit through its own hit(), inside
+ *    one transform holding the whole chain of wrappers above it.
+ *
+ * One BVH goes over all of them. Its index array holds {type, index} pairs, sorted by type within each leaf, so a leaf
+ * runs one tight loop per type instead of a virtual call per primitive, and the spheres of a leaf sit next to each
+ * other in the batch. The original graph is kept for refit(), which recompiles.
+ */
+class compiled_scene : public hitable
+{
+	public:
+		compiled_scene(hitable *world, float time0, float time1) : source(world)
+		{
+			compile(time0, time1);
+			report(std::cerr);
+		}
+
+		// One line on what the scene compiled to. Printed once, not on every refit of an animation.
+		void report(std::ostream &out) const;
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+		{
+			return hit_with<FEATURE_ALL>(r, t_min, t_max, rec);
+		}
+
+		// hit() specialized on a scene_feature mask; used directly by the render kernels.
+		template<unsigned features>
+		bool hit_with(const ray &r, float t_min, float t_max, hit_record &rec) const;
+
+		virtual bool bounding_box(float t0, float t1, aabb &box) const
+		{
+			box = bbox;
+
+			return hasbox;
+		}
+
+		virtual void refit(float t0, float t1)
+		{
+			source->refit(t0, t1);
+			compile(t0, t1);
+		}
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			fn(source);
+		}
+
+		// Scenes with fewer primitives than this are one list without a BVH, where a box test costs as much as a miss.
+		static const int min_bvh_prims = 8;
+
+		hitable *source;
+		std::vector<compiled_prim> prims;  // In leaf order.
+		bvh_tree tree;                     // Empty for small scenes.
+		sphere_batch spheres;
+		std::vector<compiled_rect> rects;
+		std::vector<compiled_box> boxes;
+		std::vector<hitable *> instances;
+		/*
+		 * Instances tested by every ray: ones without a bounding box, and ones whose box covers most of the scene (a
+		 * medium filling the scene, say), which would only widen every BVH node above them.
+		 */
+		std::vector<int> unculled;
+		int media = 0;  // How many of the instances are constant_mediums.
+		bool hasbox;
+		aabb bbox;
+
+	private:
+		void compile(float time0, float time1);
+		void gather(hitable *h, const affine_matrix &m, bool flip);
+		void add(compiled_prim_type type, int index, bool bounded, const aabb &box);
+		void add_instance(hitable *h, const affine_matrix &m, bool flip);
+
+		template<unsigned features>
+		bool hit_leaf(const ray &r, int first, int count, float t_min, float &t_max, hit_record &rec) const;
+
+		// Scratch state of compile().
+		float time0;
+		float time1;
+		std::vector<compiled_prim> refs;
+		bvh_build_input in;
+		std::deque<sphere> baked_spheres;  // Copies moved to the world, for spheres.build().
+		std::deque<moving_sphere> baked_moving;
+		std::vector<hitable *> sphere_refs;  // Index of COMPILED_SPHERE refs before batching.
+		std::vector<std::unique_ptr<transform>> placements;
+};
+
+template<bool uv>
+inline bool hit_rect(const compiled_rect &q, const ray &r, float t_min, float t_max, hit_record &rec)
+{
+	const vec3 &o = r.A;
+	const vec3 &d = r.B;
+	float t = (q.k - o[q.axis]) / d[q.axis];
+
+	if (t < t_min || t > t_max)
+	{
+		return false;
+	}
+
+	float x = o[q.a] + t * d[q.a];
+	float y = o[q.b] + t * d[q.b];
+
+	if (x < q.a0 || x > q.a1 || y < q.b0 || y > q.b1)
+	{
+		return false;
+	}
+
+	if (uv)
+	{
+		rec.u = (x - q.a0) / (q.a1 - q.a0);
+		rec.v = (y - q.b0) / (q.b1 - q.b0);
+		rec.uv_extent = sqrtf((q.a1 - q.a0) * (q.b1 - q.b0));
+	}
+
+	rec.t = t;
+	rec.mat_ptr = q.mat;
+	rec.p = r.point_at_parameter(t);
+	rec.normal = vec3(0, 0, 0);
+	rec.normal[q.axis] = q.normal;
+
+	return true;
+}
+
+/*
+ * Same hits as the six rects of a box: the entry face if it is within [t_min, t_max], else the exit face. Normals
+ * point out of the box and u, v follow the rect of each face.
+ */
+template<bool uv>
+inline bool hit_box(const compiled_box &b, const ray &world, float t_min, float t_max, hit_record &rec)
+{
+	ray r = b.moved ? ray(b.to_object.point(world.A), b.to_object.vector(world.B), world.exist_time) : world;
+	float t_near = -FLT_MAX;
+	float t_far = FLT_MAX;
+	int near_axis = -1;
+	int far_axis = -1;
+
+	for (int a = 0; a < 3; a++)
+	{
+		float t0 = (b.pmin[a] - r.A[a]) * r.inv_B[a];
+		float t1 = (b.pmax[a] - r.A[a]) * r.inv_B[a];
+
+		if (r.sign[a])
+		{
+			std::swap(t0, t1);
+		}
+
+		if (t0 > t_near)
+		{
+			t_near = t0;
+			near_axis = a;
+		}
+
+		if (t1 < t_far)
+		{
+			t_far = t1;
+			far_axis = a;
+		}
+	}
+
+	if (t_near > t_far)
+	{
+		return false;
+	}
+
+	int axis;
+	bool high;  // Face on the pmax side.
+
+	if (near_axis >= 0 && t_near >= t_min && t_near <= t_max)
+	{
+		rec.t = t_near;
+		axis = near_axis;
+		high = r.sign[axis];
+	}
+	else if (far_axis >= 0 && t_far >= t_min && t_far <= t_max)
+	{
+		rec.t = t_far;
+		axis = far_axis;
+		high = !r.sign[axis];
+	}
+	else
+	{
+		return false;
+	}
+
+	int u_axis = axis == 0 ? 1 : 0;
+	int v_axis = axis == 2 ? 1 : 2;
+	vec3 p = r.point_at_parameter(rec.t);
+	vec3 normal(0, 0, 0);
+
+	normal[axis] = high ? 1 : -1;
+
+	if (uv)
+	{
+		rec.u = (p[u_axis] - b.pmin[u_axis]) / (b.pmax[u_axis] - b.pmin[u_axis]);
+		rec.v = (p[v_axis] - b.pmin[v_axis]) / (b.pmax[v_axis] - b.pmin[v_axis]);
+		rec.uv_extent = sqrtf((b.pmax[u_axis] - b.pmin[u_axis]) * (b.pmax[v_axis] - b.pmin[v_axis]));
+	}
+
+	rec.mat_ptr = b.mat;
+
+	if (b.moved)
+	{
+		normal = b.normal_matrix.vector(normal);
+		rec.p = world.point_at_parameter(rec.t);
+		rec.normal = b.rigid ? normal : unit_vector(normal);
+	}
+	else
+	{
+		rec.p = p;
+		rec.normal = normal;
+	}
+
+	if (b.flipped)
+	{
+		rec.normal = -rec.normal;
+	}
+
+	return true;
+}
+
+void compiled_scene::compile(float t0, float t1)
+{
+	time0 = t0;
+	time1 = t1;
+	refs.clear();
+	in = bvh_build_input();
+	baked_spheres.clear();
+	baked_moving.clear();
+	sphere_refs.clear();
+	rects.clear();
+	boxes.clear();
+	instances.clear();
+	unculled.clear();
+	placements.clear();
+	media = 0;
+	hasbox = true;
+
+	gather(source, affine_matrix::identity(), false);
+
+	bbox = empty_box();
+
+	for (const aabb &box : in.bounds)
+	{
+		grow(bbox, box);
+	}
+
+	bvh_build_input culled;
+	std::vector<compiled_prim> culled_refs;
+
+	for (int i = 0; i < in.size(); i++)
+	{
+		if (refs[i].type == COMPILED_INSTANCE && surface_area(in.bounds[i]) >= 0.5f * surface_area(bbox))
+		{
+			unculled.push_back(refs[i].index);
+		}
+		else
+		{
+			culled.add(in.bounds[i]);
+			culled_refs.push_back(refs[i]);
+		}
+	}
+
+	auto by_type = [](const compiled_prim &a, const compiled_prim &b) { return a.type < b.type; };
+
+	tree.owned_nodes.clear();
+	tree.owned_indices.clear();
+	tree.use_owned();
+
+	if (culled.size() >= min_bvh_prims)
+	{
+		build_bvh(culled, tree);
+
+		if (bvh_layout == BVH_LAYOUT_TREELET)
+		{
+			layout_treelets(tree);
+		}
+
+		prims.resize(tree.index_count);
+
+		for (int i = 0; i < tree.index_count; i++)
+		{
+			prims[i] = culled_refs[tree.indices[i]];
+		}
+
+		// Group each leaf by type, so a leaf runs one loop per type.
+		for (int i = 0; i < tree.node_count; i++)
+		{
+			const flat_bvh_node &n = tree.nodes[i];
+
+			if (n.count > 0)
+			{
+				std::stable_sort(prims.begin() + n.offset, prims.begin() + n.offset + n.count, by_type);
+			}
+		}
+	}
+	else
+	{
+		prims = culled_refs;
+		std::stable_sort(prims.begin(), prims.end(), by_type);
+	}
+
+	// Batch slots go out in leaf order, so the spheres of a leaf are contiguous in the batch.
+
+	std::vector<hitable *> batch;
+
+	for (compiled_prim &p : prims)
+	{
+		if (p.type == COMPILED_SPHERE)
+		{
+			batch.push_back(sphere_refs[p.index]);
+			p.index = batch.size() - 1;
+		}
+	}
+
+	spheres.clear();
+
+	if (!batch.empty())
+	{
+		spheres.build(batch);
+	}
+
+	refs.clear();
+	in = bvh_build_input();
+	sphere_refs.clear();
+	baked_spheres.clear();
+	baked_moving.clear();
+}
+
+void compiled_scene::report(std::ostream &out) const
+{
+	size_t sphere_count = std::count_if(prims.begin(), prims.end(), [](const compiled_prim &p)
+	{
+		return p.type == COMPILED_SPHERE;
+	});
+
+	out << "Compiled scene: " << sphere_count << " spheres, " << rects.size() << " rects, " << boxes.size()
+	    << " boxes, " << instances.size() << " instances (" << media << " media, " << unculled.size()
+	    << " outside the BVH), " << tree.node_count << " BVH nodes\n";
+}
+
+void compiled_scene::add(compiled_prim_type type, int index, bool bounded, const aabb &box)
+{
+	if (!bounded)
+	{
+		unculled.push_back(index);
+		hasbox = false;
+
+		return;
+	}
+
+	refs.push_back({type, index});
+	in.add(box);
+}
+
+void compiled_scene::add_instance(hitable *h, const affine_matrix &m, bool flip)
+{
+	hitable *placed = h;
+
+	if (flip || !m.is_identity())
+	{
+		placements.emplace_back(new transform(h, m, flip));
+		placements.back()->refit(time0, time1);
+		placed = placements.back().get();
+	}
+
+	if (dynamic_cast<constant_medium *>(h))
+	{
+		media++;
+	}
+
+	aabb box;
+	bool bounded = placed->bounding_box(time0, time1, box);
+
+	instances.push_back(placed);
+	add(COMPILED_INSTANCE, instances.size() - 1, bounded, box);
+}
+
+/*
+ * Walk "h", which sits under the accumulated object-to-world matrix "m" and flip. Groups are transparent; a group
+ * reaching the same child twice (a flat_bvh with split references, the accelerator of a hitable_list) adds it once.
+ */
+void compiled_scene::gather(hitable *h, const affine_matrix &m, bool flip)
+{
+	if (translate *t = dynamic_cast<translate *>(h))
+	{
+		gather(t->ptr, m * affine_matrix::translation(t->offset), flip);
+	}
+	else if (rotate_y *r = dynamic_cast<rotate_y *>(h))
+	{
+		gather(r->ptr, m * affine_matrix::rotation_y(r->sin_theta, r->cos_theta), flip);
+	}
+	else if (transform *t = dynamic_cast<transform *>(h))
+	{
+		gather(t->ptr, m * t->to_world, flip != t->flipped);
+	}
+	else if (flip_normals *f = dynamic_cast<flip_normals *>(h))
+	{
+		gather(f->ptr, m, !flip);
+	}
+	else if (dynamic_cast<hitable_list *>(h) || dynamic_cast<flat_bvh *>(h) || dynamic_cast<motion_bvh *>(h) ||
+	         dynamic_cast<bvh_node *>(h))
+	{
+		// Flattened, every member of a rotated or scaled group would pay for the transform; as one instance only the
+		// group does.
+		if (!m.is_translation())
+		{
+			add_instance(h, m, flip);
+
+			return;
+		}
+
+		std::unordered_set<hitable *> seen;
+
+		h->visit_children([&](hitable *&child)
+		{
+			if (seen.insert(child).second)
+			{
+				gather(child, m, flip);
+			}
+		});
+	}
+	else if (m.is_translation() && !flip && dynamic_cast<sphere *>(h))
+	{
+		sphere s = *static_cast<sphere *>(h);
+		aabb box;
+
+		s.center += m.offset();
+		s.bounding_box(time0, time1, box);
+		baked_spheres.push_back(s);
+		sphere_refs.push_back(&baked_spheres.back());
+		add(COMPILED_SPHERE, sphere_refs.size() - 1, true, box);
+	}
+	else if (m.is_translation() && !flip && dynamic_cast<moving_sphere *>(h))
+	{
+		moving_sphere s = *static_cast<moving_sphere *>(h);
+		aabb box;
+
+		s.center0 += m.offset();
+		s.center1 += m.offset();
+		s.bounding_box(time0, time1, box);
+		baked_moving.push_back(s);
+		sphere_refs.push_back(&baked_moving.back());
+		add(COMPILED_SPHERE, sphere_refs.size() - 1, true, box);
+	}
+	else if (m.is_translation() && (dynamic_cast<xy_rect *>(h) || dynamic_cast<xz_rect *>(h) ||
+	                                dynamic_cast<yz_rect *>(h)))
+	{
+		compiled_rect q;
+		aabb box;
+
+		if (xy_rect *xy = dynamic_cast<xy_rect *>(h))
+		{
+			q = {2, 0, 1, xy->x0, xy->x1, xy->y0, xy->y1, xy->k, 1, xy->mat};
+		}
+		else if (xz_rect *xz = dynamic_cast<xz_rect *>(h))
+		{
+			q = {1, 0, 2, xz->x0, xz->x1, xz->z0, xz->z1, xz->k, 1, xz->mat};
+		}
+		else
+		{
+			yz_rect *yz = static_cast<yz_rect *>(h);
+			q = {0, 1, 2, yz->y0, yz->y1, yz->z0, yz->z1, yz->k, 1, yz->mat};
+		}
+
+		vec3 offset = m.offset();
+
+		q.a0 += offset[q.a];
+		q.a1 += offset[q.a];
+		q.b0 += offset[q.b];
+		q.b1 += offset[q.b];
+		q.k += offset[q.axis];
+		q.normal = flip ? -1 : 1;
+
+		h->bounding_box(time0, time1, box);
+		rects.push_back(q);
+		add(COMPILED_RECT, rects.size() - 1, true, aabb(box.min() + offset, box.max() + offset));
+	}
+	else if (box *b = dynamic_cast<box *>(h))
+	{
+		hitable_list *sides = dynamic_cast<hitable_list *>(b->list_ptr);
+		xy_rect *front = sides && sides->list_size > 0 ? dynamic_cast<xy_rect *>(sides->list[0]) : nullptr;
+
+		if (!front)
+		{
+			add_instance(h, m, flip);
+
+			return;
+		}
+
+		compiled_box c;
+
+		c.pmin = b->pmin;
+		c.pmax = b->pmax;
+		c.mat = front->mat;
+		c.moved = !m.is_identity();
+		c.rigid = m.is_rigid();
+		c.flipped = flip;
+		c.to_object = m.inverse();
+		c.normal_matrix = c.to_object.transposed();
+
+		boxes.push_back(c);
+		add(COMPILED_BOX, boxes.size() - 1, true, transformed_box(m, aabb(b->pmin, b->pmax)));
+	}
+	else
+	{
+		add_instance(h, m, flip);
+	}
+}
+
+template<unsigned features>
+bool compiled_scene::hit_leaf(const ray &r, int first, int count, float t_min, float &t_max, hit_record &rec) const
+{
+	const bool motion = features & FEATURE_MOTION_BLUR;
+	const bool uv = features & FEATURE_TEXTURES;
+	bool hit_anything = false;
+	int end = first + count;
+
+	for (int i = first; i < end;)
+	{
+		compiled_prim_type type = prims[i].type;
+		int run = i + 1;
+
+		while (run < end && prims[run].type == type)
+		{
+			run++;
+		}
+
+		switch (type)
+		{
+			case COMPILED_SPHERE:
+				hit_anything |= spheres.hit<motion, uv>(r, prims[i].index, run - i, t_min, t_max, rec);
+				break;
+
+			case COMPILED_RECT:
+				for (int j = i; j < run; j++)
+				{
+					if (hit_rect<uv>(rects[prims[j].index], r, t_min, t_max, rec))
+					{
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+				break;
+
+			case COMPILED_BOX:
+				for (int j = i; j < run; j++)
+				{
+					if (hit_box<uv>(boxes[prims[j].index], r, t_min, t_max, rec))
+					{
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+				break;
+
+			case COMPILED_INSTANCE:
+				for (int j = i; j < run; j++)
+				{
+					if (instances[prims[j].index]->hit(r, t_min, t_max, rec))
+					{
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+				break;
+		}
+
+		i = run;
+	}
+
+	return hit_anything;
+}
+
+template<unsigned features>
+bool compiled_scene::hit_with(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	auto leaf = [&](int first, int count, float &closest)
+	{
+		return hit_leaf<features>(r, first, count, t_min, closest, rec);
+	};
+
+	float closest = t_max;
+	bool hit_anything = tree.node_count ? tree.traverse(r, t_min, t_max, leaf) : leaf(0, prims.size(), closest);
+
+	if (hit_anything)
+	{
+		closest = rec.t;
+	}
+
+	for (int i : unculled)
+	{
+		if (instances[i]->hit(r, t_min, closest, rec))
+		{
+			hit_anything = true;
+			closest = rec.t;
+		}
+	}
+
+	return hit_anything;
+}
+
+/*
+ * Fire "n" random rays through the bounds of "reference" at both scenes and count the rays whose hits differ: hit or
+ * miss, distance (relative to 1e-4, for rounding in the baked transforms), material, or normal. drand48() is reseeded
+ * per ray, so media scatter at the same distance in both; constant_medium draws from it directly, so a local state
+ * won't do, and the caller's state is put back afterwards. Coincident surfaces, like a box standing on a floor, may
+ * tie-break the other way and show up as differing normals.
+ */
+int validate_compiled_scene(hitable *reference, hitable *compiled, float time0, float time1, int n = 100000)
+{
+	aabb box;
+
+	if (!reference->bounding_box(time0, time1, box))
+	{
+		box = aabb(vec3(-1, -1, -1), vec3(1, 1, 1));
+	}
+
+	std::vector<ray> rays = random_rays_in_box(box, n);
+	int mismatches = 0;
+	unsigned short saved[3];
+
+	for (int i = 0; i < n; i++)
+	{
+		unsigned short seed[3] = {0x330e, (unsigned short)i, (unsigned short)(i >> 16)};
+		hit_record a;
+		hit_record b;
+
+		// seed48() returns the state it replaces.
+		unsigned short *previous = seed48(seed);
+
+		if (i == 0)
+		{
+			memcpy(saved, previous, sizeof(saved));
+		}
+
+		bool hit_a = reference->hit(rays[i], 0.001f, FLT_MAX, a);
+		seed48(seed);
+		bool hit_b = compiled->hit(rays[i], 0.001f, FLT_MAX, b);
+
+		if (hit_a != hit_b)
+		{
+			mismatches++;
+		}
+		else if (hit_a && (fabs(a.t - b.t) > 1e-4f * fmax(1.0f, a.t) || a.mat_ptr != b.mat_ptr ||
+		                   dot(a.normal, b.normal) < 0.999f))
+		{
+			mismatches++;
+		}
+	}
+
+	if (n > 0)
+	{
+		seed48(saved);
+	}
+
+	return mismatches;
+}
+
+#endif // SCENECOMPILERHPP
@@ -0,0 +1,170 @@
+#ifndef SCENEFEATURESHPP
+#define SCENEFEATURESHPP
+
+#include "hitable.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "aarect.hpp"
+#include "constant_medium.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "image_texture.hpp"
+#include <string>
+#include <unordered_set>
+
+/*
+ * Things a scene may need from the render kernel. The integrator and the traversal of a compiled_scene are templated
+ * on a mask of these, and every render picks the instantiation with only the bits its scene and camera use, so the
+ * code for the rest is compiled out of the hot loops (see render_image()).
+ */
+enum scene_feature : unsigned
+{
+	FEATURE_MOTION_BLUR = 1,     // Something moves while the shutter is open; rays need a time.
+	FEATURE_MEDIA = 2,           // constant_medium volumes.
+	FEATURE_TEXTURES = 4,        // Textures looked up by surface (u, v), so hits must compute them.
+	FEATURE_AREA_LIGHTS = 8,     // Emitting materials. Without any, nothing reaches the camera.
+	FEATURE_DEPTH_OF_FIELD = 16, // Camera aperture above zero.
+	FEATURE_ALL = 31,
+};
+
+// Bits that change the generated code. FEATURE_MEDIA is detected and reported, but no kernel branch depends on it.
+const unsigned kernel_feature_mask = FEATURE_MOTION_BLUR | FEATURE_TEXTURES | FEATURE_AREA_LIGHTS |
+                                     FEATURE_DEPTH_OF_FIELD;
+
+// e.g. "motion+lights", or "none".
+std::string feature_names(unsigned features)
+{
+	static const char *names[] = {"motion", "media", "textures", "lights", "dof"};
+	std::string s;
+
+	for (int bit = 0; bit < 5; bit++)
+	{
+		if (features & (1u << bit))
+		{
+			s += s.empty() ? names[bit] : std::string("+") + names[bit];
+		}
+	}
+
+	return s.empty() ? "none" : s;
+}
+
+/*
+ * Walks a scene graph for the features its primitives and materials use. Anything it doesn't recognize (a primitive
+ * without children, a material or texture of an unknown class) counts as using everything.
+ */
+class feature_scanner
+{
+	public:
+		unsigned scan(hitable *h);
+
+	private:
+		unsigned scan(const material *m);
+		unsigned scan(const texture *t);
+
+		std::unordered_set<const void *> seen;
+};
+
+unsigned feature_scanner::scan(const texture *t)
+{
+	if (!t || !seen.insert(t).second || dynamic_cast<const constant_texture *>(t) ||
+	    dynamic_cast<const noise_texture *>(t))
+	{
+		return 0;
+	}
+
+	// Checkers are picked by position only.
+	if (const checker_texture *c = dynamic_cast<const checker_texture *>(t))
+	{
+		return scan(c->even) | scan(c->odd);
+	}
+
+	return FEATURE_TEXTURES;
+}
+
+unsigned feature_scanner::scan(const material *m)
+{
+	if (!m || !seen.insert(m).second || dynamic_cast<const metal *>(m) || dynamic_cast<const dielectric *>(m))
+	{
+		return 0;
+	}
+
+	if (const lambertian *l = dynamic_cast<const lambertian *>(m))
+	{
+		return scan(l->albedo);
+	}
+
+	if (const isotropic *i = dynamic_cast<const isotropic *>(m))
+	{
+		return scan(i->albedo);
+	}
+
+	if (const diffuse_light *d = dynamic_cast<const diffuse_light *>(m))
+	{
+		return FEATURE_AREA_LIGHTS | scan(d->emit);
+	}
+
+	return FEATURE_TEXTURES | FEATURE_AREA_LIGHTS;
+}
+
+unsigned feature_scanner::scan(hitable *h)
+{
+	if (!seen.insert(h).second)
+	{
+		return 0;
+	}
+
+	if (sphere *s = dynamic_cast<sphere *>(h))
+	{
+		return scan(s->mat_ptr);
+	}
+
+	if (moving_sphere *s = dynamic_cast<moving_sphere *>(h))
+	{
+		bool moves = s->center0.x() != s->center1.x() || s->center0.y() != s->center1.y() ||
+		             s->center0.z() != s->center1.z();
+
+		return (moves ? FEATURE_MOTION_BLUR : 0) | scan(s->mat_ptr);
+	}
+
+	if (xy_rect *r = dynamic_cast<xy_rect *>(h))
+	{
+		return scan(r->mat);
+	}
+
+	if (xz_rect *r = dynamic_cast<xz_rect *>(h))
+	{
+		return scan(r->mat);
+	}
+
+	if (yz_rect *r = dynamic_cast<yz_rect *>(h))
+	{
+		return scan(r->mat);
+	}
+
+	unsigned features = 0;
+	bool group = false;
+
+	if (constant_medium *c = dynamic_cast<constant_medium *>(h))
+	{
+		features |= FEATURE_MEDIA | scan(c->phase_function);
+	}
+
+	// Lists, BVHs, wrappers, boxes and media: whatever their children use.
+	h->visit_children([&](hitable *&child)
+	{
+		group = true;
+		features |= scan(child);
+	});
+
+	return group ? features : FEATURE_ALL;
+}
+
+// Features used by the primitives and materials of "world". The camera's part is added by render_image().
+unsigned scene_features(hitable *world)
+{
+	feature_scanner scanner;
+
+	return scanner.scan(world);
+}
+
+#endif // SCENEFEATURESHPP
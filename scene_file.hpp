@@ -0,0 +1,1077 @@
+#ifndef SCENEFILEHPP
+#define SCENEFILEHPP
+
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "hitable_list.hpp"
+#include "camera.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "image_texture.hpp"
+#include "texture_registry.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "constant_medium.hpp"
+#include "flat_bvh.hpp"
+#include "motion_bvh.hpp"
+#include "transform.hpp"
+#include "scene_finalize.hpp"
+#include "arena.hpp"
+#include "mapped_file.hpp"
+#include "render.hpp"
+#include "scenes.hpp"
+#include "stb_image.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Text scene description. One statement per line, "#" starts a comment. Names must be defined before they are used.
+ *
+ *     camera lookfrom x y z  lookat x y z  [vup x y z] [vfov deg] [aperture a] [focus_dist d] [time t0 t1]
+ *     settings [width w] [height h] [spp n]
+ *
+ *     texture <name> constant r g b
+ *     texture <name> checker <even texture> <odd texture>
+ *     texture <name> noise scale
+ *     texture <name> image <path>
+ *
+ *     material <name> lambertian <texture>
+ *     material <name> metal r g b fuzz
+ *     material <name> dielectric ref_idx
+ *     material <name> diffuse_light <texture>
+ *     material <name> isotropic <texture>
+ *
+ *     shape <name> sphere cx cy cz radius <material>
+ *     shape <name> moving_sphere x0 y0 z0  x1 y1 z1  t0 t1 radius <material>
+ *     shape <name> xy_rect x0 x1 y0 y1 k <material>      (also xz_rect, yz_rect)
+ *     shape <name> box x0 y0 z0  x1 y1 z1 <material>
+ *     shape <name> flip_normals <shape>
+ *     shape <name> translate <shape> dx dy dz
+ *     shape <name> rotate_y <shape> degrees
+ *     shape <name> scale <shape> sx sy sz
+ *     shape <name> constant_medium <boundary shape> density <texture>
+ *     shape <name> list <shape> <shape> ...
+ *     shape <name> bvh <shape> <shape> ...
+ *     shape <name> motion_bvh <shape> <shape> ...   BVH that interpolates its bounds over the shutter (motion blur).
+ *
+ *     add <shape> ...          Put shapes in the world.
+ *
+ * A shape may be used by several others (e.g. a sphere that is both a glass ball and the boundary of a medium); it is
+ * built once and shared.
+ *
+ * Parsed scenes are written next to the source as "<file>.cache", a flat binary image of the parsed records. Later
+ * loads map it directly and skip parsing, as long as the size and modification time of the source still match. The
+ * BVHs built for the scene go to the "<file>.bvh" directory (or the --bvh-cache one), keyed by their geometry, so a
+ * reload maps them too instead of building them.
+ */
+
+enum scene_record_kind : uint32_t
+{
+	REC_CONSTANT_TEXTURE,
+	REC_CHECKER_TEXTURE,
+	REC_NOISE_TEXTURE,
+	REC_IMAGE_TEXTURE,
+	REC_LAMBERTIAN,
+	REC_METAL,
+	REC_DIELECTRIC,
+	REC_DIFFUSE_LIGHT,
+	REC_ISOTROPIC,
+	REC_SPHERE,
+	REC_MOVING_SPHERE,
+	REC_XY_RECT,
+	REC_XZ_RECT,
+	REC_YZ_RECT,
+	REC_BOX,
+	REC_FLIP_NORMALS,
+	REC_TRANSLATE,
+	REC_ROTATE_Y,
+	REC_CONSTANT_MEDIUM,
+	REC_LIST,
+	REC_BVH,
+	REC_MOTION_BVH,
+	REC_SCALE
+};
+
+inline bool is_texture_record(uint32_t kind) { return kind <= REC_IMAGE_TEXTURE; }
+inline bool is_material_record(uint32_t kind) { return kind >= REC_LAMBERTIAN && kind <= REC_ISOTROPIC; }
+inline bool is_shape_record(uint32_t kind) { return kind >= REC_SPHERE; }
+
+// One definition from a scene file. Plain data, so a parsed scene can be written to disk and mapped back as is.
+struct scene_record
+{
+	uint32_t kind;
+	int32_t ref[2];  // Earlier records this one uses (texture, material or shape), or -1.
+	int32_t first;   // LIST/BVH: first entry in scene_desc::children. IMAGE: offset of the path in scene_desc::strings.
+	int32_t count;   // LIST/BVH: number of entries.
+	float f[9];      // Numeric parameters in file order.
+};
+
+/*
+ * A parsed scene. The arrays point either into the owned_* vectors (just parsed) or into a mapped cache file.
+ */
+struct scene_desc
+{
+	const scene_record *records = nullptr;
+	uint32_t record_count = 0;
+	const int32_t *children = nullptr;
+	uint32_t child_count = 0;
+	const char *strings = nullptr;
+	uint32_t string_bytes = 0;
+	uint32_t world_first = 0;  // The world is children[world_first, world_first + world_count).
+	uint32_t world_count = 0;
+
+	bool has_camera = false;
+	camera_settings cam;
+	bool has_settings = false;
+	render_settings settings;
+
+	std::vector<scene_record> owned_records;
+	std::vector<int32_t> owned_children;
+	std::vector<char> owned_strings;
+	mapped_file mapping;
+};
+
+/*
+ * Single pass over the text: tokens are read straight from the buffer and every statement appends its record as soon
+ * as it is complete. Names are resolved through one hash table.
+ */
+class scene_parser
+{
+	public:
+		scene_parser(const char *text, size_t size, scene_desc &d) : p(text), end(text + size), desc(d) {}
+
+		bool parse();
+
+		std::string error;
+
+	private:
+		bool at_end_of_statement();
+		bool token(std::string &out);
+		bool number(float &x);
+		bool numbers(float *x, int n);
+		bool reference(int32_t &index, bool (*is_kind)(uint32_t), const char *what);
+		bool fail(const std::string &msg);
+
+		bool parse_camera();
+		bool parse_settings();
+		bool parse_texture(scene_record &rec);
+		bool parse_material(scene_record &rec);
+		bool parse_shape(scene_record &rec);
+
+		const char *p;
+		const char *end;
+		int line = 1;
+		scene_desc &desc;
+		std::unordered_map<std::string, int32_t> names;
+		std::vector<int32_t> world;
+};
+
+bool scene_parser::fail(const std::string &msg)
+{
+	if (error.empty())
+	{
+		error = "line " + std::to_string(line) + ": " + msg;
+	}
+
+	return false;
+}
+
+// Skips blanks and comments. True if the statement is over (newline or end of file).
+bool scene_parser::at_end_of_statement()
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+	{
+		p++;
+	}
+
+	if (p < end && *p == '#')
+	{
+		while (p < end && *p != '\n')
+		{
+			p++;
+		}
+	}
+
+	return p == end || *p == '\n';
+}
+
+bool scene_parser::token(std::string &out)
+{
+	if (at_end_of_statement())
+	{
+		return false;
+	}
+
+	const char *start = p;
+
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+	{
+		p++;
+	}
+
+	out.assign(start, p);
+
+	return true;
+}
+
+bool scene_parser::number(float &x)
+{
+	if (at_end_of_statement())
+	{
+		return fail("expected a number");
+	}
+
+	// The buffer may be a mapping without a terminating NUL, so copy the token before strtof() looks at it.
+	char buf[64];
+	size_t n = 0;
+
+	while (p < end && n < sizeof(buf) - 1 && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+	{
+		buf[n++] = *p++;
+	}
+
+	buf[n] = '\0';
+
+	char *stop;
+	x = strtof(buf, &stop);
+
+	if (stop != buf + n)
+	{
+		return fail(std::string("bad number '") + buf + "'");
+	}
+
+	return true;
+}
+
+bool scene_parser::numbers(float *x, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (!number(x[i]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool scene_parser::reference(int32_t &index, bool (*is_kind)(uint32_t), const char *what)
+{
+	std::string name;
+
+	if (!token(name))
+	{
+		return fail(std::string("expected a ") + what + " name");
+	}
+
+	auto it = names.find(name);
+
+	if (it == names.end() || !is_kind(desc.owned_records[it->second].kind))
+	{
+		return fail("'" + name + "' is not a " + what);
+	}
+
+	index = it->second;
+
+	return true;
+}
+
+bool scene_parser::parse_camera()
+{
+	camera_settings &c = desc.cam;
+	std::string key;
+	bool has_from = false;
+	bool has_at = false;
+
+	c.vup = vec3(0, 1, 0);
+	c.vfov = 40;
+	c.aperture = 0.0;
+	c.focus_dist = 10.0;
+	c.time0 = 0.0;
+	c.time1 = 1.0;
+
+	while (token(key))
+	{
+		bool ok;
+
+		if (key == "lookfrom") { ok = numbers(c.lookfrom.e, 3); has_from = true; }
+		else if (key == "lookat") { ok = numbers(c.lookat.e, 3); has_at = true; }
+		else if (key == "vup") ok = numbers(c.vup.e, 3);
+		else if (key == "vfov") ok = number(c.vfov);
+		else if (key == "aperture") ok = number(c.aperture);
+		else if (key == "focus_dist") ok = number(c.focus_dist);
+		else if (key == "time") ok = number(c.time0) && number(c.time1);
+		else return fail("unknown camera key '" + key + "'");
+
+		if (!ok)
+		{
+			return false;
+		}
+	}
+
+	if (!has_from || !has_at)
+	{
+		return fail("camera needs lookfrom and lookat");
+	}
+
+	desc.has_camera = true;
+
+	return true;
+}
+
+bool scene_parser::parse_settings()
+{
+	std::string key;
+	float value;
+
+	while (token(key))
+	{
+		if (!number(value))
+		{
+			return false;
+		}
+
+		if (key == "width") desc.settings.nx = int(value);
+		else if (key == "height") desc.settings.ny = int(value);
+		else if (key == "spp") desc.settings.ns = int(value);
+		else return fail("unknown settings key '" + key + "'");
+	}
+
+	desc.has_settings = true;
+
+	return true;
+}
+
+bool scene_parser::parse_texture(scene_record &rec)
+{
+	std::string type;
+
+	if (!token(type))
+	{
+		return fail("expected a texture type");
+	}
+
+	if (type == "constant")
+	{
+		rec.kind = REC_CONSTANT_TEXTURE;
+		return numbers(rec.f, 3);
+	}
+	else if (type == "checker")
+	{
+		rec.kind = REC_CHECKER_TEXTURE;
+		return reference(rec.ref[0], is_texture_record, "texture") && reference(rec.ref[1], is_texture_record, "texture");
+	}
+	else if (type == "noise")
+	{
+		rec.kind = REC_NOISE_TEXTURE;
+		return number(rec.f[0]);
+	}
+	else if (type == "image")
+	{
+		std::string path;
+
+		if (!token(path))
+		{
+			return fail("expected an image path");
+		}
+
+		rec.kind = REC_IMAGE_TEXTURE;
+		rec.first = desc.owned_strings.size();
+		desc.owned_strings.insert(desc.owned_strings.end(), path.begin(), path.end());
+		desc.owned_strings.push_back('\0');
+
+		return true;
+	}
+
+	return fail("unknown texture type '" + type + "'");
+}
+
+bool scene_parser::parse_material(scene_record &rec)
+{
+	std::string type;
+
+	if (!token(type))
+	{
+		return fail("expected a material type");
+	}
+
+	if (type == "lambertian") { rec.kind = REC_LAMBERTIAN; return reference(rec.ref[0], is_texture_record, "texture"); }
+	if (type == "metal") { rec.kind = REC_METAL; return numbers(rec.f, 4); }
+	if (type == "dielectric") { rec.kind = REC_DIELECTRIC; return number(rec.f[0]); }
+	if (type == "diffuse_light") { rec.kind = REC_DIFFUSE_LIGHT; return reference(rec.ref[0], is_texture_record, "texture"); }
+	if (type == "isotropic") { rec.kind = REC_ISOTROPIC; return reference(rec.ref[0], is_texture_record, "texture"); }
+
+	return fail("unknown material type '" + type + "'");
+}
+
+bool scene_parser::parse_shape(scene_record &rec)
+{
+	std::string type;
+
+	if (!token(type))
+	{
+		return fail("expected a shape type");
+	}
+
+	if (type == "sphere")
+	{
+		rec.kind = REC_SPHERE;
+		return numbers(rec.f, 4) && reference(rec.ref[0], is_material_record, "material");
+	}
+	if (type == "moving_sphere")
+	{
+		rec.kind = REC_MOVING_SPHERE;
+		return numbers(rec.f, 9) && reference(rec.ref[0], is_material_record, "material");
+	}
+	if (type == "xy_rect" || type == "xz_rect" || type == "yz_rect")
+	{
+		rec.kind = type == "xy_rect" ? REC_XY_RECT : type == "xz_rect" ? REC_XZ_RECT : REC_YZ_RECT;
+		return numbers(rec.f, 5) && reference(rec.ref[0], is_material_record, "material");
+	}
+	if (type == "box")
+	{
+		rec.kind = REC_BOX;
+		return numbers(rec.f, 6) && reference(rec.ref[0], is_material_record, "material");
+	}
+	if (type == "flip_normals")
+	{
+		rec.kind = REC_FLIP_NORMALS;
+		return reference(rec.ref[0], is_shape_record, "shape");
+	}
+	if (type == "translate")
+	{
+		rec.kind = REC_TRANSLATE;
+		return reference(rec.ref[0], is_shape_record, "shape") && numbers(rec.f, 3);
+	}
+	if (type == "rotate_y")
+	{
+		rec.kind = REC_ROTATE_Y;
+		return reference(rec.ref[0], is_shape_record, "shape") && number(rec.f[0]);
+	}
+	if (type == "scale")
+	{
+		rec.kind = REC_SCALE;
+		return reference(rec.ref[0], is_shape_record, "shape") && numbers(rec.f, 3);
+	}
+	if (type == "constant_medium")
+	{
+		rec.kind = REC_CONSTANT_MEDIUM;
+		return reference(rec.ref[0], is_shape_record, "shape") && number(rec.f[0]) &&
+		       reference(rec.ref[1], is_texture_record, "texture");
+	}
+	if (type == "list" || type == "bvh" || type == "motion_bvh")
+	{
+		rec.kind = type == "list" ? REC_LIST : type == "bvh" ? REC_BVH : REC_MOTION_BVH;
+		rec.first = desc.owned_children.size();
+
+		int32_t child;
+
+		while (!at_end_of_statement())
+		{
+			if (!reference(child, is_shape_record, "shape"))
+			{
+				return false;
+			}
+
+			desc.owned_children.push_back(child);
+		}
+
+		rec.count = desc.owned_children.size() - rec.first;
+
+		return rec.count > 0 || fail("empty " + type);
+	}
+
+	return fail("unknown shape type '" + type + "'");
+}
+
+bool scene_parser::parse()
+{
+	std::string keyword;
+	std::string name;
+
+	while (p < end)
+	{
+		if (token(keyword))
+		{
+			bool ok = true;
+
+			if (keyword == "camera")
+			{
+				ok = parse_camera();
+			}
+			else if (keyword == "settings")
+			{
+				ok = parse_settings();
+			}
+			else if (keyword == "add")
+			{
+				int32_t shape;
+
+				while (ok && !at_end_of_statement())
+				{
+					ok = reference(shape, is_shape_record, "shape");
+					world.push_back(shape);
+				}
+			}
+			else if (keyword == "texture" || keyword == "material" || keyword == "shape")
+			{
+				scene_record rec;
+				memset(&rec, 0, sizeof(rec));
+				rec.ref[0] = rec.ref[1] = -1;
+
+				if (!token(name))
+				{
+					return fail("expected a name after '" + keyword + "'");
+				}
+
+				if (names.count(name))
+				{
+					return fail("'" + name + "' is already defined");
+				}
+
+				ok = keyword == "texture" ? parse_texture(rec) :
+				     keyword == "material" ? parse_material(rec) : parse_shape(rec);
+
+				if (ok)
+				{
+					names[name] = desc.owned_records.size();
+					desc.owned_records.push_back(rec);
+				}
+			}
+			else
+			{
+				return fail("unknown statement '" + keyword + "'");
+			}
+
+			if (!ok)
+			{
+				return false;
+			}
+
+			if (!at_end_of_statement())
+			{
+				return fail("unexpected text at end of statement");
+			}
+		}
+
+		if (p < end)
+		{
+			p++; // The newline.
+			line++;
+		}
+	}
+
+	if (world.empty())
+	{
+		return fail("nothing was added to the world");
+	}
+
+	desc.world_first = desc.owned_children.size();
+	desc.world_count = world.size();
+	desc.owned_children.insert(desc.owned_children.end(), world.begin(), world.end());
+
+	desc.records = desc.owned_records.data();
+	desc.record_count = desc.owned_records.size();
+	desc.children = desc.owned_children.data();
+	desc.child_count = desc.owned_children.size();
+	desc.strings = desc.owned_strings.data();
+	desc.string_bytes = desc.owned_strings.size();
+
+	return true;
+}
+
+const char scene_cache_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t scene_cache_version = 2;
+
+/*
+ * Layout of a ".cache" file: this header, then the records, the children and the strings, each starting on an 8 byte
+ * boundary. The checksum covers the three arrays; check_scene_desc() then makes sure every index in them is in range,
+ * so a damaged file is parsed again instead of read out of bounds.
+ */
+struct scene_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_count;
+	uint32_t child_count;
+	uint32_t string_bytes;
+	uint32_t world_first;
+	uint32_t world_count;
+	file_stamp source;  // Size and mtime of the text file the cache was built from.
+	uint32_t has_camera;
+	uint32_t has_settings;
+	camera_settings cam;
+	int32_t settings[3];
+	uint64_t checksum;  // FNV-1a of the records, children and strings.
+};
+
+inline size_t align8(size_t n)
+{
+	return (n + 7) & ~size_t(7);
+}
+
+struct scene_cache_layout
+{
+	size_t records;
+	size_t children;
+	size_t strings;
+	size_t total;
+
+	scene_cache_layout(uint32_t record_count, uint32_t child_count, uint32_t string_bytes)
+	{
+		records = align8(sizeof(scene_cache_header));
+		children = align8(records + record_count * sizeof(scene_record));
+		strings = align8(children + child_count * sizeof(int32_t));
+		total = strings + string_bytes;
+	}
+};
+
+uint64_t scene_desc_checksum(const scene_desc &desc)
+{
+	uint64_t hash = fnv1a(desc.records, desc.record_count * sizeof(scene_record));
+
+	hash = fnv1a(desc.children, desc.child_count * sizeof(int32_t), hash);
+
+	return fnv1a(desc.strings, desc.string_bytes, hash);
+}
+
+/*
+ * Whether every reference in "desc" is in range and of the kind its record expects: records only refer to earlier
+ * records, child lists and the world stay inside the children, and image paths are terminated strings inside the
+ * string table. build_scene() relies on it.
+ */
+bool check_scene_desc(const scene_desc &desc)
+{
+	auto refers = [&](int32_t ref, uint32_t i, bool (*is_kind)(uint32_t))
+	{
+		return ref >= 0 && uint32_t(ref) < i && is_kind(desc.records[ref].kind);
+	};
+
+	auto children = [&](uint32_t first, uint32_t count, uint32_t i)
+	{
+		if (first > desc.child_count || count > desc.child_count - first)
+		{
+			return false;
+		}
+
+		for (uint32_t c = first; c < first + count; c++)
+		{
+			if (!refers(desc.children[c], i, is_shape_record))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	};
+
+	for (uint32_t i = 0; i < desc.record_count; i++)
+	{
+		const scene_record &rec = desc.records[i];
+		bool ok;
+
+		switch (rec.kind)
+		{
+			case REC_CONSTANT_TEXTURE:
+			case REC_NOISE_TEXTURE:
+			case REC_METAL:
+			case REC_DIELECTRIC:
+				ok = true;
+				break;
+			case REC_CHECKER_TEXTURE:
+				ok = refers(rec.ref[0], i, is_texture_record) && refers(rec.ref[1], i, is_texture_record);
+				break;
+			case REC_IMAGE_TEXTURE:
+				ok = rec.first >= 0 && uint32_t(rec.first) < desc.string_bytes &&
+				     memchr(desc.strings + rec.first, '\0', desc.string_bytes - rec.first) != nullptr;
+				break;
+			case REC_LAMBERTIAN:
+			case REC_DIFFUSE_LIGHT:
+			case REC_ISOTROPIC:
+				ok = refers(rec.ref[0], i, is_texture_record);
+				break;
+			case REC_SPHERE:
+			case REC_MOVING_SPHERE:
+			case REC_XY_RECT:
+			case REC_XZ_RECT:
+			case REC_YZ_RECT:
+			case REC_BOX:
+				ok = refers(rec.ref[0], i, is_material_record);
+				break;
+			case REC_FLIP_NORMALS:
+			case REC_TRANSLATE:
+			case REC_ROTATE_Y:
+			case REC_SCALE:
+				ok = refers(rec.ref[0], i, is_shape_record);
+				break;
+			case REC_CONSTANT_MEDIUM:
+				ok = refers(rec.ref[0], i, is_shape_record) && refers(rec.ref[1], i, is_texture_record);
+				break;
+			case REC_LIST:
+			case REC_BVH:
+			case REC_MOTION_BVH:
+				ok = rec.first >= 0 && rec.count > 0 && children(rec.first, rec.count, i);
+				break;
+			default:
+				ok = false;
+		}
+
+		if (!ok)
+		{
+			return false;
+		}
+	}
+
+	return children(desc.world_first, desc.world_count, desc.record_count);
+}
+
+bool write_scene_cache(const std::string &path, const scene_desc &desc, const file_stamp &source)
+{
+	scene_cache_layout layout(desc.record_count, desc.child_count, desc.string_bytes);
+	std::vector<char> bytes(layout.total, 0);
+	scene_cache_header header{};
+
+	memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+	header.version = scene_cache_version;
+	header.record_count = desc.record_count;
+	header.child_count = desc.child_count;
+	header.string_bytes = desc.string_bytes;
+	header.world_first = desc.world_first;
+	header.world_count = desc.world_count;
+	header.source = source;
+	header.has_camera = desc.has_camera;
+	header.has_settings = desc.has_settings;
+	header.cam = desc.cam;
+	header.settings[0] = desc.settings.nx;
+	header.settings[1] = desc.settings.ny;
+	header.settings[2] = desc.settings.ns;
+	header.checksum = scene_desc_checksum(desc);
+
+	// An empty section may have no array behind it, and may start at the end of the file.
+	auto put = [&bytes](size_t offset, const void *data, size_t size)
+	{
+		if (size)
+		{
+			memcpy(&bytes[offset], data, size);
+		}
+	};
+
+	put(0, &header, sizeof(header));
+	put(layout.records, desc.records, desc.record_count * sizeof(scene_record));
+	put(layout.children, desc.children, desc.child_count * sizeof(int32_t));
+	put(layout.strings, desc.strings, desc.string_bytes);
+
+	return write_file_atomically(path, bytes.data(), bytes.size());
+}
+
+// Map a cache file. Fails (and the caller parses the text instead) if it is missing, corrupt or out of date.
+bool load_scene_cache(const std::string &path, const file_stamp &source, scene_desc &desc)
+{
+	if (!desc.mapping.open(path) || desc.mapping.size() < sizeof(scene_cache_header))
+	{
+		return false;
+	}
+
+	scene_cache_header header;
+	memcpy(&header, desc.mapping.data(), sizeof(header));
+
+	scene_cache_layout layout(header.record_count, header.child_count, header.string_bytes);
+
+	if (memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0 || header.version != scene_cache_version ||
+	    header.source.size != source.size || header.source.mtime_ns != source.mtime_ns ||
+	    layout.total != desc.mapping.size())
+	{
+		desc.mapping.close();
+		return false;
+	}
+
+	const char *base = desc.mapping.data();
+
+	desc.records = reinterpret_cast<const scene_record *>(base + layout.records);
+	desc.record_count = header.record_count;
+	desc.children = reinterpret_cast<const int32_t *>(base + layout.children);
+	desc.child_count = header.child_count;
+	desc.strings = base + layout.strings;
+	desc.string_bytes = header.string_bytes;
+	desc.world_first = header.world_first;
+	desc.world_count = header.world_count;
+
+	if (scene_desc_checksum(desc) != header.checksum || !check_scene_desc(desc))
+	{
+		desc.records = nullptr;
+		desc.record_count = 0;
+		desc.children = nullptr;
+		desc.child_count = 0;
+		desc.strings = nullptr;
+		desc.string_bytes = 0;
+		desc.world_first = 0;
+		desc.world_count = 0;
+		desc.mapping.close();
+		return false;
+	}
+
+	desc.has_camera = header.has_camera;
+	desc.cam = header.cam;
+	desc.has_settings = header.has_settings;
+	desc.settings.nx = header.settings[0];
+	desc.settings.ny = header.settings[1];
+	desc.settings.ns = header.settings[2];
+
+	return true;
+}
+
+/*
+ * Load a scene file, from its cache when that is up to date. A fresh parse rewrites the cache; failing to write it
+ * only costs the next load a parse.
+ */
+bool load_scene_file(const std::string &path, scene_desc &desc, std::string &error)
+{
+	file_stamp stamp;
+	std::string cache_path = path + ".cache";
+
+	if (!get_file_stamp(path, stamp))
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+
+	if (load_scene_cache(cache_path, stamp, desc))
+	{
+		return true;
+	}
+
+	mapped_file text;
+
+	if (!text.open(path))
+	{
+		error = "cannot read " + path;
+		return false;
+	}
+
+	scene_parser parser(text.data(), text.size(), desc);
+
+	if (!parser.parse())
+	{
+		error = path + ": " + parser.error;
+		return false;
+	}
+
+	if (!write_scene_cache(cache_path, desc, stamp))
+	{
+		std::cerr << "Could not write scene cache " << cache_path << "\n";
+	}
+
+	return true;
+}
+
+/*
+ * Create the objects of a parsed scene in "arena". Records only refer to earlier ones, so one pass in order is enough.
+ */
+hitable *build_scene(const scene_desc &desc, scene_arena &arena, std::string &error)
+{
+	std::vector<void *> objects(desc.record_count, nullptr);
+	float time0 = desc.has_camera ? desc.cam.time0 : 0.0;
+	float time1 = desc.has_camera ? desc.cam.time1 : 1.0;
+
+	auto tex = [&objects](int32_t i) { return static_cast<texture *>(objects[i]); };
+	auto mat = [&objects](int32_t i) { return static_cast<material *>(objects[i]); };
+	auto shape = [&objects](int32_t i) { return static_cast<hitable *>(objects[i]); };
+	auto shape_list = [&](const scene_record &rec)
+	{
+		hitable **list = arena.make_array<hitable *>(rec.count);
+
+		for (int32_t c = 0; c < rec.count; c++)
+		{
+			list[c] = shape(desc.children[rec.first + c]);
+		}
+
+		return list;
+	};
+
+	for (uint32_t i = 0; i < desc.record_count; i++)
+	{
+		const scene_record &rec = desc.records[i];
+		const float *f = rec.f;
+		void *obj = nullptr;
+
+		switch (rec.kind)
+		{
+			case REC_CONSTANT_TEXTURE:
+				obj = arena.make<constant_texture>(vec3(f[0], f[1], f[2]));
+				break;
+			case REC_CHECKER_TEXTURE:
+				obj = arena.make<checker_texture>(tex(rec.ref[0]), tex(rec.ref[1]));
+				break;
+			case REC_NOISE_TEXTURE:
+				obj = arena.make<noise_texture>(f[0]);
+				break;
+			case REC_IMAGE_TEXTURE:
+			{
+				const char *path = desc.strings + rec.first;
+				image_texture *image = load_image_texture(arena, path);
+
+				if (!image->loaded())
+				{
+					error = std::string("cannot load image ") + path;
+					return nullptr;
+				}
+
+				obj = image;
+				break;
+			}
+			case REC_LAMBERTIAN:
+				obj = arena.make<lambertian>(tex(rec.ref[0]));
+				break;
+			case REC_METAL:
+				obj = arena.make<metal>(vec3(f[0], f[1], f[2]), f[3]);
+				break;
+			case REC_DIELECTRIC:
+				obj = arena.make<dielectric>(f[0]);
+				break;
+			case REC_DIFFUSE_LIGHT:
+				obj = arena.make<diffuse_light>(tex(rec.ref[0]));
+				break;
+			case REC_ISOTROPIC:
+				obj = arena.make<isotropic>(tex(rec.ref[0]));
+				break;
+			case REC_SPHERE:
+				obj = static_cast<hitable *>(arena.make<sphere>(vec3(f[0], f[1], f[2]), f[3], mat(rec.ref[0])));
+				break;
+			case REC_MOVING_SPHERE:
+				obj = static_cast<hitable *>(arena.make<moving_sphere>(vec3(f[0], f[1], f[2]), vec3(f[3], f[4], f[5]),
+				                                                       f[6], f[7], f[8], mat(rec.ref[0])));
+				break;
+			case REC_XY_RECT:
+				obj = static_cast<hitable *>(arena.make<xy_rect>(f[0], f[1], f[2], f[3], f[4], mat(rec.ref[0])));
+				break;
+			case REC_XZ_RECT:
+				obj = static_cast<hitable *>(arena.make<xz_rect>(f[0], f[1], f[2], f[3], f[4], mat(rec.ref[0])));
+				break;
+			case REC_YZ_RECT:
+				obj = static_cast<hitable *>(arena.make<yz_rect>(f[0], f[1], f[2], f[3], f[4], mat(rec.ref[0])));
+				break;
+			case REC_BOX:
+				obj = static_cast<hitable *>(arena.make<box>(vec3(f[0], f[1], f[2]), vec3(f[3], f[4], f[5]),
+				                                             mat(rec.ref[0]), &arena));
+				break;
+			case REC_FLIP_NORMALS:
+				obj = static_cast<hitable *>(arena.make<flip_normals>(shape(rec.ref[0])));
+				break;
+			case REC_TRANSLATE:
+				obj = static_cast<hitable *>(arena.make<translate>(shape(rec.ref[0]), vec3(f[0], f[1], f[2])));
+				break;
+			case REC_ROTATE_Y:
+				obj = static_cast<hitable *>(arena.make<rotate_y>(shape(rec.ref[0]), f[0]));
+				break;
+			case REC_SCALE:
+				obj = static_cast<hitable *>(arena.make<transform>(shape(rec.ref[0]),
+				                                                   affine_matrix::scaling(vec3(f[0], f[1], f[2]))));
+				break;
+			case REC_CONSTANT_MEDIUM:
+				obj = static_cast<hitable *>(arena.make<constant_medium>(shape(rec.ref[0]), f[0], tex(rec.ref[1]),
+				                                                         &arena));
+				break;
+			case REC_LIST:
+				obj = static_cast<hitable *>(arena.make<hitable_list>(shape_list(rec), rec.count, time0, time1));
+				break;
+			case REC_BVH:
+				obj = static_cast<hitable *>(arena.make<flat_bvh>(shape_list(rec), rec.count, time0, time1));
+				break;
+			case REC_MOTION_BVH:
+				obj = static_cast<hitable *>(arena.make<motion_bvh>(shape_list(rec), rec.count, time0, time1,
+				                                                    motion_time_segments));
+				break;
+			default:
+				error = "bad record kind in scene";
+				return nullptr;
+		}
+
+		objects[i] = obj;
+	}
+
+	hitable **world = arena.make_array<hitable *>(desc.world_count);
+
+	for (uint32_t w = 0; w < desc.world_count; w++)
+	{
+		world[w] = shape(desc.children[desc.world_first + w]);
+	}
+
+	return arena.make<hitable_list>(world, desc.world_count, time0, time1);
+}
+
+/*
+ * Open a scene by built-in name (see scenes.hpp) or by scene file path. The camera comes from the scene; "settings"
+ * gets the features the scene uses (see scene_features.hpp), and its size and samples only if the scene file has a
+ * settings line. Image textures the scene asked for are decoded by the time it returns (see texture_registry.hpp).
+ */
+hitable *open_scene(const std::string &name, scene_arena &arena, camera_settings &cam, render_settings &settings,
+                    std::string &error)
+{
+	const scene_entry *entry = find_scene(name.c_str());
+
+	if (entry)
+	{
+		cam = entry->cam;
+
+		hitable *world = finalize_scene(entry->build(arena), arena, cam.time0, cam.time1);
+		texture_registry::shared().wait(arena);
+		settings.features = scene_features(world);
+
+		return world;
+	}
+
+	scene_desc desc;
+
+	if (!load_scene_file(name, desc, error))
+	{
+		return nullptr;
+	}
+
+	if (desc.has_camera)
+	{
+		cam = desc.cam;
+	}
+	else
+	{
+		cam = {vec3(0, 0, 10), vec3(0, 0, 0), vec3(0, 1, 0), 40, 0.0, 10.0, 0.0, 1.0};
+	}
+
+	if (desc.has_settings)
+	{
+		settings = desc.settings;
+	}
+
+	// Unless --bvh-cache names a directory, the scene's BVHs are cached next to it, as its records are.
+	if (bvh_cache_dir.empty())
+	{
+		scene_bvh_cache_dir = name + ".bvh";
+		mkdir(scene_bvh_cache_dir.c_str(), 0755);
+	}
+
+	hitable *world = build_scene(desc, arena, error);
+
+	if (world)
+	{
+		world = finalize_scene(world, arena, cam.time0, cam.time1);
+	}
+
+	scene_bvh_cache_dir.clear();
+	texture_registry::shared().wait(arena);
+
+	if (!world)
+	{
+		return nullptr;
+	}
+
+	settings.features = scene_features(world);
+
+	return world;
+}
+
+#endif // SCENEFILEHPP
@@ -0,0 +1,150 @@
+#ifndef SCENEFINALIZEHPP
+#define SCENEFINALIZEHPP
+
+#include "hitable.hpp"
+#include "transform.hpp"
+#include "arena.hpp"
+#include "scene_compiler.hpp"
+#include <unordered_map>
+
+/*
+ * Rewrites nested translate / rotate_y / flip_normals chains into single transform nodes. Chains of one wrapper are
+ * left alone, as are chains of flips only, which shrink to one flip_normals or none. Hitables shared by several
+ * parents are rewritten once and stay shared. Holders whose children changed are refit to [time0, time1].
+ */
+class transform_collapser
+{
+	public:
+		transform_collapser(scene_arena &a, float t0, float t1) : arena(a), time0(t0), time1(t1) {}
+
+		hitable *collapse(hitable *h);
+
+		int chains = 0;  // Chains replaced so far.
+
+	private:
+		scene_arena &arena;
+		float time0;
+		float time1;
+		std::unordered_map<hitable *, hitable *> done;
+};
+
+hitable *transform_collapser::collapse(hitable *h)
+{
+	auto found = done.find(h);
+
+	if (found != done.end())
+	{
+		return found->second;
+	}
+
+	affine_matrix m = affine_matrix::identity();
+	bool flip = false;
+	int wrappers = 0;
+	int moves = 0;
+	hitable *node = h;
+
+	// Outermost wrapper first, so every step multiplies on the right.
+	for (;; wrappers++)
+	{
+		if (translate *t = dynamic_cast<translate *>(node))
+		{
+			m = m * affine_matrix::translation(t->offset);
+			node = t->ptr;
+			moves++;
+		}
+		else if (rotate_y *r = dynamic_cast<rotate_y *>(node))
+		{
+			m = m * affine_matrix::rotation_y(r->sin_theta, r->cos_theta);
+			node = r->ptr;
+			moves++;
+		}
+		else if (flip_normals *f = dynamic_cast<flip_normals *>(node))
+		{
+			flip = !flip;
+			node = f->ptr;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	hitable *result = h;
+
+	if (wrappers >= 2)
+	{
+		hitable *inner = collapse(node);
+
+		if (moves > 0)
+		{
+			result = arena.make<transform>(inner, m, flip);
+			result->refit(time0, time1);
+		}
+		else
+		{
+			result = flip ? arena.make<flip_normals>(inner) : inner;
+		}
+
+		chains++;
+	}
+	else
+	{
+		bool changed = false;
+
+		h->visit_children([&](hitable *&child)
+		{
+			hitable *c = collapse(child);
+
+			changed |= c != child;
+			child = c;
+		});
+
+		if (changed)
+		{
+			h->refit(time0, time1);
+		}
+	}
+
+	done[h] = result;
+
+	return result;
+}
+
+/*
+ * Share of validation rays a compiled scene may get wrong before the graph it came from is rendered instead.
+ * Coincident faces alone stay well under it (0.14% in cornell_box).
+ */
+const float compiled_scene_max_mismatch = 0.01f;
+
+/*
+ * Passes over a finished scene, run once before rendering by open_scene(). [time0, time1] is the camera shutter.
+ * Returns the new world. With scene_compile set the world is flattened into a compiled_scene, which is checked against
+ * the graph it came from, and only used if it passes.
+ */
+hitable *finalize_scene(hitable *world, scene_arena &arena, float time0, float time1)
+{
+	transform_collapser collapser(arena, time0, time1);
+
+	world = collapser.collapse(world);
+
+	if (!scene_compile)
+	{
+		return world;
+	}
+
+	compiled_scene *compiled = arena.make<compiled_scene>(world, time0, time1);
+	int rays = 100000;
+	int mismatches = validate_compiled_scene(world, compiled, time0, time1, rays);
+
+	std::cerr << "Compiled scene validated: " << mismatches << " of " << rays << " rays differ from the scene graph\n";
+
+	if (mismatches > compiled_scene_max_mismatch * rays)
+	{
+		std::cerr << "Compiled scene rejected, rendering the scene graph\n";
+		return world;
+	}
+
+	return compiled;
+}
+
+#endif // SCENEFINALIZEHPP
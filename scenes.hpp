@@ -0,0 +1,266 @@
+#ifndef SCENESHPP
+#define SCENESHPP
+
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "hitable_list.hpp"
+#include "camera.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "image_texture.hpp"
+#include "texture_registry.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "constant_medium.hpp"
+#include "flat_bvh.hpp"
+#include "motion_bvh.hpp"
+#include "arena.hpp"
+#include "stb_image.h"
+#include <string.h>
+
+/*
+ * Built-in scenes. Each builder allocates everything it creates from "arena".
+ */
+hitable *cornell_box_final_book2(scene_arena &arena) {
+    int nb = 20;
+
+    hitable **list = arena.make_array<hitable *>(30);
+    hitable **boxlist = arena.make_array<hitable *>(10000);
+    hitable **boxlist2 = arena.make_array<hitable *>(10000);
+    material *white = arena.make<lambertian>( arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)) );
+    material *ground = arena.make<lambertian>( arena.make<constant_texture>(vec3(0.48, 0.83, 0.53)) );
+    int b = 0;
+
+    for (int i = 0; i < nb; i++)
+    {
+        for (int j = 0; j < nb; j++)
+        {
+            float w = 100;
+            float x0 = -1000 + i*w;
+            float z0 = -1000 + j*w;
+            float y0 = 0;
+            float x1 = x0 + w;
+            float y1 = 100*(drand48()+0.01);
+            float z1 = z0 + w;
+            boxlist[b++] = arena.make<box>(vec3(x0,y0,z0), vec3(x1,y1,z1), ground, &arena);
+        }
+    }
+
+    int l = 0;
+
+    list[l++] = arena.make<flat_bvh>(boxlist, b, 0, 1);
+    material *light = arena.make<diffuse_light>( arena.make<constant_texture>(vec3(7, 7, 7)) );
+    list[l++] = arena.make<xz_rect>(123, 423, 147, 412, 554, light);
+    vec3 center(400, 400, 200);
+    list[l++] = arena.make<moving_sphere>(center, center+vec3(30, 0, 0), 0, 1, 50, arena.make<lambertian>(arena.make<constant_texture>(vec3(0.7, 0.3, 0.1))));
+    list[l++] = arena.make<sphere>(vec3(260, 150, 45), 50, arena.make<dielectric>(1.5));
+    list[l++] = arena.make<sphere>(vec3(0, 150, 145), 50, arena.make<metal>(vec3(0.8, 0.8, 0.9), 10.0));
+    hitable *boundary = arena.make<sphere>(vec3(360, 150, 145), 70, arena.make<dielectric>(1.5));
+    list[l++] = boundary;
+    list[l++] = arena.make<constant_medium>(boundary, 0.2, arena.make<constant_texture>(vec3(0.2, 0.4, 0.9)), &arena);
+    boundary = arena.make<sphere>(vec3(0, 0, 0), 5000, arena.make<dielectric>(1.5));
+    list[l++] = arena.make<constant_medium>(boundary, 0.0001, arena.make<constant_texture>(vec3(1.0, 1.0, 1.0)), &arena);
+    material *emat =  arena.make<lambertian>(load_image_texture(arena, "earthmap.jpg"));
+    list[l++] = arena.make<sphere>(vec3(400,200, 400), 100, emat);
+    texture *pertext = arena.make<noise_texture>(0.1);
+    list[l++] =  arena.make<sphere>(vec3(220,280, 300), 80, arena.make<lambertian>( pertext ));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++)
+    {
+        boxlist2[j] = arena.make<sphere>(vec3(165*drand48(), 165*drand48(), 165*drand48()), 10, white);
+    }
+    list[l++] =   arena.make<translate>(arena.make<rotate_y>(arena.make<flat_bvh>(boxlist2,ns, 0.0, 1.0), 15), vec3(-100,270,395));
+    return arena.make<hitable_list>(list,l);
+}
+
+hitable *cornell_smoke(scene_arena &arena)
+{
+    hitable **list = arena.make_array<hitable *>(8);
+
+    int i = 0;
+
+    material *red = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    material *green = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    material *light = arena.make<diffuse_light>(arena.make<constant_texture>(vec3(7, 7, 7)));
+
+    // Cornell Box
+    list[i++] = arena.make<flip_normals>(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    list[i++] = arena.make<yz_rect>(0, 555, 0, 555, 0, red);
+    list[i++] = arena.make<xz_rect>(113, 443, 127, 432, 554, light);
+    list[i++] = arena.make<flip_normals>(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    list[i++] = arena.make<xz_rect>(0, 555, 0, 555, 0, white);
+    list[i++] = arena.make<flip_normals>(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    hitable *b1 = arena.make<translate>(arena.make<rotate_y>(arena.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white, &arena), -18), vec3(130, 0, 65));
+    hitable *b2 = arena.make<translate>(arena.make<rotate_y>(arena.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white, &arena), 15), vec3(265, 0, 295));
+
+    // Light particles smoke
+    list[i++] = arena.make<constant_medium>(b1, 0.01, arena.make<constant_texture>(vec3(1.0, 1.0, 1.0)), &arena);
+    // Dark particles smoke
+    list[i++] = arena.make<constant_medium>(b2, 0.01, arena.make<constant_texture>(vec3(0.0, 0.0, 0.0)), &arena);
+
+    return arena.make<hitable_list>(list, i);
+}
+
+hitable *cornell_box(scene_arena &arena)
+{
+    hitable **list = arena.make_array<hitable *>(8);
+
+    int i = 0;
+
+    material *red = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    material *green = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    material *light = arena.make<diffuse_light>(arena.make<constant_texture>(vec3(15, 15, 15)));
+
+    // Cornell Box
+    list[i++] = arena.make<flip_normals>(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    list[i++] = arena.make<yz_rect>(0, 555, 0, 555, 0, red);
+    list[i++] = arena.make<flip_normals>(arena.make<xz_rect>(213, 343, 227, 332, 554, light));
+    list[i++] = arena.make<flip_normals>(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    list[i++] = arena.make<xz_rect>(0, 555, 0, 555, 0, white);
+    list[i++] = arena.make<flip_normals>(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    // 2 Boxes inside the room (withut rotation or translation)
+    // list[i++] = arena.make<box>(vec3(130, 0, 65), vec3(295, 165, 230), white, &arena);
+    // list[i++] = arena.make<box>(vec3(265, 0, 295), vec3(430, 330, 460), white, &arena);
+
+    list[i++] = arena.make<translate>(arena.make<rotate_y>(arena.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white, &arena), -18), vec3(130, 0, 65));
+    list[i++] = arena.make<translate>(arena.make<rotate_y>(arena.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white, &arena), 15), vec3(265, 0, 295));
+
+    return arena.make<hitable_list>(list, i);
+}
+
+hitable *simple_light(scene_arena &arena)
+{
+    texture *pertext = arena.make<noise_texture>(4);
+
+    hitable **list = arena.make_array<hitable *>(4);
+
+    list[0] = arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(pertext));
+    list[1] = arena.make<sphere>(vec3(0, 2, 0), 2, arena.make<lambertian>(pertext));
+    // Lights are brighter than (1, 1, 1) to allow it to be bright enough to light things.
+    list[2] = arena.make<sphere>(vec3(0, 7, 0), 2, arena.make<diffuse_light>(arena.make<constant_texture>(vec3(4, 4, 4))));
+    list[3] = arena.make<xy_rect>(3, 5, 1, 3, -2, arena.make<diffuse_light>(arena.make<constant_texture>(vec3(4, 4, 4))));
+
+    return arena.make<hitable_list>(list, 4);
+}
+
+hitable *earth(scene_arena &arena) {
+    material *mat =  arena.make<lambertian>(load_image_texture(arena, "earthmap.jpg"));
+    return arena.make<sphere>(vec3(0,0, 0), 2, mat);
+}
+
+hitable *two_perlin_spheres(scene_arena &arena)
+{
+    texture *perlin_texture = arena.make<noise_texture>(4);
+
+    hitable **list = arena.make_array<hitable *>(2);
+
+    list[0] = arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(perlin_texture));
+    list[1] = arena.make<sphere>(vec3(0, 2, 0), 2, arena.make<lambertian>(perlin_texture));
+
+    return arena.make<hitable_list>(list, 2);
+}
+
+hitable *two_spheres(scene_arena &arena)
+{
+    texture *checker = arena.make<checker_texture>(arena.make<constant_texture>(vec3(0.2, 0.3, 0.1)),
+                       arena.make<constant_texture>(vec3(0.9, 0.9, 0.9)));
+
+    int n = 50;
+
+    hitable **list = arena.make_array<hitable *>(n + 1);
+
+    list[0] = arena.make<sphere>(vec3(0, -10, 0), 10, arena.make<lambertian>(checker));
+    list[1] = arena.make<sphere>(vec3(0, 10, 0), 10, arena.make<lambertian>(checker));
+
+    return arena.make<hitable_list>(list, 2);
+}
+
+hitable *random_scene(scene_arena &arena)
+{
+    int n = 50000;
+    hitable **list = arena.make_array<hitable *>(n+1);
+
+    texture *checker = arena.make<checker_texture>(arena.make<constant_texture>(vec3(0.2, 0.3, 0.1)),
+                                           arena.make<constant_texture>(vec3(0.9, 0.9, 0.9)));
+    list[0] = arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(checker));
+
+    int i = 1;
+
+    for(int a = -10; a < 10; a++)
+    {
+        for(int b = -10; b < 10; b++)
+        {
+            float choose_mat = drand48();
+            vec3 center(a + 0.9 * drand48(), 0.2, b + 0.9 * drand48());
+
+            if ((center - vec3(4, 0.2, 0)).length() > 0.9)
+            {
+                if (choose_mat < 0.8) // Diffuse
+                {
+                    vec3 albedo = vec3(drand48() * drand48(), drand48() * drand48(), drand48() * drand48());
+                    list[i++] = arena.make<moving_sphere>(center, center + vec3(0, 0.5 * drand48(), 0), 0.0, 1.0, 0.2,
+                                                  arena.make<lambertian>(arena.make<constant_texture>(albedo)));
+                }
+                else if (choose_mat < 0.95) // Metal
+                {
+                    vec3 albedo = vec3(0.5 * (1 + drand48()), 0.5 * (1 + drand48()), 0.5 * (1 + drand48()));
+                    float fuzz = 0.5 * drand48();
+                    list[i++] = arena.make<sphere>(center, 0.2, arena.make<metal>(albedo, fuzz));
+                }
+                else // Glass
+                {
+                    list[i++] = arena.make<sphere>(center, 0.2, arena.make<dielectric>(1.5));
+                }
+            }
+        }
+    }
+
+    list[i++] = arena.make<sphere>(vec3(0, 1, 0), 1.0, arena.make<dielectric>(1.5));
+    list[i++] = arena.make<sphere>(vec3(-4, 1, 0), 1.0, arena.make<lambertian>(arena.make<constant_texture>(vec3(0.4, 0.2, 0.1))));
+    list[i++] = arena.make<sphere>(vec3(4, 1, 0), 1.0, arena.make<metal>(vec3(0.7, 0.6, 0.5), 0.0));
+
+    // Most small spheres move during the shutter, so the BVH interpolates its bounds by ray time. It can also be
+    // refit frame by frame for animations.
+    return arena.make<motion_bvh>(list, i, 0.0, 1.0, motion_time_segments);
+}
+
+typedef hitable *(*scene_builder)(scene_arena &arena);
+
+// A built-in scene together with the camera it was designed for.
+struct scene_entry
+{
+    const char *name;
+    scene_builder build;
+    camera_settings cam;
+};
+
+const scene_entry scene_table[] = {
+    {"cornell_box_final_book2", cornell_box_final_book2, {vec3(478, 278, -600), vec3(278, 278, 0), vec3(0, 1, 0), 40, 0.0, 10.0, 0.0, 1.0}},
+    {"cornell_smoke", cornell_smoke, {vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40, 0.0, 10.0, 0.0, 1.0}},
+    {"cornell_box", cornell_box, {vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40, 0.0, 10.0, 0.0, 1.0}},
+    {"simple_light", simple_light, {vec3(20, 4, 5), vec3(0, 2, 0), vec3(0, 1, 0), 20, 0.0, 10.0, 0.0, 1.0}},
+    {"earth", earth, {vec3(20, 4, 5), vec3(0, 2, 0), vec3(0, 1, 0), 20, 0.0, 10.0, 0.0, 1.0}},
+    {"two_perlin_spheres", two_perlin_spheres, {vec3(20, 4, 5), vec3(0, 2, 0), vec3(0, 1, 0), 20, 0.0, 10.0, 0.0, 1.0}},
+    {"two_spheres", two_spheres, {vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 20, 0.0, 10.0, 0.0, 1.0}},
+    {"random_scene", random_scene, {vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 20, 0.0, 10.0, 0.0, 1.0}},
+};
+
+// Returns nullptr if there is no built-in scene with that name.
+const scene_entry *find_scene(const char *name)
+{
+    for (const scene_entry &entry : scene_table)
+    {
+        if (strcmp(entry.name, name) == 0)
+        {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+#endif // SCENESHPP
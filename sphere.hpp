@@ -32,6 +32,7 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            rec.uv_extent = sphere_uv_extent(radius);
             rec.normal = (rec.p - center) / radius;
             rec.mat_ptr = mat_ptr;
 
@@ -44,6 +45,7 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            rec.uv_extent = sphere_uv_extent(radius);
             rec.normal = (rec.p - center) / radius;
             rec.mat_ptr = mat_ptr;
 
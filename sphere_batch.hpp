@@ -0,0 +1,441 @@
+#ifndef SPHEREBATCHHPP
+#define SPHEREBATCHHPP
+
+#include "hitable.hpp"
+#include "sphere.hpp"
+#include "moving_sphere.hpp"
+#include "bvh_tree.hpp"
+#include "cpu_dispatch.hpp"
+#include <immintrin.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Spheres of a BVH copied out into structure-of-arrays form, in leaf order, so a leaf tests all its spheres at once
+ * instead of making one virtual call and one branchy quadratic solve per sphere. On CPUs with AVX2 and FMA (picked at
+ * run time, see cpu_dispatch.hpp) the test runs 8 lanes wide: discriminant, both roots, the [t_min, t_max] masks and a
+ * min-reduction for the closest lane; AVX-512 does the same with mask registers. SSE4.2 runs the scalar arithmetic 4
+ * lanes wide, and older CPUs run it in a plain loop.
+ *
+ * Static and moving spheres share the layout: the center at time t is center + (t - time0) * velocity, with a zero
+ * velocity for static ones. Only the winning sphere fills in the hit_record.
+ */
+class sphere_batch
+{
+	public:
+		// Lanes per test. BVHs over batched spheres use this as their leaf size.
+		static const int width = 8;
+
+		// True if every primitive is a sphere or moving_sphere.
+		static bool accepts(hitable *const *prims, int n);
+
+		// Copy the spheres of "prims" (in leaf order). Returns false, leaving the batch empty, if accepts() doesn't.
+		bool build(const std::vector<hitable *> &prims);
+
+		void clear()
+		{
+			cx.clear();
+			cy.clear();
+			cz.clear();
+			vx.clear();
+			vy.clear();
+			vz.clear();
+			time0.clear();
+			radius.clear();
+			materials.clear();
+		}
+
+		bool empty() const
+		{
+			return materials.empty();
+		}
+
+		/*
+		 * Closest hit among spheres [first, first + count). Lowers t_max and fills "rec" on a hit, like a BVH leaf.
+		 * Kernels for scenes without motion blur leave out the move to the ray's time, and ones without (u, v)
+		 * textures the u, v of the hit.
+		 */
+		template<bool motion = true, bool uv = true>
+		bool hit(const ray &r, int first, int count, float t_min, float &t_max, hit_record &rec) const;
+
+		typedef std::vector<float, cache_aligned_allocator<float>> lane_vector;
+
+		// Padded by "width" lanes, so full-width loads at the last spheres stay in bounds.
+		lane_vector cx, cy, cz;
+		lane_vector vx, vy, vz;
+		lane_vector time0;
+		lane_vector radius;
+		std::vector<material *> materials;
+
+	private:
+		/*
+		 * Index of the closest sphere in [first, first + count) hit within (t_min, t_max), or -1; "t" gets its hit.
+		 * Runs the version for kernel_isa; count is at most "width".
+		 */
+		template<bool motion>
+		int closest(const ray &r, int first, int count, float t_min, float t_max, float &t) const;
+
+		template<bool motion>
+		int closest_scalar(const ray &r, int first, int count, float t_min, float t_max, float &t) const;
+		template<bool motion>
+		int closest_sse42(const ray &r, int first, int count, float t_min, float t_max, float &t) const;
+		template<bool motion>
+		int closest_avx2(const ray &r, int first, int count, float t_min, float t_max, float &t) const;
+		template<bool motion>
+		int closest_avx512(const ray &r, int first, int count, float t_min, float t_max, float &t) const;
+		template<bool motion>
+		void roots8(const ray &r, int first, __m256 &disc, __m256 &near, __m256 &far) const;
+};
+
+bool sphere_batch::accepts(hitable *const *prims, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (!dynamic_cast<const sphere *>(prims[i]) && !dynamic_cast<const moving_sphere *>(prims[i]))
+		{
+			return false;
+		}
+	}
+
+	return n > 0;
+}
+
+bool sphere_batch::build(const std::vector<hitable *> &prims)
+{
+	int n = prims.size();
+
+	clear();
+
+	if (!accepts(prims.data(), n))
+	{
+		return false;
+	}
+
+	for (lane_vector *lanes : {&cx, &cy, &cz, &vx, &vy, &vz, &time0, &radius})
+	{
+		lanes->assign(n + width, 0.0f);
+	}
+
+	materials.resize(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		vec3 center;
+		vec3 velocity(0, 0, 0);
+
+		if (const sphere *s = dynamic_cast<const sphere *>(prims[i]))
+		{
+			center = s->center;
+			radius[i] = s->radius;
+			materials[i] = s->mat_ptr;
+		}
+		else
+		{
+			const moving_sphere *m = static_cast<const moving_sphere *>(prims[i]);
+
+			center = m->center0;
+			velocity = (m->center1 - m->center0) / (m->time1 - m->time0);
+			time0[i] = m->time0;
+			radius[i] = m->radius;
+			materials[i] = m->mat_ptr;
+		}
+
+		cx[i] = center.x();
+		cy[i] = center.y();
+		cz[i] = center.z();
+		vx[i] = velocity.x();
+		vy[i] = velocity.y();
+		vz[i] = velocity.z();
+	}
+
+	return true;
+}
+
+template<bool motion>
+inline __attribute__((always_inline)) int sphere_batch::closest_scalar(const ray &r, int first, int count,
+                                                                       float t_min, float t_max, float &t) const
+{
+	const vec3 &o = r.origin();
+	const vec3 &d = r.direction();
+	float a = dot(d, d);
+	int best = -1;
+
+	for (int i = first; i < first + count; i++)
+	{
+		float dt = motion ? r.time() - time0[i] : 0;
+		float ocx = o.x() - (cx[i] + dt * vx[i]);
+		float ocy = o.y() - (cy[i] + dt * vy[i]);
+		float ocz = o.z() - (cz[i] + dt * vz[i]);
+		float b = ocx * d.x() + ocy * d.y() + ocz * d.z();
+		float c = ocx * ocx + ocy * ocy + ocz * ocz - radius[i] * radius[i];
+		float disc = b * b - a * c;
+		float root = sqrtf(disc > 0 ? disc : 0);
+		float near = (-b - root) / a;
+		float far = (-b + root) / a;
+		float hit_t = near > t_min && near < t_max ? near : far;
+		bool valid = disc > 0 && hit_t > t_min && hit_t < t_max;
+
+		if (valid)
+		{
+			t_max = hit_t;
+			best = i;
+		}
+	}
+
+	t = t_max;
+
+	return best;
+}
+
+/*
+ * The scalar test, 4 lanes at a time in two passes over the 8 spheres. It keeps the scalar version's operations and
+ * their order (no FMA, a division by a rather than a multiply by 1 / a), so it finds the same hits to the bit.
+ */
+template<bool motion>
+TARGET_SSE42 int sphere_batch::closest_sse42(const ray &r, int first, int count, float t_min, float t_max,
+                                             float &t) const
+{
+	const vec3 &o = r.origin();
+	const vec3 &d = r.direction();
+	__m128 a = _mm_set1_ps(dot(d, d));
+	__m128 lo = _mm_set1_ps(t_min);
+	__m128 hi = _mm_set1_ps(t_max);
+	__m128 zero = _mm_setzero_ps();
+	__m128 best_t = _mm_set1_ps(FLT_MAX);
+	__m128i best_i = _mm_set1_epi32(-1);
+
+	for (int k = 0; k < count; k += 4)
+	{
+		int i = first + k;
+		__m128 centers[3] = {_mm_loadu_ps(&cx[i]), _mm_loadu_ps(&cy[i]), _mm_loadu_ps(&cz[i])};
+
+		if (motion)
+		{
+			__m128 dt = _mm_sub_ps(_mm_set1_ps(r.time()), _mm_loadu_ps(&time0[i]));
+
+			centers[0] = _mm_add_ps(centers[0], _mm_mul_ps(dt, _mm_loadu_ps(&vx[i])));
+			centers[1] = _mm_add_ps(centers[1], _mm_mul_ps(dt, _mm_loadu_ps(&vy[i])));
+			centers[2] = _mm_add_ps(centers[2], _mm_mul_ps(dt, _mm_loadu_ps(&vz[i])));
+		}
+
+		__m128 ocx = _mm_sub_ps(_mm_set1_ps(o.x()), centers[0]);
+		__m128 ocy = _mm_sub_ps(_mm_set1_ps(o.y()), centers[1]);
+		__m128 ocz = _mm_sub_ps(_mm_set1_ps(o.z()), centers[2]);
+		__m128 rad = _mm_loadu_ps(&radius[i]);
+
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(d.x())), _mm_mul_ps(ocy, _mm_set1_ps(d.y()))),
+		                      _mm_mul_ps(ocz, _mm_set1_ps(d.z())));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+		                      _mm_mul_ps(rad, rad));
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+		__m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+		__m128 minus_b = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+		__m128 near = _mm_div_ps(_mm_sub_ps(minus_b, root), a);
+		__m128 far = _mm_div_ps(_mm_add_ps(minus_b, root), a);
+
+		__m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near, lo), _mm_cmplt_ps(near, hi));
+		__m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far, lo), _mm_cmplt_ps(far, hi));
+		__m128 lanes = _mm_cmplt_ps(_mm_set_ps(k + 3, k + 2, k + 1, k), _mm_set1_ps(float(count)));
+		__m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(disc, zero), lanes), _mm_or_ps(near_ok, far_ok));
+		__m128 lane_t = _mm_blendv_ps(_mm_set1_ps(FLT_MAX), _mm_blendv_ps(far, near, near_ok), valid);
+
+		// Strictly closer only, so on a tie the sphere of the first pass stays, as in the scalar loop.
+		__m128 closer = _mm_cmplt_ps(lane_t, best_t);
+
+		best_t = _mm_blendv_ps(best_t, lane_t, closer);
+		best_i = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(best_i),
+		                                        _mm_castsi128_ps(_mm_set_epi32(i + 3, i + 2, i + 1, i)), closer));
+	}
+
+	alignas(16) float lane_t[4];
+	alignas(16) int lane_i[4];
+	int best = -1;
+
+	_mm_store_ps(lane_t, best_t);
+	_mm_store_si128((__m128i *)lane_i, best_i);
+
+	// The closest of the 4 lanes, the first sphere among equals.
+	for (int j = 0; j < 4; j++)
+	{
+		if (lane_i[j] >= 0 && (best < 0 || lane_t[j] < t || (lane_t[j] == t && lane_i[j] < best)))
+		{
+			t = lane_t[j];
+			best = lane_i[j];
+		}
+	}
+
+	return best;
+}
+
+// Discriminant and both roots of the 8 spheres from "first", as in sphere::hit(). Shared by AVX2 and AVX-512.
+template<bool motion>
+TARGET_AVX2 inline __attribute__((always_inline)) void sphere_batch::roots8(const ray &r, int first, __m256 &disc,
+                                                                           __m256 &near, __m256 &far) const
+{
+	const vec3 &o = r.origin();
+	const vec3 &d = r.direction();
+	float a = dot(d, d);
+
+	// oc = origin - center, with the center moved to the ray's time.
+	__m256 centers[3] = {_mm256_loadu_ps(&cx[first]), _mm256_loadu_ps(&cy[first]), _mm256_loadu_ps(&cz[first])};
+
+	if (motion)
+	{
+		__m256 dt = _mm256_sub_ps(_mm256_set1_ps(r.time()), _mm256_loadu_ps(&time0[first]));
+
+		centers[0] = _mm256_fmadd_ps(dt, _mm256_loadu_ps(&vx[first]), centers[0]);
+		centers[1] = _mm256_fmadd_ps(dt, _mm256_loadu_ps(&vy[first]), centers[1]);
+		centers[2] = _mm256_fmadd_ps(dt, _mm256_loadu_ps(&vz[first]), centers[2]);
+	}
+
+	__m256 ocx = _mm256_sub_ps(_mm256_set1_ps(o.x()), centers[0]);
+	__m256 ocy = _mm256_sub_ps(_mm256_set1_ps(o.y()), centers[1]);
+	__m256 ocz = _mm256_sub_ps(_mm256_set1_ps(o.z()), centers[2]);
+	__m256 rad = _mm256_loadu_ps(&radius[first]);
+
+	__m256 b = _mm256_fmadd_ps(ocx, _mm256_set1_ps(d.x()),
+	                           _mm256_fmadd_ps(ocy, _mm256_set1_ps(d.y()), _mm256_mul_ps(ocz, _mm256_set1_ps(d.z()))));
+	__m256 oc_oc = _mm256_fmadd_ps(ocx, ocx, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocz, ocz)));
+	__m256 c = _mm256_fnmadd_ps(rad, rad, oc_oc);
+
+	disc = _mm256_fmsub_ps(b, b, _mm256_mul_ps(_mm256_set1_ps(a), c));
+
+	__m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+	__m256 inv_a = _mm256_set1_ps(1.0f / a);
+
+	near = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), root), inv_a);
+	far = _mm256_mul_ps(_mm256_sub_ps(root, b), inv_a);
+}
+
+// Minimum of the 8 lanes, in every lane.
+TARGET_AVX2 inline __attribute__((always_inline)) __m256 lane_min(__m256 v)
+{
+	__m256 m = _mm256_min_ps(v, _mm256_permute2f128_ps(v, v, 1));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	return _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+template<bool motion>
+TARGET_AVX2 int sphere_batch::closest_avx2(const ray &r, int first, int count, float t_min, float t_max,
+                                           float &t) const
+{
+	__m256 disc, near, far;
+
+	roots8<motion>(r, first, disc, near, far);
+
+	__m256 lo = _mm256_set1_ps(t_min);
+	__m256 hi = _mm256_set1_ps(t_max);
+	__m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near, lo, _CMP_GT_OQ), _mm256_cmp_ps(near, hi, _CMP_LT_OQ));
+	__m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far, lo, _CMP_GT_OQ), _mm256_cmp_ps(far, hi, _CMP_LT_OQ));
+	__m256 lanes = _mm256_cmp_ps(_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_ps(float(count)), _CMP_LT_OQ);
+	__m256 valid = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GT_OQ), lanes),
+	                             _mm256_or_ps(near_ok, far_ok));
+
+	int mask = _mm256_movemask_ps(valid);
+
+	if (!mask)
+	{
+		return -1;
+	}
+
+	// Like sphere::hit(), the near root wins when it is in range.
+	__m256 lane_t = _mm256_blendv_ps(far, near, near_ok);
+	lane_t = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), lane_t, valid);
+
+	// The first lane holding the minimum.
+	__m256 m = lane_min(lane_t);
+
+	t = _mm256_cvtss_f32(m);
+
+	return first + __builtin_ctz(_mm256_movemask_ps(_mm256_cmp_ps(lane_t, m, _CMP_EQ_OQ)) & mask);
+}
+
+// Same test with AVX-512VL mask registers: compares go straight to bit masks, without movemask and blendv.
+template<bool motion>
+TARGET_AVX512 int sphere_batch::closest_avx512(const ray &r, int first, int count, float t_min, float t_max,
+                                               float &t) const
+{
+	__m256 disc, near, far;
+
+	roots8<motion>(r, first, disc, near, far);
+
+	__m256 lo = _mm256_set1_ps(t_min);
+	__m256 hi = _mm256_set1_ps(t_max);
+	__mmask8 lanes = __mmask8((1u << count) - 1);
+	__mmask8 near_ok = _mm256_mask_cmp_ps_mask(_mm256_cmp_ps_mask(near, lo, _CMP_GT_OQ), near, hi, _CMP_LT_OQ);
+	__mmask8 far_ok = _mm256_mask_cmp_ps_mask(_mm256_cmp_ps_mask(far, lo, _CMP_GT_OQ), far, hi, _CMP_LT_OQ);
+	__mmask8 valid = _mm256_mask_cmp_ps_mask(lanes, disc, _mm256_setzero_ps(), _CMP_GT_OQ) & (near_ok | far_ok);
+
+	if (!valid)
+	{
+		return -1;
+	}
+
+	__m256 lane_t = _mm256_mask_blend_ps(near_ok, far, near);
+	lane_t = _mm256_mask_blend_ps(valid, _mm256_set1_ps(FLT_MAX), lane_t);
+
+	__m256 m = lane_min(lane_t);
+
+	t = _mm256_cvtss_f32(m);
+
+	return first + __builtin_ctz(_mm256_cmp_ps_mask(lane_t, m, _CMP_EQ_OQ) & valid);
+}
+
+template<bool motion>
+int sphere_batch::closest(const ray &r, int first, int count, float t_min, float t_max, float &t) const
+{
+	switch (kernel_isa)
+	{
+		case ISA_AVX512:
+			return closest_avx512<motion>(r, first, count, t_min, t_max, t);
+		case ISA_AVX2:
+			return closest_avx2<motion>(r, first, count, t_min, t_max, t);
+		case ISA_SSE42:
+			return closest_sse42<motion>(r, first, count, t_min, t_max, t);
+		default:
+			return closest_scalar<motion>(r, first, count, t_min, t_max, t);
+	}
+}
+
+template<bool motion, bool uv>
+bool sphere_batch::hit(const ray &r, int first, int count, float t_min, float &t_max, hit_record &rec) const
+{
+	int best = -1;
+
+	for (int begin = first; begin < first + count; begin += width)
+	{
+		float t;
+		int lane = closest<motion>(r, begin, std::min(int(width), first + count - begin), t_min, t_max, t);
+
+		if (lane >= 0)
+		{
+			best = lane;
+			t_max = t;
+		}
+	}
+
+	if (best < 0)
+	{
+		return false;
+	}
+
+	float dt = motion ? r.time() - time0[best] : 0;
+	vec3 center(cx[best] + dt * vx[best], cy[best] + dt * vy[best], cz[best] + dt * vz[best]);
+
+	rec.t = t_max;
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = (rec.p - center) / radius[best];
+	rec.mat_ptr = materials[best];
+
+	if (uv)
+	{
+		get_sphere_uv(rec.normal, rec.u, rec.v);
+		rec.uv_extent = sphere_uv_extent(radius[best]);
+	}
+
+	return true;
+}
+
+#endif // SPHEREBATCHHPP
@@ -870,8 +870,20 @@ static stbi_uc *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// one per thread, as in later stb_image releases: the renderer decodes textures on several threads at once
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL __declspec(thread)
+   #else
+      #define STBI_THREAD_LOCAL
+   #endif
+#endif
+
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
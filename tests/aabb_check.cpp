@@ -0,0 +1,105 @@
+/*
+ * Check of the slab test in aabb::hit against the one it replaced (per-axis division and a swap for negative
+ * directions, with that version's missing return and its tmax update from t0 fixed), on random rays and on rays
+ * parallel to one or two axes, some starting exactly on a box plane. Rays parallel to an axis that pass beside the box
+ * on that axis must also miss it.
+ *
+ *     g++ -std=c++17 -O2 -I.. aabb_check.cpp -o aabb_check && ./aabb_check
+ */
+#include "aabb.hpp"
+#include <stdlib.h>
+#include <iostream>
+#include <utility>
+
+bool reference_hit(const aabb &box, const ray &r, float tmin, float tmax)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		float invD = 1.0f / r.direction()[a];
+		float t0 = (box.min()[a] - r.origin()[a]) * invD;
+		float t1 = (box.max()[a] - r.origin()[a]) * invD;
+
+		if (invD < 0.0f)
+		{
+			std::swap(t0, t1);
+		}
+
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+	}
+
+	return tmin <= tmax;
+}
+
+// Random coordinate, now and then exactly on one of the box planes.
+float coordinate(const aabb &box, int a)
+{
+	double u = drand48();
+
+	if (u < 0.1)
+	{
+		return box.min()[a];
+	}
+
+	if (u < 0.2)
+	{
+		return box.max()[a];
+	}
+
+	return drand48() * 8 - 4;
+}
+
+int main()
+{
+	int rays = 0;
+	int differences = 0;
+	int parallel_misses = 0;
+	int parallel_wrong = 0;
+
+	srand48(1);
+
+	for (int b = 0; b < 1000; b++)
+	{
+		vec3 lo(drand48() * 4 - 2, drand48() * 4 - 2, drand48() * 4 - 2);
+		aabb box(lo, lo + vec3(drand48() * 2, drand48() * 2, drand48() * 2));
+
+		for (int k = 0; k < 1000; k++)
+		{
+			vec3 origin(coordinate(box, 0), coordinate(box, 1), coordinate(box, 2));
+			vec3 direction(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5);
+			int flat = k % 4;  // 0: random direction, 1-3: zero on one or two axes, either sign of zero.
+
+			for (int a = 0; a < 3; a++)
+			{
+				if ((flat == 1 && a == 0) || (flat == 2 && a != 1) || (flat == 3 && a == 2))
+				{
+					direction[a] = drand48() < 0.5 ? 0.0f : -0.0f;
+				}
+			}
+
+			ray r(origin, direction);
+			float t_max = drand48() < 0.5 ? 1e30f : float(drand48() * 4);
+			bool hit = box.hit(r, 0.001f, t_max);
+
+			rays++;
+			differences += hit != reference_hit(box, r, 0.001f, t_max);
+
+			// A parallel ray outside the slab of its zero axis can't reach the box.
+			for (int a = 0; a < 3; a++)
+			{
+				if (direction[a] == 0 && (origin[a] < box.min()[a] || origin[a] > box.max()[a]))
+				{
+					parallel_misses++;
+					parallel_wrong += hit;
+					break;
+				}
+			}
+		}
+	}
+
+	std::cout << (differences || parallel_wrong ? "FAIL " : "ok   ") << rays << " rays: " << differences
+	          << " differ from the reference, " << parallel_wrong << " of " << parallel_misses
+	          << " parallel rays beside the box not culled\n";
+
+	return differences || parallel_wrong ? 1 : 0;
+}
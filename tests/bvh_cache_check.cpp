@@ -0,0 +1,256 @@
+/*
+ * Check of the on-disk BVH cache (--bvh-cache): a second flat_bvh over the same spheres must map the file written by
+ * the first instead of rebuilding, and a file that is corrupt, truncated, from another version or for other geometry
+ * must be rejected, rebuilt and rewritten. So must files with a valid checksum whose tree points outside itself: an
+ * index past the primitives, a leaf past the index array or larger than a leaf may be, a child before its parent, a
+ * bad split axis. Whether a tree was loaded or rebuilt shows in the file: a rebuild replaces it by rename, so its inode
+ * changes. Every tree must give the same closest hits as a brute force test of the spheres.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. bvh_cache_check.cpp -o bvh_cache_check && ./bvh_cache_check
+ */
+#include "flat_bvh.hpp"
+#include "sphere.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+std::vector<std::string> cache_files(const std::string &dir)
+{
+	std::vector<std::string> files;
+	DIR *d = opendir(dir.c_str());
+
+	while (dirent *e = readdir(d))
+	{
+		if (e->d_name[0] != '.')
+		{
+			files.push_back(dir + "/" + e->d_name);
+		}
+	}
+
+	closedir(d);
+
+	return files;
+}
+
+ino_t inode(const std::string &path)
+{
+	struct stat st;
+
+	return stat(path.c_str(), &st) == 0 ? st.st_ino : 0;
+}
+
+// Rays whose closest hit differs between "bvh" and testing every sphere.
+int wrong_hits(hitable *bvh, const std::vector<hitable *> &list)
+{
+	int wrong = 0;
+
+	for (int k = 0; k < 20000; k++)
+	{
+		ray r(vec3(drand48() * 120 - 60, drand48() * 120 - 60, -80),
+		      vec3(drand48() - 0.5, drand48() - 0.5, 1), 0);
+		hit_record a;
+		hit_record b;
+		float closest = FLT_MAX;
+		bool hit_a = bvh->hit(r, 0.001f, FLT_MAX, a);
+		bool hit_b = false;
+
+		for (hitable *h : list)
+		{
+			if (h->hit(r, 0.001f, closest, b))
+			{
+				hit_b = true;
+				closest = b.t;
+			}
+		}
+
+		wrong += hit_a != hit_b || (hit_a && a.t != closest);
+	}
+
+	return wrong;
+}
+
+// Overwrite "size" bytes at "offset" of "path" with "bytes", or truncate it there when bytes is null.
+void damage(const std::string &path, size_t offset, const void *bytes, size_t size)
+{
+	if (!bytes)
+	{
+		if (truncate(path.c_str(), offset) != 0)
+		{
+			std::cerr << "Cannot truncate " << path << "\n";
+		}
+
+		return;
+	}
+
+	std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+	f.seekp(offset);
+	f.write(static_cast<const char *>(bytes), size);
+}
+
+// Change node "node" of the cached tree at "path" with "edit", or index "index" to "value", and fix the checksum.
+template<typename F>
+void forge(const std::string &path, int node, F edit, int index = -1, int32_t value = 0)
+{
+	std::ifstream in(path, std::ios::binary);
+	std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	bvh_cache_header header;
+
+	memcpy(&header, bytes.data(), sizeof(header));
+
+	flat_bvh_node *nodes = reinterpret_cast<flat_bvh_node *>(&bytes[sizeof(header)]);
+	int32_t *indices = reinterpret_cast<int32_t *>(nodes + header.node_count);
+
+	if (node >= 0)
+	{
+		edit(nodes[node]);
+	}
+
+	if (index >= 0)
+	{
+		indices[index] = value;
+	}
+
+	header.checksum = fnv1a(indices, header.index_count * sizeof(int32_t),
+	                        fnv1a(nodes, header.node_count * sizeof(flat_bvh_node)));
+	damage(path, 0, &header, sizeof(header));
+	damage(path, sizeof(header), nodes, bytes.size() - sizeof(header));
+}
+
+int main()
+{
+	char dir[] = "/tmp/bvh_cache_check.XXXXXX";
+
+	if (!mkdtemp(dir))
+	{
+		std::cerr << "Cannot create a temporary directory\n";
+		return 1;
+	}
+
+	// The scalar leaf test, so hits match sphere::hit() exactly; the SIMD ones are compared in sphere_batch_check.cpp.
+	bvh_cache_dir = dir;
+	kernel_isa = ISA_BASELINE;
+	srand48(1);
+
+	std::vector<std::unique_ptr<sphere>> owned;
+	std::vector<hitable *> list;
+
+	for (int i = 0; i < 3000; i++)
+	{
+		vec3 c(drand48() * 100 - 50, drand48() * 100 - 50, drand48() * 100 - 50);
+
+		owned.emplace_back(new sphere(c, 0.5 + drand48(), nullptr));
+		list.push_back(owned.back().get());
+	}
+
+	int failures = 0;
+	auto report = [&](const char *name, bool ok, int wrong)
+	{
+		std::cout << (ok && !wrong ? "ok   " : "FAIL ") << name << ", " << wrong << " wrong hits\n";
+		failures += !ok || wrong;
+	};
+
+	// First build writes the file.
+	flat_bvh first(list.data(), list.size(), 0, 1);
+	std::vector<std::string> files = cache_files(dir);
+	std::string path = files.size() == 1 ? files[0] : "";
+	ino_t written = inode(path);
+
+	report("first build writes one file", files.size() == 1, wrong_hits(&first, list));
+
+	flat_bvh second(list.data(), list.size(), 0, 1);
+
+	report("second build maps it", inode(path) == written && cache_files(dir).size() == 1,
+	       wrong_hits(&second, list));
+
+	// Each kind of damage must be caught and the file rewritten.
+	struct stat st;
+	stat(path.c_str(), &st);
+
+	uint32_t other_version = bvh_cache_version + 1;
+	char garbage[4] = {'\x5a', '\x5a', '\x5a', '\x5a'};
+	struct
+	{
+		const char *name;
+		size_t offset;
+		const void *bytes;
+		size_t size;
+	} damages[] = {
+		{"flipped node bytes are rebuilt", sizeof(bvh_cache_header) + 40, garbage, sizeof(garbage)},
+		{"flipped index bytes are rebuilt", size_t(st.st_size) - 8, garbage, sizeof(garbage)},
+		{"a truncated file is rebuilt", size_t(st.st_size) - 4, nullptr, 0},
+		{"another version is rebuilt", offsetof(bvh_cache_header, version), &other_version, sizeof(other_version)},
+		{"a bad magic is rebuilt", 0, garbage, sizeof(garbage)},
+	};
+
+	for (const auto &d : damages)
+	{
+		damage(path, d.offset, d.bytes, d.size);
+		ino_t damaged = inode(path);
+
+		flat_bvh rebuilt(list.data(), list.size(), 0, 1);
+		struct stat now;
+		stat(path.c_str(), &now);
+
+		report(d.name, inode(path) != damaged && now.st_size == st.st_size, wrong_hits(&rebuilt, list));
+	}
+
+	// Valid checksums over trees that point outside themselves. Node 0 is the root; the first leaf is found below.
+	int leaf = 0;
+
+	for (const flat_bvh_node *n = second.tree.nodes; n->count == 0; n++)
+	{
+		leaf++;
+	}
+
+	struct
+	{
+		const char *name;
+		int node;
+		void (*edit)(flat_bvh_node &);
+		int index;
+		int32_t value;
+	} forgeries[] = {
+		{"an index past the primitives is rebuilt", -1, nullptr, 17, 3000},
+		{"a negative index is rebuilt", -1, nullptr, 17, -1},
+		{"a leaf past the index array is rebuilt", leaf, [](flat_bvh_node &n) { n.offset = 1 << 30; }, -1, 0},
+		{"a leaf larger than a leaf may be is rebuilt", leaf, [](flat_bvh_node &n) { n.count = 2000; }, -1, 0},
+		{"a child before its parent is rebuilt", 0, [](flat_bvh_node &n) { n.offset = 0; }, -1, 0},
+		{"a child past the nodes is rebuilt", 0, [](flat_bvh_node &n) { n.offset = 1 << 30; }, -1, 0},
+		{"a bad split axis is rebuilt", 0, [](flat_bvh_node &n) { n.axis = 7; }, -1, 0},
+	};
+
+	for (const auto &f : forgeries)
+	{
+		forge(path, f.node, [&](flat_bvh_node &n) { f.edit(n); }, f.index, f.value);
+		ino_t forged = inode(path);
+
+		flat_bvh rebuilt(list.data(), list.size(), 0, 1);
+		struct stat now;
+		stat(path.c_str(), &now);
+
+		report(f.name, inode(path) != forged && now.st_size == st.st_size, wrong_hits(&rebuilt, list));
+	}
+
+	// Moving one sphere changes the geometry: a new file, the old one kept for the old geometry.
+	static_cast<sphere *>(list[1234])->center += vec3(0.25, 0, 0);
+
+	flat_bvh moved(list.data(), list.size(), 0, 1);
+
+	report("moved geometry gets its own file", cache_files(dir).size() == 2, wrong_hits(&moved, list));
+
+	for (const std::string &f : cache_files(dir))
+	{
+		unlink(f.c_str());
+	}
+
+	rmdir(dir);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Check of the BVH builders: each tree below is built over the same 40000 spheres, a quarter of them moving and a few
+ * huge, and must give the same closest hit as a brute force test of every sphere on 20000 random rays at random
+ * times in the shutter. Leaves use the scalar sphere test, so distances must match exactly. 40000 is over twice
+ * bvh_parallel_grain, so builds with a pool split their top levels across it. Compact (quantized) trees must also
+ * decode every child box to contain all the primitives under it. Last, a hitable_list of the spheres plus an unbounded
+ * floor must build its BVH and hit what the plain list does.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. bvh_check.cpp -o bvh_check && ./bvh_check
+ */
+#include "flat_bvh.hpp"
+#include "hitable_list.hpp"
+#include "motion_bvh.hpp"
+#include "moving_sphere.hpp"
+#include "sphere.hpp"
+#include "arena.hpp"
+#include "thread_pool.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <stdlib.h>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+// Unbounded floor at y = k, for lists mixing bounded and unbounded members.
+class floor_plane : public hitable
+{
+	public:
+		floor_plane(float y) : k(y) {}
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+		{
+			float t = (k - r.origin().y()) / r.direction().y();
+
+			if (!(t > t_min && t < t_max))
+			{
+				return false;
+			}
+
+			rec.t = t;
+			rec.p = r.point_at_parameter(t);
+			rec.normal = vec3(0, 1, 0);
+			rec.mat_ptr = nullptr;
+
+			return true;
+		}
+
+		virtual bool bounding_box(float t0, float t1, aabb &box) const
+		{
+			return false;
+		}
+
+		float k;
+};
+
+struct tree_config
+{
+	const char *name;
+	std::function<hitable *(scene_arena &arena, std::vector<hitable *> &list)> build;
+};
+
+// Builds with the given globals set, restoring the defaults after.
+hitable *flat_tree(scene_arena &arena, std::vector<hitable *> &list, bvh_build_method method, thread_pool *pool,
+                   bool compact = false, bvh_node_layout layout = BVH_LAYOUT_DEPTH_FIRST)
+{
+	bvh_method = method;
+	bvh_build_pool = pool;
+	bvh_compact = compact;
+	bvh_layout = layout;
+
+	hitable *tree = arena.make<flat_bvh>(list.data(), list.size(), 0, 1);
+
+	bvh_method = BVH_BUILD_SAH;
+	bvh_build_pool = nullptr;
+	bvh_compact = false;
+	bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+
+	return tree;
+}
+
+/*
+ * Bounds of the primitives under "ref" of a compact tree into "real", counting the decoded child boxes on the way that
+ * don't contain them. Quantization must only ever grow a box.
+ */
+int uncontained(const flat_bvh &bvh, uint32_t ref, aabb &real)
+{
+	real = empty_box();
+
+	if (ref & quantized_leaf_bit)
+	{
+		int first = ref & quantized_max_first;
+		aabb box;
+
+		for (int i = first; i < first + int((ref >> 27) & 15); i++)
+		{
+			bvh.prims[i]->bounding_box(0, 1, box);
+			grow(real, box);
+		}
+
+		return 0;
+	}
+
+	const quantized_bvh_node &n = bvh.compact.nodes[ref];
+	aabb decoded[2];
+	int bad = 0;
+
+	quantized_bvh_tree::child_boxes(n, decoded);
+
+	for (int c = 0; c < 2; c++)
+	{
+		aabb child;
+
+		bad += uncontained(bvh, n.child[c], child);
+
+		for (int a = 0; a < 3; a++)
+		{
+			bad += decoded[c].min()[a] > child.min()[a] || decoded[c].max()[a] < child.max()[a];
+		}
+
+		grow(real, child);
+	}
+
+	return bad;
+}
+
+int main()
+{
+	scene_arena arena;
+	thread_pool pool(4);
+	std::vector<hitable *> list;
+
+	kernel_isa = ISA_BASELINE;
+	srand48(1);
+
+	for (int i = 0; i < 40000; i++)
+	{
+		vec3 c(drand48() * 400 - 200, drand48() * 400 - 200, drand48() * 400 - 200);
+		float radius = i % 10000 == 0 ? 50 : 0.5 + drand48() * 2;
+
+		if (i % 4 == 0)
+		{
+			vec3 v(drand48() * 40 - 20, drand48() * 40 - 20, drand48() * 40 - 20);
+
+			list.push_back(arena.make<moving_sphere>(c, c + v, 0, 1, radius, nullptr));
+		}
+		else
+		{
+			list.push_back(arena.make<sphere>(c, radius, nullptr));
+		}
+	}
+
+	std::vector<ray> rays;
+	std::vector<float> expected;
+
+	for (int k = 0; k < 20000; k++)
+	{
+		vec3 origin(drand48() * 600 - 300, drand48() * 600 - 300, drand48() * 600 - 300);
+		vec3 direction(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5);
+		ray r(origin, direction, drand48());
+		hit_record rec;
+		float closest = FLT_MAX;
+
+		for (hitable *h : list)
+		{
+			if (h->hit(r, 0.001f, closest, rec))
+			{
+				closest = rec.t;
+			}
+		}
+
+		rays.push_back(r);
+		expected.push_back(closest);
+	}
+
+	const tree_config configs[] = {
+		{"sah", [&](scene_arena &a, std::vector<hitable *> &l) { return flat_tree(a, l, BVH_BUILD_SAH, nullptr); }},
+		{"sah, 4 threads", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_SAH, &pool); }},
+		{"lbvh", [&](scene_arena &a, std::vector<hitable *> &l) { return flat_tree(a, l, BVH_BUILD_LBVH, nullptr); }},
+		{"lbvh, 4 threads", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_LBVH, &pool); }},
+		{"lbvh-treelet", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_LBVH_TREELET, nullptr); }},
+		{"lbvh-treelet, 4 threads", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_LBVH_TREELET, &pool); }},
+		{"sbvh", [&](scene_arena &a, std::vector<hitable *> &l) { return flat_tree(a, l, BVH_BUILD_SBVH, nullptr); }},
+		{"sah, compact", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_SAH, nullptr, true); }},
+		{"lbvh, compact", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_LBVH, nullptr, true); }},
+		{"sah, treelet layout", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_SAH, nullptr, false, BVH_LAYOUT_TREELET); }},
+		{"lbvh, treelet layout", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_LBVH, nullptr, false, BVH_LAYOUT_TREELET); }},
+		{"sah, treelet layout, compact", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return flat_tree(a, l, BVH_BUILD_SAH, nullptr, true, BVH_LAYOUT_TREELET); }},
+		{"motion_bvh", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return a.make<motion_bvh>(l.data(), l.size(), 0.0, 1.0); }},
+		{"motion_bvh, 4 time segments", [&](scene_arena &a, std::vector<hitable *> &l) {
+			return a.make<motion_bvh>(l.data(), l.size(), 0.0, 1.0, 4); }},
+	};
+
+	int failures = 0;
+
+	for (const tree_config &config : configs)
+	{
+		hitable *tree = config.build(arena, list);
+		int mismatches = 0;
+
+		for (size_t k = 0; k < rays.size(); k++)
+		{
+			hit_record rec;
+			float t = tree->hit(rays[k], 0.001f, FLT_MAX, rec) ? rec.t : FLT_MAX;
+
+			mismatches += t != expected[k];
+		}
+
+		flat_bvh *flat = dynamic_cast<flat_bvh *>(tree);
+		int bad_boxes = 0;
+
+		if (flat && !flat->compact.empty())
+		{
+			aabb all;
+			bad_boxes = uncontained(*flat, flat->compact.root, all);
+		}
+
+		std::cout << (mismatches || bad_boxes ? "FAIL " : "ok   ") << config.name << ": " << mismatches << " of "
+		          << rays.size() << " rays differ from testing every sphere";
+
+		if (flat && !flat->compact.empty())
+		{
+			std::cout << ", " << bad_boxes << " decoded planes cutting into their child";
+		}
+
+		std::cout << "\n";
+		failures += mismatches || bad_boxes;
+	}
+
+	// A long hitable_list builds a BVH over its bounded members and tests the floor apart; it must hit what the same
+	// list tested member by member does.
+	std::vector<hitable *> with_floor = list;
+	with_floor.insert(with_floor.begin() + with_floor.size() / 2, arena.make<floor_plane>(-150));
+
+	hitable_list *accelerated = arena.make<hitable_list>(with_floor.data(), with_floor.size());
+	list_bvh_threshold = 0;
+	hitable_list *plain = arena.make<hitable_list>(with_floor.data(), with_floor.size());
+	int mismatches = 0;
+
+	for (const ray &r : rays)
+	{
+		hit_record a;
+		hit_record b;
+		float t_a = accelerated->hit(r, 0.001f, FLT_MAX, a) ? a.t : FLT_MAX;
+		float t_b = plain->hit(r, 0.001f, FLT_MAX, b) ? b.t : FLT_MAX;
+
+		mismatches += t_a != t_b;
+	}
+
+	bool accelerated_ok = accelerated->accelerator && accelerated->unbounded.size() == 1 && !plain->accelerator;
+
+	std::cout << (mismatches || !accelerated_ok ? "FAIL " : "ok   ") << "hitable_list with a floor: " << mismatches
+	          << " of " << rays.size() << " rays differ from the plain list, "
+	          << (accelerated_ok ? "BVH over the bounded members" : "no BVH built") << "\n";
+	failures += mismatches || !accelerated_ok;
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,445 @@
+/*
+ * Check of flat_bvh::refit() over an animation: for each builder, with and without --bvh-compact and in both node
+ * layouts, 2000 moving spheres (a few of them huge, so SBVH splits) are refit for 12 frames. Every frame each primitive
+ * must be refit exactly once, the tree must hold no more references than the first build did, and the closest hit of
+ * random rays must match a brute force test of every sphere. motion_bvh gets the same checks with 1 and 4 time
+ * segments, and so does a scene graph refit from the top, the way animations refit their world. motion_bvh must also
+ * keep every tree within bvh_rebuild_threshold of the cost of its last build, and a rewrite of its children halfway
+ * through must visit each primitive once and leave refits and hits on the new ones.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. bvh_refit_check.cpp -o bvh_refit_check && ./bvh_refit_check
+ */
+#include "flat_bvh.hpp"
+#include "motion_bvh.hpp"
+#include "bvh.hpp"
+#include "hitable_list.hpp"
+#include "transform.hpp"
+#include "arena.hpp"
+#include "moving_sphere.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <stdlib.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Forwards to a sphere and counts its refits.
+class counted : public hitable
+{
+	public:
+		counted(hitable *h) : ptr(h) {}
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+		{
+			return ptr->hit(r, t_min, t_max, rec);
+		}
+
+		virtual bool bounding_box(float t0, float t1, aabb &box) const
+		{
+			return ptr->bounding_box(t0, t1, box);
+		}
+
+		virtual void refit(float t0, float t1)
+		{
+			refits++;
+		}
+
+		hitable *ptr;
+		std::atomic<int> refits{0};
+};
+
+int check(bvh_build_method method, bool compact, bvh_node_layout layout, thread_pool &pool)
+{
+	std::vector<std::unique_ptr<moving_sphere>> spheres;
+	std::vector<std::unique_ptr<counted>> wrapped;
+	std::vector<hitable *> list;
+
+	srand48(1);
+
+	for (int i = 0; i < 2000; i++)
+	{
+		vec3 c(drand48() * 200 - 100, drand48() * 200 - 100, drand48() * 200 - 100);
+		vec3 v(drand48() * 40 - 20, drand48() * 40 - 20, drand48() * 40 - 20);
+		float radius = i % 200 == 0 ? 60 : 0.5f + drand48();
+
+		spheres.emplace_back(new moving_sphere(c, c + v, 0, 1, radius, nullptr));
+		wrapped.emplace_back(new counted(spheres.back().get()));
+		list.push_back(wrapped.back().get());
+	}
+
+	bvh_method = method;
+	bvh_compact = compact;
+	bvh_layout = layout;
+	bvh_build_pool = &pool;
+
+	flat_bvh bvh(list.data(), list.size(), 0, 0.05f);
+	size_t first_refs = bvh.prims.size();
+	int failures = 0;
+
+	for (int frame = 1; frame <= 12; frame++)
+	{
+		float t0 = frame / 12.0f;
+		float t1 = t0 + 0.02f;
+
+		for (auto &w : wrapped)
+		{
+			w->refits = 0;
+		}
+
+		bvh.refit(t0, t1);
+
+		int wrong_refits = 0;
+
+		for (auto &w : wrapped)
+		{
+			wrong_refits += w->refits != 1;
+		}
+
+		int mismatches = 0;
+
+		for (int k = 0; k < 2000; k++)
+		{
+			vec3 origin(drand48() * 300 - 150, drand48() * 300 - 150, drand48() * 300 - 150);
+			vec3 direction = unit_vector(vec3(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5));
+			ray r(origin, direction, t0 + (t1 - t0) * drand48());
+			hit_record rec, best;
+			float closest = FLT_MAX;
+			bool brute = false;
+
+			for (hitable *h : list)
+			{
+				if (h->hit(r, 0.001f, closest, rec))
+				{
+					brute = true;
+					closest = rec.t;
+				}
+			}
+
+			bool found = bvh.hit(r, 0.001f, FLT_MAX, best);
+
+			mismatches += found != brute || (found && best.t != closest);
+		}
+
+		bool grew = bvh.prims.size() > first_refs + first_refs / 2 || bvh.members.size() != list.size();
+
+		if (wrong_refits || mismatches || grew)
+		{
+			std::cerr << "  frame " << frame << ": " << wrong_refits << " primitives not refit exactly once, "
+			          << mismatches << " of 2000 rays differ, " << bvh.prims.size() << " references\n";
+			failures++;
+		}
+	}
+
+	std::cout << (failures ? "FAIL " : "ok   ") << (method == BVH_BUILD_SBVH ? "sbvh" : "sah ")
+	          << (compact ? " compact" : "        ") << (layout == BVH_LAYOUT_TREELET ? " treelet" : "        ")
+	          << ": " << first_refs << " references after build, " << bvh.prims.size() << " after 12 frames\n";
+
+	return failures;
+}
+
+/*
+ * Same animation through a motion_bvh with "segments" time segments. Fast movers sit in every segment's tree, but must
+ * still be refit once per frame, over the whole frame. At frame 6 every child is swapped for a new wrapper of the same
+ * sphere, which later frames must refit instead of the old one.
+ */
+int check_motion(bvh_build_method method, int segments)
+{
+	std::vector<std::unique_ptr<moving_sphere>> spheres;
+	std::vector<std::unique_ptr<counted>> wrapped;
+	std::vector<hitable *> list;
+
+	srand48(2);
+
+	for (int i = 0; i < 2000; i++)
+	{
+		vec3 c(drand48() * 200 - 100, drand48() * 200 - 100, drand48() * 200 - 100);
+		vec3 v(drand48() * 40 - 20, drand48() * 40 - 20, drand48() * 40 - 20);
+
+		spheres.emplace_back(new moving_sphere(c, c + v, 0, 1, 0.5f + drand48(), nullptr));
+		wrapped.emplace_back(new counted(spheres.back().get()));
+		list.push_back(wrapped.back().get());
+	}
+
+	bvh_method = method;
+
+	motion_bvh bvh(list.data(), list.size(), 0, 0.05f, segments);
+	std::vector<std::unique_ptr<counted>> retired;
+	int visited = 0;
+	int rebuilds = 0;
+	int failures = 0;
+
+	auto trees = [&bvh]()
+	{
+		std::vector<const motion_tree *> all(1, &bvh.slow);
+
+		for (const motion_tree &tree : bvh.fast)
+		{
+			all.push_back(&tree);
+		}
+
+		return all;
+	};
+
+	for (int frame = 1; frame <= 12; frame++)
+	{
+		float t0 = frame / 12.0f;
+		float t1 = t0 + 0.05f;
+
+		if (frame == 6)
+		{
+			std::vector<std::unique_ptr<counted>> replaced;
+
+			bvh.visit_children([&](hitable *&h)
+			{
+				replaced.emplace_back(new counted(static_cast<counted *>(h)->ptr));
+				h = replaced.back().get();
+			});
+
+			visited = replaced.size();
+			retired = std::move(wrapped);
+			wrapped = std::move(replaced);
+
+			for (auto &w : retired)
+			{
+				w->refits = 0;
+			}
+		}
+
+		for (auto &w : wrapped)
+		{
+			w->refits = 0;
+		}
+
+		std::vector<float> built;
+
+		for (const motion_tree *tree : trees())
+		{
+			built.push_back(tree->built_cost);
+		}
+
+		bvh.refit(t0, t1);
+
+		int wrong_refits = 0;
+		int degraded = 0;
+		int k = 0;
+
+		for (auto &w : wrapped)
+		{
+			wrong_refits += w->refits != 1;
+		}
+
+		for (auto &w : retired)
+		{
+			wrong_refits += w->refits != 0;
+		}
+
+		for (const motion_tree *tree : trees())
+		{
+			degraded += tree->sah_cost() > tree->built_cost * bvh_rebuild_threshold * 1.0001f;
+			rebuilds += tree->built_cost != built[k++];
+		}
+
+		int mismatches = 0;
+
+		for (int k = 0; k < 2000; k++)
+		{
+			vec3 origin(drand48() * 300 - 150, drand48() * 300 - 150, drand48() * 300 - 150);
+			vec3 direction = unit_vector(vec3(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5));
+			ray r(origin, direction, t0 + (t1 - t0) * drand48());
+			hit_record rec, best;
+			float closest = FLT_MAX;
+			bool brute = false;
+
+			for (hitable *h : list)
+			{
+				if (h->hit(r, 0.001f, closest, rec))
+				{
+					brute = true;
+					closest = rec.t;
+				}
+			}
+
+			bool found = bvh.hit(r, 0.001f, FLT_MAX, best);
+
+			mismatches += found != brute || (found && best.t != closest);
+		}
+
+		if (wrong_refits || mismatches || degraded)
+		{
+			std::cerr << "  frame " << frame << ": " << wrong_refits << " primitives not refit exactly once, "
+			          << mismatches << " of 2000 rays differ, " << degraded << " trees past the rebuild threshold\n";
+			failures++;
+		}
+	}
+
+	bool rebuilt = bvh_rebuild_threshold == FLT_MAX ? rebuilds == 0 : rebuilds > 0;
+
+	if (visited != int(list.size()) || !rebuilt)
+	{
+		std::cerr << "  " << visited << " children visited, " << rebuilds << " trees rebuilt\n";
+		failures++;
+	}
+
+	std::cout << (failures ? "FAIL " : "ok   ") << "motion_bvh, " << (method == BVH_BUILD_SBVH ? "sbvh, " : "sah, ")
+	          << segments << " time segment" << (segments > 1 ? "s, " : ", ") << bvh.fast.size() << " fast trees, "
+	          << rebuilds << " rebuilds\n";
+
+	return failures;
+}
+
+/*
+ * Same animation through the holders a world is refit through: bvh_node, rotate_y, translate, transform, flip_normals
+ * and a hitable_list with its own BVH, under another bvh_node, which culls by their boxes. Every frame each sphere must
+ * be refit exactly once, and hits must match the same holders built around plain lists, which use no bounds.
+ */
+int check_graph()
+{
+	std::vector<std::unique_ptr<moving_sphere>> spheres;
+	std::vector<std::unique_ptr<counted>> wrapped;
+	scene_arena arena;
+
+	// Each group drifts as a whole, so a holder that keeps its old box loses whole parts of it.
+	vec3 drift[4] = {vec3(40, 0, 0), vec3(0, 40, 0), vec3(0, 0, -40), vec3(-40, -40, 0)};
+
+	srand48(3);
+
+	for (int i = 0; i < 2000; i++)
+	{
+		vec3 c(drand48() * 200 - 100, drand48() * 200 - 100, drand48() * 200 - 100);
+		vec3 v = drift[i / 500] + vec3(drand48() * 10 - 5, drand48() * 10 - 5, drand48() * 10 - 5);
+
+		spheres.emplace_back(new moving_sphere(c, c + v, 0, 1, 4 + 2 * drand48(), nullptr));
+		wrapped.emplace_back(new counted(spheres.back().get()));
+	}
+
+	bvh_method = BVH_BUILD_SAH;
+	bvh_compact = false;
+	bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+	bvh_build_pool = nullptr;
+	bvh_rebuild_threshold = 1.5f;
+
+	// Four groups of 500 spheres. "plain" builds them without BVHs, for reference.
+	auto group = [&](int g, bool plain) -> hitable *
+	{
+		hitable **members = arena.make_array<hitable *>(500);
+
+		for (int i = 0; i < 500; i++)
+		{
+			members[i] = wrapped[g * 500 + i].get();
+		}
+
+		if (plain || g == 2)
+		{
+			return arena.make<hitable_list>(members, 500, 0, 0.05f);
+		}
+
+		return arena.make<bvh_node>(members, 500, 0, 0.05f, &arena);
+	};
+
+	auto build = [&](bool plain) -> hitable *
+	{
+		affine_matrix m = affine_matrix::translation(vec3(0, -40, 0)) * affine_matrix::rotation_y(-60) *
+		                  affine_matrix::scaling(vec3(0.5f, 2, 1));
+		hitable **top = arena.make_array<hitable *>(4);
+
+		list_bvh_threshold = plain ? 0 : 8;
+		top[0] = group(0, plain);
+		top[1] = arena.make<translate>(arena.make<rotate_y>(group(1, plain), 30), vec3(50, 0, 0));
+		top[2] = arena.make<transform>(group(2, plain), m);
+		top[3] = arena.make<flip_normals>(group(3, plain));
+		list_bvh_threshold = 8;
+
+		if (plain)
+		{
+			return arena.make<hitable_list>(top, 4);
+		}
+
+		return arena.make<bvh_node>(top, 4, 0, 0.05f, &arena);
+	};
+
+	hitable *world = build(false);
+	hitable *reference = build(true);
+	int failures = 0;
+
+	for (int frame = 1; frame <= 12; frame++)
+	{
+		// Past the spheres' [0, 1], where boxes made at construction no longer cover them.
+		float t0 = frame / 4.0f;
+		float t1 = t0 + 0.05f;
+
+		for (auto &w : wrapped)
+		{
+			w->refits = 0;
+		}
+
+		world->refit(t0, t1);
+
+		int wrong_refits = 0;
+
+		for (auto &w : wrapped)
+		{
+			wrong_refits += w->refits != 1;
+		}
+
+		int mismatches = 0;
+
+		for (int k = 0; k < 2000; k++)
+		{
+			vec3 origin(drand48() * 300 - 150, drand48() * 300 - 150, drand48() * 300 - 150);
+			vec3 direction = unit_vector(vec3(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5));
+			ray r(origin, direction, t0 + (t1 - t0) * drand48());
+			hit_record expected, best;
+
+			bool brute = reference->hit(r, 0.001f, FLT_MAX, expected);
+			bool found = world->hit(r, 0.001f, FLT_MAX, best);
+
+			mismatches += found != brute || (found && best.t != expected.t);
+		}
+
+		if (wrong_refits || mismatches)
+		{
+			std::cerr << "  frame " << frame << ": " << wrong_refits << " primitives not refit exactly once, "
+			          << mismatches << " of 2000 rays differ\n";
+			failures++;
+		}
+	}
+
+	std::cout << (failures ? "FAIL " : "ok   ") << "scene graph of bvh_node, rotate_y, translate, transform, "
+	          << "flip_normals and hitable_list\n";
+
+	return failures;
+}
+
+int main()
+{
+	thread_pool pool(4);
+	int failures = 0;
+
+	// Rebuilding once refits have doubled the cost hides refit bugs behind the rebuild, so run refits alone too.
+	for (float threshold : {1.2f, FLT_MAX})
+	{
+		bvh_rebuild_threshold = threshold;
+		std::cout << (threshold == FLT_MAX ? "refit only:\n" : "rebuild past 1.2x the built cost:\n");
+
+		for (bvh_build_method method : {BVH_BUILD_SAH, BVH_BUILD_SBVH})
+		{
+			for (bool compact : {false, true})
+			{
+				for (bvh_node_layout layout : {BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_TREELET})
+				{
+					failures += check(method, compact, layout, pool);
+				}
+			}
+
+			for (int segments : {1, 4})
+			{
+				failures += check_motion(method, segments);
+			}
+		}
+	}
+
+	failures += check_graph();
+
+	return failures ? 1 : 0;
+}
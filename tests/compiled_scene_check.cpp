@@ -0,0 +1,432 @@
+/*
+ * Check the passes finalize_scene() runs, on every built-in scene: the graph after transform_collapser and the
+ * compiled_scene built from it must hit the same surfaces as the scene as built, on 100000 random rays through its
+ * bounds, like validate_compiled_scene().
+ *
+ * Four kinds of difference are expected and counted apart:
+ * - coincident faces, like a box standing on the floor, that tie-break the other way (same distance and material,
+ *   opposite normals). Up to 1% of the rays pass; a lost flip_normals turns far more hits around;
+ * - distances that round differently, off by less than 4e-6 of the scene's size (~64 float steps);
+ * - hits on the same material more than 1000 units along the ray. sphere::hit() squares that distance in float, so a
+ *   small sphere far away is only placed to about a unit, and a neighbouring sphere can win instead. Up to 10 per
+ *   scene pass;
+ * - scatter points in media (isotropic material). drand48() is reseeded per ray, but where a ray crosses several media
+ *   the compiled scene may test them in another order and hand them other draws. Up to 10 such rays per scene pass.
+ * Any other difference fails.
+ *
+ * Wrapper chains of every shape the collapser handles, and transforms that scale, are checked the same way against
+ * the graphs they replace.
+ *
+ * finalize_scene() itself must render the compiled scene when it passes validation, and the graph when it doesn't (a
+ * shape that hits on every other call makes the compiled scene disagree). It must leave drand48() where it was, and
+ * the compile summary must be printed once, not again on each refit.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. compiled_scene_check.cpp -o compiled_scene_check && ./compiled_scene_check
+ */
+#include "scenes.hpp"
+#include "scene_finalize.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+struct differences
+{
+	int coincident = 0;
+	int rounding = 0;
+	int far = 0;
+	int medium = 0;
+	int wrong = 0;
+};
+
+struct traced
+{
+	bool hit;
+	hit_record rec;
+};
+
+// drand48() is reseeded per ray, so media scatter at the same distance in every scene traced.
+std::vector<traced> trace(const hitable *world, const std::vector<ray> &rays)
+{
+	std::vector<traced> hits(rays.size());
+
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		unsigned short seed[3] = {0x330e, (unsigned short)i, (unsigned short)(i >> 16)};
+
+		seed48(seed);
+		hits[i].hit = world->hit(rays[i], 0.001f, FLT_MAX, hits[i].rec);
+	}
+
+	return hits;
+}
+
+differences compare(const std::vector<ray> &rays, const std::vector<traced> &reference,
+                    const std::vector<traced> &other, float scene_size)
+{
+	differences d;
+
+	for (size_t i = 0; i < reference.size(); i++)
+	{
+		bool hit_a = reference[i].hit;
+		bool hit_b = other[i].hit;
+		const hit_record &a = reference[i].rec;
+		const hit_record &b = other[i].rec;
+
+		if (!hit_a && !hit_b)
+		{
+			continue;
+		}
+
+		bool same_surface = hit_a && hit_b && a.mat_ptr == b.mat_ptr;
+		float dt = fabs(a.t - b.t);
+		// Normals of far hits may be off unit length by rounding, the same in both scenes.
+		float cosine = same_surface ? dot(unit_vector(a.normal), unit_vector(b.normal)) : 0;
+
+		if (same_surface && dt <= 1e-4f * fmax(1.0f, a.t) && cosine >= 0.999f)
+		{
+			continue;
+		}
+
+		if (same_surface && dt <= 1e-4f * fmax(1.0f, a.t) && cosine <= -0.999f)
+		{
+			d.coincident++;
+		}
+		else if (same_surface && dt <= 4e-6f * scene_size && cosine >= 0.999f)
+		{
+			d.rounding++;
+		}
+		else if (same_surface && (a.p - rays[i].origin()).length() > 1000 && cosine >= 0.99f)
+		{
+			d.far++;
+		}
+		else if ((hit_a && dynamic_cast<isotropic *>(a.mat_ptr)) || (hit_b && dynamic_cast<isotropic *>(b.mat_ptr)))
+		{
+			d.medium++;
+		}
+		else
+		{
+			d.wrong++;
+		}
+	}
+
+	return d;
+}
+
+float random_in(float lo, float hi)
+{
+	return lo + (hi - lo) * drand48();
+}
+
+vec3 random_in(const vec3 &lo, const vec3 &hi)
+{
+	return vec3(random_in(lo[0], hi[0]), random_in(lo[1], hi[1]), random_in(lo[2], hi[2]));
+}
+
+/*
+ * 200 spheres and boxes, each under translate(rotate_y(flip_normals?(translate(rotate_y(shape))))). One chain sits in
+ * two lists, and two more are flip_normals only: two of them around a sphere, and three. Every chain must collapse
+ * once, the shared one to one shared transform, the flips to the sphere and to one flip_normals, and the collapsed
+ * graph must hit what the chains did.
+ */
+int check_chains(int n)
+{
+	scene_arena arena;
+	hitable *chains[200];
+
+	srand48(1);
+
+	for (int i = 0; i < 200; i++)
+	{
+		material *mat = arena.make<lambertian>(arena.make<constant_texture>(vec3(drand48(), drand48(), drand48())));
+		vec3 size = random_in(vec3(1, 1, 1), vec3(4, 4, 4));
+		hitable *shape = i % 2 ? static_cast<hitable *>(arena.make<box>(-size, size, mat, &arena))
+		                       : arena.make<sphere>(vec3(0, 0, 0), size[0], mat);
+		hitable *inner = arena.make<translate>(arena.make<rotate_y>(shape, random_in(-180, 180)),
+		                                       random_in(vec3(-5, -5, -5), vec3(5, 5, 5)));
+
+		if (i % 3 == 0)
+		{
+			inner = arena.make<flip_normals>(inner);
+		}
+
+		chains[i] = arena.make<translate>(arena.make<rotate_y>(inner, random_in(-180, 180)),
+		                                  random_in(vec3(-100, -100, -100), vec3(100, 100, 100)));
+	}
+
+	material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+	material *red = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+	hitable *twice = arena.make<sphere>(vec3(0, 150, 0), 20, white);
+	hitable *thrice = arena.make<sphere>(vec3(0, -150, 0), 20, red);
+	hitable **first = arena.make_array<hitable *>(101);
+	hitable **second = arena.make_array<hitable *>(101);
+	hitable **top = arena.make_array<hitable *>(4);
+
+	for (int i = 0; i < 100; i++)
+	{
+		first[i] = chains[i];
+		second[i] = chains[100 + i];
+	}
+
+	first[100] = chains[0];
+	second[100] = chains[0];
+
+	hitable_list *first_list = arena.make<hitable_list>(first, 101);
+	hitable_list *second_list = arena.make<hitable_list>(second, 101);
+
+	top[0] = first_list;
+	top[1] = second_list;
+	top[2] = arena.make<flip_normals>(arena.make<flip_normals>(twice));
+	top[3] = arena.make<flip_normals>(arena.make<flip_normals>(arena.make<flip_normals>(thrice)));
+
+	hitable *world = arena.make<hitable_list>(top, 4);
+	aabb box;
+
+	world->bounding_box(0, 1, box);
+
+	std::vector<ray> rays = random_rays_in_box(box, n);
+	std::vector<traced> reference = trace(world, rays);
+	transform_collapser collapser(arena, 0, 1);
+	hitable *collapsed = collapser.collapse(world);
+	differences d = compare(rays, reference, trace(collapsed, rays), (box.max() - box.min()).length());
+	flip_normals *flipped = dynamic_cast<flip_normals *>(top[3]);
+	bool shape_ok = collapser.chains == 202 && first[0] == first[100] && first[0] == second[100] && top[2] == twice &&
+	                flipped && flipped->ptr == thrice;
+
+	for (int i = 0; i < 100; i++)
+	{
+		shape_ok &= dynamic_cast<transform *>(first[i]) && dynamic_cast<transform *>(second[i]);
+	}
+
+	bool ok = shape_ok && d.wrong == 0 && d.coincident * 100 <= n && d.far <= 10 && d.medium == 0;
+
+	std::cout << (ok ? "ok   " : "FAIL ") << "wrapper chains: " << collapser.chains << " collapsed"
+	          << (shape_ok ? "" : " into the wrong nodes") << ", " << d.wrong << " of " << n
+	          << " rays differ from the chains, " << d.coincident << " coincident faces, " << d.rounding
+	          << " rounding\n";
+
+	return !ok;
+}
+
+/*
+ * A transform that scales must hit what the scaled shape itself does: a unit sphere scaled by 2 against a radius 2
+ * sphere, and a box scaled by (2, 0.5, 3) and turned 90 degrees against the box with those corners. A unit sphere
+ * under that transform is an ellipsoid, checked against its implicit surface.
+ */
+int check_scaled(int n)
+{
+	scene_arena arena;
+	material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+	affine_matrix turn = affine_matrix::translation(vec3(10, 0, -4)) * affine_matrix::rotation_y(90) *
+	                     affine_matrix::scaling(vec3(2, 0.5, 3));
+	hitable *shapes[2][2] = {
+		{arena.make<sphere>(vec3(2, 4, -6), 2, white),
+		 arena.make<transform>(arena.make<sphere>(vec3(1, 2, -3), 1, white), affine_matrix::scaling(vec3(2, 2, 2)))},
+		// (x, y, z) -> (2x, 0.5y, 3z) -> (3z, 0.5y, -2x) + (10, 0, -4)
+		{arena.make<box>(vec3(7, -0.5, -8), vec3(16, 1, -2), white, &arena),
+		 arena.make<transform>(arena.make<box>(vec3(-1, -1, -1), vec3(2, 2, 2), white, &arena), turn)}};
+	const char *names[2] = {"sphere", "box"};
+	int failures = 0;
+
+	for (int s = 0; s < 2; s++)
+	{
+		aabb box;
+
+		shapes[s][0]->bounding_box(0, 1, box);
+		box = aabb(box.min() - vec3(5, 5, 5), box.max() + vec3(5, 5, 5));
+
+		std::vector<ray> rays = random_rays_in_box(box, n);
+		differences d = compare(rays, trace(shapes[s][0], rays), trace(shapes[s][1], rays),
+		                        (box.max() - box.min()).length());
+		bool ok = d.wrong == 0 && d.coincident == 0;
+
+		std::cout << (ok ? "ok   " : "FAIL ") << "scaled " << names[s] << ": " << d.wrong << " of " << n
+		          << " rays differ from the " << names[s] << " with the scaled size, " << d.rounding << " rounding\n";
+		failures += !ok;
+	}
+
+	// No shape to compare an ellipsoid with: its hits must lie on it, with the gradient of |to_object(p)|^2 as normal.
+	transform *ellipsoid = arena.make<transform>(arena.make<sphere>(vec3(0, 0, 0), 1, white), turn);
+	aabb box;
+
+	ellipsoid->bounding_box(0, 1, box);
+	box = aabb(box.min() - vec3(1, 1, 1), box.max() + vec3(1, 1, 1));
+
+	std::vector<ray> rays = random_rays_in_box(box, n);
+	int hits = 0;
+	int wrong = 0;
+
+	for (const ray &r : rays)
+	{
+		hit_record rec;
+
+		if (!ellipsoid->hit(r, 0.001f, FLT_MAX, rec))
+		{
+			continue;
+		}
+
+		vec3 gradient;
+		float h = 1e-3f;
+
+		for (int a = 0; a < 3; a++)
+		{
+			vec3 step(0, 0, 0);
+
+			step[a] = h;
+			gradient[a] = (ellipsoid->to_object.point(rec.p + step).squared_length() -
+			               ellipsoid->to_object.point(rec.p - step).squared_length()) / (2 * h);
+		}
+
+		float radius = ellipsoid->to_object.point(rec.p).length();
+
+		hits++;
+		wrong += fabs(radius - 1) > 1e-4f || fabs(rec.normal.length() - 1) > 1e-4f ||
+		         dot(rec.normal, unit_vector(gradient)) < 0.999f;
+	}
+
+	bool ok = hits > 1000 && wrong == 0;
+
+	std::cout << (ok ? "ok   " : "FAIL ") << "scaled ellipsoid: " << wrong << " of " << hits
+	          << " hits off the surface or with the wrong normal\n";
+	failures += !ok;
+
+	return failures;
+}
+
+// Hits like its shape on every other call only, so no two traces agree.
+class flicker : public hitable
+{
+	public:
+		flicker(hitable *h) : ptr(h) {}
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+		{
+			return (calls++ & 1) && ptr->hit(r, t_min, t_max, rec);
+		}
+
+		virtual bool bounding_box(float t0, float t1, aabb &box) const
+		{
+			return ptr->bounding_box(t0, t1, box);
+		}
+
+		hitable *ptr;
+		mutable unsigned calls = 0;
+};
+
+int check_finalize()
+{
+	scene_arena arena;
+	std::ostringstream log;
+	std::streambuf *console = std::cerr.rdbuf(log.rdbuf());
+	auto summaries = [&log]()
+	{
+		std::string text = log.str();
+		int count = 0;
+
+		for (size_t at = text.find("Compiled scene:"); at != std::string::npos; at = text.find("Compiled scene:", at + 1))
+		{
+			count++;
+		}
+
+		return count;
+	};
+
+	scene_compile = true;
+
+	srand48(7);
+	double expected = drand48();
+	srand48(7);
+	hitable *good = finalize_scene(two_spheres(arena), arena, 0, 1);
+	double drawn = drand48();
+
+	int printed = summaries();
+
+	for (int frame = 1; frame <= 3; frame++)
+	{
+		good->refit(frame, frame + 0.5f);
+	}
+
+	int refit_printed = summaries() - printed;
+
+	hitable **list = arena.make_array<hitable *>(2);
+	material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+
+	list[0] = arena.make<sphere>(vec3(0, 0, 0), 1, white);
+	list[1] = arena.make<flicker>(arena.make<sphere>(vec3(3, 0, 0), 1, white));
+
+	hitable *bad = finalize_scene(arena.make<hitable_list>(list, 2), arena, 0, 1);
+
+	scene_compile = false;
+	std::cerr.rdbuf(console);
+
+	bool good_used = dynamic_cast<compiled_scene *>(good);
+	bool bad_used = dynamic_cast<compiled_scene *>(bad);
+	bool ok = good_used && !bad_used;
+
+	std::cout << (ok ? "ok   " : "FAIL ") << "finalize_scene: compiled scene " << (good_used ? "used" : "not used")
+	          << " when it matches, " << (bad_used ? "used" : "not used") << " when it doesn't\n";
+
+	int failures = !ok;
+
+	ok = drawn == expected;
+	std::cout << (ok ? "ok   " : "FAIL ") << "finalize_scene leaves drand48() where it was\n";
+	failures += !ok;
+
+	ok = printed == 1 && refit_printed == 0;
+	std::cout << (ok ? "ok   " : "FAIL ") << "compile summary printed " << printed << " time(s) when built, "
+	          << refit_printed << " over 3 refits\n";
+	failures += !ok;
+
+	return failures;
+}
+
+int main()
+{
+	const int n = 100000;
+	int failures = 0;
+
+	for (const scene_entry &entry : scene_table)
+	{
+		scene_arena arena;
+		float t0 = entry.cam.time0;
+		float t1 = entry.cam.time1;
+		hitable *built = entry.build(arena);
+		aabb box;
+
+		if (!built->bounding_box(t0, t1, box))
+		{
+			box = aabb(vec3(-1, -1, -1), vec3(1, 1, 1));
+		}
+
+		std::vector<ray> rays = random_rays_in_box(box, n);
+		float scene_size = (box.max() - box.min()).length();
+		// Traced before collapsing: the collapser rewrites child pointers in place, so "built" changes with it.
+		std::vector<traced> reference = trace(built, rays);
+		transform_collapser collapser(arena, t0, t1);
+		hitable *collapsed = collapser.collapse(built);
+		compiled_scene *compiled = arena.make<compiled_scene>(collapsed, t0, t1);
+		const hitable *stages[2] = {collapsed, compiled};
+		const char *names[2] = {"collapsed", "compiled"};
+
+		for (int s = 0; s < 2; s++)
+		{
+			differences d = compare(rays, reference, trace(stages[s], rays), scene_size);
+
+			bool ok = d.wrong == 0 && d.coincident * 100 <= n && d.far <= 10 && d.medium <= 10;
+
+			std::cout << (ok ? "ok   " : "FAIL ") << entry.name << " " << names[s] << ": " << d.wrong << " of " << n
+			          << " rays differ from the scene as built, " << d.coincident << " coincident faces, "
+			          << d.rounding << " rounding, " << d.far << " far, " << d.medium << " media\n";
+			failures += !ok;
+		}
+	}
+
+	failures += check_chains(n);
+	failures += check_scaled(n);
+	failures += check_finalize();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Check of the render kernels specialized on scene features: on every built-in scene, opened as built and with
+ * --compile-scene, the kernel picked for the scene's features must trace exactly what the kernel with every feature
+ * compiled in traces. For 5000 random pixel samples each:
+ * - the camera ray of the specialized kernel must start and point where the all-features one does, given the same
+ *   random draws. Its time must lie in the shutter, and match too if both kernels sample the lens first;
+ * - the specialized traversal must find the same closest hit for that ray: distance, point, normal, material, and
+ *   (u, v) if the scene uses textures;
+ * - trace() specialized on the scene's features must return the same color as trace<FEATURE_ALL>() for that ray,
+ *   with drand48() reseeded the same way for both. In unlit scenes both are black, so the hits above are what count.
+ * A feature the scanner missed shows up in one of these.
+ * select_tile_kernel() must also hand out the render_tile() instantiation for those features.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. kernel_check.cpp -o kernel_check && ./kernel_check
+ */
+#include "render.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <stdlib.h>
+#include <iostream>
+#include <utility>
+
+bool same(const vec3 &a, const vec3 &b)
+{
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+struct kernel_differences
+{
+	int rays = 0;
+	int hits = 0;
+	int colors = 0;
+};
+
+template<unsigned features, typename world_type>
+kernel_differences compare_kernels(hitable *scene, const camera &cam, int n)
+{
+	const world_type *world = static_cast<const world_type *>(scene);
+	const bool lens = features & FEATURE_DEPTH_OF_FIELD;
+	const bool shutter = features & FEATURE_MOTION_BLUR;
+	const bool uv = features & FEATURE_TEXTURES;
+	kernel_differences d;
+
+	for (int i = 0; i < n; i++)
+	{
+		unsigned short seed[3] = {0x330e, (unsigned short)i, (unsigned short)(i >> 16)};
+		unsigned short path_seed[3] = {0x1234, (unsigned short)i, (unsigned short)(i >> 16)};
+
+		seed48(seed);
+		float u = drand48();
+		float v = drand48();
+		ray r = cam.get_ray<true, true>(u, v);
+
+		seed48(seed);
+		drand48();
+		drand48();
+		ray special = cam.get_ray<lens, shutter>(u, v);
+
+		/*
+		 * Without a lens sample the shutter gets another draw, so the time only matches when both kernels take one.
+		 * Without motion blur nothing moves, so the time doesn't matter.
+		 */
+		bool time_ok = special.time() >= cam.time0 && special.time() <= cam.time1 &&
+		               (!lens || !shutter || special.time() == r.time());
+
+		d.rays += !same(special.origin(), r.origin()) || !same(special.direction(), r.direction()) || !time_ok;
+
+		// Media leave (u, v) alone, so start both records the same.
+		hit_record a;
+		hit_record b;
+
+		a.u = b.u = 0;
+		a.v = b.v = 0;
+
+		seed48(path_seed);
+		bool hit_a = world_hit<FEATURE_ALL>(world, r, a);
+		seed48(path_seed);
+		bool hit_b = world_hit<features>(world, r, b);
+
+		d.hits += hit_a != hit_b || (hit_a && (a.t != b.t || !same(a.p, b.p) || !same(a.normal, b.normal) ||
+		                                       a.mat_ptr != b.mat_ptr || (uv && (a.u != b.u || a.v != b.v))));
+
+		seed48(path_seed);
+		vec3 all = de_nan(trace<FEATURE_ALL>(r, world, 0));
+		seed48(path_seed);
+		vec3 only = de_nan(trace<features>(r, world, 0));
+
+		d.colors += !same(all, only);
+	}
+
+	return d;
+}
+
+typedef kernel_differences (*compare_function)(hitable *scene, const camera &cam, int n);
+
+// compare_kernels() per feature mask, like tile_kernels().
+template<typename world_type, size_t... masks>
+const compare_function *compare_functions(std::index_sequence<masks...>)
+{
+	static const compare_function functions[] = {compare_kernels<masks & kernel_feature_mask, world_type>...};
+
+	return functions;
+}
+
+template<typename world_type, size_t... masks>
+const tile_kernel *expected_tile_kernels(std::index_sequence<masks...>)
+{
+	static const tile_kernel kernels[] = {render_tile<masks & kernel_feature_mask, world_type>...};
+
+	return kernels;
+}
+
+int main()
+{
+	const int n = 5000;
+	int failures = 0;
+	std::make_index_sequence<FEATURE_ALL + 1> masks;
+
+	for (bool compile : {false, true})
+	{
+		scene_compile = compile;
+
+		for (const scene_entry &entry : scene_table)
+		{
+			scene_arena arena;
+			camera_settings cam_settings;
+			render_settings settings;
+			std::string error;
+			hitable *world = open_scene(entry.name, arena, cam_settings, settings, error);
+
+			if (!world)
+			{
+				std::cout << "FAIL " << entry.name << ": " << error << "\n";
+				failures++;
+				continue;
+			}
+
+			camera cam(cam_settings, 200, 200);
+			unsigned features = render_features(settings, cam);
+			bool compiled = dynamic_cast<compiled_scene *>(world);
+			kernel_differences d;
+			tile_kernel expected;
+
+			if (compiled)
+			{
+				d = compare_functions<compiled_scene>(masks)[features](world, cam, n);
+				expected = expected_tile_kernels<compiled_scene>(masks)[features];
+			}
+			else
+			{
+				d = compare_functions<hitable>(masks)[features](world, cam, n);
+				expected = expected_tile_kernels<hitable>(masks)[features];
+			}
+
+			bool picked = select_tile_kernel(world, features) == expected;
+			bool ok = d.rays == 0 && d.hits == 0 && d.colors == 0 && picked && compiled == compile;
+
+			std::cout << (ok ? "ok   " : "FAIL ") << entry.name << (compiled ? " compiled" : "") << " ("
+			          << feature_names(features) << "): " << d.rays << " camera rays, " << d.hits << " hits and "
+			          << d.colors << " colors of " << n << " differ from the all-features kernel"
+			          << (picked ? "" : ", select_tile_kernel() picked another kernel") << "\n";
+			failures += !ok;
+		}
+	}
+
+	return failures ? 1 : 0;
+}
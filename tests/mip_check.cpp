@@ -0,0 +1,271 @@
+/*
+ * Check of mip filtered image textures and of the footprints that pick their level.
+ * - filtered_value(), on power-of-two images with detail at every scale, in both layouts. Without a footprint it must
+ *   be value(). Below a texel it reads the full image bilinearly, so at a texel's centre it returns that texel. At a
+ *   footprint of 2^k texels, at the centres of level k's texels, it returns the average of the 2^k x 2^k block of the
+ *   image each covers (every halving rounds, so within k/2 of a step). Between two such footprints it blends them,
+ *   linearly in log2(width). Past the whole image it returns the image's average.
+ * - footprints: a camera made for an image size gives its rays one pixel's footprint, so on a wall in the middle of
+ *   the view uv_footprint() must match the (u, v) spacing of the hits of the neighbouring pixels' rays.
+ * - uv_extent: a sphere under a transform that scales it, alone or with a turn and a move, must report the extent of
+ *   the sphere of that size. A moving sphere or a medium hit after a larger sphere in the same record must report 0,
+ *   not the larger sphere's extent.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. mip_check.cpp -o mip_check && ./mip_check
+ */
+#include "scenes.hpp"
+#include "transform.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+
+// Sum of random values over blocks of 1, 2, 4 ... 256 pixels, so every level of the pyramid has detail of its own.
+int detail(int i, int j, int c)
+{
+	int sum = 0;
+
+	for (int s = 0; s <= 8; s++)
+	{
+		unsigned h = (unsigned(i >> s) * 73856093u) ^ (unsigned(j >> s) * 19349663u) ^ (unsigned(s * 3 + c) * 83492791u);
+
+		h ^= h >> 13;
+		h *= 0x5bd1e995u;
+		h ^= h >> 15;
+		sum += h % 29;
+	}
+
+	return sum;
+}
+
+bool close(const vec3 &a, const vec3 &b, float tolerance)
+{
+	return fabs(a[0] - b[0]) <= tolerance && fabs(a[1] - b[1]) <= tolerance && fabs(a[2] - b[2]) <= tolerance;
+}
+
+int check_filtering(int nx, int ny, texture_texel_layout layout)
+{
+	std::vector<unsigned char> pixels(size_t(nx) * ny * 3);
+
+	for (int j = 0; j < ny; j++)
+	{
+		for (int i = 0; i < nx; i++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				pixels[3 * (i + nx * j) + c] = detail(i, j, c);
+			}
+		}
+	}
+
+	texture_layout = layout;
+	image_texture texture(pixels.data(), nx, ny);
+	texture_layout = TEXTURE_LAYOUT_TILED;
+
+	const vec3 p(0, 0, 0);
+	const float step = 1 / 255.0f;
+	int size = std::max(nx, ny);
+	int top = int(log2f(size));
+	int checked = 0;
+	int wrong = 0;
+
+	// Average of the texels in [i0, i1) x [j0, j1), 0 to 1.
+	auto block = [&](int i0, int i1, int j0, int j1)
+	{
+		vec3 sum(0, 0, 0);
+
+		for (int j = j0; j < j1; j++)
+		{
+			for (int i = i0; i < i1; i++)
+			{
+				sum += vec3(pixels[3 * (i + nx * j)], pixels[3 * (i + nx * j) + 1], pixels[3 * (i + nx * j) + 2]);
+			}
+		}
+
+		return sum / (255.0f * (i1 - i0) * (j1 - j0));
+	};
+
+	for (int k = 0; k < 500; k++)
+	{
+		float u = drand48();
+		float v = drand48();
+		int i = lrand48() % nx;
+		int j = lrand48() % ny;
+
+		vec3 centre = texture.filtered_value((i + 0.5f) / nx, 1 - (j + 0.5f) / ny, p, 0.5f / size);
+
+		wrong += !close(texture.filtered_value(u, v, p, 0), texture.value(u, v, p), 0);
+		wrong += !close(centre, block(i, i + 1, j, j + 1), 1e-6f);
+		checked += 2;
+	}
+
+	for (int level = 1; level <= top; level++)
+	{
+		int lx = std::max(nx >> level, 1);
+		int ly = std::max(ny >> level, 1);
+		float tolerance = level * 0.5f * step + 1e-5f;
+
+		for (int k = 0; k < 200; k++)
+		{
+			int i = lrand48() % lx;
+			int j = lrand48() % ly;
+			vec3 expected = block(i << level, std::min((i + 1) << level, nx), j << level, std::min((j + 1) << level, ny));
+
+			wrong += !close(texture.filtered_value((i + 0.5f) / lx, 1 - (j + 0.5f) / ly, p, ldexpf(1, level) / size),
+			                expected, tolerance);
+			checked++;
+		}
+	}
+
+	for (int k = 0; k < 2000; k++)
+	{
+		float u = drand48() * 1.2 - 0.1;
+		float v = drand48() * 1.2 - 0.1;
+		int level = lrand48() % top;
+		float width = ldexpf(1, level) * powf(2, drand48()) / size;
+		float f = log2f(width * size) - level;
+		vec3 below = texture.filtered_value(u, v, p, ldexpf(1, level) / size);
+		vec3 above = texture.filtered_value(u, v, p, ldexpf(1, level + 1) / size);
+
+		wrong += !close(texture.filtered_value(u, v, p, width), (1 - f) * below + f * above, 1e-5f);
+		wrong += !close(texture.filtered_value(u, v, p, 4), block(0, nx, 0, ny), top * 0.5f * step + 1e-5f);
+		checked += 2;
+	}
+
+	std::cout << (wrong ? "FAIL " : "ok   ") << "mip filtering, " << nx << "x" << ny << " "
+	          << (layout == TEXTURE_LAYOUT_TILED ? "tiled" : "linear") << ": " << wrong << " of " << checked
+	          << " lookups wrong\n";
+
+	return wrong != 0;
+}
+
+// The middle 10x10 pixels of a 200x100 image of a wall that fills the view.
+int check_footprint()
+{
+	camera_settings settings = {vec3(0, 0, 10), vec3(0, 0, 0), vec3(0, 1, 0), 40, 0, 10, 0, 0};
+	camera cam(settings, 200, 100);
+	constant_texture gray(vec3(0.73, 0.73, 0.73));
+	lambertian white(&gray);
+	xy_rect wall(-20, 20, -10, 10, 0, &white);
+	int checked = 0;
+	int wrong = 0;
+
+	for (int y = 45; y < 55; y++)
+	{
+		for (int x = 95; x < 105; x++)
+		{
+			ray r = cam.get_ray<false, false>((x + 0.5f) / 200, (y + 0.5f) / 100);
+			ray right = cam.get_ray<false, false>((x + 1.5f) / 200, (y + 0.5f) / 100);
+			ray up = cam.get_ray<false, false>((x + 0.5f) / 200, (y + 1.5f) / 100);
+			hit_record a;
+			hit_record b;
+			hit_record c;
+
+			if (!wall.hit(r, 0.001f, FLT_MAX, a) || !wall.hit(right, 0.001f, FLT_MAX, b) ||
+			    !wall.hit(up, 0.001f, FLT_MAX, c))
+			{
+				wrong++;
+				continue;
+			}
+
+			// The wall's uv_extent is sqrt(40 * 20), the unit uv_footprint() measures in, against 40 per u and 20 per v.
+			float width = uv_footprint(r, a);
+			float du = (b.u - a.u) * 40 / sqrtf(40 * 20);
+			float dv = (c.v - a.v) * 20 / sqrtf(40 * 20);
+
+			wrong += fabs(width / du - 1) > 0.01f || fabs(width / dv - 1) > 0.01f;
+			checked++;
+		}
+	}
+
+	std::cout << (wrong ? "FAIL " : "ok   ") << "camera footprint: " << wrong << " of " << checked
+	          << " pixels off the spacing of their neighbours by over 1%\n";
+
+	return wrong != 0;
+}
+
+int check_uv_extent()
+{
+	scene_arena arena;
+	material *white = arena.make<lambertian>(arena.make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+	vec3 center(1, 2, -3);
+	// Pairs that must report the same uv_extent.
+	hitable *pairs[2][2] = {
+		{arena.make<sphere>(vec3(0, 0, 0), 2, white),
+		 arena.make<transform>(arena.make<sphere>(vec3(0, 0, 0), 1, white), affine_matrix::scaling(vec3(2, 2, 2)))},
+		{arena.make<sphere>(center, 3, white),
+		 arena.make<transform>(arena.make<sphere>(vec3(0, 0, 0), 1, white), affine_matrix::translation(center) *
+		                       affine_matrix::rotation_y(30) * affine_matrix::scaling(vec3(3, 3, 3)))}};
+	// A larger sphere first in the list, so its hit fills the record before the closer one replaces it.
+	hitable *behind = arena.make<sphere>(vec3(0, 0, -1100), 1000, white);
+	hitable *moving[2] = {behind, arena.make<moving_sphere>(vec3(0, 0, 0), vec3(0, 0.5, 0), 0, 1, 1, white)};
+	hitable *medium[2] = {behind, arena.make<constant_medium>(arena.make<sphere>(vec3(0, 0, 0), 1, white), 100,
+	                                                          arena.make<constant_texture>(vec3(1, 1, 1)), &arena)};
+	hitable_list *after[2] = {arena.make<hitable_list>(moving, 2), arena.make<hitable_list>(medium, 2)};
+	int checked = 0;
+	int wrong = 0;
+
+	for (int k = 0; k < 1000; k++)
+	{
+		vec3 target(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5);
+		vec3 from(20 * (drand48() - 0.5), 20 * (drand48() - 0.5), 10);
+
+		for (int s = 0; s < 2; s++)
+		{
+			vec3 offset = s ? center : vec3(0, 0, 0);
+			ray r(from + offset, target - from, drand48());
+			hit_record a;
+			hit_record b;
+
+			if (pairs[s][0]->hit(r, 0.001f, FLT_MAX, a) != pairs[s][1]->hit(r, 0.001f, FLT_MAX, b))
+			{
+				wrong++;
+			}
+			else if (a.t > 0)
+			{
+				wrong += fabs(b.uv_extent / a.uv_extent - 1) > 1e-5f;
+			}
+
+			checked++;
+		}
+
+		for (hitable_list *list : after)
+		{
+			ray r(from, target - from, drand48());
+			hit_record rec;
+
+			// Rays the medium lets through, or that pass beside the sphere as it moves, hit the large sphere itself.
+			if (list->hit(r, 0.001f, FLT_MAX, rec) && rec.p.z() > -50)
+			{
+				wrong += rec.uv_extent != 0;
+				checked++;
+			}
+		}
+	}
+
+	std::cout << (wrong ? "FAIL " : "ok   ") << "uv_extent: " << wrong << " of " << checked
+	          << " hits report another extent than the shape they hit\n";
+
+	return wrong != 0;
+}
+
+int main()
+{
+	const int sizes[][2] = {{256, 256}, {512, 64}, {32, 128}};
+	int failures = 0;
+
+	srand48(1);
+
+	for (const auto &size : sizes)
+	{
+		failures += check_filtering(size[0], size[1], TEXTURE_LAYOUT_LINEAR);
+		failures += check_filtering(size[0], size[1], TEXTURE_LAYOUT_TILED);
+	}
+
+	failures += check_footprint();
+	failures += check_uv_extent();
+
+	return failures ? 1 : 0;
+}
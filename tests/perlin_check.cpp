@@ -0,0 +1,317 @@
+/*
+ * Check the Perlin tables and that perlin::noise8() and turbulence() give the same values with every ISA this CPU
+ * runs as the scalar noise(), at random points (negative ones too), on lattice points and on points a float step below
+ * them, where floor() changes cell.
+ * baked_turbulence is checked against the exact turbulence it samples: equal to it on its grid points, the trilinear
+ * blend of those in between (negative cells too), exact in bricks past its memory budget, and giving the same values
+ * when 8 threads bake the same bricks at once, with each brick published once. Past the bricks a key holds, lookups
+ * must be exact, not another brick's samples, and bake nothing.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. perlin_check.cpp -o perlin_check && ./perlin_check
+ */
+#include "baked_noise.hpp"
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// The compile-time tables: each permutation holds 0..255 once, each gradient is unit length.
+int check_tables()
+{
+	int errors = 0;
+	const int32_t *perms[3] = {perlin::tables.perm_x, perlin::tables.perm_y, perlin::tables.perm_z};
+
+	for (const int32_t *perm : perms)
+	{
+		int seen[256] = {};
+
+		for (int i = 0; i < 256; i++)
+		{
+			if (perm[i] < 0 || perm[i] > 255 || seen[perm[i]]++)
+			{
+				errors++;
+			}
+		}
+	}
+
+	for (int i = 0; i < 256; i++)
+	{
+		float x = perlin::tables.gradient_x[i];
+		float y = perlin::tables.gradient_y[i];
+		float z = perlin::tables.gradient_z[i];
+
+		errors += fabs(sqrt(x * x + y * y + z * z) - 1) > 1e-6;
+	}
+
+	std::cout << (errors ? "FAIL " : "ok   ") << "tables: " << errors << " bad permutation entries or gradients\n";
+
+	return errors;
+}
+
+std::vector<vec3> test_points()
+{
+	std::vector<vec3> points;
+
+	srand48(1);
+
+	for (int i = 0; i < 1000000; i++)
+	{
+		float scale = i % 2 ? 10 : 1000;
+
+		points.push_back(vec3((drand48() * 2 - 1) * scale, (drand48() * 2 - 1) * scale, (drand48() * 2 - 1) * scale));
+	}
+
+	for (int x = -3; x <= 3; x++)
+	{
+		for (int y = -3; y <= 3; y++)
+		{
+			for (int z = -3; z <= 3; z++)
+			{
+				points.push_back(vec3(x, y, z));
+				points.push_back(vec3(nextafterf(x, -10), nextafterf(y, -10), nextafterf(z, -10)));
+			}
+		}
+	}
+
+	points.push_back(vec3(255.5, 256.5, -256.5));
+
+	return points;
+}
+
+// Bricks a baked_turbulence reports in its first line.
+size_t reported_bricks(const baked_turbulence &baked)
+{
+	std::ostringstream report;
+	std::string word;
+	size_t bricks = 0;
+
+	baked.report(report);
+	std::istringstream in(report.str());
+	in >> word >> word >> bricks;
+
+	return bricks;
+}
+
+int check_baked(const std::vector<vec3> &points)
+{
+	const float resolution = 8;  // A power of two, so grid points divide back exactly.
+	const int depth = 7;
+	perlin noise;
+	auto exact = [&](int x, int y, int z) { return noise.turbulence(vec3(x, y, z) / resolution, depth); };
+	std::vector<float> expected;
+	std::set<std::tuple<int, int, int>> bricks;
+	int failures = 0;
+
+	// Trilinear blend of the exact turbulence at the grid points around each point.
+	for (const vec3 &p : points)
+	{
+		vec3 g = p * resolution;
+		int x = int(floorf(g.x()));
+		int y = int(floorf(g.y()));
+		int z = int(floorf(g.z()));
+		float fx = g.x() - floorf(g.x());
+		float fy = g.y() - floorf(g.y());
+		float fz = g.z() - floorf(g.z());
+		float c0 = (exact(x, y, z) * (1 - fz) + exact(x, y, z + 1) * fz) * (1 - fy) +
+		           (exact(x, y + 1, z) * (1 - fz) + exact(x, y + 1, z + 1) * fz) * fy;
+		float c1 = (exact(x + 1, y, z) * (1 - fz) + exact(x + 1, y, z + 1) * fz) * (1 - fy) +
+		           (exact(x + 1, y + 1, z) * (1 - fz) + exact(x + 1, y + 1, z + 1) * fz) * fy;
+
+		expected.push_back(c0 * (1 - fx) + c1 * fx);
+		bricks.insert(std::make_tuple(x >> 3, y >> 3, z >> 3));
+	}
+
+	{
+		baked_turbulence baked(resolution, size_t(256) << 20, depth);
+		int wrong = 0;
+
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			wrong += fabs(baked.value(points[i]) - expected[i]) > 1e-5f;
+		}
+
+		for (int i = 0; i < 10000; i++)
+		{
+			int x = lrand48() % 321 - 160;
+			int y = lrand48() % 321 - 160;
+			int z = lrand48() % 321 - 160;
+
+			wrong += baked.value(vec3(x, y, z) / resolution) != exact(x, y, z);
+		}
+
+		std::cout << (wrong ? "FAIL " : "ok   ") << "baked turbulence: " << wrong << " of " << points.size() + 10000
+		          << " lookups off the exact turbulence on the grid or its trilinear blend between\n";
+		failures += wrong != 0;
+	}
+
+	{
+		// Room for a single brick: the first point's. Everything else must be evaluated exactly.
+		baked_turbulence baked(resolution, 1, depth);
+		vec3 first = points[0] * resolution;
+		auto first_brick = std::make_tuple(int(floorf(first.x())) >> 3, int(floorf(first.y())) >> 3,
+		                                   int(floorf(first.z())) >> 3);
+		int wrong = 0;
+
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			vec3 g = points[i] * resolution;
+			bool in_first = std::make_tuple(int(floorf(g.x())) >> 3, int(floorf(g.y())) >> 3,
+			                                int(floorf(g.z())) >> 3) == first_brick;
+			float value = baked.value(points[i]);
+
+			wrong += in_first ? fabs(value - expected[i]) > 1e-5f : value != noise.turbulence(points[i], depth);
+		}
+
+		wrong += reported_bricks(baked) != 1;
+
+		std::cout << (wrong ? "FAIL " : "ok   ") << "baked turbulence, budget of one brick: " << wrong << " of "
+		          << points.size() << " lookups wrong, " << reported_bricks(baked) << " bricks baked\n";
+		failures += wrong != 0;
+	}
+
+	{
+		baked_turbulence baked(resolution, size_t(256) << 20, depth);
+		std::vector<std::thread> threads;
+		std::atomic<int> wrong{0};
+
+		for (int t = 0; t < 8; t++)
+		{
+			threads.emplace_back([&]()
+			{
+				for (size_t i = 0; i < points.size(); i++)
+				{
+					if (fabs(baked.value(points[i]) - expected[i]) > 1e-5f)
+					{
+						wrong++;
+					}
+				}
+			});
+		}
+
+		for (std::thread &thread : threads)
+		{
+			thread.join();
+		}
+
+		size_t baked_bricks = reported_bricks(baked);
+		bool ok = wrong == 0 && baked_bricks == bricks.size();
+
+		std::cout << (ok ? "ok   " : "FAIL ") << "baked turbulence, 8 threads: " << wrong << " of "
+		          << 8 * points.size() << " lookups wrong, " << baked_bricks << " bricks baked for " << bricks.size()
+		          << " touched\n";
+		failures += !ok;
+	}
+
+	{
+		// At 8 samples per unit, keys hold bricks up to 2^20 units from the origin. The brick 2^21 bricks along x from
+		// a baked one used to share its key; off the grid in y and z, its baked value can't match the exact one.
+		baked_turbulence baked(resolution, size_t(256) << 20, depth);
+		const vec3 near(0.5f, 0.3f, 0.7f);
+		const vec3 far[] = {vec3(2097152.5f, 0.3f, 0.7f), vec3(1048576.5f, 0.3f, 0.7f), vec3(-1048576.5f, 0.3f, 0.7f),
+		                    vec3(0.3f, 0.7f, 3000000.25f), vec3(0.3f, -20000000.0f, 0.7f)};
+		int wrong = 0;
+
+		baked.value(near);
+
+		for (const vec3 &p : far)
+		{
+			wrong += baked.value(p) != noise.turbulence(p, depth);
+		}
+
+		wrong += reported_bricks(baked) != 1;
+
+		// The last bricks a key holds are still baked.
+		baked.value(vec3(1048575.5f, 0.3f, 0.7f));
+		baked.value(vec3(-1048575.5f, 0.3f, 0.7f));
+		wrong += reported_bricks(baked) != 3;
+
+		std::cout << (wrong ? "FAIL " : "ok   ") << "baked turbulence past the range of brick keys: " << wrong
+		          << " lookups wrong or bricks miscounted, " << reported_bricks(baked) << " bricks baked\n";
+		failures += wrong != 0;
+	}
+
+	return failures;
+}
+
+int main()
+{
+	perlin noise;
+	std::vector<vec3> points = test_points();
+	std::vector<float> expected_noise;
+	std::vector<float> expected_turbulence;
+	cpu_isa supported = detect_cpu_isa();
+	int failures = check_tables();
+
+	kernel_isa = ISA_BASELINE;
+
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		expected_noise.push_back(noise.noise(points[i]));
+		expected_turbulence.push_back(noise.turbulence(points[i], 1 + i % 12));
+	}
+
+	for (cpu_isa isa : {ISA_SSE42, ISA_AVX2, ISA_AVX512})
+	{
+		if (isa > supported)
+		{
+			std::cout << "skip " << isa_name(isa) << ": not supported by this CPU\n";
+			continue;
+		}
+
+		double noise_error = 0;
+		double turbulence_error = 0;
+
+		kernel_isa = isa;
+
+		for (size_t first = 0; first < points.size(); first += 8)
+		{
+			float x[8] = {}, y[8] = {}, z[8] = {}, out[8];
+			size_t n = points.size() - first < 8 ? points.size() - first : 8;
+
+			for (size_t i = 0; i < n; i++)
+			{
+				x[i] = points[first + i].x();
+				y[i] = points[first + i].y();
+				z[i] = points[first + i].z();
+			}
+
+			perlin::noise8(x, y, z, out);
+
+			for (size_t i = 0; i < n; i++)
+			{
+				noise_error = fmax(noise_error, fabs(out[i] - expected_noise[first + i]));
+			}
+		}
+
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			float t = noise.turbulence(points[i], 1 + i % 12);
+
+			turbulence_error = fmax(turbulence_error, fabs(t - expected_turbulence[i]));
+		}
+
+		// A few float roundings of values of size ~1, differently ordered.
+		bool ok = noise_error < 1e-5 && turbulence_error < 1e-5;
+
+		std::cout << (ok ? "ok   " : "FAIL ") << isa_name(isa) << ": " << points.size() << " points, largest "
+		          << "difference from the scalar noise " << noise_error << ", turbulence " << turbulence_error << "\n";
+		failures += !ok;
+	}
+
+	kernel_isa = ISA_BASELINE;
+
+	std::vector<vec3> baked_points;
+
+	for (int i = 0; i < 20000; i++)
+	{
+		baked_points.push_back(vec3(drand48() * 20 - 10, drand48() * 20 - 10, drand48() * 20 - 10));
+	}
+
+	failures += check_baked(baked_points);
+
+	return failures ? 1 : 0;
+}
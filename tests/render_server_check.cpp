@@ -0,0 +1,205 @@
+/*
+ * Check of the render server, run in this process on a socket in a temporary directory, with clients that behave
+ * badly:
+ * - a client that asks for a large image and never reads must not hold up another client's job on the same pool.
+ *   The other job must finish, and the first still gets its DONE once it reads, whatever updates it lost.
+ * - a scene file edited between two jobs must be read again: a lamp that filled the view at one brightness must come
+ *   out at the new one.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. render_server_check.cpp -o render_server_check && ./render_server_check
+ */
+#include "render_server.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+int connect_to(const std::string &path, int receive_buffer = 0)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	if (receive_buffer)
+	{
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+	}
+
+	// The server may not be listening yet.
+	for (int tries = 0; connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0; tries++)
+	{
+		if (tries == 100)
+		{
+			close(fd);
+			return -1;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+
+	timeval timeout = {120, 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	return fd;
+}
+
+bool send_job(int fd, const std::string &job)
+{
+	uint32_t len = job.size();
+	uint8_t type = MSG_JOB;
+
+	return write_all(fd, &len, sizeof(len)) && write_all(fd, &type, sizeof(type)) && write_all(fd, job.data(), len);
+}
+
+// Reads frames up to the job's DONE or ERROR. Returns that frame's type, 0 if the connection failed first.
+uint8_t finish_job(int fd, int &tiles, std::string &message)
+{
+	tiles = 0;
+
+	for (;;)
+	{
+		uint32_t len;
+		uint8_t type;
+
+		if (!read_all(fd, &len, sizeof(len)) || !read_all(fd, &type, sizeof(type)))
+		{
+			return 0;
+		}
+
+		message.assign(len, '\0');
+
+		if (len && !read_all(fd, &message[0], len))
+		{
+			return 0;
+		}
+
+		tiles += type == MSG_TILE;
+
+		if (type == MSG_DONE || type == MSG_ERROR)
+		{
+			return type;
+		}
+	}
+}
+
+// Middle pixel of a P3 image, -1 if it can't be read.
+int middle_red(const std::string &path)
+{
+	std::ifstream in(path.c_str());
+	std::string magic;
+	int nx = 0;
+	int ny = 0;
+	int max = 0;
+	int value = -1;
+
+	if (!(in >> magic >> nx >> ny >> max) || magic != "P3")
+	{
+		return -1;
+	}
+
+	for (int i = 0; i <= 3 * (nx * (ny / 2) + nx / 2); i++)
+	{
+		if (!(in >> value))
+		{
+			return -1;
+		}
+	}
+
+	return value;
+}
+
+// Renders the lamp scene, whose light is "glow", and returns its middle pixel.
+int render_lamp(const std::string &dir, const std::string &glow)
+{
+	std::string scene = dir + "/lamp.scene";
+	std::ofstream(scene.c_str()) << "camera lookfrom 0 0 5  lookat 0 0 0  vfov 20  aperture 0  focus_dist 5  time 0 1\n"
+	                                "texture glow constant " << glow << "\n"
+	                                "material lamp diffuse_light glow\n"
+	                                "shape bulb sphere 0 0 0 2 lamp\n"
+	                                "add bulb\n";
+
+	int fd = connect_to(dir + "/socket");
+	int tiles = 0;
+	std::string message;
+	std::string job = "scene " + scene + "\nwidth 32\nheight 32\nspp 1\noutput " + dir + "/lamp.ppm\n";
+	int red = fd >= 0 && send_job(fd, job) && finish_job(fd, tiles, message) == MSG_DONE ? middle_red(dir + "/lamp.ppm")
+	                                                                                      : -1;
+
+	close(fd);
+	return red;
+}
+
+int main()
+{
+	char dir_template[] = "/tmp/render_server_check_XXXXXX";
+	std::string dir = mkdtemp(dir_template);
+	std::string path = dir + "/socket";
+	thread_pool pool(4);
+	render_server server(path, pool);
+	int failures = 0;
+
+	std::thread(&render_server::run, &server).detach();
+
+	// A 3000x3000 image is 27 MB of tiles, more than the server queues for a client.
+	int stalled = connect_to(path, 4096);
+	bool sent = stalled >= 0 &&
+	            send_job(stalled, "scene two_spheres\nwidth 3000\nheight 3000\nspp 8\noutput " + dir + "/stalled.ppm\n");
+
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+
+	auto start = std::chrono::steady_clock::now();
+	int other = connect_to(path);
+	int tiles = 0;
+	std::string message;
+	std::string job = "scene two_spheres\nwidth 100\nheight 100\nspp 4\noutput " + dir + "/other.ppm\n";
+	uint8_t result = sent && other >= 0 && send_job(other, job) ? finish_job(other, tiles, message) : 0;
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	bool ok = result == MSG_DONE && tiles == 16;
+
+	std::cout << (ok ? "ok   " : "FAIL ") << "a job beside a client that doesn't read: "
+	          << (result == MSG_DONE ? "done" : "not done") << " in " << seconds << " s, " << tiles << " of 16 tiles\n";
+	failures += !ok;
+
+	int stalled_tiles = 0;
+
+	result = stalled >= 0 ? finish_job(stalled, stalled_tiles, message) : 0;
+	ok = result == MSG_DONE;
+	std::cout << (ok ? "ok   " : "FAIL ") << "the client that didn't read: " << (ok ? "done" : "no DONE") << " after "
+	          << stalled_tiles << " of 8836 tiles\n";
+	failures += !ok;
+
+	int dim = render_lamp(dir, "0.1 0.1 0.1");
+	int bright = render_lamp(dir, "0.75 0.75 0.75");
+
+	ok = dim > 0 && bright > dim;
+	std::cout << (ok ? "ok   " : "FAIL ") << "scene file edited between jobs: middle pixel " << dim << ", then " << bright
+	          << "\n";
+	failures += !ok;
+
+	close(stalled);
+	close(other);
+	unlink((dir + "/stalled.ppm").c_str());
+	unlink((dir + "/other.ppm").c_str());
+	unlink((dir + "/lamp.ppm").c_str());
+	unlink((dir + "/lamp.scene").c_str());
+	unlink((dir + "/lamp.scene.cache").c_str());
+	rmdir((dir + "/lamp.scene.bvh").c_str());
+	unlink(path.c_str());
+	rmdir(dir.c_str());
+
+	// The server thread never returns; leave without tearing down what it uses.
+	std::cout.flush();
+	_exit(failures ? 1 : 0);
+}
@@ -0,0 +1,281 @@
+/*
+ * Check that the scalar sphere_batch kernel finds the same closest hit as the spheres it copies, and that every SIMD
+ * kernel this CPU runs agrees with the scalar one, on batches of 8 static and 8 moving spheres and 50000 random rays
+ * through each batch. The SIMD kernels are also run on the first 1 to 7 spheres of a batch.
+ *
+ * The SSE4.2 kernel keeps the scalar operations and their order, so it must find exactly the scalar hits.
+ *
+ * The AVX2 and AVX-512 kernels use FMA and another order of operations, so where a ray grazes a sphere, and its
+ * distance comes from the square root of a tiny discriminant, they may call hit or miss differently, or pick the sphere
+ * behind. Each disagreement beyond 1e-5 in distance is checked in double precision: it passes only if the sphere one
+ * kernel missed is grazed (the ray passes within 1e-3 of its radius from the center) or both distances agree to 1e-3.
+ * Anything else fails.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. sphere_batch_check.cpp -o sphere_batch_check && ./sphere_batch_check
+ */
+#include "sphere_batch.hpp"
+#include "arena.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+struct ray_hit
+{
+	bool hit;
+	float t;
+	int index;  // Of the sphere hit, in the batch.
+};
+
+struct test_sphere
+{
+	vec3 center0;
+	vec3 center1;
+	float radius;
+};
+
+// Closest hits of "rays" against the first "count" spheres of the batch, with the kernels of "isa".
+template<bool motion>
+std::vector<ray_hit> trace(const sphere_batch &batch, const std::vector<ray> &rays, cpu_isa isa,
+                           int count = sphere_batch::width)
+{
+	std::vector<ray_hit> hits;
+
+	kernel_isa = isa;
+
+	for (const ray &r : rays)
+	{
+		hit_record rec;
+		float t_max = 1e30f;
+		bool hit = batch.hit<motion>(r, 0, count, 0.001f, t_max, rec);
+
+		hits.push_back({hit, hit ? rec.t : 0, hit ? int(uintptr_t(rec.mat_ptr) / 16 - 1) : -1});
+	}
+
+	return hits;
+}
+
+// Closest hits of "rays" against each of "prims" in turn, through their own hit().
+std::vector<ray_hit> trace(const std::vector<hitable *> &prims, const std::vector<ray> &rays)
+{
+	std::vector<ray_hit> hits;
+
+	for (const ray &r : rays)
+	{
+		hit_record rec;
+		float t_max = 1e30f;
+		bool hit = false;
+
+		for (hitable *h : prims)
+		{
+			if (h->hit(r, 0.001f, t_max, rec))
+			{
+				hit = true;
+				t_max = rec.t;
+			}
+		}
+
+		hits.push_back({hit, hit ? rec.t : 0, hit ? int(uintptr_t(rec.mat_ptr) / 16 - 1) : -1});
+	}
+
+	return hits;
+}
+
+/*
+ * sphere_batch::width random spheres, static or moving, as hitables for a batch and as "spheres" for grazes(). The
+ * material pointer of sphere i is 16 * (i + 1), so hits tell which sphere they came from.
+ */
+void random_spheres(scene_arena &arena, bool moving, std::vector<hitable *> &prims, std::vector<test_sphere> &spheres)
+{
+	for (int i = 0; i < sphere_batch::width; i++)
+	{
+		vec3 c(drand48() * 10 - 5, drand48() * 10 - 5, drand48() * 10 - 5);
+		vec3 v = moving ? vec3(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5) : vec3(0, 0, 0);
+		float radius = 0.2 + drand48() * 2;
+		material *mat = reinterpret_cast<material *>(uintptr_t(16 * (i + 1)));
+
+		if (moving)
+		{
+			prims.push_back(arena.make<moving_sphere>(c, c + v, 0, 1, radius, mat));
+		}
+		else
+		{
+			prims.push_back(arena.make<sphere>(c, radius, mat));
+		}
+
+		spheres.push_back({c, c + v, radius});
+	}
+}
+
+// Rays from around the spheres of random_spheres() toward points among them, at random times.
+std::vector<ray> random_rays(int n)
+{
+	std::vector<ray> rays;
+
+	for (int k = 0; k < n; k++)
+	{
+		vec3 origin(drand48() * 30 - 15, drand48() * 30 - 15, drand48() * 30 - 15);
+		vec3 target(drand48() * 10 - 5, drand48() * 10 - 5, drand48() * 10 - 5);
+
+		rays.push_back(ray(origin, target - origin, drand48()));
+	}
+
+	return rays;
+}
+
+// True if "r" passes within 1e-3 radius of the surface of "s" at its shutter time, in double precision.
+bool grazes(const ray &r, const test_sphere &s)
+{
+	double time = r.time();
+	double oc[3];
+	double d[3];
+	double dd = 0;
+	double od = 0;
+	double oo = 0;
+
+	for (int c = 0; c < 3; c++)
+	{
+		oc[c] = r.origin()[c] - (s.center0[c] + time * (double(s.center1[c]) - s.center0[c]));
+		d[c] = r.direction()[c];
+		dd += d[c] * d[c];
+		od += oc[c] * d[c];
+		oo += oc[c] * oc[c];
+	}
+
+	double distance = sqrt(fmax(oo - od * od / dd, 0.0));
+
+	return fabs(distance - s.radius) < 1e-3 * s.radius;
+}
+
+// True if the kernels' answers "a" and "b" for "r" differ only by what rounding can explain.
+bool explained(const ray &r, const ray_hit &a, const ray_hit &b, const std::vector<test_sphere> &spheres)
+{
+	if (a.hit && b.hit && a.index == b.index)
+	{
+		return fabs(a.t - b.t) <= 1e-3f * fmax(1.0f, a.t) || grazes(r, spheres[a.index]);
+	}
+
+	// Different spheres or hit / miss: the nearer one, which the other kernel missed, must be grazed.
+	const ray_hit &nearer = !b.hit || (a.hit && a.t < b.t) ? a : b;
+
+	return grazes(r, spheres[nearer.index]) || (a.hit && b.hit && fabs(a.t - b.t) <= 1e-3f * fmax(1.0f, a.t));
+}
+
+int main()
+{
+	scene_arena arena;
+	cpu_isa supported = detect_cpu_isa();
+	int failures = 0;
+
+	srand48(1);
+
+	// The scalar kernel is what the SIMD ones are held to, so it must match the spheres' own hit() exactly.
+	int scalar_checked = 0;
+	int scalar_wrong = 0;
+
+	for (int round = 0; round < 20; round++)
+	{
+		for (bool moving : {false, true})
+		{
+			std::vector<hitable *> prims;
+			std::vector<test_sphere> spheres;
+
+			random_spheres(arena, moving, prims, spheres);
+
+			sphere_batch batch;
+			batch.build(prims);
+
+			std::vector<ray> rays = random_rays(50000);
+			std::vector<ray_hit> expected = trace(prims, rays);
+			std::vector<ray_hit> got = moving ? trace<true>(batch, rays, ISA_BASELINE) :
+			                                    trace<false>(batch, rays, ISA_BASELINE);
+
+			for (size_t k = 0; k < rays.size(); k++)
+			{
+				const ray_hit &a = expected[k];
+				const ray_hit &b = got[k];
+
+				scalar_wrong += a.hit != b.hit || (a.hit && (a.index != b.index || a.t != b.t));
+			}
+
+			scalar_checked += rays.size();
+		}
+	}
+
+	std::cout << (scalar_wrong ? "FAIL " : "ok   ") << "scalar: " << scalar_checked << " rays, " << scalar_wrong
+	          << " different closest hits from sphere and moving_sphere\n";
+	failures += scalar_wrong != 0;
+
+	for (cpu_isa isa : {ISA_SSE42, ISA_AVX2, ISA_AVX512})
+	{
+		if (isa > supported)
+		{
+			std::cout << "skip " << isa_name(isa) << ": not supported by this CPU\n";
+			continue;
+		}
+
+		int checked = 0;
+		int rounding = 0;
+		int wrong = 0;
+
+		for (int round = 0; round < 20; round++)
+		{
+			for (bool moving : {false, true})
+			{
+				std::vector<hitable *> prims;
+				std::vector<test_sphere> spheres;
+
+				random_spheres(arena, moving, prims, spheres);
+
+				sphere_batch batch;
+				batch.build(prims);
+
+				std::vector<ray> rays = random_rays(50000);
+				// Every round but the last few leaves lanes of the batch out.
+				int count = std::min(1 + round, int(sphere_batch::width));
+
+				std::vector<ray_hit> expected = moving ? trace<true>(batch, rays, ISA_BASELINE, count) :
+				                                         trace<false>(batch, rays, ISA_BASELINE, count);
+				std::vector<ray_hit> got = moving ? trace<true>(batch, rays, isa, count) :
+				                                    trace<false>(batch, rays, isa, count);
+
+				for (size_t k = 0; k < rays.size(); k++)
+				{
+					const ray_hit &a = expected[k];
+					const ray_hit &b = got[k];
+
+					// SSE4.2 does the scalar arithmetic in the same order, so it must agree to the bit.
+					if (isa == ISA_SSE42)
+					{
+						wrong += a.hit != b.hit || (a.hit && (a.index != b.index || a.t != b.t));
+						continue;
+					}
+
+					if (a.hit == b.hit && (!a.hit || (a.index == b.index && fabs(a.t - b.t) <= 1e-5f * fmax(1.0f, a.t))))
+					{
+						continue;
+					}
+
+					if (explained(rays[k], a, b, spheres))
+					{
+						rounding++;
+					}
+					else
+					{
+						wrong++;
+					}
+				}
+
+				checked += rays.size();
+			}
+		}
+
+		std::cout << (wrong ? "FAIL " : "ok   ") << isa_name(isa) << ": " << checked << " rays, " << wrong
+		          << " different closest hits from the scalar kernel, " << rounding << " within rounding\n";
+		failures += wrong != 0;
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * Check of image_texture storage: on random images of odd and power-of-two sizes, value() and filtered_value() must
+ * return exactly the same colors whichever way the texels are stored. 20000 random lookups per image, with (u, v) a
+ * little outside [0, 1] to cover clamping and footprints from a fraction of a texel to the whole image.
+ * - tiled layout: textures built with texture_layout tiled against the same image in the linear layout.
+ * - tile cache: textures opened by path in a tile_cache of 16 tiles, shared by all the images so they evict each
+ *   other's tiles, and looked up from 4 threads at once, against the images decoded in memory. A file that can't be
+ *   read must give an empty texture.
+ * - .rtex: the same files converted with convert_texture(), and written by write_rtex() from the linear layout, then
+ *   mapped, against the images decoded in memory. Files with a damaged header or level table, or the wrong size, must
+ *   be refused.
+ * - texture registry: the files requested on a thread pool, some twice, through a symlink, a path with "./" and a
+ *   copy under another name. Each file must be decoded once, shared by every name for it (aliases of one file
+ *   recognized by path, not only by contents), and match the image decoded in memory. A file rewritten while its
+ *   texture is in use must get a new texture. Two scenes requesting at once must each get a report of their own
+ *   textures only, and one sharing a texture still being decoded for the other must find it decoded after its own
+ *   wait(). Entries of textures no scene holds must be dropped.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. texture_check.cpp -o texture_check && ./texture_check
+ */
+#include "texture_registry.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct image
+{
+	int nx;
+	int ny;
+	std::vector<unsigned char> pixels;
+};
+
+struct lookup
+{
+	float u;
+	float v;
+	float width;  // 0 for value().
+};
+
+image random_image(int nx, int ny)
+{
+	image im = {nx, ny, std::vector<unsigned char>(size_t(nx) * ny * 3)};
+
+	for (unsigned char &c : im.pixels)
+	{
+		c = lrand48() & 255;
+	}
+
+	return im;
+}
+
+// Binary PPM, which stb_image reads.
+bool write_ppm(const std::string &path, const image &im)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+
+	if (!f)
+	{
+		return false;
+	}
+
+	fprintf(f, "P6\n%d %d\n255\n", im.nx, im.ny);
+	bool written = fwrite(im.pixels.data(), 1, im.pixels.size(), f) == im.pixels.size();
+
+	return fclose(f) == 0 && written;
+}
+
+std::vector<lookup> random_lookups(int n)
+{
+	std::vector<lookup> lookups;
+
+	for (int k = 0; k < n; k++)
+	{
+		float u = drand48() * 1.2 - 0.1;
+		float v = drand48() * 1.2 - 0.1;
+		float width = k % 4 == 0 ? 0 : powf(2, -12 + 13 * drand48());
+
+		lookups.push_back({u, v, width});
+	}
+
+	return lookups;
+}
+
+vec3 look_up(const image_texture &texture, const lookup &l)
+{
+	vec3 p(0, 0, 0);
+
+	return l.width > 0 ? texture.filtered_value(l.u, l.v, p, l.width) : texture.value(l.u, l.v, p);
+}
+
+// Lookups where "texture" returns another color than "reference".
+int differences(const image_texture &reference, const image_texture &texture, const std::vector<lookup> &lookups)
+{
+	int count = 0;
+
+	for (const lookup &l : lookups)
+	{
+		vec3 a = look_up(reference, l);
+		vec3 b = look_up(texture, l);
+
+		count += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+	}
+
+	return count;
+}
+
+int main()
+{
+	const int sizes[][2] = {{1, 1}, {31, 33}, {100, 67}, {257, 129}, {512, 512}};
+	int failures = 0;
+
+	srand48(1);
+
+	std::vector<lookup> lookups = random_lookups(20000);
+
+	for (const auto &size : sizes)
+	{
+		image im = random_image(size[0], size[1]);
+
+		texture_layout = TEXTURE_LAYOUT_LINEAR;
+		image_texture linear(im.pixels.data(), im.nx, im.ny);
+		texture_layout = TEXTURE_LAYOUT_TILED;
+		image_texture tiled(im.pixels.data(), im.nx, im.ny);
+
+		int tiled_differences = differences(linear, tiled, lookups);
+
+		std::cout << (tiled_differences ? "FAIL " : "ok   ") << "tiled layout, " << im.nx << "x" << im.ny << ": "
+		          << tiled_differences << " of " << lookups.size() << " lookups differ from the linear layout\n";
+		failures += tiled_differences != 0;
+	}
+
+	char dir_template[] = "/tmp/texture_check_XXXXXX";
+	std::string dir = mkdtemp(dir_template);
+	std::vector<std::string> files;
+	std::vector<image> images;
+	std::vector<std::unique_ptr<image_texture>> decoded;
+	tile_cache cache(16 * tile_cache::tile_words * 4);
+	std::vector<std::unique_ptr<image_texture>> lazy;
+
+	texture_layout = TEXTURE_LAYOUT_TILED;
+
+	for (const auto &size : sizes)
+	{
+		// stbi_info() rejects PPM files under 6x6 (another format's probe reads past their end).
+		if (size[0] < 6)
+		{
+			continue;
+		}
+
+		image im = random_image(size[0], size[1]);
+		std::string path = dir + "/" + std::to_string(im.nx) + "x" + std::to_string(im.ny) + ".ppm";
+
+		if (!write_ppm(path, im))
+		{
+			std::cout << "FAIL cannot write " << path << "\n";
+			return 1;
+		}
+
+		files.push_back(path);
+		images.push_back(im);
+		decoded.emplace_back(new image_texture());
+		decoded.back()->decode(path);
+		lazy.emplace_back(new image_texture(path, cache));
+	}
+
+	// Each thread looks up every texture in turn, starting at its own quarter of the lookups.
+	std::vector<std::atomic<int>> cache_differences(lazy.size());
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&, t]()
+		{
+			for (size_t k = 0; k < lookups.size(); k++)
+			{
+				const lookup &l = lookups[(k + t * lookups.size() / 4) % lookups.size()];
+
+				for (size_t i = 0; i < lazy.size(); i++)
+				{
+					vec3 a = look_up(*decoded[i], l);
+					vec3 b = look_up(*lazy[i], l);
+
+					cache_differences[i] += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+				}
+			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	for (size_t i = 0; i < lazy.size(); i++)
+	{
+		std::cout << (cache_differences[i] ? "FAIL " : "ok   ") << "tile cache, " << lazy[i]->nx << "x" << lazy[i]->ny
+		          << ": " << cache_differences[i] << " of " << 4 * lookups.size()
+		          << " lookups from 4 threads differ from the decoded image\n";
+		failures += cache_differences[i] != 0;
+	}
+
+	tile_cache_stats stats = cache.stats();
+	image_texture missing(dir + "/missing.ppm", cache);
+	bool missing_ok = !missing.loaded() && missing.nx == 0;
+
+	std::cout << (stats.evictions ? "ok   " : "FAIL ") << "tile cache: " << stats.misses << " misses, "
+	          << stats.evictions << " evictions in " << stats.capacity << " tiles\n";
+	std::cout << (missing_ok ? "ok   " : "FAIL ") << "tile cache: a missing file gives an empty texture\n";
+	failures += !stats.evictions + !missing_ok;
+
+	lazy.clear();
+
+	std::vector<std::string> ppm_files = files;
+
+	for (size_t i = 0; i < ppm_files.size(); i++)
+	{
+		std::string converted = ppm_files[i] + ".rtex";
+		std::string written = ppm_files[i] + ".linear.rtex";
+		image_texture linear;
+		image_texture a;
+		image_texture b;
+
+		texture_layout = TEXTURE_LAYOUT_LINEAR;
+		linear.decode(ppm_files[i]);
+		texture_layout = TEXTURE_LAYOUT_TILED;
+		files.push_back(converted);
+		files.push_back(written);
+
+		bool opened = convert_texture(ppm_files[i], converted) == 0 && a.open_rtex(converted) &&
+		              linear.write_rtex(written) && b.open_rtex(written);
+		int rtex_differences = opened ? differences(*decoded[i], a, lookups) + differences(*decoded[i], b, lookups) : 0;
+		bool ok = opened && rtex_differences == 0;
+
+		std::cout << (ok ? "ok   " : "FAIL ") << ".rtex, " << decoded[i]->nx << "x" << decoded[i]->ny << ": "
+		          << (opened ? "" : "could not be written or opened, ") << rtex_differences << " of "
+		          << 2 * lookups.size() << " lookups differ from the decoded image\n";
+		failures += !ok;
+	}
+
+	// Damage one converted file at a time; each copy must be refused.
+	std::string good = files[ppm_files.size()];
+	std::string damaged = dir + "/damaged.rtex";
+	FILE *f = fopen(good.c_str(), "rb");
+
+	fseek(f, 0, SEEK_END);
+	std::vector<char> bytes(ftell(f));
+	rewind(f);
+	bytes.resize(fread(bytes.data(), 1, bytes.size(), f));
+	fclose(f);
+	files.push_back(damaged);
+
+	struct damage
+	{
+		const char *name;
+		size_t offset;  // Byte to flip, or the new size for "resize".
+		bool resize;
+	};
+
+	const damage damages[] = {
+		{"bad magic", 0, false},
+		{"bad version", offsetof(rtex_header, version), false},
+		{"bad tile count", offsetof(rtex_header, tile_count), false},
+		// First tile of level 1, off by one: still inside the file, so only the checksum tells.
+		{"bad level table", offsetof(rtex_header, levels) + sizeof(rtex_level) + offsetof(rtex_level, first_tile), false},
+		{"one byte short", bytes.size() - 1, true},
+		{"one byte long", bytes.size() + 1, true},
+	};
+
+	for (const damage &d : damages)
+	{
+		std::vector<char> copy = bytes;
+
+		if (d.resize)
+		{
+			copy.resize(d.offset);
+		}
+		else
+		{
+			copy[d.offset] ^= 1;
+		}
+
+		f = fopen(damaged.c_str(), "wb");
+		fwrite(copy.data(), 1, copy.size(), f);
+		fclose(f);
+
+		image_texture texture;
+		bool refused = !texture.open_rtex(damaged) && !texture.loaded();
+
+		std::cout << (refused ? "ok   " : "FAIL ") << ".rtex, " << d.name << ": "
+		          << (refused ? "refused" : "accepted") << "\n";
+		failures += !refused;
+	}
+
+	thread_pool pool(4);
+	texture_registry registry;
+	scene_arena arena;
+	std::string link = dir + "/link.ppm";
+	std::string copy = dir + "/copy.ppm";
+	std::string dotted = dir + "/./" + ppm_files[0].substr(dir.size() + 1);
+	std::vector<image_texture *> requested;
+
+	bvh_build_pool = &pool;
+	files.push_back(link);
+	files.push_back(copy);
+	symlink(ppm_files[0].c_str(), link.c_str());
+	write_ppm(copy, images[1]);
+
+	for (const std::string &path : ppm_files)
+	{
+		requested.push_back(registry.request(arena, path));
+	}
+
+	bool shared = registry.request(arena, ppm_files[0]) == requested[0] &&
+	              registry.request(arena, link) == requested[0] && registry.request(arena, dotted) == requested[0] &&
+	              registry.request(arena, copy) == requested[1];
+	int registry_differences = 0;
+	bool distinct = true;
+	std::ostringstream report;
+	std::streambuf *console = std::cerr.rdbuf(report.rdbuf());
+
+	registry.wait(arena);
+	std::cerr.rdbuf(console);
+	std::cerr << report.str();
+
+	// The content hash would share aliases too; the report tells whether they were known by their resolved path.
+	std::string lines = report.str();
+	int by_path = 0;
+
+	for (size_t at = lines.find(": already loaded"); at != std::string::npos; at = lines.find(": already loaded", at + 1))
+	{
+		by_path++;
+	}
+
+	shared &= by_path == 3;
+
+	for (size_t i = 0; i < requested.size(); i++)
+	{
+		registry_differences += requested[i] ? differences(*decoded[i], *requested[i], lookups) : lookups.size();
+
+		for (size_t j = 0; j < i; j++)
+		{
+			distinct &= requested[i] != requested[j];
+		}
+	}
+
+	std::cout << (shared && distinct ? "ok   " : "FAIL ") << "texture registry: " << requested.size()
+	          << " files decoded once each, " << (shared ? "" : "not ") << "shared by every name for them\n";
+	std::cout << (registry_differences ? "FAIL " : "ok   ") << "texture registry: " << registry_differences << " of "
+	          << requested.size() * lookups.size() << " lookups differ from the images decoded in memory\n";
+	failures += !shared || !distinct || registry_differences;
+
+	// Another size, so the change shows however coarse the file times are.
+	image changed = random_image(images[0].nx + 1, images[0].ny);
+	texture_layout = TEXTURE_LAYOUT_LINEAR;
+	image_texture changed_reference(changed.pixels.data(), changed.nx, changed.ny);
+	texture_layout = TEXTURE_LAYOUT_TILED;
+	scene_arena later;
+
+	write_ppm(ppm_files[0], changed);
+
+	image_texture *reloaded = registry.request(later, ppm_files[0]);
+
+	registry.wait(later);
+
+	bool reloaded_ok = reloaded && reloaded != requested[0] && differences(changed_reference, *reloaded, lookups) == 0;
+
+	std::cout << (reloaded_ok ? "ok   " : "FAIL ") << "texture registry: a rewritten file gets a new texture\n";
+	failures += !reloaded_ok;
+
+	// Two scenes at once. A large image, slow to decode, is asked for by both, and "second" waits first.
+	texture_registry scenes;
+	std::string second_report;
+	std::string first_report;
+	std::string large = dir + "/large.ppm";
+	image large_image = random_image(2048, 2048);
+	image_texture large_reference(large_image.pixels.data(), large_image.nx, large_image.ny);
+
+	files.push_back(large);
+	write_ppm(large, large_image);
+
+	{
+		scene_arena first;
+		scene_arena second;
+		image_texture *first_large = scenes.request(first, large);
+		scenes.request(second, ppm_files[2]);
+		image_texture *second_large = scenes.request(second, large);
+		std::ostringstream log;
+
+		console = std::cerr.rdbuf(log.rdbuf());
+		scenes.wait(second);
+		second_report = log.str();
+		// The size is known before the pixels are, so it takes lookups to tell the decode is done.
+		bool decoded_in_time = differences(large_reference, *second_large, lookups) == 0;
+		log.str("");
+		scenes.wait(first);
+		first_report = log.str();
+		std::cerr.rdbuf(console);
+
+		auto has = [](const std::string &report, const std::string &text)
+		{
+			return report.find(text) != std::string::npos;
+		};
+
+		bool own = has(second_report, ppm_files[2] + ": ") && has(second_report, large + ": already loaded") &&
+		           !has(second_report, large + ": 2048x2048") && has(first_report, large + ": 2048x2048") &&
+		           !has(first_report, ppm_files[2]);
+		bool ok = first_large == second_large && decoded_in_time && own;
+
+		std::cout << (ok ? "ok   " : "FAIL ") << "texture registry: two scenes at once, each reports its own textures, "
+		          << "and the shared one is " << (decoded_in_time ? "" : "not ") << "decoded by the first wait\n";
+		failures += !ok;
+	}
+
+	// Both arenas are gone, so a new file leaves only its own entry.
+	size_t held = scenes.known_files();
+	scene_arena third;
+
+	scenes.request(third, ppm_files[1]);
+	scenes.wait(third);
+
+	bool pruned = held == 2 && scenes.known_files() == 1;
+
+	std::cout << (pruned ? "ok   " : "FAIL ") << "texture registry: " << held << " entries after their scenes went, "
+	          << scenes.known_files() << " after the next new file\n";
+	failures += !pruned;
+	bvh_build_pool = nullptr;
+
+	for (const std::string &path : files)
+	{
+		unlink(path.c_str());
+	}
+
+	rmdir(dir.c_str());
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Check that every tonemap_row() version this CPU runs writes the same bytes as the scalar one, on random sums and on
+ * the edge cases: zero, negative, NaN, infinite and over-bright sums, for every row length up to 64 so each tail is
+ * covered.
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. tonemap_check.cpp -o tonemap_check && ./tonemap_check
+ */
+#include "render.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+
+int main()
+{
+	std::vector<float> sums;
+	const float edges[] = {0.0f, -0.0f, -1.0f, -1e30f, NAN, -NAN, INFINITY, -INFINITY, 1e30f, 16.0f, 16.5f, 1e-30f};
+
+	srand48(1);
+
+	for (float e : edges)
+	{
+		sums.push_back(e);
+	}
+
+	for (int i = 0; i < 100000; i++)
+	{
+		sums.push_back(drand48() * 20 - 1);
+	}
+
+	cpu_isa supported = detect_cpu_isa();
+	int failures = 0;
+
+	for (cpu_isa isa : {ISA_SSE42, ISA_AVX2, ISA_AVX512})
+	{
+		if (isa > supported)
+		{
+			std::cout << "skip " << isa_name(isa) << ": not supported by this CPU\n";
+			continue;
+		}
+
+		int differences = 0;
+
+		for (int samples : {1, 16})
+		{
+			for (int n = 0; n <= 64; n++)
+			{
+				for (size_t first = 0; first + n <= sums.size(); first += 997)
+				{
+					std::vector<unsigned char> expected(n + 1, 0xaa), got(n + 1, 0xaa);
+
+					tonemap_row_scalar(&sums[first], expected.data(), n, samples);
+					kernel_isa = isa;
+					tonemap_row(&sums[first], got.data(), n, samples);
+
+					// The byte past the row checks that the tail isn't overwritten.
+					differences += expected != got;
+				}
+			}
+		}
+
+		std::cout << (differences ? "FAIL " : "ok   ") << isa_name(isa) << ": " << differences
+		          << " rows differ from the scalar version\n";
+		failures += differences;
+	}
+
+	return failures ? 1 : 0;
+}
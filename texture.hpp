@@ -2,11 +2,21 @@
 #define TEXTUREHPP
 
 #include "perlin.hpp"
+#include "baked_noise.hpp"
 
 class texture
 {
 	public:
 		virtual vec3 value(float u, float v, const vec3 &p) const = 0;
+
+		/*
+		 * Color averaged over a footprint "width" wide in u and v around (u, v) (see ray::footprint()). Textures that
+		 * can't filter return value().
+		 */
+		virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+		{
+			return value(u, v, p);
+		}
 };
 
 class constant_texture : public texture
@@ -50,6 +60,13 @@ class checker_texture : public texture
 			}
 		}
 
+		virtual vec3 filtered_value(float u, float v, const vec3 &p, float width) const
+		{
+			float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+
+			return (sines < 0 ? odd : even)->filtered_value(u, v, p, width);
+		}
+
 		texture *even;
 		texture *odd;
 };
@@ -65,7 +82,9 @@ class noise_texture : public texture
 			// return vec3(1, 1, 1) * 0.5 * (1 + noise.noise(scale * p));
 			//return vec3(1, 1, 1) * 0.5 * (1 + noise.turbulence(scale * p));
 			//return vec3(1, 1, 1) * noise.turbulence(scale * p);
-			return vec3(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * noise.turbulence(p)));
+			float turbulence = noise_bake_resolution > 0 ? shared_baked_turbulence().value(p) : noise.turbulence(p);
+
+			return vec3(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * turbulence));
 		}
 
 		perlin noise;
@@ -0,0 +1,115 @@
+#ifndef TEXTUREBENCHMARKHPP
+#define TEXTUREBENCHMARKHPP
+
+#include "image_texture.hpp"
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+/*
+ * Times lookups into a "size" x "size" random image stored in each texture layout (see image_texture.hpp), for a few
+ * access patterns, best of "repeats" runs. Prints nanoseconds per lookup to "out":
+ *
+ *     random    uniformly random (u, v), every lookup a cache miss in both layouts.
+ *     walk      a random walk of about a texel a step, like neighbouring pixels on one surface.
+ *     column    steps down the image with u almost fixed, like texels around the pole of a sphere. Each step is a
+ *               new row, which the linear layout puts a whole row of bytes away.
+ *
+ * each with nearest lookups (value()) and bilinear ones at the full-size level (filtered_value()).
+ */
+void run_texture_benchmark(std::ostream &out, int size = 4096, int lookups = 1 << 22, int repeats = 3)
+{
+	unsigned short state[3] = {1, 2, 3};
+	std::vector<unsigned char> pixels(size_t(size) * size * 3);
+
+	for (unsigned char &c : pixels)
+	{
+		c = nrand48(state);
+	}
+
+	texture_texel_layout saved = texture_layout;
+	texture_layout = TEXTURE_LAYOUT_LINEAR;
+	image_texture linear(pixels.data(), size, size);
+	texture_layout = TEXTURE_LAYOUT_TILED;
+	image_texture tiled(pixels.data(), size, size);
+	texture_layout = saved;
+
+	const char *patterns[] = {"random", "walk", "column"};
+	std::vector<float> us(lookups);
+	std::vector<float> vs(lookups);
+	char line[256];
+
+	snprintf(line, sizeof(line), "%-8s %-9s %12s %12s %8s\n", "pattern", "lookup", "linear (ns)", "tiled (ns)",
+	         "speedup");
+	out << line;
+
+	for (int pattern = 0; pattern < 3; pattern++)
+	{
+		float u = 0.5f;
+		float v = 0.5f;
+
+		for (int i = 0; i < lookups; i++)
+		{
+			if (pattern == 0)
+			{
+				u = erand48(state);
+				v = erand48(state);
+			}
+			else if (pattern == 1)
+			{
+				u = fmodf(u + float(erand48(state) - 0.5) * 2 / size + 1, 1);
+				v = fmodf(v + float(erand48(state) - 0.5) * 2 / size + 1, 1);
+			}
+			else
+			{
+				u = 0.5f + float(erand48(state) - 0.5) * 4 / size;
+				v = fmodf(v + 1.0f / size, 1);
+			}
+
+			us[i] = u;
+			vs[i] = v;
+		}
+
+		for (int filtered = 0; filtered < 2; filtered++)
+		{
+			double ns[2] = {DBL_MAX, DBL_MAX};
+			vec3 sum(0, 0, 0);
+
+			// Interleaved, so both layouts see the same machine load.
+			for (int run = 0; run < repeats; run++)
+			{
+				for (int layout = 0; layout < 2; layout++)
+				{
+					const image_texture &t = layout == 0 ? linear : tiled;
+					vec3 p(0, 0, 0);
+					auto start = std::chrono::steady_clock::now();
+
+					for (int i = 0; i < lookups; i++)
+					{
+						// A footprint far below a texel picks bilinear filtering of the full-size level.
+						sum += filtered ? t.filtered_value(us[i], vs[i], p, 1e-9f) : t.value(us[i], vs[i], p);
+					}
+
+					std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+					ns[layout] = std::min(ns[layout], elapsed.count() / lookups);
+				}
+			}
+
+			// Keeps the lookups from being optimized out.
+			if (sum.x() < 0)
+			{
+				out << sum << "\n";
+			}
+
+			snprintf(line, sizeof(line), "%-8s %-9s %12.1f %12.1f %7.2fx\n", patterns[pattern],
+			         filtered ? "bilinear" : "nearest", ns[0], ns[1], ns[0] / ns[1]);
+			out << line;
+		}
+	}
+}
+
+#endif // TEXTUREBENCHMARKHPP
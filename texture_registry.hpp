@@ -0,0 +1,296 @@
+#ifndef TEXTUREREGISTRYHPP
+#define TEXTUREREGISTRYHPP
+
+#include "image_texture.hpp"
+#include "mapped_file.hpp"
+#include "flat_bvh.hpp"
+#include "thread_pool.hpp"
+#include "arena.hpp"
+#include "stb_image.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Decoded image textures of every scene in the process. A file asked for again, under the same path or any other
+ * with the same contents, gets the texture already decoded instead of a second copy, as long as a scene still holds
+ * it. New files are decoded on the scene build pool (bvh_build_pool) while the scene goes on building, and wait() is
+ * called with the scene's arena once the scene is done (see open_scene()). Scenes built at the same time, as the
+ * render server does, each wait for and report their own textures only.
+ *
+ * Textures are shared between arenas: each arena holding one keeps it alive through a shared_ptr, and the registry
+ * only keeps weak ones. Entries of textures no scene holds any more are dropped whenever a new one is added.
+ */
+class texture_registry
+{
+	public:
+		/*
+		 * Texture for the image at "path", owned together with "arena". Returns nullptr if the file is not a
+		 * readable image. A new texture stays empty until wait(arena).
+		 */
+		image_texture *request(scene_arena &arena, const std::string &path);
+
+		/*
+		 * Finish the decodes the requests for "arena" started or share, and report each one's time and memory, and
+		 * each reuse, to std::cerr.
+		 */
+		void wait(scene_arena &arena);
+
+		// Files with an entry: held by some scene, or not pruned yet.
+		size_t known_files()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			return by_path.size();
+		}
+
+		static texture_registry &shared()
+		{
+			static texture_registry registry;
+
+			return registry;
+		}
+
+	private:
+		struct entry
+		{
+			std::string path;
+			std::string key;  // Canonical path.
+			file_stamp stamp;
+			uint64_t content;  // FNV-1a of the file.
+			std::weak_ptr<image_texture> texture;
+			double load_ms = 0;
+			std::promise<void> decoding;
+			std::shared_future<void> decoded = decoding.get_future().share();
+		};
+
+		// Requests made for one arena since its last wait().
+		struct batch
+		{
+			std::vector<std::shared_ptr<entry>> decoding;  // Decoded for this arena.
+			std::vector<std::shared_ptr<entry>> shared;    // Served from an earlier request, maybe still decoding.
+			std::vector<std::string> reused;  // Report lines for "shared".
+			std::unique_ptr<task_group> group;
+		};
+
+		image_texture *hold(scene_arena &arena, const std::shared_ptr<image_texture> &texture)
+		{
+			arena.make<std::shared_ptr<image_texture>>(texture);
+
+			return texture.get();
+		}
+
+		image_texture *reuse(scene_arena &arena, const std::shared_ptr<entry> &e,
+		                     const std::shared_ptr<image_texture> &texture, const std::string &line)
+		{
+			batch &b = batches[&arena];
+
+			b.shared.push_back(e);
+			b.reused.push_back(line);
+
+			return hold(arena, texture);
+		}
+
+		void prune();
+
+		std::mutex lock;
+		std::unordered_map<std::string, std::shared_ptr<entry>> by_path;  // Canonical path.
+		std::unordered_map<uint64_t, std::shared_ptr<entry>> by_content;
+		std::unordered_map<const scene_arena *, batch> batches;
+};
+
+// Whether the files at "a" and "b" hold the same bytes.
+inline bool same_bytes(const std::string &a, const std::string &b)
+{
+	mapped_file fa;
+	mapped_file fb;
+
+	return fa.open(a) && fb.open(b) && fa.size() == fb.size() && memcmp(fa.data(), fb.data(), fa.size()) == 0;
+}
+
+image_texture *texture_registry::request(scene_arena &arena, const std::string &path)
+{
+	char resolved[PATH_MAX];
+	std::string key = realpath(path.c_str(), resolved) ? resolved : path;
+	file_stamp stamp;
+	int nx, ny, nn;
+
+	if (!get_file_stamp(key, stamp) || !stbi_info(key.c_str(), &nx, &ny, &nn))
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto known = by_path.find(key);
+
+	if (known != by_path.end() && known->second->stamp.size == stamp.size &&
+	    known->second->stamp.mtime_ns == stamp.mtime_ns)
+	{
+		if (std::shared_ptr<image_texture> texture = known->second->texture.lock())
+		{
+			return reuse(arena, known->second, texture, path + ": already loaded");
+		}
+	}
+
+	// Same bytes under another name, or a file that changed since it was loaded. The hash only finds the candidate.
+	mapped_file file;
+	uint64_t content = file.open(key) ? fnv1a(file.data(), file.size()) : 0;
+	auto same = by_content.find(content);
+
+	if (content && same != by_content.end() && same->second->stamp.size == stamp.size &&
+	    same_bytes(key, same->second->key))
+	{
+		if (std::shared_ptr<image_texture> texture = same->second->texture.lock())
+		{
+			by_path[key] = same->second;
+			return reuse(arena, same->second, texture, path + ": same contents as " + same->second->path);
+		}
+	}
+
+	prune();
+
+	std::shared_ptr<entry> e = std::make_shared<entry>();
+	std::shared_ptr<image_texture> texture = std::make_shared<image_texture>();
+	batch &b = batches[&arena];
+
+	e->path = path;
+	e->key = key;
+	e->stamp = stamp;
+	e->content = content;
+	e->texture = texture;
+	texture->decode_queued = true;
+	by_path[key] = e;
+	b.decoding.push_back(e);
+
+	if (content)
+	{
+		by_content[content] = e;
+	}
+
+	auto decode = [e, texture, key]()
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		if (!texture->decode(key))
+		{
+			std::cerr << "Cannot load image " << e->path << "\n";
+		}
+
+		e->load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		e->decoding.set_value();
+	};
+
+	if (!bvh_build_pool)
+	{
+		decode();
+	}
+	else
+	{
+		if (!b.group)
+		{
+			b.group.reset(new task_group(*bvh_build_pool));
+		}
+
+		b.group->run(decode);
+	}
+
+	return hold(arena, texture);
+}
+
+// Drop the entries of textures no arena holds any more. Called with "lock" held.
+void texture_registry::prune()
+{
+	for (auto i = by_path.begin(); i != by_path.end();)
+	{
+		i = i->second->texture.expired() ? by_path.erase(i) : std::next(i);
+	}
+
+	for (auto i = by_content.begin(); i != by_content.end();)
+	{
+		i = i->second->texture.expired() ? by_content.erase(i) : std::next(i);
+	}
+}
+
+void texture_registry::wait(scene_arena &arena)
+{
+	batch b;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = batches.find(&arena);
+
+		if (found == batches.end())
+		{
+			return;
+		}
+
+		b = std::move(found->second);
+		batches.erase(found);
+	}
+
+	// Without holding the registry, so other scenes can go on requesting.
+	if (b.group)
+	{
+		b.group->wait();
+	}
+
+	for (const std::shared_ptr<entry> &e : b.shared)
+	{
+		e->decoded.wait();
+	}
+
+	for (const std::shared_ptr<entry> &e : b.decoding)
+	{
+		if (std::shared_ptr<image_texture> texture = e->texture.lock())
+		{
+			char line[512];
+
+			snprintf(line, sizeof(line), "Texture %s: %dx%d, decoded in %.1f ms, %.1f MB\n", e->path.c_str(),
+			         texture->nx, texture->ny, e->load_ms, texture->memory_bytes() / (1024.0 * 1024.0));
+			std::cerr << line;
+		}
+	}
+
+	for (const std::string &line : b.reused)
+	{
+		std::cerr << "Texture " << line << "\n";
+	}
+}
+
+/*
+ * Image texture for the file at "path", owned by "arena". .rtex files are mapped. For other images, with a
+ * texture_cache_budget (see tile_cache.hpp) only the image size is read here and tiles load on first use; otherwise
+ * the texture comes from the shared texture_registry, decoded by the time open_scene() returns. Check loaded() for
+ * files that can't be read.
+ */
+image_texture *load_image_texture(scene_arena &arena, const char *path)
+{
+	if (is_rtex_path(path))
+	{
+		image_texture *image = arena.make<image_texture>();
+		image->open_rtex(path);
+
+		return image;
+	}
+
+	if (texture_cache_budget > 0)
+	{
+		return arena.make<image_texture>(std::string(path), shared_texture_cache());
+	}
+
+	image_texture *image = texture_registry::shared().request(arena, path);
+
+	return image ? image : arena.make<image_texture>();
+}
+
+#endif // TEXTUREREGISTRYHPP
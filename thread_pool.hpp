@@ -0,0 +1,197 @@
+#ifndef THREADPOOLHPP
+#define THREADPOOLHPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads pulling tasks from a shared FIFO queue. Created once and kept alive for the whole
+ * process, so renders, BVH builds and texture loads don't pay thread start-up each time.
+ */
+class thread_pool
+{
+	public:
+		thread_pool(int num_threads = 0);
+		~thread_pool();
+
+		thread_pool(const thread_pool &) = delete;
+		thread_pool &operator=(const thread_pool &) = delete;
+
+		void submit(std::function<void()> task);
+
+		// Run one queued task on the calling thread. Returns false if the queue was empty.
+		bool run_pending_task();
+
+		int size() const
+		{
+			return int(workers.size());
+		}
+
+	private:
+		void worker_loop();
+
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+};
+
+thread_pool::thread_pool(int num_threads)
+{
+	if (num_threads <= 0)
+	{
+		num_threads = std::thread::hardware_concurrency();
+	}
+
+	if (num_threads <= 0)
+	{
+		num_threads = 1;
+	}
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		workers.push_back(std::thread(&thread_pool::worker_loop, this));
+	}
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	wake.notify_all();
+
+	for (std::thread &t : workers)
+	{
+		t.join();
+	}
+}
+
+void thread_pool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(task));
+	}
+
+	wake.notify_one();
+}
+
+bool thread_pool::run_pending_task()
+{
+	std::function<void()> task;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (tasks.empty())
+		{
+			return false;
+		}
+
+		task = std::move(tasks.front());
+		tasks.pop_front();
+	}
+
+	task();
+
+	return true;
+}
+
+void thread_pool::worker_loop()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+			if (stopping && tasks.empty())
+			{
+				return;
+			}
+
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+
+		task();
+	}
+}
+
+/*
+ * A batch of tasks that can be waited on. wait() keeps executing queued tasks instead of blocking, so a task may start
+ * a nested group (e.g. one BVH subtree spawning its children) without starving the pool.
+ */
+class task_group
+{
+	public:
+		task_group(thread_pool &p) : pool(p), pending(0) {}
+
+		~task_group()
+		{
+			wait();
+		}
+
+		void run(std::function<void()> task)
+		{
+			pending.fetch_add(1);
+			pool.submit([this, task]()
+			{
+				task();
+				pending.fetch_sub(1);
+			});
+		}
+
+		void wait()
+		{
+			while (pending.load() > 0)
+			{
+				if (!pool.run_pending_task())
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+	private:
+		thread_pool &pool;
+		std::atomic<int> pending;
+};
+
+/*
+ * Call fn(begin, end) over [first, last) split into chunks of at most "grain" items, running the chunks on the pool.
+ */
+template<typename F>
+void parallel_for(thread_pool &pool, int first, int last, int grain, F fn)
+{
+	if (last - first <= grain)
+	{
+		fn(first, last);
+
+		return;
+	}
+
+	task_group group(pool);
+
+	for (int begin = first; begin < last; begin += grain)
+	{
+		int end = begin + grain < last ? begin + grain : last;
+
+		group.run([&fn, begin, end]() { fn(begin, end); });
+	}
+
+	group.wait();
+}
+
+#endif // THREADPOOLHPP
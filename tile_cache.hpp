@@ -0,0 +1,274 @@
+#ifndef TILECACHEHPP
+#define TILECACHEHPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+
+/*
+ * Something whose 4 KB tiles (1024 32-bit words) the tile_cache holds, e.g. an image texture backed by a file. It
+ * keeps the table of which cache slot holds each of its tiles, so a hit is one load from it.
+ */
+class tile_source
+{
+	public:
+		tile_source() : id(next_id()) {}
+		virtual ~tile_source() {}
+
+		// Fill "words" with tile "tile". Called with the cache lock held, one tile at a time.
+		virtual void load_tile(uint32_t tile, uint32_t *words) = 0;
+
+		// Size the slot table for "tiles" tiles, none cached. Must be called before the first lookup.
+		void set_tile_count(uint32_t tiles)
+		{
+			tile_slots.reset(new std::atomic<int32_t>[tiles]);
+
+			for (uint32_t i = 0; i < tiles; i++)
+			{
+				tile_slots[i].store(-1, std::memory_order_relaxed);
+			}
+		}
+
+		const uint32_t id;
+		std::unique_ptr<std::atomic<int32_t>[]> tile_slots;  // Cache slot of each tile, -1 if not cached.
+
+	private:
+		static uint32_t next_id()
+		{
+			static std::atomic<uint32_t> ids(0);
+
+			return ++ids;
+		}
+};
+
+struct tile_cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t resident;  // Tiles in the cache.
+	size_t capacity;  // Tiles the budget holds.
+};
+
+/*
+ * Fixed budget of 4 KB tile slots shared by every tile_source, with clock (second chance) replacement, which
+ * approximates LRU without reordering a list on every hit.
+ *
+ * Hits take no lock: a reader looks the slot up in the source's table and reads the word under the slot's sequence
+ * number (a seqlock), retrying through the miss path if the slot was being refilled meanwhile. Misses and evictions
+ * take the cache lock and load the tile there, so a slow tile load holds up other misses but never hits.
+ */
+class tile_cache
+{
+	public:
+		static const int tile_words = 1024;
+
+		tile_cache(size_t budget_bytes);
+
+		tile_cache(const tile_cache &) = delete;
+		tile_cache &operator=(const tile_cache &) = delete;
+
+		// Word "word" of tile "tile" of "source", loading the tile on a miss.
+		uint32_t read(tile_source &source, uint32_t tile, uint32_t word)
+		{
+			int32_t s = source.tile_slots[tile].load(std::memory_order_acquire);
+
+			if (s >= 0)
+			{
+				slot &sl = slots[s];
+				uint32_t version = sl.version.load(std::memory_order_acquire);
+
+				if (!(version & 1) && sl.key.load(std::memory_order_relaxed) == key(source, tile))
+				{
+					uint32_t value = words[size_t(s) * tile_words + word].load(std::memory_order_relaxed);
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+
+					if (sl.version.load(std::memory_order_relaxed) == version)
+					{
+						if (!sl.used.load(std::memory_order_relaxed))
+						{
+							sl.used.store(true, std::memory_order_relaxed);
+						}
+
+						count_hit();
+
+						return value;
+					}
+				}
+			}
+
+			return miss(source, tile, word);
+		}
+
+		// Drop every tile of "source", e.g. before it is destroyed.
+		void forget(tile_source &source, uint32_t tiles);
+
+		// Hits are counted per thread and added up in batches, so they may lag by a few thousand per thread.
+		tile_cache_stats stats() const;
+
+	private:
+		struct slot
+		{
+			std::atomic<uint32_t> version{0};  // Odd while the slot is being refilled.
+			std::atomic<uint64_t> key{0};  // Source id and tile, 0 if empty.
+			std::atomic<bool> used{false};  // Touched since the clock hand last passed.
+			tile_source *owner = nullptr;  // Only used under the lock.
+			uint32_t tile = 0;
+		};
+
+		static uint64_t key(const tile_source &source, uint32_t tile)
+		{
+			return uint64_t(source.id) << 32 | tile;
+		}
+
+		uint32_t miss(tile_source &source, uint32_t tile, uint32_t word);
+
+		void count_hit()
+		{
+			static const uint32_t batch = 4096;
+			static thread_local uint32_t local_hits = 0;
+
+			if (++local_hits == batch)
+			{
+				hits.fetch_add(batch, std::memory_order_relaxed);
+				local_hits = 0;
+			}
+		}
+
+		std::unique_ptr<slot[]> slots;
+		std::unique_ptr<std::atomic<uint32_t>[]> words;
+		size_t capacity;
+		size_t resident = 0;
+		size_t hand = 0;
+		mutable std::mutex lock;
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+		std::atomic<uint64_t> evictions{0};
+};
+
+tile_cache::tile_cache(size_t budget_bytes)
+{
+	capacity = std::max<size_t>(budget_bytes / (tile_words * 4), 1);
+	slots.reset(new slot[capacity]);
+	words.reset(new std::atomic<uint32_t>[capacity * tile_words]);
+}
+
+uint32_t tile_cache::miss(tile_source &source, uint32_t tile, uint32_t word)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	int32_t s = source.tile_slots[tile].load(std::memory_order_relaxed);
+
+	// Loaded by another thread while this one waited for the lock.
+	if (s >= 0)
+	{
+		return words[size_t(s) * tile_words + word].load(std::memory_order_relaxed);
+	}
+
+	misses.fetch_add(1, std::memory_order_relaxed);
+
+	// Second chance: skip and clear slots used since the hand last passed them.
+	while (slots[hand].used.load(std::memory_order_relaxed))
+	{
+		slots[hand].used.store(false, std::memory_order_relaxed);
+		hand = (hand + 1) % capacity;
+	}
+
+	s = int32_t(hand);
+	hand = (hand + 1) % capacity;
+
+	slot &sl = slots[s];
+
+	if (sl.owner)
+	{
+		sl.owner->tile_slots[sl.tile].store(-1, std::memory_order_relaxed);
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		resident++;
+	}
+
+	uint32_t version = sl.version.load(std::memory_order_relaxed);
+	sl.version.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint32_t loaded[tile_words];
+	source.load_tile(tile, loaded);
+
+	for (int i = 0; i < tile_words; i++)
+	{
+		words[size_t(s) * tile_words + i].store(loaded[i], std::memory_order_relaxed);
+	}
+
+	sl.owner = &source;
+	sl.tile = tile;
+	sl.key.store(key(source, tile), std::memory_order_relaxed);
+	sl.used.store(true, std::memory_order_relaxed);
+	sl.version.store(version + 2, std::memory_order_release);
+	source.tile_slots[tile].store(s, std::memory_order_release);
+
+	return loaded[word];
+}
+
+void tile_cache::forget(tile_source &source, uint32_t tiles)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (uint32_t tile = 0; tile < tiles; tile++)
+	{
+		int32_t s = source.tile_slots[tile].load(std::memory_order_relaxed);
+
+		if (s >= 0)
+		{
+			slot &sl = slots[s];
+			uint32_t version = sl.version.load(std::memory_order_relaxed);
+
+			sl.version.store(version + 2, std::memory_order_release);
+			sl.key.store(0, std::memory_order_relaxed);
+			sl.used.store(false, std::memory_order_relaxed);
+			sl.owner = nullptr;
+			source.tile_slots[tile].store(-1, std::memory_order_relaxed);
+			resident--;
+		}
+	}
+}
+
+tile_cache_stats tile_cache::stats() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return {hits.load(), misses.load(), evictions.load(), resident, capacity};
+}
+
+/*
+ * Memory cap of the texture cache in bytes. 0 (the default) keeps textures fully decoded in memory, as loaded; any
+ * other value makes image textures load lazily into the shared cache (see load_image_texture()).
+ */
+size_t texture_cache_budget = 0;
+
+// The cache image textures share, created on first use with texture_cache_budget.
+tile_cache &shared_texture_cache()
+{
+	static tile_cache cache(texture_cache_budget);
+
+	return cache;
+}
+
+// One line of texture cache statistics, e.g. after a render.
+void report_texture_cache(std::ostream &out)
+{
+	tile_cache_stats s = shared_texture_cache().stats();
+	uint64_t lookups = s.hits + s.misses;
+
+	out << "Texture cache: " << s.hits << " hits, " << s.misses << " misses ("
+	    << (lookups ? 100.0 * s.hits / lookups : 0.0) << "% hits), " << s.evictions << " evictions, "
+	    << s.resident << " of " << s.capacity << " tiles resident (" << s.capacity * 4 / 1024 << " MB budget)\n";
+}
+
+#endif // TILECACHEHPP
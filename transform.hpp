@@ -0,0 +1,332 @@
+#ifndef TRANSFORMHPP
+#define TRANSFORMHPP
+
+#include "hitable.hpp"
+#include <math.h>
+
+/*
+ * 3x4 affine matrix: a linear 3x3 part and a translation in the last column. Points get the translation, vectors
+ * don't.
+ */
+struct affine_matrix
+{
+	float m[3][4];
+
+	static affine_matrix identity()
+	{
+		return scaling(vec3(1, 1, 1));
+	}
+
+	static affine_matrix translation(const vec3 &offset)
+	{
+		affine_matrix a = identity();
+
+		for (int i = 0; i < 3; i++)
+		{
+			a.m[i][3] = offset[i];
+		}
+
+		return a;
+	}
+
+	static affine_matrix scaling(const vec3 &scale)
+	{
+		affine_matrix a;
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				a.m[i][j] = i == j ? scale[i] : 0;
+			}
+		}
+
+		return a;
+	}
+
+	// Same rotation as rotate_y: object space to world space, counterclockwise seen from +y.
+	static affine_matrix rotation_y(float degrees)
+	{
+		float radians = (M_PI / 180) * degrees;
+
+		return rotation_y(sin(radians), cos(radians));
+	}
+
+	static affine_matrix rotation_y(float sin_theta, float cos_theta)
+	{
+		affine_matrix a = identity();
+
+		a.m[0][0] = cos_theta;
+		a.m[0][2] = sin_theta;
+		a.m[2][0] = -sin_theta;
+		a.m[2][2] = cos_theta;
+
+		return a;
+	}
+
+	// this * other: applies "other" first.
+	affine_matrix operator*(const affine_matrix &other) const
+	{
+		affine_matrix a;
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				a.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j];
+			}
+
+			a.m[i][3] += m[i][3];
+		}
+
+		return a;
+	}
+
+	vec3 point(const vec3 &p) const
+	{
+		return vector(p) + offset();
+	}
+
+	vec3 vector(const vec3 &v) const
+	{
+		return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+		            m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+		            m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+	}
+
+	// Determinant of the linear part: how much it scales volumes.
+	float determinant() const
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+		       m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+		       m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+	// Inverse of an invertible matrix (no zero scale).
+	affine_matrix inverse() const
+	{
+		affine_matrix a;
+		float inv_det = 1.0f / determinant();
+
+		// Adjugate of the linear part over the determinant.
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				int r0 = (j + 1) % 3;
+				int r1 = (j + 2) % 3;
+				int c0 = (i + 1) % 3;
+				int c1 = (i + 2) % 3;
+
+				a.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * inv_det;
+			}
+
+			a.m[i][3] = 0;
+		}
+
+		vec3 t = a.vector(vec3(m[0][3], m[1][3], m[2][3]));
+
+		for (int i = 0; i < 3; i++)
+		{
+			a.m[i][3] = -t[i];
+		}
+
+		return a;
+	}
+
+	// Transpose of the linear part, without translation.
+	affine_matrix transposed() const
+	{
+		affine_matrix a;
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				a.m[i][j] = m[j][i];
+			}
+
+			a.m[i][3] = 0;
+		}
+
+		return a;
+	}
+
+	// True if the linear part is a rotation (or reflection), which keeps normals unit length.
+	bool is_rigid() const
+	{
+		affine_matrix product = transposed() * *this;
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				if (fabs(product.m[i][j] - (i == j ? 1.0f : 0.0f)) > 1e-5f)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// True if the linear part is the identity, so the matrix only moves things.
+	bool is_translation() const
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				if (m[i][j] != (i == j ? 1.0f : 0.0f))
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	bool is_identity() const
+	{
+		return is_translation() && m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0;
+	}
+
+	vec3 offset() const
+	{
+		return vec3(m[0][3], m[1][3], m[2][3]);
+	}
+};
+
+// Box around the eight transformed corners of "box".
+inline aabb transformed_box(const affine_matrix &m, const aabb &box)
+{
+	vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		vec3 p((corner & 1 ? box.max() : box.min()).x(),
+		       (corner & 2 ? box.max() : box.min()).y(),
+		       (corner & 4 ? box.max() : box.min()).z());
+		vec3 q = m.point(p);
+
+		for (int c = 0; c < 3; c++)
+		{
+			min[c] = fmin(min[c], q[c]);
+			max[c] = fmax(max[c], q[c]);
+		}
+	}
+
+	return aabb(min, max);
+}
+
+/*
+ * Child placed in the world by an affine matrix: any mix of translation, rotation and scale, plus optionally flipped
+ * normals. Replaces chains of translate / rotate_y / flip_normals (see transform_collapser, run by finalize_scene() in
+ * scene_finalize.hpp), so a ray pays for one transform instead of one virtual call and ray copy per wrapper.
+ *
+ * The ray direction is transformed but not normalized, so the hit distance t is the same in both spaces. Normals go
+ * through the inverse transpose and are renormalized unless the matrix is rigid.
+ */
+class transform : public hitable
+{
+	public:
+		transform(hitable *p, const affine_matrix &object_to_world, bool flip = false);
+
+		virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const;
+
+		virtual bool bounding_box(float t0, float t1, aabb &box) const
+		{
+			box = bbox;
+
+			return hasbox;
+		}
+
+		virtual void refit(float t0, float t1)
+		{
+			ptr->refit(t0, t1);
+			compute_box(t0, t1);
+		}
+
+		virtual void visit_children(const std::function<void(hitable *&)> &fn)
+		{
+			fn(ptr);
+		}
+
+		// Bounds of the transformed child over [t0, t1].
+		void compute_box(float t0, float t1);
+
+		hitable *ptr;
+		affine_matrix to_world;
+		affine_matrix to_object;
+		affine_matrix normal_matrix;  // Inverse transpose of to_world.
+		float volume_scale;           // |determinant| of to_world.
+		bool rigid;
+		bool flipped;
+		bool hasbox;
+		aabb bbox;
+};
+
+transform::transform(hitable *p, const affine_matrix &object_to_world, bool flip) :
+    ptr(p), to_world(object_to_world), flipped(flip)
+{
+	to_object = to_world.inverse();
+	normal_matrix = to_object.transposed();
+	volume_scale = fabsf(to_world.determinant());
+	rigid = to_world.is_rigid();
+
+	compute_box(0, 1);
+}
+
+void transform::compute_box(float t0, float t1)
+{
+	aabb child;
+
+	hasbox = ptr->bounding_box(t0, t1, child);
+
+	if (!hasbox)
+	{
+		return;
+	}
+
+	bbox = transformed_box(to_world, child);
+}
+
+bool transform::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+	ray local(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+
+	if (!ptr->hit(local, t_min, t_max, rec))
+	{
+		return false;
+	}
+
+	vec3 normal = normal_matrix.vector(rec.normal);
+
+	rec.p = r.point_at_parameter(rec.t);
+
+	if (!rigid)
+	{
+		/*
+		 * A surface element with unit normal n grows in area by |det M| * |M^-T n|, so uv_extent, a length, grows by
+		 * the square root of that. Anisotropic scales stretch u and v differently; this keeps their average.
+		 */
+		float length = normal.length();
+
+		rec.uv_extent *= sqrtf(volume_scale * length);
+		normal /= length;
+	}
+
+	rec.normal = normal;
+
+	if (flipped)
+	{
+		rec.normal = -rec.normal;
+	}
+
+	return true;
+}
+
+#endif // TRANSFORMHPP